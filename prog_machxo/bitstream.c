@@ -0,0 +1,86 @@
+/*
+ * Functions for Lattice MachXO2 bitstream files.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bitstream.h"
+
+static const uint8_t preamble[4] = { 0xFF, 0xFF, 0xBD, 0xB3 };
+
+// The comment header of a .bit file is a few strings, well within this
+#define HEADER_SEARCH_BYTES 4096
+
+/*
+ * Both .bit and raw .bin bitstreams start with 0xFF: a .bit file with the
+ * 0xFF 0x00 of its comment header, a .bin file with dummy bytes or the
+ * preamble itself.  Either has the whole preamble near the start, which a
+ * JEDEC file, being text, never has.
+ */
+int is_bitstream_file(char *fname)
+{
+	uint8_t head[HEADER_SEARCH_BYTES];
+	size_t len;
+	FILE *f;
+	f = fopen(fname, "rb");
+	if (f == 0)
+		return 0;
+	len = fread(head, 1, sizeof head, f);
+	fclose(f);
+	return len > 0 && head[0] == 0xFF && memmem(head, len, preamble, sizeof preamble) != 0;
+}
+
+/*
+ * Map the file and return the bitstream from the 0xFF 0xFF 0xBD 0xB3
+ * preamble on.  The comment header of a .bit file (0xFF 0x00, NUL
+ * terminated strings, 0xFF) is not sent to the device.  The mapping is
+ * private and read-only, and is returned in 'map' for the caller to unmap.
+ */
+int load_bitstream(char *fname, uint8_t **data, int *data_len, void **map_out, size_t *map_len)
+{
+	struct stat st;
+	uint8_t *map;
+	uint8_t *start;
+	int fd;
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+	{
+		perror("load_bitstream");
+		return 0;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		fprintf(stderr, "Could not read %s\n", fname);
+		close(fd);
+		return 0;
+	}
+	map = (uint8_t *)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		perror("load_bitstream");
+		return 0;
+	}
+	start = (uint8_t *)memmem(map, st.st_size, preamble, sizeof preamble);
+	if (start == 0)
+	{
+		fprintf(stderr, "Could not find bitstream preamble\n");
+		munmap(map, st.st_size);
+		return 0;
+	}
+	*data = start;
+	*data_len = st.st_size - (start - map);
+	*map_out = map;
+	*map_len = st.st_size;
+	return 1;
+}
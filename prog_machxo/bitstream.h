@@ -0,0 +1,14 @@
+/*
+ * Definitions for Lattice MachXO2 bitstream files.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ */
+#ifndef _BITSTREAM_H
+#define _BITSTREAM_H 1
+#include <stddef.h>
+#include <stdint.h>
+
+int is_bitstream_file(char *fname);
+int load_bitstream(char *fname, uint8_t **data, int *data_len, void **map, size_t *map_len);
+
+#endif
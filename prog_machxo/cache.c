@@ -0,0 +1,445 @@
+/*
+ * On-disk cache of parsed JEDEC files.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * A cache file holds an image as parsed from a JEDEC file: block table,
+ * non-zero page runs, feature row/bits and usercode, followed by the fuse
+ * and UFM data, page aligned, starting on a memory page.  It is named after
+ * a hash of the JEDEC file contents, so an edited file is simply a new
+ * entry, and mapped on later runs with the blocks pointing into the map.
+ * The image owns the mapping, which goes away with free_image().
+ *
+ * The cache is local to the machine, so fields are in host order.  The byte
+ * order word rejects a cache copied from a machine with the other order.
+ *
+ * Programming and verify both read the data from the map, so a damaged file
+ * would verify as good.  The header therefore holds a hash of itself, the
+ * block table, the runs and the data, checked before the map is used.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "cache.h"
+#include "machxo.h"
+
+#define CACHE_MAGIC "MXC2"
+#define CACHE_BYTE_ORDER 0x01020304
+#define CACHE_DATA_ALIGN 4096
+
+#define CACHE_HAS_FEATURE_ROW 1
+#define CACHE_HAS_USER_CODE 2
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+struct cache_header {
+	char magic[4];
+	uint32_t byte_order;
+	uint64_t source_hash;
+	uint64_t source_size;
+	uint64_t file_size;
+	uint32_t num_blocks;
+	uint32_t num_runs;
+	uint32_t flags;
+	uint32_t user_code;
+	uint32_t erase_sections;
+	uint8_t feature_row[8];
+	uint8_t feature_bits[2];
+	uint8_t pad[2];
+	uint64_t content_hash;	// Hashed with this field zero
+};
+
+struct cache_block {
+	uint32_t address;
+	uint32_t is_user_flash;
+	uint64_t data_offset;
+	uint32_t data_len;
+	uint32_t pad;
+};
+
+static uint64_t align(uint64_t offset, uint64_t to)
+{
+	return (offset + to - 1) / to * to;
+}
+
+// FNV-1a over 64-bit words, so hashing keeps up with the bus
+static uint64_t hash_more(uint64_t hash, const uint8_t *data, size_t len)
+{
+	uint64_t word;
+	size_t i;
+	for (i = 0; i + 8 <= len; i += 8)
+	{
+		memcpy(&word, data + i, 8);
+		hash = (hash ^ word) * FNV_PRIME;
+	}
+	for (; i < len; i++)
+		hash = (hash ^ data[i]) * FNV_PRIME;
+	return hash;
+}
+
+static uint64_t hash_contents(const uint8_t *data, size_t len)
+{
+	return hash_more(FNV_OFFSET, data, len);
+}
+
+// The header, block table and runs; the caller goes on with the data of each block
+static uint64_t hash_tables(const struct cache_header *header, const struct cache_block *blocks,
+			    const struct page_run *runs)
+{
+	struct cache_header h = *header;
+	uint64_t hash;
+	h.content_hash = 0;
+	hash = hash_more(FNV_OFFSET, (const uint8_t *)&h, sizeof h);
+	hash = hash_more(hash, (const uint8_t *)blocks, header->num_blocks * sizeof *blocks);
+	return hash_more(hash, (const uint8_t *)runs, header->num_runs * sizeof *runs);
+}
+
+char *default_cache_dir()
+{
+	static char dir[PATH_MAX];
+	char *base = getenv("XDG_CACHE_HOME");
+	if (base != 0 && base[0] != 0)
+		snprintf(dir, sizeof dir, "%s/prog_machxo", base);
+	else if ((base = getenv("HOME")) != 0 && base[0] != 0)
+		snprintf(dir, sizeof dir, "%s/.cache/prog_machxo", base);
+	else
+		return 0;
+	return dir;
+}
+
+static int make_dirs(char *dir)
+{
+	char path[PATH_MAX];
+	char *p;
+	char c;
+	snprintf(path, sizeof path, "%s", dir);
+	for (p = path + 1; ; p++)
+	{
+		if (*p != '/' && *p != 0)
+			continue;
+		c = *p;
+		*p = 0;
+		if (mkdir(path, 0777) != 0 && errno != EEXIST)
+			return 0;
+		*p = c;
+		if (c == 0)
+			return 1;
+	}
+}
+
+/*
+ * Hash the JEDEC file and work out the name of its cache file.  Returns 0
+ * if the JEDEC file can not be read, the caller then parses it as usual.
+ */
+int open_image_cache(struct image_cache *cache, char *dir, char *fname)
+{
+	struct stat st;
+	void *map;
+	int fd;
+	memset(cache, 0, sizeof *cache);
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return 0;
+	}
+	map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+	cache->source_hash = hash_contents((const uint8_t *)map, st.st_size);
+	cache->source_size = st.st_size;
+	munmap(map, st.st_size);
+	snprintf(cache->path, sizeof cache->path, "%s/%016llx.mxc", dir, (unsigned long long)cache->source_hash);
+	return 1;
+}
+
+/*
+ * Fill 'image' from the cache file, if there is one.  Returns 1 on a hit
+ * and 0 on a miss; a damaged cache file is reported and counts as a miss.
+ */
+int load_cached_image(struct image_cache *cache, struct machxo_image *image)
+{
+	struct cache_header *header;
+	struct cache_block *blocks;
+	struct page_run *runs;
+	struct stat st;
+	uint8_t *map;
+	uint64_t hash;
+	int fd;
+	uint32_t i;
+	fd = open(cache->path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof *header)
+	{
+		close(fd);
+		return 0;
+	}
+	map = (uint8_t *)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+	header = (struct cache_header *)map;
+	blocks = (struct cache_block *)(header + 1);
+	runs = (struct page_run *)(blocks + header->num_blocks);
+	if (memcmp(header->magic, CACHE_MAGIC, 4) != 0 || header->byte_order != CACHE_BYTE_ORDER ||
+	    header->source_hash != cache->source_hash || header->source_size != cache->source_size ||
+	    header->file_size != (uint64_t)st.st_size ||
+	    sizeof *header + (uint64_t)header->num_blocks * sizeof *blocks +
+	    (uint64_t)header->num_runs * sizeof *image->runs > (uint64_t)st.st_size)
+		goto damaged;
+	for (i = 0; i < header->num_blocks; i++)
+		if (blocks[i].data_offset + align(blocks[i].data_len, MACHXO2_PAGE_SIZE) > (uint64_t)st.st_size)
+			goto damaged;
+	// Runs are programmed straight from the map, whole pages, so each must lie within its block
+	for (i = 0; i < header->num_runs; i++)
+		if (runs[i].block < 0 || (uint32_t)runs[i].block >= header->num_blocks ||
+		    runs[i].first_page < 0 || runs[i].num_pages <= 0 ||
+		    (uint64_t)runs[i].first_page + runs[i].num_pages >
+		    align(blocks[runs[i].block].data_len, MACHXO2_PAGE_SIZE) / MACHXO2_PAGE_SIZE)
+			goto damaged;
+	hash = hash_tables(header, blocks, runs);
+	for (i = 0; i < header->num_blocks; i++)
+		hash = hash_more(hash, map + blocks[i].data_offset, blocks[i].data_len);
+	if (hash != header->content_hash)
+		goto damaged;
+	memset(image, 0, sizeof *image);
+	image->blocks = (struct image_block *)malloc(header->num_blocks * sizeof *image->blocks + 1);
+	image->runs = (struct page_run *)malloc(header->num_runs * sizeof *image->runs + 1);
+	if (image->blocks == 0 || image->runs == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		free(image->blocks);
+		free(image->runs);
+		munmap(map, st.st_size);
+		return 0;
+	}
+	for (i = 0; i < header->num_blocks; i++)
+	{
+		image->blocks[i].address = blocks[i].address;
+		image->blocks[i].is_user_flash = blocks[i].is_user_flash;
+		image->blocks[i].data = map + blocks[i].data_offset;
+		image->blocks[i].data_len = blocks[i].data_len;
+	}
+	image->num_blocks = header->num_blocks;
+	memcpy(image->runs, runs, header->num_runs * sizeof *image->runs);
+	image->num_runs = header->num_runs;
+	image->has_feature_row = (header->flags & CACHE_HAS_FEATURE_ROW) != 0;
+	memcpy(image->feature_row, header->feature_row, 8);
+	memcpy(image->feature_bits, header->feature_bits, 2);
+	image->has_user_code = (header->flags & CACHE_HAS_USER_CODE) != 0;
+	image->user_code = header->user_code;
+	image->erase_sections = header->erase_sections;
+	image->map = map;
+	image->map_len = st.st_size;
+	return 1;
+
+damaged:
+	fprintf(stderr, "Ignoring damaged cache file %s\n", cache->path);
+	munmap(map, st.st_size);
+	return 0;
+}
+
+static int write_padding(FILE *f, uint64_t offset, uint64_t to)
+{
+	static const uint8_t zeros[CACHE_DATA_ALIGN];
+	uint64_t len = align(offset, to) - offset;
+	return len == 0 || fwrite(zeros, len, 1, f) == 1;
+}
+
+/*
+ * Create a uniquely named file next to 'path' to be renamed over it.  The
+ * daemon saves from several threads of one process, so the pid alone does
+ * not make the name unique.
+ */
+static FILE *create_temp_file(char *tmp_path, size_t size, char *path)
+{
+	FILE *f;
+	int fd;
+	snprintf(tmp_path, size, "%s.XXXXXX", path);
+	fd = mkstemp(tmp_path);
+	if (fd < 0)
+		return 0;
+	// mkstemp() makes the file private, the cache is not
+	fchmod(fd, 0644);
+	f = fdopen(fd, "wb");
+	if (f == 0)
+	{
+		close(fd);
+		unlink(tmp_path);
+	}
+	return f;
+}
+
+/*
+ * Write 'image' to the cache.  The file is written under a temporary name
+ * and renamed into place, so concurrent runs never see half a file.  Any
+ * failure only costs the cache, so it is reported and otherwise ignored.
+ */
+int save_cached_image(struct image_cache *cache, struct machxo_image *image)
+{
+	struct cache_header header;
+	struct cache_block *blocks;
+	char tmp_path[PATH_MAX + 16];
+	char dir[PATH_MAX];
+	uint64_t offset;
+	FILE *f;
+	int i;
+	snprintf(dir, sizeof dir, "%s", cache->path);
+	*strrchr(dir, '/') = 0;
+	if (make_dirs(dir) != 1)
+	{
+		perror("save_cached_image");
+		return 0;
+	}
+	blocks = (struct cache_block *)calloc(image->num_blocks + 1, sizeof *blocks);
+	if (blocks == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	f = create_temp_file(tmp_path, sizeof tmp_path, cache->path);
+	if (f == 0)
+	{
+		perror("save_cached_image");
+		free(blocks);
+		return 0;
+	}
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, CACHE_MAGIC, 4);
+	header.byte_order = CACHE_BYTE_ORDER;
+	header.source_hash = cache->source_hash;
+	header.source_size = cache->source_size;
+	header.num_blocks = image->num_blocks;
+	header.num_runs = image->num_runs;
+	header.flags = (image->has_feature_row ? CACHE_HAS_FEATURE_ROW : 0) |
+		       (image->has_user_code ? CACHE_HAS_USER_CODE : 0);
+	header.user_code = image->user_code;
+	header.erase_sections = image->erase_sections;
+	memcpy(header.feature_row, image->feature_row, 8);
+	memcpy(header.feature_bits, image->feature_bits, 2);
+	// Work out where the data goes, and the hash, before writing the tables
+	offset = sizeof header + image->num_blocks * sizeof *blocks + image->num_runs * sizeof *image->runs;
+	offset = align(offset, CACHE_DATA_ALIGN);
+	for (i = 0; i < image->num_blocks; i++)
+	{
+		blocks[i].address = image->blocks[i].address;
+		blocks[i].is_user_flash = image->blocks[i].is_user_flash;
+		blocks[i].data_offset = offset;
+		blocks[i].data_len = image->blocks[i].data_len;
+		offset = align(offset + blocks[i].data_len, MACHXO2_PAGE_SIZE);
+	}
+	header.file_size = offset;
+	header.content_hash = hash_tables(&header, blocks, image->runs);
+	for (i = 0; i < image->num_blocks; i++)
+		header.content_hash = hash_more(header.content_hash, image->blocks[i].data, image->blocks[i].data_len);
+	if (fwrite(&header, sizeof header, 1, f) != 1 ||
+	    (image->num_blocks > 0 && fwrite(blocks, sizeof *blocks, image->num_blocks, f) != (size_t)image->num_blocks))
+		goto failed;
+	if (image->num_runs > 0 && fwrite(image->runs, sizeof *image->runs, image->num_runs, f) != (size_t)image->num_runs)
+		goto failed;
+	offset = sizeof header + image->num_blocks * sizeof *blocks + image->num_runs * sizeof *image->runs;
+	if (write_padding(f, offset, CACHE_DATA_ALIGN) != 1)
+		goto failed;
+	for (i = 0; i < image->num_blocks; i++)
+	{
+		int len = image->blocks[i].data_len;
+		if ((len > 0 && fwrite(image->blocks[i].data, len, 1, f) != 1) ||
+		    write_padding(f, len, MACHXO2_PAGE_SIZE) != 1)
+			goto failed;
+	}
+	if (fclose(f) != 0)
+	{
+		f = 0;
+		goto failed;
+	}
+	if (rename(tmp_path, cache->path) != 0)
+	{
+		perror("save_cached_image");
+		unlink(tmp_path);
+		free(blocks);
+		return 0;
+	}
+	free(blocks);
+	return 1;
+
+failed:
+	perror("save_cached_image");
+	if (f != 0)
+		fclose(f);
+	unlink(tmp_path);
+	free(blocks);
+	return 0;
+}
+
+/*
+ * Tuned SPI clocks are kept in one text file in the cache directory, a
+ * line of "<IDCODE> <Hz> <device file>" per board.  A board is a device
+ * file with a given part on it, so another part on the same bus is tuned
+ * again.
+ */
+int load_cached_spi_speed(char *dir, char *dev_name, uint32_t device_id, uint32_t *speed)
+{
+	char path[PATH_MAX];
+	char line[PATH_MAX + 32];
+	char name[PATH_MAX];
+	unsigned int id, hz;
+	FILE *f;
+	int found = 0;
+	snprintf(path, sizeof path, "%s/%s", dir, SPI_SPEED_FILE);
+	f = fopen(path, "r");
+	if (f == 0)
+		return 0;
+	while (!found && fgets(line, sizeof line, f) != 0)
+		if (sscanf(line, "%x %u %4095s", &id, &hz, name) == 3 && id == device_id && strcmp(name, dev_name) == 0)
+		{
+			*speed = hz;
+			found = 1;
+		}
+	fclose(f);
+	return found;
+}
+
+// Rewritten under a temporary name like the image cache, dropping the old line of the board
+int save_cached_spi_speed(char *dir, char *dev_name, uint32_t device_id, uint32_t speed)
+{
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX + 16];
+	char line[PATH_MAX + 32];
+	char name[PATH_MAX];
+	unsigned int id, hz;
+	FILE *in, *out;
+	snprintf(path, sizeof path, "%s/%s", dir, SPI_SPEED_FILE);
+	if (make_dirs(dir) != 1 || (out = create_temp_file(tmp_path, sizeof tmp_path, path)) == 0)
+	{
+		perror("save_cached_spi_speed");
+		return 0;
+	}
+	in = fopen(path, "r");
+	while (in != 0 && fgets(line, sizeof line, in) != 0)
+		if (sscanf(line, "%x %u %4095s", &id, &hz, name) == 3 && !(id == device_id && strcmp(name, dev_name) == 0))
+			fputs(line, out);
+	if (in != 0)
+		fclose(in);
+	fprintf(out, "%08x %u %s\n", device_id, speed, dev_name);
+	if (fclose(out) != 0 || rename(tmp_path, path) != 0)
+	{
+		perror("save_cached_spi_speed");
+		unlink(tmp_path);
+		return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,29 @@
+/*
+ * On-disk cache of parsed JEDEC files, and of tuned SPI clocks.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ */
+#ifndef _CACHE_H
+#define _CACHE_H 1
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "image.h"
+
+#define SPI_SPEED_FILE "spi_speed"
+
+struct image_cache {
+	char path[PATH_MAX];	// Cache file for the JEDEC file
+	uint64_t source_hash;
+	uint64_t source_size;
+};
+
+char *default_cache_dir();
+int open_image_cache(struct image_cache *cache, char *dir, char *fname);
+int load_cached_image(struct image_cache *cache, struct machxo_image *image);
+int save_cached_image(struct image_cache *cache, struct machxo_image *image);
+int load_cached_spi_speed(char *dir, char *dev_name, uint32_t device_id, uint32_t *speed);
+int save_cached_spi_speed(char *dir, char *dev_name, uint32_t device_id, uint32_t speed);
+
+#endif
@@ -0,0 +1,702 @@
+/*
+ * Resident programming daemon and its client.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * The daemon keeps devices open and parsed images in memory, and takes jobs
+ * over a Unix domain socket.  A request is one line of words:
+ *
+ *   program <device> <file> [erase=0] [flash=0] [verify=0] [force=1]
+ *   verify <device> <file>
+ *   ufm <device> <file>
+ *   sram <device> <bitstream>
+ *   usercode <device>
+ *   status <device>
+ *   refresh <device>
+ *   close <device>
+ *   load <file>
+ *   ping
+ *
+ * and the reply is any number of
+ *
+ *   queued <jobs ahead>
+ *   progress <stage> <done> <total>
+ *   message <text>
+ *
+ * lines, ending with "ok [<value>]" or "error <code> <text>".  A connection
+ * may send any number of requests, one after the other.
+ *
+ * Each connection has its own thread, which runs the jobs it is sent.  Jobs
+ * for one device take a ticket and run in the order they came; jobs for
+ * different devices run at the same time.  An image is parsed on first use
+ * and kept until the file changes.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "bitstream.h"
+#include "daemon.h"
+#include "image.h"
+#include "machxo.h"
+#include "program.h"
+
+#define MAX_REQUEST 1024
+#define MAX_WORDS 16
+
+// Errors of the daemon itself, after the MACHXO_ERR_* codes
+#define DAEMON_ERR_REQUEST (MACHXO_NUM_ERRORS + 0)
+#define DAEMON_ERR_OPEN (MACHXO_NUM_ERRORS + 1)
+#define DAEMON_ERR_FILE (MACHXO_NUM_ERRORS + 2)
+
+struct device_slot {
+	char *name;
+	struct machxo_device *dev;	// 0 until the first job, or after close
+	pthread_mutex_t lock;
+	pthread_cond_t turn;
+	unsigned int next_ticket;
+	unsigned int serving;
+	struct device_slot *next;
+};
+
+struct loaded_image {
+	char *path;
+	struct stat st;			// To notice that the file has changed
+	int refs;			// Jobs using the image
+	int stale;			// Replaced, freed when the last job is done
+	struct machxo_image image;
+	uint8_t *bitstream;		// Whole bitstream of a .bit/.bin file, for SRAM
+	int bitstream_len;
+	void *bitstream_map;
+	size_t bitstream_map_len;
+	struct loaded_image *next;
+};
+
+static const char *stage_names[] = { "erase", "program", "verify", "done" };
+
+static struct daemon_config *config;
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct device_slot *slots = 0;
+static pthread_mutex_t images_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct loaded_image *images = 0;
+
+static int write_all(int fd, const char *data, size_t len)
+{
+	ssize_t n;
+	while (len > 0)
+	{
+		n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		data += n;
+		len -= n;
+	}
+	return 1;
+}
+
+// A client that went away only loses the rest of its reply
+static void reply(int fd, const char *format, ...)
+{
+	char line[MAX_REQUEST];
+	va_list ap;
+	int len;
+	va_start(ap, format);
+	len = vsnprintf(line, sizeof line - 1, format, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if (len > (int)sizeof line - 2)
+		len = sizeof line - 2;
+	line[len++] = '\n';
+	write_all(fd, line, len);
+}
+
+static void send_progress(void *arg, int stage, int done, int total)
+{
+	reply(*(int *)arg, "progress %s %d %d", stage_names[stage], done, total);
+}
+
+static void send_message(void *arg, const char *text)
+{
+	reply(*(int *)arg, "message %s", text);
+}
+
+static struct device_slot *get_slot(char *name)
+{
+	struct device_slot *slot;
+	pthread_mutex_lock(&slots_lock);
+	for (slot = slots; slot != 0; slot = slot->next)
+		if (strcmp(slot->name, name) == 0)
+			break;
+	if (slot == 0)
+	{
+		slot = (struct device_slot *)calloc(1, sizeof *slot);
+		if (slot != 0 && (slot->name = strdup(name)) == 0)
+		{
+			free(slot);
+			slot = 0;
+		}
+		if (slot != 0)
+		{
+			pthread_mutex_init(&slot->lock, 0);
+			pthread_cond_init(&slot->turn, 0);
+			slot->next = slots;
+			slots = slot;
+		}
+	}
+	pthread_mutex_unlock(&slots_lock);
+	return slot;
+}
+
+/*
+ * Wait for the jobs queued before this one, telling the client how many
+ * there are.  The reply is sent without the lock, as a slow client would
+ * otherwise hold up every job on the device.
+ */
+static void wait_turn(struct device_slot *slot, int fd)
+{
+	unsigned int ticket, ahead;
+	pthread_mutex_lock(&slot->lock);
+	ticket = slot->next_ticket++;
+	ahead = ticket - slot->serving;
+	pthread_mutex_unlock(&slot->lock);
+	if (ahead != 0)
+		reply(fd, "queued %u", ahead);
+	pthread_mutex_lock(&slot->lock);
+	while (ticket != slot->serving)
+		pthread_cond_wait(&slot->turn, &slot->lock);
+	pthread_mutex_unlock(&slot->lock);
+}
+
+static void end_turn(struct device_slot *slot)
+{
+	pthread_mutex_lock(&slot->lock);
+	slot->serving++;
+	pthread_cond_broadcast(&slot->turn);
+	pthread_mutex_unlock(&slot->lock);
+}
+
+// Only called during the turn of a job, so the handle is never opened twice
+static int open_slot(struct device_slot *slot)
+{
+	if (slot->dev != 0)
+		return 1;
+	slot->dev = open_device(slot->name, config->mode, config->i2c_addr);
+	if (slot->dev != 0 && !device_present(slot->dev))
+	{
+		close_device(slot->dev);
+		slot->dev = 0;
+	}
+	if (slot->dev == 0)
+		return 0;
+	set_page_program_delay(slot->dev, config->page_program_delay);
+	set_verify_burst(slot->dev, config->verify_burst);
+	set_adaptive_polling(slot->dev, config->adaptive_polling);
+	if (config->mode == MODE_SPI)
+		set_spi_clock(slot->dev, config->spi_mode, config->spi_speed);
+	else
+		set_i2c_speed(slot->dev, config->i2c_speed);
+	return 1;
+}
+
+static void free_loaded_image(struct loaded_image *li)
+{
+	free_image(&li->image);
+	if (li->bitstream_map != 0)
+		munmap(li->bitstream_map, li->bitstream_map_len);
+	free(li->path);
+	free(li);
+}
+
+static struct loaded_image *load_image(char *path, struct stat *st)
+{
+	struct loaded_image *li;
+	int status;
+	li = (struct loaded_image *)calloc(1, sizeof *li);
+	if (li == 0)
+		return 0;
+	li->path = strdup(path);
+	li->st = *st;
+	if (li->path == 0)
+	{
+		free(li);
+		return 0;
+	}
+	// A bitstream only loads into SRAM, flash is programmed from JEDEC files
+	if (is_bitstream_file(path))
+		status = load_bitstream(path, &li->bitstream, &li->bitstream_len, &li->bitstream_map, &li->bitstream_map_len) == 1;
+	else
+		status = load_jedec_image(path, &li->image) == 1;
+	if (status && li->bitstream == 0 && config->options.hash_page >= 0)
+		status = prepare_hash_page(&li->image, config->options.hash_page);
+	if (!status)
+	{
+		free_loaded_image(li);
+		return 0;
+	}
+	return li;
+}
+
+static void unlink_image(struct loaded_image *li)
+{
+	struct loaded_image **p;
+	for (p = &images; *p != 0; p = &(*p)->next)
+		if (*p == li)
+		{
+			*p = li->next;
+			return;
+		}
+}
+
+/*
+ * The parsed image of 'path', parsed now if it is new or the file has
+ * changed.  Parsing is done with the lock held, so two jobs for the same
+ * new file do not both parse it.
+ */
+static struct loaded_image *get_image(char *path)
+{
+	struct loaded_image *li;
+	struct stat st;
+	if (stat(path, &st) != 0)
+		return 0;
+	pthread_mutex_lock(&images_lock);
+	for (li = images; li != 0; li = li->next)
+		if (!li->stale && strcmp(li->path, path) == 0)
+			break;
+	if (li != 0 && (li->st.st_ino != st.st_ino || li->st.st_size != st.st_size ||
+			li->st.st_mtime != st.st_mtime))
+	{
+		li->stale = 1;
+		if (li->refs == 0)
+		{
+			unlink_image(li);
+			free_loaded_image(li);
+		}
+		li = 0;
+	}
+	if (li == 0)
+	{
+		li = load_image(path, &st);
+		if (li != 0)
+		{
+			li->next = images;
+			images = li;
+		}
+	}
+	if (li != 0)
+		li->refs++;
+	pthread_mutex_unlock(&images_lock);
+	return li;
+}
+
+static void release_image(struct loaded_image *li)
+{
+	pthread_mutex_lock(&images_lock);
+	if (--li->refs == 0 && li->stale)
+	{
+		unlink_image(li);
+		free_loaded_image(li);
+	}
+	pthread_mutex_unlock(&images_lock);
+}
+
+// Options of a program request, "erase=0" and so on
+static int parse_flags(struct machxo_options *options, char **words, int num_words)
+{
+	int i;
+	for (i = 0; i < num_words; i++)
+	{
+		char *value = strchr(words[i], '=');
+		int bit;
+		if (value == 0)
+			return 0;
+		*value++ = 0;
+		if (strcmp(words[i], "erase") == 0)
+			bit = MACHXO_ERASE;
+		else if (strcmp(words[i], "flash") == 0)
+			bit = MACHXO_FLASH;
+		else if (strcmp(words[i], "verify") == 0)
+			bit = MACHXO_VERIFY;
+		else if (strcmp(words[i], "force") == 0)
+		{
+			options->force = atoi(value);
+			continue;
+		}
+		else
+			return 0;
+		if (atoi(value))
+			options->op |= bit;
+		else
+			options->op &= ~bit;
+	}
+	return 1;
+}
+
+static void run_request(int fd, char **words, int num_words)
+{
+	struct machxo_options options;
+	struct machxo_session s;
+	struct device_slot *slot;
+	struct loaded_image *li = 0;
+	char *command = words[0];
+	int needs_file;
+	uint32_t value;
+	int status;
+
+	if (strcmp(command, "ping") == 0)
+	{
+		reply(fd, "ok");
+		return;
+	}
+	if (strcmp(command, "load") == 0)
+	{
+		if (num_words != 2)
+			goto bad_request;
+		li = get_image(words[1]);
+		if (li == 0)
+		{
+			reply(fd, "error %d Could not load %s", DAEMON_ERR_FILE, words[1]);
+			return;
+		}
+		release_image(li);
+		reply(fd, "ok");
+		return;
+	}
+	needs_file = strcmp(command, "program") == 0 || strcmp(command, "verify") == 0 ||
+		     strcmp(command, "ufm") == 0 || strcmp(command, "sram") == 0;
+	if (num_words < (needs_file ? 3 : 2) || (strcmp(command, "program") != 0 && num_words > (needs_file ? 3 : 2)))
+		goto bad_request;
+	options = config->options;
+	options.progress = send_progress;
+	options.message = send_message;
+	options.arg = &fd;
+	if (strcmp(command, "verify") == 0)
+		options.op = MACHXO_VERIFY;
+	if (strcmp(command, "program") == 0 && !parse_flags(&options, words + 3, num_words - 3))
+		goto bad_request;
+	slot = get_slot(words[1]);
+	if (slot == 0)
+	{
+		reply(fd, "error %d Out of memory", MACHXO_ERR_NO_MEMORY);
+		return;
+	}
+	if (needs_file)
+	{
+		li = get_image(words[2]);
+		if (li == 0)
+		{
+			reply(fd, "error %d Could not load %s", DAEMON_ERR_FILE, words[2]);
+			return;
+		}
+		if (strcmp(command, "sram") == 0 && li->bitstream == 0)
+		{
+			release_image(li);
+			reply(fd, "error %d %s is not a bitstream", DAEMON_ERR_FILE, words[2]);
+			return;
+		}
+		if (strcmp(command, "sram") != 0 && li->bitstream != 0)
+		{
+			release_image(li);
+			reply(fd, "error %d %s is a bitstream, which only loads into SRAM", DAEMON_ERR_FILE, words[2]);
+			return;
+		}
+	}
+	wait_turn(slot, fd);
+	if (strcmp(command, "close") == 0)
+	{
+		if (slot->dev != 0)
+			close_device(slot->dev);
+		slot->dev = 0;
+		end_turn(slot);
+		reply(fd, "ok");
+		return;
+	}
+	if (open_slot(slot) != 1)
+	{
+		end_turn(slot);
+		if (li != 0)
+			release_image(li);
+		reply(fd, "error %d Failed to open device %s", DAEMON_ERR_OPEN, words[1]);
+		return;
+	}
+	init_session(&s, slot->dev, &options);
+	set_message_handler(slot->dev, send_message, &fd);
+	value = 0;
+	if (strcmp(command, "program") == 0 || strcmp(command, "verify") == 0)
+		status = program_image(&s, &li->image);
+	else if (strcmp(command, "ufm") == 0)
+		status = update_user_flash(&s, &li->image);
+	else if (strcmp(command, "sram") == 0)
+		status = load_sram(&s, li->bitstream, li->bitstream_len);
+	else if (strcmp(command, "usercode") == 0)
+		status = read_user_code(slot->dev, &value);
+	else if (strcmp(command, "status") == 0)
+	{
+		value = read_status_register(slot->dev);
+		status = 1;
+	}
+	else if (strcmp(command, "refresh") == 0)
+	{
+		// Nothing answers over the GPMC bridge once the refresh has replaced it
+		if (bus_survives_refresh(slot->dev))
+			status = refresh(slot->dev) == 1 && wait_not_busy(slot->dev) == 1;
+		else
+		{
+			refresh(slot->dev);
+			status = 1;
+		}
+	}
+	else
+		status = -1;
+	// Nobody listens between jobs
+	set_message_handler(slot->dev, 0, 0);
+	end_turn(slot);
+	if (li != 0)
+		release_image(li);
+	if (status < 0)
+		goto bad_request;
+	if (status != 1)
+		reply(fd, "error %d %s", s.error != MACHXO_OK ? s.error : MACHXO_ERR_PROGRAM,
+		      s.message[0] != 0 ? s.message : machxo_strerror(s.error != MACHXO_OK ? s.error : MACHXO_ERR_PROGRAM));
+	else if (strcmp(command, "usercode") == 0 || strcmp(command, "status") == 0)
+		reply(fd, "ok %08x", value);
+	else if (s.already_programmed)
+		reply(fd, "ok already programmed");
+	else
+		reply(fd, "ok");
+	return;
+
+bad_request:
+	reply(fd, "error %d Bad request", DAEMON_ERR_REQUEST);
+}
+
+static void *serve_connection(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char buffer[MAX_REQUEST];
+	char *words[MAX_WORDS];
+	int used = 0;
+	ssize_t n;
+	char *line, *nl, *save;
+	int num_words;
+	for (;;)
+	{
+		n = read(fd, buffer + used, sizeof buffer - 1 - used);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		used += n;
+		buffer[used] = 0;
+		line = buffer;
+		while ((nl = strchr(line, '\n')) != 0)
+		{
+			*nl = 0;
+			num_words = 0;
+			for (words[0] = strtok_r(line, " \t\r", &save); words[num_words] != 0 && num_words < MAX_WORDS - 1;
+			     words[num_words] = strtok_r(0, " \t\r", &save))
+				num_words++;
+			if (num_words > 0)
+				run_request(fd, words, num_words);
+			line = nl + 1;
+		}
+		used -= line - buffer;
+		memmove(buffer, line, used);
+		if (used == sizeof buffer - 1)
+		{
+			reply(fd, "error %d Request too long", DAEMON_ERR_REQUEST);
+			break;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+/*
+ * Serve requests until killed.  The files in 'preload' are parsed before
+ * the socket is opened, so the first jobs on them are fast as well.
+ */
+int run_daemon(char *socket_path, struct daemon_config *daemon_config, char **preload, int num_preload)
+{
+	struct sockaddr_un addr;
+	struct loaded_image *li;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int listen_fd, fd;
+	int i;
+	config = daemon_config;
+	for (i = 0; i < num_preload; i++)
+	{
+		li = get_image(preload[i]);
+		if (li == 0)
+		{
+			fprintf(stderr, "Could not load %s\n", preload[i]);
+			return 0;
+		}
+		release_image(li);
+	}
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof addr.sun_path)
+	{
+		fprintf(stderr, "Socket path too long\n");
+		return 0;
+	}
+	strcpy(addr.sun_path, socket_path);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0)
+	{
+		perror("run_daemon");
+		return 0;
+	}
+	unlink(socket_path);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof addr) != 0 || listen(listen_fd, 16) != 0)
+	{
+		perror("run_daemon");
+		close(listen_fd);
+		return 0;
+	}
+	// Clients that hang up are noticed by write(), not by a signal
+	signal(SIGPIPE, SIG_IGN);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (;;)
+	{
+		fd = accept(listen_fd, 0, 0);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("run_daemon");
+			break;
+		}
+		if (pthread_create(&thread, &attr, serve_connection, (void *)(intptr_t)fd) != 0)
+		{
+			reply(fd, "error %d Out of threads", MACHXO_ERR_NO_MEMORY);
+			close(fd);
+		}
+	}
+	pthread_attr_destroy(&attr);
+	close(listen_fd);
+	return 0;
+}
+
+// "<stage> <done> <total>" as a percentage, on one line per stage
+static void print_progress(char *text)
+{
+	char stage[16];
+	int done, total;
+	if (sscanf(text, "%15s %d %d", stage, &done, &total) != 3)
+		return;
+	if (strcmp(stage, "done") == 0)
+		fprintf(stderr, "\n");
+	else if (total > 0)
+		fprintf(stderr, "\r%-8s %3d%%", stage, (int)(100.0 * done / total));
+	else
+		fprintf(stderr, "\r%-8s %d bytes", stage, done);
+}
+
+/*
+ * Send one request, made of the words in 'argv', and print the reply.
+ * Words naming a file are sent as an absolute path, as the daemon has its
+ * own working directory.  Returns 1 when the daemon answers "ok".
+ */
+int send_request(char *socket_path, int argc, char **argv, int show_progress)
+{
+	struct sockaddr_un addr;
+	char request[MAX_REQUEST];
+	char buffer[MAX_REQUEST];
+	char path[PATH_MAX];
+	char *line, *nl;
+	int used = 0;
+	int len = 0;
+	ssize_t n;
+	int fd;
+	int i;
+	for (i = 0; i < argc; i++)
+	{
+		char *word = argv[i];
+		if (access(word, F_OK) == 0 && realpath(word, path) != 0)
+			word = path;
+		len += snprintf(request + len, sizeof request - len, "%s%s", i > 0 ? " " : "", word);
+		if (len >= (int)sizeof request - 1)
+		{
+			fprintf(stderr, "Request too long\n");
+			return 0;
+		}
+	}
+	request[len++] = '\n';
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof addr.sun_path, "%s", socket_path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof addr) != 0)
+	{
+		perror("send_request");
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+	if (write_all(fd, request, len) != 1)
+	{
+		perror("send_request");
+		close(fd);
+		return 0;
+	}
+	for (;;)
+	{
+		n = read(fd, buffer + used, sizeof buffer - 1 - used);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		used += n;
+		buffer[used] = 0;
+		line = buffer;
+		while ((nl = strchr(line, '\n')) != 0)
+		{
+			*nl = 0;
+			if (strncmp(line, "ok", 2) == 0)
+			{
+				if (line[2] == ' ')
+					printf("%s\n", line + 3);
+				close(fd);
+				return 1;
+			}
+			if (strncmp(line, "error ", 6) == 0)
+			{
+				char *text = strchr(line + 6, ' ');
+				fprintf(stderr, "%s\n", text != 0 ? text + 1 : line);
+				close(fd);
+				return 0;
+			}
+			if (strncmp(line, "message ", 8) == 0)
+				fprintf(stderr, "%s\n", line + 8);
+			else if (strncmp(line, "queued ", 7) == 0)
+				fprintf(stderr, "Waiting for %s earlier jobs on the device\n", line + 7);
+			else if (show_progress && strncmp(line, "progress ", 9) == 0)
+				print_progress(line + 9);
+			line = nl + 1;
+		}
+		used -= line - buffer;
+		memmove(buffer, line, used);
+	}
+	fprintf(stderr, "Daemon closed the connection\n");
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,27 @@
+/*
+ * Resident programming daemon and its client.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ */
+#ifndef _DAEMON_H
+#define _DAEMON_H 1
+
+#include "program.h"
+
+// How devices are opened and programmed, the same for every job
+struct daemon_config {
+	int mode;
+	int i2c_addr;
+	int page_program_delay;
+	int verify_burst;
+	int adaptive_polling;
+	int spi_mode;
+	uint32_t spi_speed;
+	uint32_t i2c_speed;	// 0 for what the adapter tells
+	struct machxo_options options;
+};
+
+int run_daemon(char *socket_path, struct daemon_config *config, char **preload, int num_preload);
+int send_request(char *socket_path, int argc, char **argv, int show_progress);
+
+#endif
@@ -0,0 +1,372 @@
+/*
+ * Memory mapped transport to designs in the MachXO2, on the BeagleBone
+ * GPMC bus.  See gpmc.h for the mailbox.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "gpmc.h"
+#include "machxo.h"
+
+struct gpmc_window {
+	int fd;
+	void *map;
+	volatile uint8_t *regs;
+	uint8_t seq;		// Last REQUEST written
+};
+
+//#define DEBUG(x) (x)
+#define DEBUG(x)
+
+// Spins between clock reads while waiting for the other side
+#define GPMC_SPINS 256
+
+uint32_t gpmc_get_le(volatile uint8_t *regs, int reg, int len)
+{
+	uint32_t val = 0;
+	int i;
+	for (i = len - 1; i >= 0; i--)
+		val = (val << 8) | regs[reg + i];
+	return val;
+}
+
+void gpmc_put_le(volatile uint8_t *regs, int reg, uint32_t val, int len)
+{
+	int i;
+	for (i = 0; i < len; i++)
+		regs[reg + i] = (val >> (8 * i)) & 0xFF;
+}
+
+/*
+ * Word accesses where the buffer allows, so the CPU issues a quarter of
+ * the bus cycles itself; the GPMC splits them for the 8-bit bus.  Device
+ * memory must not see unaligned accesses, so the mailbox side is always
+ * aligned and the user side goes through a local word.
+ */
+void gpmc_write(volatile uint8_t *dst, const uint8_t *src, int len)
+{
+	uint32_t word;
+	int i;
+	for (i = 0; i + 4 <= len; i += 4)
+	{
+		memcpy(&word, src + i, 4);
+		*(volatile uint32_t *)(dst + i) = word;
+	}
+	for (; i < len; i++)
+		dst[i] = src[i];
+}
+
+void gpmc_read(uint8_t *dst, volatile uint8_t *src, int len)
+{
+	uint32_t word;
+	int i;
+	for (i = 0; i + 4 <= len; i += 4)
+	{
+		word = *(volatile uint32_t *)(src + i);
+		memcpy(dst + i, &word, 4);
+	}
+	for (; i < len; i++)
+		dst[i] = src[i];
+}
+
+static uint64_t usecs_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void *map_window(const char *name, int *fd)
+{
+	void *map;
+	off_t base;
+	if (strcmp(name, GPMC_DEV) == 0)
+	{
+		*fd = open("/dev/mem", O_RDWR | O_SYNC);
+		base = GPMC_CS1_BASE;
+	}
+	else
+	{
+		*fd = open(name + strlen(GPMC_DEV) + 1, O_RDWR);
+		base = 0;
+	}
+	if (*fd < 0)
+	{
+		perror("gpmc_open");
+		return 0;
+	}
+	map = mmap(0, GPMC_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, base);
+	if (map == MAP_FAILED)
+	{
+		perror("gpmc_open: mmap");
+		close(*fd);
+		return 0;
+	}
+	return map;
+}
+
+struct gpmc_window *gpmc_map(const char *name, uint32_t id)
+{
+	struct gpmc_window *w;
+	uint32_t found;
+	w = (struct gpmc_window *)calloc(1, sizeof *w);
+	if (w == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	w->map = map_window(name, &w->fd);
+	if (w->map == 0)
+	{
+		free(w);
+		return 0;
+	}
+	w->regs = (volatile uint8_t *)w->map;
+	found = gpmc_get_le(w->regs, GPMC_REG_ID, 4);
+	if (found != id)
+	{
+		fprintf(stderr, "Expected design %08x in %s, found %08x.  Is the design loaded?\n", id, name, found);
+		gpmc_close(w);
+		return 0;
+	}
+	// Whatever was left by an earlier run, the design is in step with it
+	w->seq = w->regs[GPMC_REG_DONE];
+	w->regs[GPMC_REG_REQUEST] = w->seq;
+	return w;
+}
+
+struct gpmc_window *gpmc_open(const char *name)
+{
+	return gpmc_map(name, GPMC_BRIDGE_ID);
+}
+
+volatile uint8_t *gpmc_regs(struct gpmc_window *w)
+{
+	return w->regs;
+}
+
+void gpmc_close(struct gpmc_window *w)
+{
+	if (w == 0)
+		return;
+	munmap(w->map, GPMC_WINDOW_SIZE);
+	close(w->fd);
+	free(w);
+}
+
+int gpmc_request(struct gpmc_window *w)
+{
+	uint64_t deadline = 0;
+	int spins = 0;
+	__sync_synchronize();
+	w->regs[GPMC_REG_REQUEST] = ++w->seq;
+	while (w->regs[GPMC_REG_DONE] != w->seq)
+	{
+		if (++spins < GPMC_SPINS)
+			continue;
+		spins = 0;
+		// Lets a stand-in on the same CPU answer
+		sched_yield();
+		if (deadline == 0)
+			deadline = usecs_now() + GPMC_TIMEOUT_USECS;
+		else if (usecs_now() > deadline)
+		{
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+	__sync_synchronize();
+	switch (w->regs[GPMC_REG_STATUS])
+	{
+	case GPMC_STATUS_OK:
+		return 0;
+	case GPMC_STATUS_TOO_LONG:
+		errno = EMSGSIZE;
+		return -1;
+	case GPMC_STATUS_BAD_REQUEST:
+		errno = EINVAL;
+		return -1;
+	default:
+		errno = EIO;
+		return -1;
+	}
+}
+
+int gpmc_frame(struct gpmc_window *w, const uint8_t *cmd, int oplen, uint8_t *data, int data_len, int direction)
+{
+	volatile uint8_t *regs = w->regs;
+	int done = 0;
+	int chunk;
+	uint8_t flags;
+	DEBUG(fprintf(stderr, "gpmc_frame: %02x, %d bytes\n", cmd[0], data_len));
+	if (data == 0)
+		data_len = 0;
+	gpmc_put_le(regs, GPMC_REG_TOTAL, data_len, 4);
+	gpmc_write(regs + GPMC_REG_COMMAND, cmd, 4);
+	regs[GPMC_REG_OPLEN] = oplen;
+	flags = GPMC_FLAG_FIRST;
+	if (direction != DIRECTION_SEND)
+		flags |= GPMC_FLAG_RECEIVE;
+	do
+	{
+		chunk = data_len - done;
+		if (chunk > GPMC_DATA_SIZE)
+			chunk = GPMC_DATA_SIZE;
+		if (done + chunk == data_len)
+			flags |= GPMC_FLAG_LAST;
+		regs[GPMC_REG_FLAGS] = flags;
+		gpmc_put_le(regs, GPMC_REG_LENGTH, chunk, 2);
+		if (direction == DIRECTION_SEND)
+			gpmc_write(regs + GPMC_REG_DATA, data + done, chunk);
+		if (gpmc_request(w) < 0)
+			return -1;
+		if (direction != DIRECTION_SEND)
+			gpmc_read(data + done, regs + GPMC_REG_DATA, chunk);
+		flags &= ~GPMC_FLAG_FIRST;
+		done += chunk;
+	} while (done < data_len);
+	return 0;
+}
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void stop_serving(int sig)
+{
+	serve_stop = 1;
+}
+
+int gpmc_serve(const char *path, uint32_t id, gpmc_handler_fn handler, void *arg)
+{
+	struct sigaction sa;
+	volatile uint8_t *regs;
+	void *map;
+	uint8_t seq;
+	int spins = 0;
+	int fd;
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0 || ftruncate(fd, GPMC_WINDOW_SIZE) < 0)
+	{
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+	map = mmap(0, GPMC_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		perror(path);
+		close(fd);
+		return 0;
+	}
+	regs = (volatile uint8_t *)map;
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = stop_serving;
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+	seq = regs[GPMC_REG_REQUEST];
+	regs[GPMC_REG_DONE] = seq;
+	gpmc_put_le(regs, GPMC_REG_ID, id, 4);
+	while (!serve_stop)
+	{
+		if (regs[GPMC_REG_REQUEST] == seq)
+		{
+			// Spin for the next chunk of a frame, sleep between frames
+			if (++spins > GPMC_SPINS * 64)
+				usleep(100);
+			else if (spins % GPMC_SPINS == 0)
+				sched_yield();
+			continue;
+		}
+		spins = 0;
+		__sync_synchronize();
+		seq = regs[GPMC_REG_REQUEST];
+		regs[GPMC_REG_STATUS] = handler(arg, regs);
+		__sync_synchronize();
+		regs[GPMC_REG_DONE] = seq;
+	}
+	// No design any more, for hosts that map the window later
+	gpmc_put_le(regs, GPMC_REG_ID, 0, 4);
+	munmap(map, GPMC_WINDOW_SIZE);
+	close(fd);
+	return 1;
+}
+
+// The whole frame of the request in the mailbox, 'buffer' holding its data
+struct bridge_frame {
+	struct machxo_device *dev;
+	uint8_t cmd[4];
+	int direction;
+	uint32_t total;
+	uint32_t pos;
+	uint8_t *buffer;
+	int status;
+};
+
+static int forward_frame(struct bridge_frame *f)
+{
+	if (send_command(f->dev, f->cmd, f->direction, f->total > 0 ? f->buffer : 0, f->total) != 1)
+		return GPMC_STATUS_ERROR;
+	return GPMC_STATUS_OK;
+}
+
+static int serve_chunk(void *arg, volatile uint8_t *regs)
+{
+	struct bridge_frame *f = (struct bridge_frame *)arg;
+	uint8_t flags = regs[GPMC_REG_FLAGS];
+	uint32_t len = gpmc_get_le(regs, GPMC_REG_LENGTH, 2);
+	if (flags & GPMC_FLAG_FIRST)
+	{
+		gpmc_read(f->cmd, regs + GPMC_REG_COMMAND, 4);
+		f->direction = (flags & GPMC_FLAG_RECEIVE) ? DIRECTION_RECEIVE : DIRECTION_SEND;
+		f->total = gpmc_get_le(regs, GPMC_REG_TOTAL, 4);
+		f->pos = 0;
+		f->status = GPMC_STATUS_OK;
+		if (f->total > MAX_SPI_TRANSFER)
+			f->status = GPMC_STATUS_TOO_LONG;
+		else if (f->direction == DIRECTION_RECEIVE && f->total > 0)
+			f->status = forward_frame(f);
+	}
+	if (f->status != GPMC_STATUS_OK)
+		return f->status;
+	if (len > GPMC_DATA_SIZE || f->pos + len > f->total)
+		return GPMC_STATUS_TOO_LONG;
+	if (f->direction == DIRECTION_RECEIVE)
+		gpmc_write(regs + GPMC_REG_DATA, f->buffer + f->pos, len);
+	else
+		gpmc_read(f->buffer + f->pos, regs + GPMC_REG_DATA, len);
+	f->pos += len;
+	// Sends, and commands without data, go out when all of it is in
+	if ((flags & GPMC_FLAG_LAST) && (f->direction == DIRECTION_SEND || f->total == 0))
+		f->status = forward_frame(f);
+	return f->status;
+}
+
+int run_gpmc_bridge(const char *path, struct machxo_device *dev)
+{
+	struct bridge_frame frame;
+	int status;
+	memset(&frame, 0, sizeof frame);
+	frame.dev = dev;
+	frame.buffer = (uint8_t *)malloc(MAX_SPI_TRANSFER);
+	if (frame.buffer == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	fprintf(stderr, "GPMC bridge on %s, forwarding to %s\n", path, device_name(dev));
+	status = gpmc_serve(path, GPMC_BRIDGE_ID, serve_chunk, &frame);
+	free(frame.buffer);
+	return status;
+}
@@ -0,0 +1,100 @@
+/*
+ * Memory mapped transport to designs in the MachXO2, on the BeagleBone
+ * GPMC bus.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * The BB-MACHXO2-JTAG overlay maps the FPGA on chip select 1, an 8-bit
+ * synchronous muxed bus with a 256 byte window.  The designs behind it put
+ * a mailbox in the window, a dual-port RAM on the FPGA side, that starts
+ * with the same header for all of them:
+ *
+ *   0x00  ID        4 bytes, tells which design is loaded
+ *   0x04  REQUEST   sequence number, written last by the host
+ *   0x05  DONE      the design copies REQUEST here when the request is through
+ *   0x06  STATUS    GPMC_STATUS_* of the request
+ *
+ * The configuration bridge, GPMC_BRIDGE_ID, goes on with:
+ *
+ *   0x07  FLAGS     GPMC_FLAG_*
+ *   0x08  LENGTH    2 bytes, data bytes in this chunk
+ *   0x0C  TOTAL     4 bytes, data bytes in the whole frame
+ *   0x10  COMMAND   command byte and 3 operand bytes
+ *   0x14  OPLEN     3 or 4, bytes of COMMAND that are sent
+ *   0x20  DATA      up to GPMC_DATA_SIZE bytes
+ *
+ * Multi-byte fields are little endian.  One frame is one command to the
+ * configuration logic, framed as on SPI (reads start with a dummy page),
+ * and is passed as as many chunks as its data needs.  A read is done by
+ * the bridge on the first chunk and handed back a chunk at a time.
+ *
+ * "gpmc" maps the real window through /dev/mem.  "gpmc:<file>" maps a file
+ * instead, such as one in /dev/shm, served by gpmc_serve() in another
+ * process.  jtag.h has the mailbox of the JTAG master.
+ */
+#ifndef _GPMC_H
+#define _GPMC_H 1
+#include <stdint.h>
+
+#define GPMC_DEV "gpmc"
+#define GPMC_CS1_BASE 0x18000000	// From the overlay's chip select ranges
+#define GPMC_WINDOW_SIZE 0x100
+#define GPMC_BRIDGE_ID 0x3258424D	// "MBX2"
+
+#define GPMC_REG_ID 0x00
+#define GPMC_REG_REQUEST 0x04
+#define GPMC_REG_DONE 0x05
+#define GPMC_REG_STATUS 0x06
+#define GPMC_REG_FLAGS 0x07
+# define GPMC_FLAG_RECEIVE 0x01
+# define GPMC_FLAG_FIRST 0x02
+# define GPMC_FLAG_LAST 0x04
+#define GPMC_REG_LENGTH 0x08
+#define GPMC_REG_TOTAL 0x0C
+#define GPMC_REG_COMMAND 0x10
+#define GPMC_REG_OPLEN 0x14
+#define GPMC_REG_DATA 0x20
+#define GPMC_DATA_SIZE (GPMC_WINDOW_SIZE - GPMC_REG_DATA)
+
+#define GPMC_STATUS_OK 0
+#define GPMC_STATUS_ERROR 1	// The configuration logic did not take the frame
+#define GPMC_STATUS_TOO_LONG 2	// More data than the design buffers
+#define GPMC_STATUS_BAD_REQUEST 3	// The design could not make sense of it
+
+#define GPMC_TIMEOUT_USECS 1000000	// For one request
+
+struct gpmc_window;
+struct machxo_device;
+
+// Serves one request in the mailbox, returns its GPMC_STATUS_*
+typedef int (*gpmc_handler_fn)(void *arg, volatile uint8_t *regs);
+
+// 'name' is "gpmc" or "gpmc:<file>".  0 unless the design 'id' is in the window.
+struct gpmc_window *gpmc_map(const char *name, uint32_t id);
+volatile uint8_t *gpmc_regs(struct gpmc_window *w);
+// Ring REQUEST and wait for DONE.  -1 with errno set on failure or a bad STATUS.
+int gpmc_request(struct gpmc_window *w);
+void gpmc_close(struct gpmc_window *w);
+uint32_t gpmc_get_le(volatile uint8_t *regs, int reg, int len);
+void gpmc_put_le(volatile uint8_t *regs, int reg, uint32_t val, int len);
+// Copies to and from the mailbox, 'len' bytes at a word aligned register
+void gpmc_write(volatile uint8_t *dst, const uint8_t *src, int len);
+void gpmc_read(uint8_t *dst, volatile uint8_t *src, int len);
+/*
+ * Stand-in for a design: create the mailbox in 'path' and pass each
+ * request to 'handler' until SIGINT or SIGTERM.
+ */
+int gpmc_serve(const char *path, uint32_t id, gpmc_handler_fn handler, void *arg);
+
+// The configuration bridge, for MODE_GPMC
+struct gpmc_window *gpmc_open(const char *name);
+/*
+ * Send one frame, 'oplen' bytes of 'cmd' and then 'data_len' bytes of
+ * data in the given direction.  Same contract as ioctl(2): -1 with errno
+ * set on failure.
+ */
+int gpmc_frame(struct gpmc_window *w, const uint8_t *cmd, int oplen, uint8_t *data, int data_len, int direction);
+// Stand-in for the bridge design, passing the frames on to 'dev'
+int run_gpmc_bridge(const char *path, struct machxo_device *dev);
+
+#endif
@@ -0,0 +1,329 @@
+/*
+ * In-memory image of a MachXO2 configuration, as read from a JEDEC file.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "jedec.h"
+#include "image.h"
+#include "kernels.h"
+#include "machxo.h"
+
+#define HASH_MAGIC "MXH2"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static int add_block(struct machxo_image *image, uint32_t address, int is_user_flash, uint8_t *data, int data_len)
+{
+	struct image_block *blocks;
+	blocks = (struct image_block *)realloc(image->blocks, (image->num_blocks + 1) * sizeof *blocks);
+	if (blocks == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	image->blocks = blocks;
+	blocks += image->num_blocks++;
+	blocks->address = address;
+	blocks->is_user_flash = is_user_flash;
+	blocks->data = data;
+	blocks->data_len = data_len;
+	return 1;
+}
+
+static int parse_jedec(struct jedec_file *jf, struct machxo_image *image)
+{
+	int section;
+	uint32_t address;
+	uint8_t *data;
+	int data_len;
+	int tag_data_seen = 0;
+
+	// Assume there will be one initial section that we can safely ignore
+	if (get_next_jedec_section(jf, &section, &address, &data, &data_len) != 1)
+		return 0;
+	while (1)
+	{
+		if (get_next_jedec_section(jf, &section, &address, &data, &data_len) != 1)
+		{
+			fprintf(stderr, "Input file error.\n");
+			return 0;
+		}
+		switch (section)
+		{
+		case SECTION_NOTE:
+			if (strstr((char*)data, "TAG DATA") != 0)
+				tag_data_seen = 1;
+			break;
+		case SECTION_FUSE_MAP:
+			if (add_block(image, address, tag_data_seen, data, data_len) != 1)
+				return 0;
+			break;
+		case SECTION_ARCH:
+			if (data_len != 10)
+			{
+				fprintf(stderr, "Incorrect size feature row and bits\n");
+				return 0;
+			}
+			memcpy(image->feature_row, data, 8);
+			memcpy(image->feature_bits, data + 8, 2);
+			image->has_feature_row = 1;
+			break;
+		case SECTION_USERCODE:
+			image->user_code = address;
+			image->has_user_code = 1;
+			break;
+		case SECTION_END:
+			return find_page_runs(image);
+		case SECTION_NONE:
+		case SECTION_NUM_PINS:
+		case SECTION_NUM_FUSES:
+		case SECTION_DEFAULT_FUSE_VAL:
+		case SECTION_CHECK_SUM:
+			break; // just ignore for now
+		case SECTION_SECURITY_FUSE:
+			if (data[0] != '0')
+				fprintf(stderr, "Security fuse not implemented");
+			break;
+		default:
+			fprintf(stderr, "Unknown JEDEC section\n");
+			return 0;
+		}
+	}
+}
+
+/*
+ * The image takes over the fuse data of the parser, so it stays valid until
+ * free_image(), and several files can be loaded at the same time.
+ */
+int load_jedec_image(char *fname, struct machxo_image *image)
+{
+	struct jedec_file jf;
+	int status;
+	memset(image, 0, sizeof *image);
+	image->erase_sections = ERASE_FEATURE_ROW | ERASE_CONFIGURATION | ERASE_USER_FLASH;
+	status = open_jedec(&jf, fname, 0) == 1 && parse_jedec(&jf, image) == 1;
+	image->arena = take_jedec_arena(&jf);
+	close_jedec(&jf);
+	if (!status)
+		free_image(image);
+	return status;
+}
+
+/*
+ * Replace the user flash blocks of the image with the contents of a raw
+ * binary file, starting at UFM page 0 and padded with zeros to whole pages.
+ */
+int load_user_flash_binary(char *fname, struct machxo_image *image)
+{
+	FILE *f;
+	uint8_t *data;
+	long len;
+	int i, j;
+	f = fopen(fname, "rb");
+	if (f == 0)
+	{
+		perror("load_user_flash_binary");
+		return 0;
+	}
+	if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0)
+	{
+		perror("load_user_flash_binary");
+		fclose(f);
+		return 0;
+	}
+	len = (len + MACHXO2_PAGE_SIZE - 1) / MACHXO2_PAGE_SIZE * MACHXO2_PAGE_SIZE;
+	data = (uint8_t *)calloc(1, len ? len : 1);
+	if (data == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		fclose(f);
+		return 0;
+	}
+	if (fread(data, 1, len, f) == 0 && ferror(f))
+	{
+		perror("load_user_flash_binary");
+		fclose(f);
+		free(data);
+		return 0;
+	}
+	fclose(f);
+	for (i = 0, j = 0; i < image->num_blocks; i++)
+		if (!image->blocks[i].is_user_flash)
+			image->blocks[j++] = image->blocks[i];
+	image->num_blocks = j;
+	free(image->ufm_data);
+	image->ufm_data = 0;
+	if (len == 0)
+	{
+		free(data);
+		return find_page_runs(image);
+	}
+	image->ufm_data = data;
+	if (add_block(image, 0, 1, data, len) != 1)
+		return 0;
+	return find_page_runs(image);
+}
+
+/*
+ * List the runs of pages that are not all zero, block by block.  A partial
+ * page at the end of a block counts as a page.
+ */
+int find_page_runs(struct machxo_image *image)
+{
+	struct page_run *runs = 0;
+	int num_runs = 0;
+	int size = 0;
+	int i, page;
+	for (i = 0; i < image->num_blocks; i++)
+	{
+		struct image_block *block = &image->blocks[i];
+		int num_pages = (block->data_len + MACHXO2_PAGE_SIZE - 1) / MACHXO2_PAGE_SIZE;
+		int in_run = 0;
+		for (page = 0; page < num_pages; page++)
+		{
+			int len = block->data_len - page * MACHXO2_PAGE_SIZE;
+			if (all_zero(block->data + page * MACHXO2_PAGE_SIZE, len < MACHXO2_PAGE_SIZE ? len : MACHXO2_PAGE_SIZE))
+			{
+				in_run = 0;
+				continue;
+			}
+			if (in_run)
+			{
+				runs[num_runs - 1].num_pages++;
+				continue;
+			}
+			if (num_runs == size)
+			{
+				struct page_run *p;
+				size = size ? size * 2 : 64;
+				p = (struct page_run *)realloc(runs, size * sizeof *runs);
+				if (p == 0)
+				{
+					fprintf(stderr, "Out of memory\n");
+					free(runs);
+					return 0;
+				}
+				runs = p;
+			}
+			runs[num_runs].block = i;
+			runs[num_runs].first_page = page;
+			runs[num_runs].num_pages = 1;
+			num_runs++;
+			in_run = 1;
+		}
+	}
+	free(image->runs);
+	image->runs = runs;
+	image->num_runs = num_runs;
+	return 1;
+}
+
+static uint64_t fnv1a(uint64_t hash, const uint8_t *data, int data_len)
+{
+	int i;
+	for (i = 0; i < data_len; i++)
+		hash = (hash ^ data[i]) * FNV_PRIME;
+	return hash;
+}
+
+/*
+ * 64-bit FNV-1a over everything that ends up in the device: block addresses
+ * and contents, feature row and bits, and the usercode.  The UFM blocks are
+ * left out for the design hash, which a UFM-only update keeps.
+ */
+static uint64_t hash_image(struct machxo_image *image, int with_user_flash)
+{
+	uint64_t hash = FNV_OFFSET;
+	uint8_t buffer[5];
+	int i;
+	for (i = 0; i < image->num_blocks; i++)
+	{
+		struct image_block *block = &image->blocks[i];
+		if (block->is_user_flash && !with_user_flash)
+			continue;
+		buffer[0] = block->address >> 24;
+		buffer[1] = block->address >> 16;
+		buffer[2] = block->address >> 8;
+		buffer[3] = block->address;
+		buffer[4] = block->is_user_flash;
+		hash = fnv1a(hash, buffer, 5);
+		hash = fnv1a(hash, block->data, block->data_len);
+	}
+	if (image->has_feature_row)
+	{
+		hash = fnv1a(hash, image->feature_row, 8);
+		hash = fnv1a(hash, image->feature_bits, 2);
+	}
+	if (image->has_user_code)
+	{
+		buffer[0] = image->user_code >> 24;
+		buffer[1] = image->user_code >> 16;
+		buffer[2] = image->user_code >> 8;
+		buffer[3] = image->user_code;
+		hash = fnv1a(hash, buffer, 4);
+	}
+	return hash;
+}
+
+uint64_t image_hash(struct machxo_image *image)
+{
+	return hash_image(image, 1);
+}
+
+uint64_t design_hash(struct machxo_image *image)
+{
+	return hash_image(image, 0);
+}
+
+/*
+ * The hash page is one UFM page holding HASH_MAGIC, the 64-bit image hash
+ * and the design hash folded to 32 bits, all big endian.  It is worked out
+ * once per image, however many devices are programmed from it.
+ */
+int prepare_hash_page(struct machxo_image *image, int hash_page)
+{
+	struct image_block *block;
+	uint8_t *page = image->hash_data;
+	uint64_t hash;
+	uint32_t folded;
+	int i;
+	for (i = 0; i < image->num_blocks; i++)
+	{
+		block = &image->blocks[i];
+		if (block->is_user_flash && block->address <= (uint32_t)hash_page * MACHXO2_PAGE_SIZE
+		    && (uint32_t)hash_page * MACHXO2_PAGE_SIZE < block->address + block->data_len)
+		{
+			fprintf(stderr, "Hash page %d is used by the image.\n", hash_page);
+			return 0;
+		}
+	}
+	image->hash = image_hash(image);
+	memset(page, 0, MACHXO2_PAGE_SIZE);
+	memcpy(page, HASH_MAGIC, HASH_MAGIC_LEN);
+	for (i = 0; i < 8; i++)
+		page[4 + i] = image->hash >> (56 - 8 * i);
+	hash = design_hash(image);
+	folded = (uint32_t)(hash >> 32) ^ (uint32_t)hash;
+	for (i = 0; i < HASH_DESIGN_LEN; i++)
+		page[HASH_DESIGN_OFFSET + i] = folded >> (24 - 8 * i);
+	return 1;
+}
+
+void free_image(struct machxo_image *image)
+{
+	free(image->blocks);
+	free(image->runs);
+	free_jedec_arena(image->arena);
+	if (image->map != 0)
+		munmap(image->map, image->map_len);
+	free(image->ufm_data);
+	memset(image, 0, sizeof *image);
+}
@@ -0,0 +1,61 @@
+/*
+ * In-memory image of a MachXO2 configuration, as read from a JEDEC file.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ */
+#ifndef _IMAGE_H
+#define _IMAGE_H 1
+#include <stddef.h>
+#include <stdint.h>
+
+#include "machxo.h"
+
+// Where the hash page has its magic, and the hash of all but the UFM
+#define HASH_MAGIC_LEN 4
+#define HASH_DESIGN_OFFSET 12
+#define HASH_DESIGN_LEN 4
+
+struct image_block {
+	uint32_t address;	// Byte address
+	int is_user_flash;
+	uint8_t *data;
+	int data_len;
+};
+
+// Pages that are not all zero, the erased state
+struct page_run {
+	int32_t block;		// Index in 'blocks'
+	int32_t first_page;	// Page within the block
+	int32_t num_pages;
+};
+
+struct machxo_image {
+	struct image_block *blocks;
+	int num_blocks;
+	struct page_run *runs;
+	int num_runs;
+	int has_feature_row;
+	uint8_t feature_row[8];
+	uint8_t feature_bits[2];
+	int has_user_code;
+	uint32_t user_code;
+	uint32_t erase_sections;	// ISC_ERASE operand
+	// Storage the blocks point into, released by free_image()
+	void *arena;		// Fuse data parsed from a JEDEC file
+	void *map;		// Mapped bitstream or cache file
+	size_t map_len;
+	uint8_t *ufm_data;	// Raw UFM binary
+	// Hash page contents, see prepare_hash_page()
+	uint64_t hash;
+	uint8_t hash_data[MACHXO2_PAGE_SIZE];
+};
+
+int load_jedec_image(char *fname, struct machxo_image *image);
+int load_user_flash_binary(char *fname, struct machxo_image *image);
+uint64_t image_hash(struct machxo_image *image);
+uint64_t design_hash(struct machxo_image *image);
+int find_page_runs(struct machxo_image *image);
+int prepare_hash_page(struct machxo_image *image, int hash_page);
+void free_image(struct machxo_image *image);
+
+#endif
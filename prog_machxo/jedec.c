@@ -2,14 +2,39 @@
  * Functions for JEDEC files for Lattice MachXO2 FPGA's.
  * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
  * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * The file is mapped read-only and sections are found with memchr().  Fuse
+ * data is packed straight from the mapping, either into one arena sized from
+ * the QF fuse count, or in streaming mode piece by piece into one small
+ * buffer that is reused for every piece.  Other sections are copied to a
+ * scratch buffer that is reused as well, so section data is only valid
+ * until the next call, except fuse data in arena mode which is valid until
+ * close_jedec(), or until free_jedec_arena() if the arena has been taken
+ * over with take_jedec_arena().
+ *
+ * All state is in the struct jedec_file, so different files can be parsed
+ * at the same time from different threads.
  */
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "jedec.h"
+#include "kernels.h"
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	uint8_t data[];
+};
 
-static FILE *f = 0;
 
 static int is_ws(int c)
 {
@@ -18,103 +43,244 @@ static int is_ws(int c)
 
 static int bitstring_to_bytes(uint8_t *data)
 {
-	int dst_idx = 0;
-	int cur_bit = 0;
-	int src_idx;
-	for (src_idx = 0; data[src_idx] != 0; src_idx++)
-	{
-		int bit = data[src_idx];
-		if (bit == '0')
-			bit = 0;
-		else if (bit == '1')
-			bit = 1;
-		else
-			continue;
-		if (cur_bit == 8)
-		{
-			cur_bit = 0;
-			dst_idx++;
-		}
-		if (cur_bit == 0)
-			data[dst_idx] = bit; // Initialize with zero
-		else
-			data[dst_idx] = (data[dst_idx] << 1) | bit;
-		cur_bit++;
+	int len = pack_bits(data, strlen((char *)data), data, 0x7FFFFFFF, 0);
+	return len ? len : 1;
+}
+
+static uint8_t *arena_reserve(struct jedec_file *jf, size_t size)
+{
+	struct arena_chunk *chunk = jf->arena;
+	if (chunk == 0 || chunk->size - chunk->used < size)
+	{
+		size_t chunk_size = size > 65536 ? size : 65536;
+		chunk = (struct arena_chunk *)malloc(sizeof *chunk + chunk_size);
+		if (chunk == 0)
+			return 0;
+		chunk->next = jf->arena;
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		jf->arena = chunk;
+	}
+	return chunk->data + chunk->used;
+}
+
+static void arena_commit(struct jedec_file *jf, size_t size)
+{
+	jf->arena->used += size;
+}
+
+/*
+ * Size the arena for the whole fuse map in one allocation.  Each section
+ * takes (bits + 7) / 8 bytes, so this is their sum as long as sections are
+ * whole bytes, as the 128 fuse rows of the MachXO2 are.
+ */
+static void arena_size_for_fuses(struct jedec_file *jf, unsigned long fuses)
+{
+	struct arena_chunk *chunk;
+	size_t size = (fuses + 7) / 8;
+	if (jf->arena != 0 || size < 65536)
+		return;
+	chunk = (struct arena_chunk *)malloc(sizeof *chunk + size);
+	if (chunk == 0)
+		return;
+	chunk->next = 0;
+	chunk->size = size;
+	chunk->used = 0;
+	jf->arena = chunk;
+}
+
+/*
+ * Fuses in a section body, one character each on lines ending in '\n' or
+ * "\r\n".  Anything else on a line is counted too, so never too few.
+ */
+static size_t count_fuses(const uint8_t *body, size_t len)
+{
+	const uint8_t *end = body + len;
+	const uint8_t *nl;
+	size_t bits = 0, line;
+	while (body < end)
+	{
+		nl = (const uint8_t *)memchr(body, '\n', end - body);
+		line = (nl != 0 ? nl : end) - body;
+		if (line > 0 && body[line - 1] == '\r')
+			line--;
+		bits += line;
+		if (nl == 0)
+			break;
+		body = nl + 1;
 	}
-	return dst_idx + 1;
+	return bits;
 }
 
-static int reverse_bits(uint8_t *data, int data_len)
+static uint8_t *copy_to_scratch(struct jedec_file *jf, const uint8_t *src, size_t len)
 {
-  int i, j;
-  // reverse bytes
-  for (i = 0; i < data_len / 2; i++)
-  {
-    uint8_t tmp = data[data_len - i - 1];
-    data[data_len - i - 1] = data[i];
-    data[i] = tmp;
-  }
-  // reverse bits
-  for (i = 0; i < data_len; i++)
-  {
-    uint8_t tmp = data[i];
-    data[i] = 0;
-    for (j = 0; j < 8; j++)
-    {
-      data[i] = (data[i] << 1) | (tmp & 1);
-      tmp >>= 1;
-    }
-  }
+	if (len + 1 > jf->scratch_size)
+	{
+		uint8_t *p = (uint8_t *)realloc(jf->scratch, len + 1);
+		if (p == 0)
+			return 0;
+		jf->scratch = p;
+		jf->scratch_size = len + 1;
+	}
+	memcpy(jf->scratch, src, len);
+	jf->scratch[len] = 0;
+	return jf->scratch;
 }
 
-int open_jedec(char *fname)
+/*
+ * With 'stream_max' > 0 fuse map sections are returned in pieces of at most
+ * that many bytes, each valid until the next call, instead of whole.
+ */
+int open_jedec(struct jedec_file *jf, char *fname, int stream_max)
 {
-	f = fopen(fname, "r");
-	if (f == 0)
+	struct stat st;
+	const uint8_t *stx;
+	int fd;
+	memset(jf, 0, sizeof *jf);
+	jf->stream_max = stream_max;
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
 	{
 		perror("open_jedec");
 		return 0;
 	}
-	while (!feof(f))
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
 	{
-		int c = getc(f);
-		if (c == '\x02')
-			break;
+		fprintf(stderr, "Could not find start of file marker\n");
+		close(fd);
+		return 0;
 	}
-	if (feof(f))
+	jf->map = (const uint8_t *)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (jf->map == MAP_FAILED)
+	{
+		perror("open_jedec");
+		jf->map = 0;
+		return 0;
+	}
+	jf->map_len = st.st_size;
+	madvise((void *)jf->map, jf->map_len, MADV_SEQUENTIAL);
+	stx = (const uint8_t *)memchr(jf->map, '\x02', jf->map_len);
+	if (stx == 0)
 	{
 		fprintf(stderr, "Could not find start of file marker\n");
 		return 0;
 	}
+	jf->pos = stx + 1 - jf->map;
+	if (jf->stream_max > 0)
+	{
+		jf->stream_buffer = (uint8_t *)malloc(jf->stream_max);
+		if (jf->stream_buffer == 0)
+		{
+			fprintf(stderr, "Out of memory\n");
+			return 0;
+		}
+	}
 	return 1;
 }
 
-int get_next_jedec_section(int *section, uint32_t *address, uint8_t **data, int *data_len)
+// The fuse data then stays valid after close_jedec()
+void *take_jedec_arena(struct jedec_file *jf)
 {
-	int c;
-	int buffer_free;
+	void *arena = jf->arena;
+	jf->arena = 0;
+	return arena;
+}
+
+void free_jedec_arena(void *arena)
+{
+	struct arena_chunk *chunk = (struct arena_chunk *)arena;
+	while (chunk != 0)
+	{
+		struct arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+}
+
+void close_jedec(struct jedec_file *jf)
+{
+	free_jedec_arena(take_jedec_arena(jf));
+	if (jf->map != 0)
+		munmap((void *)jf->map, jf->map_len);
+	jf->map = 0;
+	jf->map_len = 0;
+	free(jf->scratch);
+	jf->scratch = 0;
+	jf->scratch_size = 0;
+	free(jf->stream_buffer);
+	jf->stream_buffer = 0;
+	jf->stream_next = 0;
+	jf->stream_released = 0;
+}
+
+// Drop the pages of the mapping that have been parsed, so they do not add to RSS
+static void release_consumed(struct jedec_file *jf, const uint8_t *upto)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t offset = (upto - jf->map) / page * page;
+	if (offset <= jf->stream_released)
+		return;
+	madvise((void *)(jf->map + jf->stream_released), offset - jf->stream_released, MADV_DONTNEED);
+	jf->stream_released = offset;
+}
+
+/*
+ * Next piece of a fuse map section in streaming mode.  The end of the
+ * section is found as the text is packed, so the mapping is only touched
+ * once, front to back.
+ */
+static int next_stream_piece(struct jedec_file *jf, uint32_t *address, uint8_t **data, int *data_len)
+{
+	const uint8_t *end = jf->map + jf->map_len;
+	int consumed;
+	int len = pack_bits(jf->stream_next, end - jf->stream_next, jf->stream_buffer, jf->stream_max, &consumed);
+	jf->stream_next += consumed;
+	release_consumed(jf, jf->stream_next);
+	*address = jf->stream_address;
+	*data = jf->stream_buffer;
+	*data_len = len;
+	jf->stream_address += len;
+	// Look ahead for the end of the section, so it is not returned again empty
+	while (jf->stream_next < end && is_ws(*jf->stream_next))
+		jf->stream_next++;
+	if (jf->stream_next == end)
+	{
+		fprintf(stderr, "Unexpected end of file\n");
+		return 0;
+	}
+	if (*jf->stream_next == '*')
+	{
+		jf->pos = jf->stream_next + 1 - jf->map;
+		jf->stream_next = 0;
+	}
+	return 1;
+}
+
+int get_next_jedec_section(struct jedec_file *jf, int *section, uint32_t *address, uint8_t **data, int *data_len)
+{
+	const uint8_t *body, *star, *nl;
+	size_t body_len, size;
 	uint8_t *buffer;
-	int buffer_ptr;
-	int i;
+	uint32_t addr;
+	int c;
 	// Defaults
 	*address = 0;
 	*data = 0;
 	*data_len = 0;
-	while (!feof(f))
+	if (jf->stream_next != 0)
 	{
-		int c = getc(f);
-		if (!is_ws(c))
-		{
-			ungetc(c, f);
-			break;
-		}
+		*section = SECTION_FUSE_MAP;
+		return next_stream_piece(jf, address, data, data_len);
 	}
-	if (feof(f))
+	while (jf->pos < jf->map_len && is_ws(jf->map[jf->pos]))
+		jf->pos++;
+	if (jf->pos >= jf->map_len)
 	{
 		fprintf(stderr, "Truncated file\n");
 		return 0;
 	}
-	c = getc(f);
+	c = jf->map[jf->pos++];
 	if (c == '\x03')
 	{
 		// End of file
@@ -127,58 +293,82 @@ int get_next_jedec_section(int *section, uint32_t *address, uint8_t **data, int
 		*section = SECTION_NONE;
 		return 1;
 	}
-	// Assume valid JEDEC code.  Read data (skip white space)
-	buffer_free = 80;
-	buffer = (uint8_t*)malloc(buffer_free + 1);
-	if (buffer == 0)
-	{
-		fprintf(stderr, "Out of memory\n");
-		return 0;
-	}
-	buffer_ptr = 0;
-	while (!feof(f))
+	// Assume valid JEDEC code
+	body = jf->map + jf->pos;
+	if (c == 'L')
 	{
-		int c = getc(f);
-		if (c == '*')
-			break;
-		if (buffer_free == 0)
+		*section = SECTION_FUSE_MAP;
+		for (addr = 0; jf->pos < jf->map_len && jf->map[jf->pos] >= '0' && jf->map[jf->pos] <= '9'; jf->pos++)
+			addr = addr * 10 + jf->map[jf->pos] - '0';
+		nl = (const uint8_t *)memchr(jf->map + jf->pos, '\n', jf->map_len - jf->pos);
+		if (nl == 0)
+		{
+			fprintf(stderr, "Unexpected end of file\n");
+			return 0;
+		}
+		*address = addr / 8; // Byte address, not bit address
+		if (jf->stream_max > 0)
+		{
+			jf->stream_next = nl + 1;
+			jf->stream_address = *address;
+			return next_stream_piece(jf, address, data, data_len);
+		}
+		body = nl + 1;
+		star = (const uint8_t *)memchr(body, '*', jf->map + jf->map_len - body);
+		if (star == 0)
 		{
-			buffer_free = 2048;
-			buffer = (uint8_t*)realloc(buffer, buffer_ptr + buffer_free + 1);
-			if (buffer == 0)
-			{
-				fprintf(stderr, "Out of memory\n");
-				return 0;
-			}
+			fprintf(stderr, "Unexpected end of file\n");
+			return 0;
 		}
-		buffer[buffer_ptr++] = c;
-		--buffer_free;
+		body_len = star - body;
+		jf->pos = star + 1 - jf->map;
+		size = (count_fuses(body, body_len) + 7) / 8;
+		buffer = arena_reserve(jf, size);
+		if (buffer == 0)
+		{
+			fprintf(stderr, "Out of memory\n");
+			return 0;
+		}
+		*data = buffer;
+		*data_len = pack_bits(body, body_len, buffer, size, 0);
+		arena_commit(jf, *data_len);
+		return 1;
 	}
-	buffer[buffer_ptr] = 0;
-	if (feof(f))
+	// The section runs up to the next '*'
+	star = (const uint8_t *)memchr(body, '*', jf->map_len - jf->pos);
+	if (star == 0)
 	{
 		fprintf(stderr, "Unexpected end of file\n");
 		return 0;
 	}
+	body_len = star - body;
+	jf->pos = star + 1 - jf->map;
+	buffer = copy_to_scratch(jf, body, body_len);
+	if (buffer == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
 	switch (c)
 	{
 	case 'N':
 		*section = SECTION_NOTE;
 		*data = buffer;
-		*data_len = buffer_ptr;
+		*data_len = body_len;
 		return 1;
 	case 'Q':
 		if (buffer[0] == 'F')
 		{
 			*section = SECTION_NUM_FUSES;
 			*data = buffer + 1;
-			*data_len = buffer_ptr - 1;
+			*data_len = body_len - 1;
+			arena_size_for_fuses(jf, strtoul((char *)buffer + 1, 0, 10));
 		}
-		else if (buffer[0] = 'P')
+		else if (buffer[0] == 'P')
 		{
 			*section = SECTION_NUM_PINS;
 			*data = buffer + 1;
-			*data_len = buffer_ptr - 1;
+			*data_len = body_len - 1;
 		}
 		else
 		{
@@ -196,20 +386,6 @@ int get_next_jedec_section(int *section, uint32_t *address, uint8_t **data, int
 		*data = buffer;
 		*data_len = 1;
 		return 1;
-	case 'L':
-		*section = SECTION_FUSE_MAP;
-		*address = (uint32_t)strtol((char *)buffer, 0, 10);
-		*address /= 8; // Byte address, not bit address
-		for (i = 0; buffer[i] != '\n' && buffer[i] != 0; i++)
-			;
-		if (buffer[i] == 0)
-		{
-			fprintf(stderr, "Unexpected end of file\n");
-			return 0;
-		}
-		*data = buffer + i + 1;
-		*data_len = bitstring_to_bytes(*data);
-		return 1;
 	case 'C':
 		*section = SECTION_CHECK_SUM;
 		*data = buffer;
@@ -252,4 +428,4 @@ int get_next_jedec_section(int *section, uint32_t *address, uint8_t **data, int
 		break;
 	}
 	return 0;
-}
\ No newline at end of file
+}
@@ -4,7 +4,9 @@
  * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
  */
 #ifndef _JEDEC_H
-#define _JEDEX_H 1
+#define _JEDEC_H 1
+#include <stddef.h>
+#include <stdint.h>
 
 #define SECTION_NONE 0
 #define SECTION_END 1
@@ -18,7 +20,27 @@
 #define SECTION_ARCH 9
 #define SECTION_USERCODE 10
 
-int open_jedec(char *fname);
-int get_next_jedec_section(int *section, uint32_t *address, uint8_t **data, int *data_len);
+struct arena_chunk;
+
+// A JEDEC file being parsed
+struct jedec_file {
+	const uint8_t *map;
+	size_t map_len;
+	size_t pos;
+	uint8_t *scratch;
+	size_t scratch_size;
+	struct arena_chunk *arena;	// Fuse data
+	int stream_max;
+	uint8_t *stream_buffer;
+	const uint8_t *stream_next;	// Remaining text of the current L section
+	uint32_t stream_address;
+	size_t stream_released;		// Mapping before this offset has been dropped
+};
+
+int open_jedec(struct jedec_file *jf, char *fname, int stream_max);
+void close_jedec(struct jedec_file *jf);
+int get_next_jedec_section(struct jedec_file *jf, int *section, uint32_t *address, uint8_t **data, int *data_len);
+void *take_jedec_arena(struct jedec_file *jf);
+void free_jedec_arena(void *arena);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,468 @@
+/*
+ * JTAG master on the GPMC bus, queuing scans into batches.  See jtag.h.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gpmc.h"
+#include "jtag.h"
+
+// TDO of a captured shift, to be copied out when its request is through
+struct jtag_read {
+	uint8_t *dest;
+	int bits;
+	int tdo_offset;		// In the TDO of its request
+};
+
+// One mailbox request worth of the queue
+struct jtag_segment {
+	int ops_end;
+	int reads_end;
+};
+
+struct jtag {
+	struct gpmc_window *w;
+	int state;		// After the queue
+
+	uint8_t *ops;
+	int ops_len;
+	int ops_size;
+	struct jtag_read *reads;
+	int num_reads;
+	int reads_size;
+	struct jtag_segment *segments;
+	int num_segments;
+	int segments_size;
+	int seg_start;		// Of the segment being filled
+	int seg_tdo;		// TDO bytes of the segment being filled
+
+	struct jtag_stats stats;
+};
+
+//#define DEBUG(x) (x)
+#define DEBUG(x)
+
+// A shift is split in operations of at most this many bits
+#define JTAG_SHIFT_MAX_BITS ((GPMC_DATA_SIZE - 4) * 8)
+
+const uint8_t jtag_next_state[JTAG_NUM_STATES][2] = {
+	[JTAG_RESET] = { JTAG_IDLE, JTAG_RESET },
+	[JTAG_IDLE] = { JTAG_IDLE, JTAG_DRSELECT },
+	[JTAG_DRSELECT] = { JTAG_DRCAPTURE, JTAG_IRSELECT },
+	[JTAG_DRCAPTURE] = { JTAG_DRSHIFT, JTAG_DREXIT1 },
+	[JTAG_DRSHIFT] = { JTAG_DRSHIFT, JTAG_DREXIT1 },
+	[JTAG_DREXIT1] = { JTAG_DRPAUSE, JTAG_DRUPDATE },
+	[JTAG_DRPAUSE] = { JTAG_DRPAUSE, JTAG_DREXIT2 },
+	[JTAG_DREXIT2] = { JTAG_DRSHIFT, JTAG_DRUPDATE },
+	[JTAG_DRUPDATE] = { JTAG_IDLE, JTAG_DRSELECT },
+	[JTAG_IRSELECT] = { JTAG_IRCAPTURE, JTAG_RESET },
+	[JTAG_IRCAPTURE] = { JTAG_IRSHIFT, JTAG_IREXIT1 },
+	[JTAG_IRSHIFT] = { JTAG_IRSHIFT, JTAG_IREXIT1 },
+	[JTAG_IREXIT1] = { JTAG_IRPAUSE, JTAG_IRUPDATE },
+	[JTAG_IRPAUSE] = { JTAG_IRPAUSE, JTAG_IREXIT2 },
+	[JTAG_IREXIT2] = { JTAG_IRSHIFT, JTAG_IRUPDATE },
+	[JTAG_IRUPDATE] = { JTAG_IDLE, JTAG_DRSELECT },
+};
+
+static const char *state_names[JTAG_NUM_STATES] = {
+	"RESET", "IDLE", "DRSELECT", "DRCAPTURE", "DRSHIFT", "DREXIT1", "DRPAUSE", "DREXIT2",
+	"DRUPDATE", "IRSELECT", "IRCAPTURE", "IRSHIFT", "IREXIT1", "IRPAUSE", "IREXIT2", "IRUPDATE",
+};
+
+const char *jtag_state_name(int state)
+{
+	if (state < 0 || state >= JTAG_NUM_STATES)
+		return "?";
+	return state_names[state];
+}
+
+struct jtag *jtag_open(const char *name)
+{
+	struct jtag *j;
+	j = (struct jtag *)calloc(1, sizeof *j);
+	if (j == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	j->w = gpmc_map(name, JTAG_MASTER_ID);
+	if (j->w == 0)
+	{
+		free(j);
+		return 0;
+	}
+	// Unknown until the first reset, which any path from here starts with
+	j->state = -1;
+	return j;
+}
+
+void jtag_close(struct jtag *j)
+{
+	if (j == 0)
+		return;
+	gpmc_close(j->w);
+	free(j->ops);
+	free(j->reads);
+	free(j->segments);
+	free(j);
+}
+
+int jtag_state(struct jtag *j)
+{
+	return j->state;
+}
+
+void jtag_get_stats(struct jtag *j, struct jtag_stats *stats)
+{
+	*stats = j->stats;
+}
+
+static int grow(void **buffer, int *size, int needed, int item_size)
+{
+	void *p;
+	int n;
+	if (needed <= *size)
+		return 1;
+	n = *size > 0 ? *size : 64;
+	while (n < needed)
+		n *= 2;
+	p = realloc(*buffer, (size_t)n * item_size);
+	if (p == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	*buffer = p;
+	*size = n;
+	return 1;
+}
+
+static int close_segment(struct jtag *j)
+{
+	if (j->ops_len == j->seg_start)
+		return 1;
+	if (!grow((void **)&j->segments, &j->segments_size, j->num_segments + 1, sizeof *j->segments))
+		return 0;
+	j->segments[j->num_segments].ops_end = j->ops_len;
+	j->segments[j->num_segments].reads_end = j->num_reads;
+	j->num_segments++;
+	j->seg_start = j->ops_len;
+	j->seg_tdo = 0;
+	return 1;
+}
+
+/*
+ * Room for an operation of 'op_len' bytes giving 'tdo_len' bytes of TDO,
+ * in the segment being filled if it fits there.
+ */
+static uint8_t *queue_op(struct jtag *j, int op_len, int tdo_len, int *tdo_offset)
+{
+	uint8_t *op;
+	if (j->ops_len >= JTAG_QUEUE_MAX && jtag_flush(j) != 1)
+		return 0;
+	if (j->ops_len - j->seg_start + op_len > GPMC_DATA_SIZE || j->seg_tdo + tdo_len > GPMC_DATA_SIZE)
+	{
+		if (close_segment(j) != 1)
+			return 0;
+	}
+	if (!grow((void **)&j->ops, &j->ops_size, j->ops_len + op_len, 1))
+		return 0;
+	op = j->ops + j->ops_len;
+	j->ops_len += op_len;
+	*tdo_offset = j->seg_tdo;
+	j->seg_tdo += tdo_len;
+	return op;
+}
+
+static void discard_queue(struct jtag *j)
+{
+	j->ops_len = 0;
+	j->num_reads = 0;
+	j->num_segments = 0;
+	j->seg_start = 0;
+	j->seg_tdo = 0;
+}
+
+int jtag_flush(struct jtag *j)
+{
+	volatile uint8_t *regs = gpmc_regs(j->w);
+	uint8_t tdo[GPMC_DATA_SIZE];
+	int ops_start = 0, reads_start = 0;
+	int tdo_len;
+	int i, k;
+	if (close_segment(j) != 1)
+	{
+		discard_queue(j);
+		return 0;
+	}
+	for (i = 0; i < j->num_segments; i++)
+	{
+		struct jtag_segment *seg = &j->segments[i];
+		int len = seg->ops_end - ops_start;
+		gpmc_write(regs + JTAG_REG_DATA, j->ops + ops_start, len);
+		gpmc_put_le(regs, JTAG_REG_LENGTH, len, 2);
+		if (gpmc_request(j->w) < 0)
+		{
+			fprintf(stderr, "JTAG request failed: %s\n", strerror(errno));
+			discard_queue(j);
+			return 0;
+		}
+		j->stats.requests++;
+		j->stats.bytes_out += len;
+		// Only as much TDO as was asked for crosses the bus
+		tdo_len = gpmc_get_le(regs, JTAG_REG_TDO_LENGTH, 2);
+		if (tdo_len > GPMC_DATA_SIZE)
+			tdo_len = GPMC_DATA_SIZE;
+		if (tdo_len > 0)
+		{
+			gpmc_read(tdo, regs + JTAG_REG_DATA, tdo_len);
+			j->stats.bytes_in += tdo_len;
+		}
+		for (k = reads_start; k < seg->reads_end; k++)
+		{
+			struct jtag_read *r = &j->reads[k];
+			int bytes = (r->bits + 7) / 8;
+			if (r->tdo_offset + bytes > tdo_len)
+			{
+				fprintf(stderr, "JTAG master sent %d TDO bytes, expected %d\n", tdo_len, r->tdo_offset + bytes);
+				discard_queue(j);
+				return 0;
+			}
+			memcpy(r->dest, tdo + r->tdo_offset, bytes);
+		}
+		ops_start = seg->ops_end;
+		reads_start = seg->reads_end;
+	}
+	discard_queue(j);
+	return 1;
+}
+
+int jtag_tms(struct jtag *j, int bits, const uint8_t *tms)
+{
+	uint8_t *op;
+	int unused;
+	int done, n, i;
+	for (done = 0; done < bits; done += n)
+	{
+		n = bits - done;
+		if (n > 8)
+			n = 8;
+		op = queue_op(j, 3, 0, &unused);
+		if (op == 0)
+			return 0;
+		op[0] = JTAG_OP_TMS;
+		op[1] = n;
+		op[2] = 0;
+		for (i = 0; i < n; i++)
+		{
+			int bit = (tms[(done + i) / 8] >> ((done + i) % 8)) & 1;
+			op[2] |= bit << i;
+			if (j->state >= 0)
+				j->state = jtag_next_state[j->state][bit];
+		}
+	}
+	j->stats.tck += bits;
+	return 1;
+}
+
+int jtag_reset(struct jtag *j)
+{
+	static const uint8_t tms = 0x1F; // Five high, then low into Run-Test/Idle
+	if (jtag_tms(j, 6, &tms) != 1)
+		return 0;
+	j->state = JTAG_IDLE;
+	return 1;
+}
+
+// Shortest TMS sequence from one state to another, LSB first
+static int tms_path(int from, int to, uint16_t *tms)
+{
+	int prev[JTAG_NUM_STATES], prev_bit[JTAG_NUM_STATES];
+	int queue[JTAG_NUM_STATES];
+	int head = 0, tail = 0;
+	int s, bit, n;
+	for (s = 0; s < JTAG_NUM_STATES; s++)
+		prev[s] = -1;
+	prev[from] = from;
+	queue[tail++] = from;
+	while (head < tail && prev[to] < 0)
+	{
+		s = queue[head++];
+		for (bit = 0; bit < 2; bit++)
+		{
+			int next = jtag_next_state[s][bit];
+			if (prev[next] >= 0)
+				continue;
+			prev[next] = s;
+			prev_bit[next] = bit;
+			queue[tail++] = next;
+		}
+	}
+	// Walk back from the target, filling the sequence from the end
+	for (n = 0, s = to; s != from; s = prev[s])
+		n++;
+	*tms = 0;
+	for (s = to, bit = n - 1; s != from; s = prev[s], bit--)
+		*tms |= prev_bit[s] << bit;
+	return n;
+}
+
+int jtag_goto(struct jtag *j, int state)
+{
+	uint8_t bytes[2];
+	uint16_t tms;
+	int n;
+	if (state < 0 || state >= JTAG_NUM_STATES)
+		return 0;
+	if (state == JTAG_RESET)
+	{
+		// By TMS alone, from any state
+		static const uint8_t ones = 0x1F;
+		if (jtag_tms(j, 5, &ones) != 1)
+			return 0;
+		j->state = JTAG_RESET;
+		return 1;
+	}
+	if (j->state < 0 && jtag_reset(j) != 1)
+		return 0;
+	n = tms_path(j->state, state, &tms);
+	if (n == 0)
+		return 1;
+	bytes[0] = tms & 0xFF;
+	bytes[1] = tms >> 8;
+	return jtag_tms(j, n, bytes);
+}
+
+int jtag_shift(struct jtag *j, int bits, const uint8_t *tdi, uint8_t *tdo, int exit)
+{
+	struct jtag_read *r;
+	uint8_t *op;
+	int tdo_offset;
+	int done, n, bytes;
+	if (j->state != JTAG_DRSHIFT && j->state != JTAG_IRSHIFT)
+	{
+		fprintf(stderr, "JTAG shift in state %s\n", jtag_state_name(j->state));
+		return 0;
+	}
+	for (done = 0; done < bits; done += n)
+	{
+		n = bits - done;
+		if (n > JTAG_SHIFT_MAX_BITS)
+			n = JTAG_SHIFT_MAX_BITS;
+		bytes = (n + 7) / 8;
+		op = queue_op(j, 4 + (tdi != 0 ? bytes : 0), tdo != 0 ? bytes : 0, &tdo_offset);
+		if (op == 0)
+			return 0;
+		op[0] = JTAG_OP_SHIFT;
+		op[1] = 0;
+		if (tdo != 0)
+			op[1] |= JTAG_SHIFT_CAPTURE;
+		if (exit && done + n == bits)
+			op[1] |= JTAG_SHIFT_EXIT;
+		if (tdi != 0)
+			memcpy(op + 4, tdi + done / 8, bytes);
+		else
+			op[1] |= JTAG_SHIFT_ONES;
+		op[2] = n & 0xFF;
+		op[3] = n >> 8;
+		if (tdo == 0)
+			continue;
+		// Pieces but the last are whole bytes, so each read starts at a byte
+		if (!grow((void **)&j->reads, &j->reads_size, j->num_reads + 1, sizeof *j->reads))
+			return 0;
+		r = &j->reads[j->num_reads++];
+		r->dest = tdo + done / 8;
+		r->bits = n;
+		r->tdo_offset = tdo_offset;
+	}
+	if (exit && bits > 0)
+		j->state = jtag_next_state[j->state][1];
+	j->stats.tck += bits;
+	return 1;
+}
+
+static int scan(struct jtag *j, int shift_state, int bits, const uint8_t *tdi, uint8_t *tdo, int end_state)
+{
+	if (jtag_goto(j, shift_state) != 1)
+		return 0;
+	if (jtag_shift(j, bits, tdi, tdo, end_state != shift_state) != 1)
+		return 0;
+	return jtag_goto(j, end_state);
+}
+
+int jtag_shift_ir(struct jtag *j, int bits, const uint8_t *tdi, uint8_t *tdo, int end_state)
+{
+	DEBUG(fprintf(stderr, "Shift IR, %d bits\n", bits));
+	return scan(j, JTAG_IRSHIFT, bits, tdi, tdo, end_state);
+}
+
+int jtag_shift_dr(struct jtag *j, int bits, const uint8_t *tdi, uint8_t *tdo, int end_state)
+{
+	DEBUG(fprintf(stderr, "Shift DR, %d bits\n", bits));
+	return scan(j, JTAG_DRSHIFT, bits, tdi, tdo, end_state);
+}
+
+int jtag_run_idle(struct jtag *j, int cycles)
+{
+	uint8_t *op;
+	int unused;
+	int n;
+	if (jtag_goto(j, JTAG_IDLE) != 1)
+		return 0;
+	for (; cycles > 0; cycles -= n)
+	{
+		n = cycles > 0xFFFF ? 0xFFFF : cycles;
+		op = queue_op(j, 3, 0, &unused);
+		if (op == 0)
+			return 0;
+		op[0] = JTAG_OP_IDLE;
+		op[1] = n & 0xFF;
+		op[2] = n >> 8;
+		j->stats.tck += n;
+	}
+	return 1;
+}
+
+static uint32_t get_bits(const uint8_t *buffer, int pos, int bits)
+{
+	uint32_t val = 0;
+	int i;
+	for (i = 0; i < bits; i++)
+		val |= (uint32_t)((buffer[(pos + i) / 8] >> ((pos + i) % 8)) & 1) << i;
+	return val;
+}
+
+/*
+ * After reset every device has IDCODE or BYPASS in its DR, and IDCODEs
+ * have bit 0 set.  Shifting ones through shows where the chain ends.  The
+ * device nearest TDO comes first.
+ */
+int jtag_read_idcodes(struct jtag *j, uint32_t *idcodes, int max)
+{
+	uint8_t tdo[(JTAG_MAX_CHAIN + 1) * 4];
+	int bits, pos, n;
+	if (max > JTAG_MAX_CHAIN)
+		max = JTAG_MAX_CHAIN;
+	bits = (max + 1) * 32;
+	if (jtag_reset(j) != 1 || jtag_shift_dr(j, bits, 0, tdo, JTAG_IDLE) != 1 || jtag_flush(j) != 1)
+		return -1;
+	for (n = 0, pos = 0; n < max && pos + 32 <= bits; n++)
+	{
+		if (get_bits(tdo, pos, 1) == 0)
+		{
+			idcodes[n] = 0;
+			pos++;
+			continue;
+		}
+		idcodes[n] = get_bits(tdo, pos, 32);
+		if (idcodes[n] == 0xFFFFFFFF)
+			break;
+		pos += 32;
+	}
+	return n;
+}
@@ -0,0 +1,128 @@
+/*
+ * JTAG master on the GPMC bus, queuing scans into batches.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * The JTAG master design, JTAG_MASTER_ID, has the mailbox header of
+ * gpmc.h and goes on with:
+ *
+ *   0x08  LENGTH      2 bytes, bytes of operations in DATA
+ *   0x0A  TDO_LENGTH  2 bytes, bytes of TDO the master put in DATA
+ *   0x20  DATA        operations in, TDO out
+ *
+ * The operations are run in order, and the TDO of every captured shift
+ * starts at a new byte, LSB first:
+ *
+ *   JTAG_OP_TMS    count (1..8), TMS bits; TDI is held low
+ *   JTAG_OP_SHIFT  flags, count (2 bytes), TDI bytes unless JTAG_SHIFT_ONES;
+ *                  TMS is low but for the last bit with JTAG_SHIFT_EXIT
+ *   JTAG_OP_IDLE   count (2 bytes) of TCK cycles with TMS low
+ *
+ * Scans are queued on the host and only go out, as few mailbox requests
+ * as they fit in, when jtag_flush() is called or the queue is full.  TDO
+ * is copied to the caller's buffers then, so those must be kept until the
+ * next jtag_flush() returns.
+ */
+#ifndef _JTAG_H
+#define _JTAG_H 1
+#include <stdint.h>
+
+#define JTAG_MASTER_ID 0x47544A4D	// "MJTG"
+
+#define JTAG_REG_LENGTH 0x08
+#define JTAG_REG_TDO_LENGTH 0x0A
+#define JTAG_REG_DATA 0x20
+
+#define JTAG_OP_TMS 0x01
+#define JTAG_OP_SHIFT 0x02
+# define JTAG_SHIFT_CAPTURE 0x01	// Send back TDO
+# define JTAG_SHIFT_EXIT 0x02		// TMS high on the last bit
+# define JTAG_SHIFT_ONES 0x04		// TDI high, no TDI bytes follow
+#define JTAG_OP_IDLE 0x03
+
+#define JTAG_QUEUE_MAX 65536	// Queued operation bytes before an automatic flush
+
+// TAP controller states
+#define JTAG_RESET 0
+#define JTAG_IDLE 1
+#define JTAG_DRSELECT 2
+#define JTAG_DRCAPTURE 3
+#define JTAG_DRSHIFT 4
+#define JTAG_DREXIT1 5
+#define JTAG_DRPAUSE 6
+#define JTAG_DREXIT2 7
+#define JTAG_DRUPDATE 8
+#define JTAG_IRSELECT 9
+#define JTAG_IRCAPTURE 10
+#define JTAG_IRSHIFT 11
+#define JTAG_IREXIT1 12
+#define JTAG_IRPAUSE 13
+#define JTAG_IREXIT2 14
+#define JTAG_IRUPDATE 15
+#define JTAG_NUM_STATES 16
+
+// MachXO2 instructions, 8 bit IR
+#define JTAG_IR_BITS 8
+#define JTAG_IDCODE 0xE0
+#define JTAG_USERCODE 0xC0
+#define JTAG_ER1 0x32		// User register through the JTAGF primitive
+#define JTAG_BYPASS 0xFF
+
+#define JTAG_MAX_CHAIN 8	// Devices jtag_read_idcodes() looks for
+
+struct jtag_stats {
+	uint64_t tck;		// TCK cycles queued
+	uint32_t requests;	// Mailbox requests
+	uint64_t bytes_out;	// Operation bytes written to the mailbox
+	uint64_t bytes_in;	// TDO bytes read back
+};
+
+struct jtag;
+
+extern const uint8_t jtag_next_state[JTAG_NUM_STATES][2];
+const char *jtag_state_name(int state);
+
+// 'name' is "gpmc" or "gpmc:<file>"
+struct jtag *jtag_open(const char *name);
+void jtag_close(struct jtag *j);
+// State the TAP will be in once the queue is through
+int jtag_state(struct jtag *j);
+// Test-Logic-Reset by TMS, then Run-Test/Idle
+int jtag_reset(struct jtag *j);
+// Shortest TMS path to 'state'
+int jtag_goto(struct jtag *j, int state);
+// 'bits' TMS bits, LSB first, from whatever state the TAP is in
+int jtag_tms(struct jtag *j, int bits, const uint8_t *tms);
+/*
+ * Shift 'bits' in the current shift state.  'tdi' 0 shifts ones, 'tdo'
+ * 0 does not read back.  'exit' leaves the shift state on the last bit.
+ */
+int jtag_shift(struct jtag *j, int bits, const uint8_t *tdi, uint8_t *tdo, int exit);
+// Whole IR and DR scans, ending in 'end_state'
+int jtag_shift_ir(struct jtag *j, int bits, const uint8_t *tdi, uint8_t *tdo, int end_state);
+int jtag_shift_dr(struct jtag *j, int bits, const uint8_t *tdi, uint8_t *tdo, int end_state);
+// 'cycles' TCK in Run-Test/Idle
+int jtag_run_idle(struct jtag *j, int cycles);
+// Send everything queued and fill in the TDO buffers
+int jtag_flush(struct jtag *j);
+// IDCODEs after a reset, 0 for devices in BYPASS.  Number of devices, -1 on failure.
+int jtag_read_idcodes(struct jtag *j, uint32_t *idcodes, int max);
+void jtag_get_stats(struct jtag *j, struct jtag_stats *stats);
+
+/*
+ * Stand-in for the JTAG master design on a file, with simulated MachXO2
+ * TAPs behind it.  'options' is a comma separated list of key=value pairs
+ * (may be empty or 0):
+ *   taps        devices in the chain (default 1)
+ *   idcode      IDCODE of every device
+ *   usercode    USERCODE of every device
+ */
+int run_jtag_sim(const char *path, const char *options);
+/*
+ * Serve OpenOCD's jtag_vpi protocol on 'address', "<port>", "<host>:<port>"
+ * or a Unix socket path, for the JTAG master on 'window'.  Runs until
+ * killed.
+ */
+int run_jtag_server(const char *address, const char *window);
+
+#endif
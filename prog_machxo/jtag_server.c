@@ -0,0 +1,303 @@
+/*
+ * OpenOCD jtag_vpi server for the GPMC JTAG master.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * jtag_vpi sends whole TMS sequences and scans of up to 4096 bits as
+ * fixed size records, little endian:
+ *
+ *   0     cmd         4 bytes, VPI_CMD_*
+ *   4     buffer_out  512 bytes, TMS or TDI
+ *   516   buffer_in   512 bytes, TDO
+ *   1028  length      4 bytes, bytes used in the buffers
+ *   1032  nb_bits     4 bytes
+ *
+ * Scans are answered with the record, buffer_in filled in; nothing else
+ * is.  Commands are queued on the JTAG master as they come, and the queue
+ * is only flushed, and the answers sent, when the client has nothing more
+ * waiting on the socket.  OpenOCD waits for every answer, so it gets one
+ * request per scan with whatever TMS moves came before it; a client that
+ * sends ahead gets its scans batched.
+ *
+ * One client at a time, as there is one JTAG chain.
+ */
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "jtag.h"
+
+#define VPI_CMD_RESET 0
+#define VPI_CMD_TMS_SEQ 1
+#define VPI_CMD_SCAN_CHAIN 2
+#define VPI_CMD_SCAN_CHAIN_FLIP_TMS 3
+#define VPI_CMD_STOP_SIMU 4
+
+#define VPI_XFER_MAX 512
+#define VPI_OFF_OUT 4
+#define VPI_OFF_IN (VPI_OFF_OUT + VPI_XFER_MAX)
+#define VPI_OFF_LENGTH (VPI_OFF_IN + VPI_XFER_MAX)
+#define VPI_OFF_NB_BITS (VPI_OFF_LENGTH + 4)
+#define VPI_CMD_SIZE (VPI_OFF_NB_BITS + 4)
+
+#define VPI_MAX_PENDING 256	// Scans answered per flush at most
+#define VPI_READ_RECORDS 64	// Records read from the socket at a time
+
+struct server_stats {
+	uint64_t scans;
+	uint64_t scan_bits;
+	uint64_t commands;
+	uint32_t flushes;
+};
+
+static uint32_t le_4bytes(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int write_all(int fd, const uint8_t *buffer, size_t len)
+{
+	ssize_t n;
+	while (len > 0)
+	{
+		n = write(fd, buffer, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		buffer += n;
+		len -= n;
+	}
+	return 1;
+}
+
+// "<port>", "<host>:<port>" for TCP, anything with a '/' for a Unix socket
+static int open_listener(const char *address)
+{
+	struct sockaddr_un un;
+	struct sockaddr_in in;
+	const char *colon = strrchr(address, ':');
+	char host[64];
+	int one = 1;
+	int fd;
+	if (strchr(address, '/') != 0)
+	{
+		memset(&un, 0, sizeof un);
+		un.sun_family = AF_UNIX;
+		if (strlen(address) >= sizeof un.sun_path)
+		{
+			fprintf(stderr, "Socket path too long\n");
+			return -1;
+		}
+		strcpy(un.sun_path, address);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+		unlink(address);
+		if (bind(fd, (struct sockaddr *)&un, sizeof un) != 0 || listen(fd, 1) != 0)
+		{
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+	memset(&in, 0, sizeof in);
+	in.sin_family = AF_INET;
+	in.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Not on the network unless asked
+	if (colon != 0)
+	{
+		if (colon - address >= (int)sizeof host)
+			return -1;
+		memcpy(host, address, colon - address);
+		host[colon - address] = 0;
+		if (inet_pton(AF_INET, host, &in.sin_addr) != 1)
+		{
+			fprintf(stderr, "Bad address %s\n", host);
+			return -1;
+		}
+		address = colon + 1;
+	}
+	in.sin_port = htons(atoi(address));
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	if (bind(fd, (struct sockaddr *)&in, sizeof in) != 0 || listen(fd, 1) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int answer_scans(int fd, struct jtag *j, uint8_t *pending, int *num_pending, struct server_stats *st)
+{
+	int status = 1;
+	if (jtag_flush(j) != 1)
+		status = 0;
+	st->flushes++;
+	// Answered even when the flush failed, so the client is not left waiting
+	if (*num_pending > 0 && !write_all(fd, pending, (size_t)*num_pending * VPI_CMD_SIZE))
+		status = 0;
+	*num_pending = 0;
+	return status;
+}
+
+// Queue one record.  0 on errors and at VPI_CMD_STOP_SIMU.
+static int queue_command(struct jtag *j, uint8_t *rec, uint8_t *pending, int *num_pending, struct server_stats *st)
+{
+	uint32_t cmd = le_4bytes(rec);
+	uint32_t nb_bits = le_4bytes(rec + VPI_OFF_NB_BITS);
+	uint8_t *slot;
+	st->commands++;
+	if (nb_bits > VPI_XFER_MAX * 8)
+	{
+		fprintf(stderr, "jtag_vpi: %u bits is more than a record holds\n", nb_bits);
+		return 0;
+	}
+	switch (cmd)
+	{
+	case VPI_CMD_RESET:
+		return jtag_goto(j, JTAG_RESET);
+	case VPI_CMD_TMS_SEQ:
+		return jtag_tms(j, nb_bits, rec + VPI_OFF_OUT);
+	case VPI_CMD_SCAN_CHAIN:
+	case VPI_CMD_SCAN_CHAIN_FLIP_TMS:
+		// The answer is the record itself, so TDO goes straight into it
+		slot = pending + (size_t)(*num_pending)++ * VPI_CMD_SIZE;
+		memcpy(slot, rec, VPI_CMD_SIZE);
+		memset(slot + VPI_OFF_IN, 0, VPI_XFER_MAX);
+		st->scans++;
+		st->scan_bits += nb_bits;
+		return jtag_shift(j, nb_bits, slot + VPI_OFF_OUT, slot + VPI_OFF_IN, cmd == VPI_CMD_SCAN_CHAIN_FLIP_TMS);
+	case VPI_CMD_STOP_SIMU:
+		return 0;
+	default:
+		fprintf(stderr, "jtag_vpi: unknown command %u\n", cmd);
+		return 0;
+	}
+}
+
+static void serve_client(int fd, struct jtag *j, uint8_t *pending)
+{
+	uint8_t *in;
+	struct server_stats st;
+	struct jtag_stats js0, js;
+	struct pollfd pfd;
+	int num_pending = 0;
+	size_t have = 0, pos;
+	double start, elapsed;
+	ssize_t n;
+	int running = 1;
+	in = (uint8_t *)malloc(VPI_READ_RECORDS * VPI_CMD_SIZE);
+	if (in == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return;
+	}
+	memset(&st, 0, sizeof st);
+	jtag_get_stats(j, &js0);
+	start = now();
+	// OpenOCD takes the TAP to be in Test-Logic-Reset when it connects
+	if (jtag_goto(j, JTAG_RESET) != 1 || jtag_flush(j) != 1)
+		running = 0;
+	while (running)
+	{
+		for (pos = 0; running && have - pos >= VPI_CMD_SIZE; pos += VPI_CMD_SIZE)
+		{
+			running = queue_command(j, in + pos, pending, &num_pending, &st);
+			if (running && num_pending == VPI_MAX_PENDING)
+				running = answer_scans(fd, j, pending, &num_pending, &st);
+		}
+		memmove(in, in + pos, have - pos);
+		have -= pos;
+		if (!running)
+			break;
+		// Answer once the client has nothing more queued up
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (num_pending > 0 && poll(&pfd, 1, 0) == 0)
+		{
+			if (answer_scans(fd, j, pending, &num_pending, &st) != 1)
+				break;
+		}
+		n = read(fd, in + have, VPI_READ_RECORDS * VPI_CMD_SIZE - have);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		have += n;
+	}
+	if (num_pending > 0)
+		answer_scans(fd, j, pending, &num_pending, &st);
+	else
+		jtag_flush(j);
+	elapsed = now() - start;
+	jtag_get_stats(j, &js);
+	fprintf(stderr, "jtag_vpi: %llu commands, %llu scans of %llu bits in %.3f s: %.0f scans/s, %.0f bits/s\n",
+		(unsigned long long)st.commands, (unsigned long long)st.scans, (unsigned long long)st.scan_bits,
+		elapsed, st.scans / elapsed, st.scan_bits / elapsed);
+	fprintf(stderr, "jtag_vpi: %llu TCK in %u flushes and %u mailbox requests\n",
+		(unsigned long long)(js.tck - js0.tck), st.flushes, js.requests - js0.requests);
+	free(in);
+}
+
+int run_jtag_server(const char *address, const char *window)
+{
+	uint8_t *pending;
+	struct jtag *j;
+	int listen_fd, fd;
+	int one = 1;
+	j = jtag_open(window);
+	if (j == 0)
+		return 0;
+	pending = (uint8_t *)malloc((size_t)VPI_MAX_PENDING * VPI_CMD_SIZE);
+	listen_fd = open_listener(address);
+	if (pending == 0 || listen_fd < 0)
+	{
+		perror("run_jtag_server");
+		free(pending);
+		jtag_close(j);
+		return 0;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	fprintf(stderr, "jtag_vpi server on %s for %s\n", address, window);
+	for (;;)
+	{
+		fd = accept(listen_fd, 0, 0);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("run_jtag_server");
+			break;
+		}
+		// Every scan is a round trip, so no waiting to fill segments
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+		serve_client(fd, j, pending);
+		close(fd);
+	}
+	close(listen_fd);
+	free(pending);
+	jtag_close(j);
+	return 0;
+}
@@ -0,0 +1,223 @@
+/*
+ * Stand-in for the JTAG master design, with simulated MachXO2 TAPs.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * The TAPs are clocked one TCK at a time.  Each has the 8 bit MachXO2 IR
+ * with IDCODE, USERCODE, a 32 bit ER1 user register that keeps what was
+ * shifted in, and BYPASS for everything else.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gpmc.h"
+#include "jtag.h"
+#include "sim.h"
+
+struct sim_tap {
+	int state;
+	uint8_t ir;
+	uint8_t ir_shift;
+	uint64_t dr_shift;
+	int dr_len;
+	uint32_t er1;
+	uint32_t idcode;
+	uint32_t usercode;
+};
+
+struct jtag_sim {
+	int num_taps;
+	struct sim_tap taps[JTAG_MAX_CHAIN];
+	uint64_t tck;
+};
+
+static int parse_option(struct jtag_sim *sim, const char *key, const char *value)
+{
+	unsigned long val = strtoul(value, 0, 0);
+	int i;
+	if (strcmp(key, "taps") == 0)
+	{
+		if (val < 1 || val > JTAG_MAX_CHAIN)
+			return 0;
+		sim->num_taps = val;
+	}
+	else if (strcmp(key, "idcode") == 0)
+		for (i = 0; i < JTAG_MAX_CHAIN; i++)
+			sim->taps[i].idcode = val;
+	else if (strcmp(key, "usercode") == 0)
+		for (i = 0; i < JTAG_MAX_CHAIN; i++)
+			sim->taps[i].usercode = val;
+	else
+		return 0;
+	return 1;
+}
+
+static int parse_options(struct jtag_sim *sim, const char *options)
+{
+	char *opts, *tok, *save;
+	int status = 1;
+	if (options == 0 || *options == 0)
+		return 1;
+	opts = strdup(options);
+	if (opts == 0)
+		return 0;
+	for (tok = strtok_r(opts, ",", &save); tok != 0 && status; tok = strtok_r(0, ",", &save))
+	{
+		char *eq = strchr(tok, '=');
+		if (eq == 0)
+		{
+			fprintf(stderr, "jtag sim: expected key=value, got '%s'\n", tok);
+			status = 0;
+			break;
+		}
+		*eq = 0;
+		status = parse_option(sim, tok, eq + 1);
+		if (!status)
+			fprintf(stderr, "jtag sim: bad option '%s'\n", tok);
+	}
+	free(opts);
+	return status;
+}
+
+// One TCK, returns TDO
+static int tap_clock(struct sim_tap *tap, int tms, int tdi)
+{
+	int tdo = 0;
+	switch (tap->state)
+	{
+	case JTAG_DRCAPTURE:
+		tap->dr_len = 32;
+		if (tap->ir == JTAG_IDCODE)
+			tap->dr_shift = tap->idcode;
+		else if (tap->ir == JTAG_USERCODE)
+			tap->dr_shift = tap->usercode;
+		else if (tap->ir == JTAG_ER1)
+			tap->dr_shift = tap->er1;
+		else
+		{
+			tap->dr_shift = 0;
+			tap->dr_len = 1;
+		}
+		break;
+	case JTAG_DRSHIFT:
+		tdo = tap->dr_shift & 1;
+		tap->dr_shift = (tap->dr_shift >> 1) | ((uint64_t)tdi << (tap->dr_len - 1));
+		break;
+	case JTAG_DRUPDATE:
+		if (tap->ir == JTAG_ER1)
+			tap->er1 = tap->dr_shift;
+		break;
+	case JTAG_IRCAPTURE:
+		tap->ir_shift = 0x01; // IEEE 1149.1 wants 01 in the low bits
+		break;
+	case JTAG_IRSHIFT:
+		tdo = tap->ir_shift & 1;
+		tap->ir_shift = (tap->ir_shift >> 1) | (tdi << (JTAG_IR_BITS - 1));
+		break;
+	case JTAG_IRUPDATE:
+		tap->ir = tap->ir_shift;
+		break;
+	}
+	tap->state = jtag_next_state[tap->state][tms];
+	if (tap->state == JTAG_RESET)
+		tap->ir = JTAG_IDCODE;
+	return tdo;
+}
+
+// TDI goes in at the first TAP, TDO comes out of the last
+static int chain_clock(struct jtag_sim *sim, int tms, int tdi)
+{
+	int i;
+	for (i = 0; i < sim->num_taps; i++)
+		tdi = tap_clock(&sim->taps[i], tms, tdi);
+	sim->tck++;
+	return tdi;
+}
+
+static int run_ops(void *arg, volatile uint8_t *regs)
+{
+	struct jtag_sim *sim = (struct jtag_sim *)arg;
+	uint8_t ops[GPMC_DATA_SIZE];
+	uint8_t tdo[GPMC_DATA_SIZE];
+	int len = gpmc_get_le(regs, JTAG_REG_LENGTH, 2);
+	int pos = 0, tdo_len = 0;
+	int count, flags, bytes, i;
+	if (len > GPMC_DATA_SIZE)
+		return GPMC_STATUS_TOO_LONG;
+	gpmc_read(ops, regs + JTAG_REG_DATA, len);
+	while (pos < len)
+	{
+		switch (ops[pos])
+		{
+		case JTAG_OP_TMS:
+			if (pos + 3 > len || ops[pos + 1] < 1 || ops[pos + 1] > 8)
+				return GPMC_STATUS_BAD_REQUEST;
+			for (i = 0; i < ops[pos + 1]; i++)
+				chain_clock(sim, (ops[pos + 2] >> i) & 1, 0);
+			pos += 3;
+			break;
+		case JTAG_OP_SHIFT:
+			if (pos + 4 > len)
+				return GPMC_STATUS_BAD_REQUEST;
+			flags = ops[pos + 1];
+			count = ops[pos + 2] + 0x100 * ops[pos + 3];
+			bytes = (count + 7) / 8;
+			pos += 4;
+			if (!(flags & JTAG_SHIFT_ONES) && pos + bytes > len)
+				return GPMC_STATUS_BAD_REQUEST;
+			if ((flags & JTAG_SHIFT_CAPTURE) && tdo_len + bytes > GPMC_DATA_SIZE)
+				return GPMC_STATUS_TOO_LONG;
+			if (flags & JTAG_SHIFT_CAPTURE)
+				memset(tdo + tdo_len, 0, bytes);
+			for (i = 0; i < count; i++)
+			{
+				int tdi = (flags & JTAG_SHIFT_ONES) ? 1 : (ops[pos + i / 8] >> (i % 8)) & 1;
+				int tms = (flags & JTAG_SHIFT_EXIT) && i == count - 1;
+				int bit = chain_clock(sim, tms, tdi);
+				if (flags & JTAG_SHIFT_CAPTURE)
+					tdo[tdo_len + i / 8] |= bit << (i % 8);
+			}
+			if (!(flags & JTAG_SHIFT_ONES))
+				pos += bytes;
+			if (flags & JTAG_SHIFT_CAPTURE)
+				tdo_len += bytes;
+			break;
+		case JTAG_OP_IDLE:
+			if (pos + 3 > len)
+				return GPMC_STATUS_BAD_REQUEST;
+			count = ops[pos + 1] + 0x100 * ops[pos + 2];
+			for (i = 0; i < count; i++)
+				chain_clock(sim, 0, 0);
+			pos += 3;
+			break;
+		default:
+			return GPMC_STATUS_BAD_REQUEST;
+		}
+	}
+	gpmc_write(regs + JTAG_REG_DATA, tdo, tdo_len);
+	gpmc_put_le(regs, JTAG_REG_TDO_LENGTH, tdo_len, 2);
+	return GPMC_STATUS_OK;
+}
+
+int run_jtag_sim(const char *path, const char *options)
+{
+	struct jtag_sim sim;
+	int i;
+	memset(&sim, 0, sizeof sim);
+	sim.num_taps = 1;
+	for (i = 0; i < JTAG_MAX_CHAIN; i++)
+	{
+		sim.taps[i].state = JTAG_RESET;
+		sim.taps[i].ir = JTAG_IDCODE;
+		sim.taps[i].idcode = SIM_DEFAULT_IDCODE;
+	}
+	if (!parse_options(&sim, options))
+		return 0;
+	fprintf(stderr, "JTAG master on %s, %d simulated TAP%s\n", path, sim.num_taps, sim.num_taps > 1 ? "s" : "");
+	if (gpmc_serve(path, JTAG_MASTER_ID, run_ops, &sim) != 1)
+		return 0;
+	fprintf(stderr, "JTAG master stopped after %llu TCK\n", (unsigned long long)sim.tck);
+	return 1;
+}
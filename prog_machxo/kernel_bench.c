@@ -0,0 +1,277 @@
+/*
+ * Micro-benchmark for the fuse data kernels, on a generated fuse map the
+ * size of the largest MachXO2 (LCMXO2-7000, 9212 configuration pages) where
+ * about half the pages are zero, like real designs.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * Every implementation the CPU supports is timed against the byte at a time
+ * loops the kernels replaced, and checked against them as well.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kernels.h"
+
+#define PAGES 9212
+#define PAGE_SIZE 16
+#define ROW_CHARS (PAGE_SIZE * 8 + 1)
+#define MIN_TIME 0.2
+
+static uint8_t *text;
+static int text_len;
+static uint8_t *fuses;
+static uint8_t *copy;
+static uint8_t *work;
+static volatile int sink;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* The loops the kernels replaced */
+
+static int pack_bytewise(const uint8_t *src, int src_len, uint8_t *dst)
+{
+	int dst_idx = 0;
+	int cur_bit = 0;
+	int i;
+	uint8_t val = 0;
+	for (i = 0; i < src_len; i++)
+	{
+		if (src[i] != '0' && src[i] != '1')
+			continue;
+		val = (val << 1) | (src[i] - '0');
+		if (++cur_bit == 8)
+		{
+			dst[dst_idx++] = val;
+			cur_bit = 0;
+			val = 0;
+		}
+	}
+	return dst_idx;
+}
+
+static void reverse_bytewise(uint8_t *data, int data_len)
+{
+	int i, j;
+	for (i = 0; i < data_len / 2; i++)
+	{
+		uint8_t tmp = data[data_len - i - 1];
+		data[data_len - i - 1] = data[i];
+		data[i] = tmp;
+	}
+	for (i = 0; i < data_len; i++)
+	{
+		uint8_t tmp = data[i];
+		data[i] = 0;
+		for (j = 0; j < 8; j++)
+		{
+			data[i] = (data[i] << 1) | (tmp & 1);
+			tmp >>= 1;
+		}
+	}
+}
+
+static int zero_bytewise(const uint8_t *data, int data_len)
+{
+	int i;
+	for (i = 0; i < data_len; i++)
+		if (data[i] != 0)
+			return 0;
+	return 1;
+}
+
+static int mismatch_bytewise(const uint8_t *a, const uint8_t *b, int len)
+{
+	int i;
+	for (i = 0; i < len; i++)
+		if (a[i] != b[i])
+			break;
+	return i;
+}
+
+/* One pass of each benchmark, kind < 0 is the byte at a time loop */
+
+static void run_pack(int kind)
+{
+	if (kind < 0)
+		sink = pack_bytewise(text, text_len, work);
+	else
+		sink = pack_bits(text, text_len, work, PAGES * PAGE_SIZE, 0);
+}
+
+static void run_reverse(int kind)
+{
+	if (kind < 0)
+		reverse_bytewise(work, PAGES * PAGE_SIZE);
+	else
+		reverse_bits(work, PAGES * PAGE_SIZE);
+}
+
+static void run_feature_row(int kind)
+{
+	int i;
+	// Feature row and feature bits, as found in every JEDEC file
+	for (i = 0; i < 1000; i++)
+	{
+		if (kind < 0)
+		{
+			reverse_bytewise(work, 8);
+			reverse_bytewise(work + 8, 2);
+		}
+		else
+		{
+			reverse_bits(work, 8);
+			reverse_bits(work + 8, 2);
+		}
+	}
+}
+
+static void run_zero_pages(int kind)
+{
+	int n = 0;
+	int i;
+	for (i = 0; i < PAGES; i++)
+		n += kind < 0 ? zero_bytewise(fuses + i * PAGE_SIZE, PAGE_SIZE) : all_zero(fuses + i * PAGE_SIZE, PAGE_SIZE);
+	sink = n;
+}
+
+static void run_zero_block(int kind)
+{
+	// An all zero block is the worst case, every byte is looked at
+	memset(work, 0, PAGES * PAGE_SIZE);
+	sink = kind < 0 ? zero_bytewise(work, PAGES * PAGE_SIZE) : all_zero(work, PAGES * PAGE_SIZE);
+}
+
+static void run_compare(int kind)
+{
+	// Equal buffers are the worst case, like a successful verify
+	sink = kind < 0 ? mismatch_bytewise(fuses, copy, PAGES * PAGE_SIZE) : first_mismatch(fuses, copy, PAGES * PAGE_SIZE);
+}
+
+struct bench {
+	const char *name;
+	void (*run)(int kind);
+	int bytes;	// Bytes of input per pass
+};
+
+static double time_pass(struct bench *b, int kind)
+{
+	double start = now();
+	double elapsed;
+	int passes = 0;
+	if (kind >= 0)
+		select_kernels(kind);
+	do
+	{
+		b->run(kind);
+		passes++;
+		elapsed = now() - start;
+	} while (elapsed < MIN_TIME);
+	return elapsed / passes;
+}
+
+static void make_fuse_map()
+{
+	int i, j;
+	uint8_t *p;
+	srand(1);
+	text_len = PAGES * ROW_CHARS;
+	text = (uint8_t *)malloc(text_len);
+	fuses = (uint8_t *)malloc(PAGES * PAGE_SIZE);
+	copy = (uint8_t *)malloc(PAGES * PAGE_SIZE);
+	work = (uint8_t *)malloc(PAGES * PAGE_SIZE);
+	p = text;
+	for (i = 0; i < PAGES; i++)
+	{
+		int zero = rand() & 1;
+		for (j = 0; j < ROW_CHARS - 1; j++)
+			*p++ = zero ? '0' : '0' + (rand() & 1);
+		*p++ = '\n';
+	}
+	pack_bytewise(text, text_len, fuses);
+	memcpy(copy, fuses, PAGES * PAGE_SIZE);
+}
+
+static int check(int kind)
+{
+	uint8_t expected[64];
+	int i, n;
+	select_kernels(kind);
+	if (pack_bits(text, text_len, work, PAGES * PAGE_SIZE, 0) != PAGES * PAGE_SIZE ||
+	    memcmp(work, fuses, PAGES * PAGE_SIZE) != 0)
+		return 0;
+	for (n = 1; n <= 64; n++)
+	{
+		memcpy(expected, fuses + 100 * PAGE_SIZE, n);
+		memcpy(work, expected, n);
+		reverse_bytewise(expected, n);
+		reverse_bits(work, n);
+		if (memcmp(work, expected, n) != 0)
+			return 0;
+	}
+	for (i = 0; i < PAGES; i++)
+		if (all_zero(fuses + i * PAGE_SIZE, PAGE_SIZE) != zero_bytewise(fuses + i * PAGE_SIZE, PAGE_SIZE))
+			return 0;
+	for (i = 0; i < 1000; i++)
+	{
+		int at = rand() % (PAGES * PAGE_SIZE);
+		copy[at] ^= 0x10;
+		n = first_mismatch(fuses, copy, PAGES * PAGE_SIZE);
+		copy[at] ^= 0x10;
+		if (n != at)
+			return 0;
+	}
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench benches[] = {
+		{ "pack fuse rows", run_pack, 0 },
+		{ "reverse bits", run_reverse, PAGES * PAGE_SIZE },
+		{ "reverse feature row", run_feature_row, 10 * 1000 },
+		{ "zero test per page", run_zero_pages, PAGES * PAGE_SIZE },
+		{ "zero test per block", run_zero_block, PAGES * PAGE_SIZE },
+		{ "compare", run_compare, PAGES * PAGE_SIZE },
+	};
+	int num_benches = sizeof benches / sizeof benches[0];
+	int kind, i;
+	make_fuse_map();
+	benches[0].bytes = text_len;
+	printf("Fuse map of %d pages, %d bytes of JEDEC text\n", PAGES, text_len);
+	for (kind = 0; kind < KERNELS_NUM; kind++)
+	{
+		if (!kernels_available(kind))
+			continue;
+		if (!check(kind))
+		{
+			printf("%s kernels give wrong results\n", kernels_name(kind));
+			return 1;
+		}
+	}
+	printf("%-20s %-8s %12s %10s %8s\n", "kernel", "version", "us/pass", "MB/s", "speedup");
+	for (i = 0; i < num_benches; i++)
+	{
+		double base = time_pass(&benches[i], -1);
+		printf("%-20s %-8s %12.1f %10.1f %8s\n", benches[i].name, "bytewise",
+		       base * 1e6, benches[i].bytes / base / 1e6, "1.0");
+		for (kind = 0; kind < KERNELS_NUM; kind++)
+		{
+			double t;
+			if (!kernels_available(kind))
+				continue;
+			t = time_pass(&benches[i], kind);
+			printf("%-20s %-8s %12.1f %10.1f %8.1f\n", "", kernels_name(kind),
+			       t * 1e6, benches[i].bytes / t / 1e6, base / t);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,584 @@
+/*
+ * Vectorized helpers for fuse data: ASCII bit packing, bit reversal,
+ * zero page detection and compare.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * Each kernel has a scalar version, SSE2 and AVX2 versions on x86 and a NEON
+ * version on ARM.  The x86 versions are compiled with target attributes, so
+ * no special compiler flags are needed, and picked at run time with
+ * __builtin_cpu_supports().  NEON is used when the compiler targets it
+ * (-mfpu=neon on the BeagleBone's Cortex-A8).
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include "kernels.h"
+
+struct kernels {
+	// Pack whole bytes while the input is nothing but '0'/'1', returns characters used
+	int (*pack_run)(const uint8_t *src, int src_len, uint8_t *dst, int max_bytes);
+	// Reverse 'data_len' bytes from both ends towards the middle, returns bytes left in the middle
+	int (*reverse_ends)(uint8_t *data, int data_len);
+	// Returns the length of the leading run of zero bytes, rounded down to whole vectors
+	int (*zero_run)(const uint8_t *data, int data_len);
+	// Returns the length of the leading run of equal bytes, rounded down to whole vectors
+	int (*equal_run)(const uint8_t *a, const uint8_t *b, int len);
+};
+
+static const char *names[KERNELS_NUM] = { "scalar", "sse2", "avx2", "neon" };
+
+static const uint8_t rev8[256] = {
+#define R2(n) n, n + 2*64, n + 1*64, n + 3*64
+#define R4(n) R2(n), R2(n + 2*16), R2(n + 1*16), R2(n + 3*16)
+#define R6(n) R4(n), R4(n + 2*4), R4(n + 1*4), R4(n + 3*4)
+	R6(0), R6(2), R6(1), R6(3)
+#undef R2
+#undef R4
+#undef R6
+};
+
+/* Scalar: eight characters at a time in a 64-bit word */
+
+static uint64_t load_le64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static int pack_run_scalar(const uint8_t *src, int src_len, uint8_t *dst, int max_bytes)
+{
+	int n;
+	for (n = 0; n < max_bytes && src_len - n * 8 >= 8; n++)
+	{
+		uint64_t v = load_le64(src + n * 8);
+		if ((v & 0xFEFEFEFEFEFEFEFEULL) != 0x3030303030303030ULL)
+			break;
+		// Gathers bit 0 of every byte into the top byte, first character as MSB
+		dst[n] = ((v & 0x0101010101010101ULL) * 0x8040201008040201ULL) >> 56;
+	}
+	return n * 8;
+}
+
+static int reverse_ends_scalar(uint8_t *data, int data_len)
+{
+	return data_len;
+}
+
+static int zero_run_scalar(const uint8_t *data, int data_len)
+{
+	int i;
+	for (i = 0; data_len - i >= 8; i += 8)
+		if (load_le64(data + i) != 0)
+			break;
+	return i;
+}
+
+static int equal_run_scalar(const uint8_t *a, const uint8_t *b, int len)
+{
+	int i;
+	for (i = 0; len - i >= 8; i += 8)
+		if (load_le64(a + i) != load_le64(b + i))
+			break;
+	return i;
+}
+
+#ifdef HAVE_X86
+
+/* SSE2: 16 bytes at a time */
+
+__attribute__((target("sse2")))
+static int pack_run_sse2(const uint8_t *src, int src_len, uint8_t *dst, int max_bytes)
+{
+	const __m128i fe = _mm_set1_epi8((char)0xFE);
+	const __m128i zero = _mm_set1_epi8('0');
+	int n;
+	for (n = 0; max_bytes - n >= 2 && src_len - n * 8 >= 16; n += 2)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + n * 8));
+		int m;
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, fe), zero)) != 0xFFFF)
+			break;
+		// Bit 0 of every character to its MSB, then one mask bit per character
+		m = _mm_movemask_epi8(_mm_slli_epi64(v, 7));
+		dst[n] = rev8[m & 0xFF];
+		dst[n + 1] = rev8[m >> 8];
+	}
+	return n * 8;
+}
+
+__attribute__((target("sse2")))
+static __m128i reverse_sse2(__m128i v)
+{
+	const __m128i m1 = _mm_set1_epi8(0x55);
+	const __m128i m2 = _mm_set1_epi8(0x33);
+	const __m128i m4 = _mm_set1_epi8(0x0F);
+	// Bits within bytes, by swapping neighbours, pairs and nibbles
+	v = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 1), m1), _mm_slli_epi16(_mm_and_si128(v, m1), 1));
+	v = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 2), m2), _mm_slli_epi16(_mm_and_si128(v, m2), 2));
+	v = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 4), m4), _mm_slli_epi16(_mm_and_si128(v, m4), 4));
+	// Bytes, by swapping bytes in words, words in quad words, and quad words
+	v = _mm_or_si128(_mm_srli_epi16(v, 8), _mm_slli_epi16(v, 8));
+	v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0x1B), 0x1B);
+	return _mm_shuffle_epi32(v, 0x4E);
+}
+
+__attribute__((target("sse2")))
+static int reverse_ends_sse2(uint8_t *data, int data_len)
+{
+	uint8_t *lo = data;
+	uint8_t *hi = data + data_len;
+	while (hi - lo >= 32)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)lo);
+		__m128i b = _mm_loadu_si128((const __m128i *)(hi - 16));
+		_mm_storeu_si128((__m128i *)lo, reverse_sse2(b));
+		_mm_storeu_si128((__m128i *)(hi - 16), reverse_sse2(a));
+		lo += 16;
+		hi -= 16;
+	}
+	return hi - lo;
+}
+
+__attribute__((target("sse2")))
+static int zero_run_sse2(const uint8_t *data, int data_len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int i;
+	for (i = 0; data_len - i >= 64; i += 64)
+	{
+		__m128i v = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(data + i)),
+				     _mm_loadu_si128((const __m128i *)(data + i + 16))),
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(data + i + 32)),
+				     _mm_loadu_si128((const __m128i *)(data + i + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF)
+			break;
+	}
+	for (; data_len - i >= 16; i += 16)
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), zero)) != 0xFFFF)
+			break;
+	return i;
+}
+
+__attribute__((target("sse2")))
+static int equal_run_sse2(const uint8_t *a, const uint8_t *b, int len)
+{
+	int i;
+	for (i = 0; len - i >= 16; i += 16)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF)
+			break;
+	}
+	return i;
+}
+
+/* AVX2: 32 bytes at a time */
+
+__attribute__((target("avx2")))
+static int pack_run_avx2(const uint8_t *src, int src_len, uint8_t *dst, int max_bytes)
+{
+	const __m256i fe = _mm256_set1_epi8((char)0xFE);
+	const __m256i zero = _mm256_set1_epi8('0');
+	// Reverse the characters of every group of eight, so the first ends up as MSB
+	const __m256i order = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+					       7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+	int n;
+	for (n = 0; max_bytes - n >= 4 && src_len - n * 8 >= 32; n += 4)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + n * 8));
+		uint32_t m;
+		if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(v, fe), zero)) != 0xFFFFFFFF)
+			break;
+		m = _mm256_movemask_epi8(_mm256_slli_epi64(_mm256_shuffle_epi8(v, order), 7));
+		dst[n] = m;
+		dst[n + 1] = m >> 8;
+		dst[n + 2] = m >> 16;
+		dst[n + 3] = m >> 24;
+	}
+	return n * 8;
+}
+
+__attribute__((target("avx2")))
+static __m256i reverse_avx2(__m256i v)
+{
+	const __m256i nibbles = _mm256_setr_epi8(0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE, 0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF,
+						 0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE, 0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF);
+	const __m256i bytes = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+					       15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+	const __m256i m4 = _mm256_set1_epi8(0x0F);
+	__m256i lo = _mm256_shuffle_epi8(nibbles, _mm256_and_si256(v, m4));
+	__m256i hi = _mm256_shuffle_epi8(nibbles, _mm256_and_si256(_mm256_srli_epi16(v, 4), m4));
+	v = _mm256_or_si256(_mm256_slli_epi16(lo, 4), hi);
+	v = _mm256_shuffle_epi8(v, bytes);
+	return _mm256_permute4x64_epi64(v, 0x4E);
+}
+
+__attribute__((target("avx2")))
+static int reverse_ends_avx2(uint8_t *data, int data_len)
+{
+	uint8_t *lo = data;
+	uint8_t *hi = data + data_len;
+	while (hi - lo >= 64)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i *)lo);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(hi - 32));
+		_mm256_storeu_si256((__m256i *)lo, reverse_avx2(b));
+		_mm256_storeu_si256((__m256i *)(hi - 32), reverse_avx2(a));
+		lo += 32;
+		hi -= 32;
+	}
+	return hi - lo;
+}
+
+__attribute__((target("avx2")))
+static int zero_run_avx2(const uint8_t *data, int data_len)
+{
+	int i;
+	for (i = 0; data_len - i >= 128; i += 128)
+	{
+		__m256i v = _mm256_or_si256(
+			_mm256_or_si256(_mm256_loadu_si256((const __m256i *)(data + i)),
+					_mm256_loadu_si256((const __m256i *)(data + i + 32))),
+			_mm256_or_si256(_mm256_loadu_si256((const __m256i *)(data + i + 64)),
+					_mm256_loadu_si256((const __m256i *)(data + i + 96))));
+		if (!_mm256_testz_si256(v, v))
+			break;
+	}
+	for (; data_len - i >= 32; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+		if (!_mm256_testz_si256(v, v))
+			break;
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static int equal_run_avx2(const uint8_t *a, const uint8_t *b, int len)
+{
+	int i;
+	for (i = 0; len - i >= 32; i += 32)
+	{
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != 0xFFFFFFFF)
+			break;
+	}
+	return i;
+}
+
+#endif /* HAVE_X86 */
+
+#ifdef HAVE_NEON
+
+/* NEON: 16 bytes at a time, ARMv7 instructions only */
+
+static int all_ones_neon(uint8x16_t v)
+{
+	uint8x8_t m = vpmin_u8(vget_low_u8(v), vget_high_u8(v));
+	return vget_lane_u64(vreinterpret_u64_u8(m), 0) == ~0ULL;
+}
+
+static int all_zeros_neon(uint8x16_t v)
+{
+	uint8x8_t m = vpmax_u8(vget_low_u8(v), vget_high_u8(v));
+	return vget_lane_u64(vreinterpret_u64_u8(m), 0) == 0;
+}
+
+static int pack_run_neon(const uint8_t *src, int src_len, uint8_t *dst, int max_bytes)
+{
+	static const int8_t shifts[16] = { 7, 6, 5, 4, 3, 2, 1, 0, 7, 6, 5, 4, 3, 2, 1, 0 };
+	const int8x16_t shift = vld1q_s8(shifts);
+	int n;
+	for (n = 0; max_bytes - n >= 2 && src_len - n * 8 >= 16; n += 2)
+	{
+		uint8x16_t v = vld1q_u8(src + n * 8);
+		uint8x16_t bits;
+		uint8x8_t s;
+		if (!all_ones_neon(vceqq_u8(vandq_u8(v, vdupq_n_u8(0xFE)), vdupq_n_u8('0'))))
+			break;
+		bits = vshlq_u8(vandq_u8(v, vdupq_n_u8(1)), shift);
+		// Three pairwise adds sum each group of eight into one byte
+		s = vpadd_u8(vget_low_u8(bits), vget_high_u8(bits));
+		s = vpadd_u8(s, s);
+		s = vpadd_u8(s, s);
+		dst[n] = vget_lane_u8(s, 0);
+		dst[n + 1] = vget_lane_u8(s, 1);
+	}
+	return n * 8;
+}
+
+static uint8x8_t reverse_half_neon(uint8x8_t v)
+{
+	static const uint8_t nibble_table[16] = { 0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE, 0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF };
+	uint8x8x2_t table;
+	uint8x8_t lo, hi;
+	table.val[0] = vld1_u8(nibble_table);
+	table.val[1] = vld1_u8(nibble_table + 8);
+	lo = vtbl2_u8(table, vand_u8(v, vdup_n_u8(0x0F)));
+	hi = vtbl2_u8(table, vshr_n_u8(v, 4));
+	return vrev64_u8(vorr_u8(vshl_n_u8(lo, 4), hi));
+}
+
+static uint8x16_t reverse_neon(uint8x16_t v)
+{
+	return vcombine_u8(reverse_half_neon(vget_high_u8(v)), reverse_half_neon(vget_low_u8(v)));
+}
+
+static int reverse_ends_neon(uint8_t *data, int data_len)
+{
+	uint8_t *lo = data;
+	uint8_t *hi = data + data_len;
+	while (hi - lo >= 32)
+	{
+		uint8x16_t a = vld1q_u8(lo);
+		uint8x16_t b = vld1q_u8(hi - 16);
+		vst1q_u8(lo, reverse_neon(b));
+		vst1q_u8(hi - 16, reverse_neon(a));
+		lo += 16;
+		hi -= 16;
+	}
+	return hi - lo;
+}
+
+static int zero_run_neon(const uint8_t *data, int data_len)
+{
+	int i;
+	for (i = 0; data_len - i >= 64; i += 64)
+	{
+		uint8x16_t v = vorrq_u8(vorrq_u8(vld1q_u8(data + i), vld1q_u8(data + i + 16)),
+					vorrq_u8(vld1q_u8(data + i + 32), vld1q_u8(data + i + 48)));
+		if (!all_zeros_neon(v))
+			break;
+	}
+	for (; data_len - i >= 16; i += 16)
+		if (!all_zeros_neon(vld1q_u8(data + i)))
+			break;
+	return i;
+}
+
+static int equal_run_neon(const uint8_t *a, const uint8_t *b, int len)
+{
+	int i;
+	for (i = 0; len - i >= 16; i += 16)
+		if (!all_zeros_neon(veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i))))
+			break;
+	return i;
+}
+
+#endif /* HAVE_NEON */
+
+static const struct kernels all_kernels[KERNELS_NUM] = {
+	{ pack_run_scalar, reverse_ends_scalar, zero_run_scalar, equal_run_scalar },
+#ifdef HAVE_X86
+	{ pack_run_sse2, reverse_ends_sse2, zero_run_sse2, equal_run_sse2 },
+	{ pack_run_avx2, reverse_ends_avx2, zero_run_avx2, equal_run_avx2 },
+#else
+	{ 0 },
+	{ 0 },
+#endif
+#ifdef HAVE_NEON
+	{ pack_run_neon, reverse_ends_neon, zero_run_neon, equal_run_neon },
+#else
+	{ 0 },
+#endif
+};
+
+/*
+ * Chosen once, before the first kernel runs, as daemon connections and
+ * fleet workers call the kernels from several threads.
+ */
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+static const struct kernels *current = &all_kernels[KERNELS_SCALAR];
+static int current_kind = KERNELS_SCALAR;
+
+int kernels_available(int kind)
+{
+	switch (kind)
+	{
+	case KERNELS_SCALAR:
+		return 1;
+#ifdef HAVE_X86
+	case KERNELS_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case KERNELS_AVX2:
+		return __builtin_cpu_supports("avx2");
+#endif
+#ifdef HAVE_NEON
+	case KERNELS_NEON:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+const char *kernels_name(int kind)
+{
+	return kind >= 0 && kind < KERNELS_NUM ? names[kind] : "unknown";
+}
+
+static int use_kernels(int kind)
+{
+	if (kind < 0 || kind >= KERNELS_NUM || !kernels_available(kind))
+		return 0;
+	current = &all_kernels[kind];
+	current_kind = kind;
+	return 1;
+}
+
+static void init_kernels()
+{
+	char *env = getenv("MACHXO_KERNELS");
+	int kind;
+	if (env != 0)
+		for (kind = 0; kind < KERNELS_NUM; kind++)
+			if (strcmp(env, names[kind]) == 0 && use_kernels(kind))
+				return;
+	for (kind = KERNELS_NUM - 1; kind >= 0; kind--)
+		if (use_kernels(kind))
+			return;
+}
+
+static const struct kernels *kernels()
+{
+	pthread_once(&kernels_once, init_kernels);
+	return current;
+}
+
+// After the automatic choice, so that it does not override this one later
+int select_kernels(int kind)
+{
+	pthread_once(&kernels_once, init_kernels);
+	return use_kernels(kind);
+}
+
+int selected_kernels()
+{
+	kernels();
+	return current_kind;
+}
+
+/*
+ * Pack ASCII '0'/'1' into bytes, MSB first, ignoring everything else.  A
+ * partial last byte keeps its bits in the low end.  Stops at '*' or after
+ * 'max_bytes' bytes and sets '*consumed' to the number of characters used.
+ * Runs of plain bits go to the vector kernel whenever a byte is complete.
+ */
+int pack_bits(const uint8_t *src, int src_len, uint8_t *dst, int max_bytes, int *consumed)
+{
+	int dst_idx = 0;
+	int cur_bit = 0;
+	int src_idx = 0;
+	uint8_t val = 0;
+	const struct kernels *k = kernels();
+	while (src_idx < src_len)
+	{
+		int bit;
+		if (cur_bit == 0)
+		{
+			int n = k->pack_run(src + src_idx, src_len - src_idx, dst + dst_idx, max_bytes - dst_idx);
+			n += pack_run_scalar(src + src_idx + n, src_len - src_idx - n, dst + dst_idx + n / 8, max_bytes - dst_idx - n / 8);
+			src_idx += n;
+			dst_idx += n / 8;
+			if (src_idx == src_len)
+				break;
+		}
+		bit = src[src_idx];
+		if (bit == '0')
+			bit = 0;
+		else if (bit == '1')
+			bit = 1;
+		else if (bit == '*')
+			break;
+		else
+		{
+			src_idx++;
+			continue;
+		}
+		if (dst_idx == max_bytes)
+			break;
+		val = (val << 1) | bit;
+		src_idx++;
+		if (++cur_bit == 8)
+		{
+			dst[dst_idx++] = val;
+			cur_bit = 0;
+			val = 0;
+		}
+	}
+	if (cur_bit != 0 && dst_idx < max_bytes)
+		dst[dst_idx++] = val;
+	if (consumed != 0)
+		*consumed = src_idx;
+	return dst_idx;
+}
+
+// Reverse the order of all bits in 'data'
+void reverse_bits(uint8_t *data, int data_len)
+{
+	int left;
+	int i;
+	left = kernels()->reverse_ends(data, data_len);
+	data += (data_len - left) / 2;
+	for (i = 0; i < left / 2; i++)
+	{
+		uint8_t tmp = rev8[data[left - i - 1]];
+		data[left - i - 1] = rev8[data[i]];
+		data[i] = tmp;
+	}
+	if (left & 1)
+		data[left / 2] = rev8[data[left / 2]];
+}
+
+/*
+ * A single page is not worth the call through 'current', so buffers up to
+ * SHORT_LEN bytes only use the scalar kernel.
+ */
+#define SHORT_LEN 32
+
+int all_zero(const uint8_t *data, int data_len)
+{
+	int i = 0;
+	if (data_len > SHORT_LEN)
+	{
+		i = kernels()->zero_run(data, data_len);
+	}
+	i += zero_run_scalar(data + i, data_len - i);
+	for (; i < data_len; i++)
+		if (data[i] != 0)
+			return 0;
+	return 1;
+}
+
+// Index of the first byte that differs, or 'len' if there is none
+int first_mismatch(const uint8_t *a, const uint8_t *b, int len)
+{
+	int i = 0;
+	if (len > SHORT_LEN)
+	{
+		i = kernels()->equal_run(a, b, len);
+	}
+	i += equal_run_scalar(a + i, b + i, len - i);
+	for (; i < len; i++)
+		if (a[i] != b[i])
+			break;
+	return i;
+}
@@ -0,0 +1,33 @@
+/*
+ * Vectorized helpers for fuse data: ASCII bit packing, bit reversal,
+ * zero page detection and compare.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ */
+#ifndef _KERNELS_H
+#define _KERNELS_H 1
+#include <stdint.h>
+
+#define KERNELS_SCALAR 0
+#define KERNELS_SSE2 1
+#define KERNELS_AVX2 2
+#define KERNELS_NEON 3
+#define KERNELS_NUM 4
+
+/*
+ * The best implementation the CPU supports is picked on first use, once
+ * for all threads.  MACHXO_KERNELS=scalar|sse2|avx2|neon in the environment
+ * overrides that.  select_kernels() is for benchmarks, and must not race
+ * with threads running the kernels.
+ */
+int kernels_available(int kind);
+int select_kernels(int kind);
+int selected_kernels();
+const char *kernels_name(int kind);
+
+int pack_bits(const uint8_t *src, int src_len, uint8_t *dst, int max_bytes, int *consumed);
+void reverse_bits(uint8_t *data, int data_len);
+int all_zero(const uint8_t *data, int data_len);
+int first_mismatch(const uint8_t *a, const uint8_t *b, int len);
+
+#endif
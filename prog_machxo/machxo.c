@@ -3,11 +3,14 @@
  * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
  * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
  */
+#include <errno.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/ioctl.h>
@@ -20,39 +23,187 @@
 #include <linux/types.h>
 #include <linux/spi/spidev.h>
 
+#include "gpmc.h"
+#include "kernels.h"
 #include "machxo.h"
+#include "sim.h"
 
-static int dev_fd = -1;
-static int mode = MODE_SPI;
+/*
+ * Busy wait bookkeeping.  Each wait is classified by the command that
+ * started it.  The estimate starts at the typical datasheet figure and
+ * follows the measured completion times, so the first status poll lands
+ * just after the operation usually finishes.
+ */
+struct busy_class {
+	const char *name;
+	uint32_t estimate;	// usecs
+	uint32_t min_interval;	// usecs between polls
+	uint32_t max_interval;
+	uint32_t timeout;	// usecs
+	uint32_t waits;
+	uint64_t total;		// usecs
+};
+
+static const struct busy_class default_busy_classes[BUSY_NUM_CLASSES] = {
+	[BUSY_PAGE] = { "page", 200, 20, 200, 100000 },
+	[BUSY_ERASE] = { "erase", 500000, 1000, 50000, 30000000 },
+	[BUSY_ERASE_UFM] = { "ufm erase", 50000, 500, 10000, 10000000 },
+	[BUSY_ERASE_SRAM] = { "sram erase", 1000, 50, 1000, 1000000 },
+	[BUSY_FEATURE] = { "feature", 200, 20, 200, 100000 },
+	[BUSY_DONE] = { "done", 200, 20, 200, 100000 },
+	[BUSY_REFRESH] = { "refresh", 5000, 100, 1000, 1000000 },
+	[BUSY_OTHER] = { "other", 50, 20, 1000, 1000000 },
+};
+
+/*
+ * Instrumentation, only allocated when asked for so that the cost is one
+ * test per command otherwise.  Commands are counted by opcode, with the
+ * time spent in the ioctl of each.
+ */
+struct command_stats {
+	uint32_t calls;
+	uint32_t failures;
+	uint32_t ioctls;
+	uint64_t bytes;		// Data bytes, not counting the command
+	uint64_t usecs;
+	uint32_t max_usecs;
+	uint32_t histogram[LATENCY_BUCKETS];
+};
 
-static uint8_t spi_mode = 0;
-static uint8_t spi_bits = 8;
-static uint32_t spi_speed = 5000000; // 5 MHz
-static uint16_t spi_delay = 0;
+struct instrumentation {
+	struct command_stats commands[256];
+	uint64_t sleep_usecs;	// In wait_not_busy()
+	uint32_t sleeps;
+	uint32_t polls;
+	uint32_t ioctls;
+};
 
-static uint16_t i2c_addr = 0x40;
+/*
+ * Everything about one open device.  Devices share nothing, so several can
+ * be programmed at the same time from different threads.
+ */
+struct machxo_device {
+	char *name;
+	int dev_fd;
+	struct machxo_sim *sim;
+	struct gpmc_window *gpmc;
+	int mode;
 
-static struct spi_ioc_transfer spi_xfer[3];
-static struct i2c_rdwr_ioctl_data i2c_packets;
-static struct i2c_msg i2c_messages[2];
+	uint8_t spi_mode;
+	uint8_t spi_bits;
+	uint32_t spi_speed;
+	uint16_t spi_delay;
+
+	uint16_t i2c_addr;
+	uint32_t i2c_speed;	// Hz, set by the adapter; used to space batched page writes
+	unsigned long i2c_funcs;	// I2C_FUNCS of the adapter
+
+	int max_transfer; // spidev buffer size
+	uint8_t *verify_buffer;
+	int verify_buffer_size;
+	int verify_buffer_owned; // Allocated here, not supplied by the caller
+	int verify_burst;
+
+	machxo_message_fn message;
+	void *message_arg;
+
+	struct spi_ioc_transfer spi_xfer[3];
+	struct spi_ioc_transfer batch_xfer[MACHXO2_MAX_BATCH_PAGES * 3 - 1];
+	uint16_t page_program_delay;
+	int flash_page;		// Page the next LSC_PROG_INCR_NV goes to, -1 if not known
+	int flash_ufm;
+	struct i2c_rdwr_ioctl_data i2c_packets;
+	struct i2c_msg i2c_messages[I2C_RDWR_IOCTL_MAX_MSGS];
+
+	struct busy_class busy_classes[BUSY_NUM_CLASSES];
+	int adaptive_polling;
+	uint8_t last_command;
+	uint32_t last_operand;
+	struct timespec last_command_time;
+
+	struct instrumentation *instr;
+};
 
 //#define DEBUG(x) (x)
 #define DEBUG(x)
 #define DEBUG2 0
 
-static int send_receive(uint8_t command, uint32_t operand, int direction, uint8_t *data, int data_len)
+// Errors go to the message handler, stderr unless the caller set one
+static void report(struct machxo_device *dev, const char *format, ...)
+{
+	char text[256];
+	va_list ap;
+	va_start(ap, format);
+	vsnprintf(text, sizeof text, format, ap);
+	va_end(ap);
+	if (dev->message != 0)
+		dev->message(dev->message_arg, text);
+	else
+		fprintf(stderr, "%s\n", text);
+}
+
+static int no_device(struct machxo_device *dev)
+{
+	return dev->dev_fd == -1 && dev->sim == 0 && dev->gpmc == 0;
+}
+
+static int do_ioctl(struct machxo_device *dev, unsigned long request, void *arg)
+{
+	if (dev->instr != 0)
+		dev->instr->ioctls++;
+	if (dev->sim != 0)
+		return sim_ioctl(dev->sim, request, arg);
+	return ioctl(dev->dev_fd, request, arg);
+}
+
+static uint32_t usecs_since(struct timespec *start)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - start->tv_sec) * 1000000 + (ts.tv_nsec - start->tv_nsec) / 1000;
+}
+
+// 'start' and 'ioctls' were taken before the command went out
+static void count_command(struct machxo_device *dev, uint8_t command, int data_len, int status,
+			  struct timespec *start, uint32_t ioctls)
+{
+	struct command_stats *cs = &dev->instr->commands[command];
+	uint32_t usecs = usecs_since(start);
+	int bucket = 0;
+	while (bucket < LATENCY_BUCKETS - 1 && usecs >= (1u << bucket))
+		bucket++;
+	cs->calls++;
+	cs->ioctls += dev->instr->ioctls - ioctls;
+	if (status < 0)
+		cs->failures++;
+	cs->bytes += data_len;
+	cs->usecs += usecs;
+	if (usecs > cs->max_usecs)
+		cs->max_usecs = usecs;
+	cs->histogram[bucket]++;
+}
+
+static int send_receive(struct machxo_device *dev, uint8_t command, uint32_t operand, int direction, uint8_t *data, int data_len)
 {
+	struct timespec start;
+	uint32_t ioctls = 0;
 	uint8_t cmd_buffer[4];
 	int status;
 	int num_xfers;
+	int chunk, done;
 	num_xfers = (data == 0) ? 1 : 2;
-	if (mode == MODE_SPI) num_xfers++;
+	if (dev->mode == MODE_SPI) num_xfers++;
 	int oplen = 4;
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
-	memset(spi_xfer, 0 , sizeof spi_xfer);
-	memset(&i2c_packets, 0, sizeof i2c_packets);
-	memset(i2c_messages, 0, sizeof i2c_messages);
+	if (dev->instr != 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ioctls = dev->instr->ioctls;
+	}
+	memset(dev->spi_xfer, 0 , sizeof dev->spi_xfer);
+	memset(&dev->i2c_packets, 0, sizeof dev->i2c_packets);
+	memset(dev->i2c_messages, 0, sizeof dev->i2c_messages);
 	cmd_buffer[0] = command;
 	cmd_buffer[1] = (operand & 0xFF0000) >> 16;
 	cmd_buffer[2] = (operand & 0x00FF00) >> 8;
@@ -69,9 +220,16 @@ static int send_receive(uint8_t command, uint32_t operand, int direction, uint8_
 		oplen = 4;
 		break;
 	}
-	if (data_len < 0 || data_len > 4*1024)
+	if (data_len < 0 || data_len > (dev->mode == MODE_I2C ? MAX_I2C_TRANSFER : MAX_SPI_TRANSFER))
 	{
-		fprintf(stderr, "Incorrect data length %d\n", data_len);
+		report(dev, "Incorrect data length %d", data_len);
+		return 0;
+	}
+	if (dev->mode == MODE_I2C && data_len > MAX_I2C_MESSAGE && !(dev->i2c_funcs & I2C_FUNC_NOSTART))
+	{
+		report(dev, "%d bytes do not fit in one I2C message, and the adapter can not go on without a START",
+		       data_len);
+		errno = EOPNOTSUPP;
 		return 0;
 	}
 #if DEBUG2
@@ -87,39 +245,73 @@ static int send_receive(uint8_t command, uint32_t operand, int direction, uint8_
 		fprintf(stderr, "\n");
 	}
 #endif
-	if (mode == MODE_SPI)
+	if (dev->mode == MODE_SPI)
 	{
-		spi_xfer[0].tx_buf = (unsigned long)cmd_buffer;
-		spi_xfer[0].len = 1;
-		spi_xfer[0].delay_usecs = 1;
-		spi_xfer[1].tx_buf = (unsigned long)(cmd_buffer + 1);
-		spi_xfer[1].len = oplen - 1;
+		dev->spi_xfer[0].tx_buf = (unsigned long)cmd_buffer;
+		dev->spi_xfer[0].len = 1;
+		dev->spi_xfer[0].delay_usecs = 1;
+		dev->spi_xfer[1].tx_buf = (unsigned long)(cmd_buffer + 1);
+		dev->spi_xfer[1].len = oplen - 1;
+		chunk = data_len;
+		if (chunk > dev->max_transfer - oplen)
+			chunk = dev->max_transfer - oplen;
 		if (data != 0)
 		{
 			if (direction == DIRECTION_SEND)
-				spi_xfer[2].tx_buf = (unsigned long)data;
+				dev->spi_xfer[2].tx_buf = (unsigned long)data;
 			else
-				spi_xfer[2].rx_buf = (unsigned long)data;
-			spi_xfer[2].len = data_len;
+				dev->spi_xfer[2].rx_buf = (unsigned long)data;
+			dev->spi_xfer[2].len = chunk;
+			dev->spi_xfer[2].cs_change = chunk < data_len; // Keep CS asserted for the rest
+		}
+		status = do_ioctl(dev, SPI_IOC_MESSAGE(num_xfers), dev->spi_xfer);
+		// Data beyond the spidev buffer size follows in further messages, which only the SRAM burst needs
+		for (done = chunk; status >= 0 && done < data_len; done += chunk)
+		{
+			chunk = data_len - done;
+			if (chunk > dev->max_transfer)
+				chunk = dev->max_transfer;
+			memset(dev->spi_xfer, 0, sizeof dev->spi_xfer[0]);
+			if (direction == DIRECTION_SEND)
+				dev->spi_xfer[0].tx_buf = (unsigned long)(data + done);
+			else
+				dev->spi_xfer[0].rx_buf = (unsigned long)(data + done);
+			dev->spi_xfer[0].len = chunk;
+			dev->spi_xfer[0].cs_change = done + chunk < data_len;
+			status = do_ioctl(dev, SPI_IOC_MESSAGE(1), dev->spi_xfer);
 		}
-		status = ioctl(dev_fd, SPI_IOC_MESSAGE(num_xfers), spi_xfer);
 	}
-	else if (mode == MODE_I2C)
+	else if (dev->mode == MODE_I2C)
 	{
-		i2c_messages[0].addr = i2c_addr;
-		i2c_messages[0].flags = 0;
-		i2c_messages[0].buf = cmd_buffer;
-		i2c_messages[0].len = command == ISC_ENABLE ? 3 : 4;
-		if (data != 0)
+		dev->i2c_messages[0].addr = dev->i2c_addr;
+		dev->i2c_messages[0].flags = 0;
+		dev->i2c_messages[0].buf = cmd_buffer;
+		dev->i2c_messages[0].len = command == ISC_ENABLE ? 3 : 4;
+		// Data beyond the i2c-dev message limit continues without a new START
+		for (done = 0; data != 0 && done < data_len; done += chunk)
 		{
-			i2c_messages[1].addr = i2c_addr;
-			i2c_messages[1].flags = direction == DIRECTION_SEND ? 0 : I2C_M_RD;
-			i2c_messages[1].buf = data;
-			i2c_messages[1].len = data_len;
+			chunk = data_len - done;
+			if (chunk > MAX_I2C_MESSAGE)
+				chunk = MAX_I2C_MESSAGE;
+			dev->i2c_messages[num_xfers - 1].addr = dev->i2c_addr;
+			dev->i2c_messages[num_xfers - 1].flags = direction == DIRECTION_SEND ? 0 : I2C_M_RD;
+			if (done > 0)
+				dev->i2c_messages[num_xfers - 1].flags |= I2C_M_NOSTART;
+			dev->i2c_messages[num_xfers - 1].buf = data + done;
+			dev->i2c_messages[num_xfers - 1].len = chunk;
+			if (done + chunk < data_len)
+				num_xfers++;
 		}
-		i2c_packets.msgs = i2c_messages;
-		i2c_packets.nmsgs = num_xfers;
-		status = ioctl(dev_fd, I2C_RDWR, &i2c_packets);
+		dev->i2c_packets.msgs = dev->i2c_messages;
+		dev->i2c_packets.nmsgs = num_xfers;
+		status = do_ioctl(dev, I2C_RDWR, &dev->i2c_packets);
+	}
+	else if (dev->mode == MODE_GPMC)
+		status = gpmc_frame(dev->gpmc, cmd_buffer, oplen, data, data_len, direction);
+	else
+	{
+		errno = EINVAL;
+		status = -1;
 	}
 #if DEBUG2
 	if (direction != DIRECTION_SEND)
@@ -131,11 +323,28 @@ static int send_receive(uint8_t command, uint32_t operand, int direction, uint8_
 		fprintf(stderr, "\n");
 	}
 #endif
+	if (dev->instr != 0)
+		count_command(dev, command, data_len, status, &start, ioctls);
 	if (status < 0)
-		perror("message");
+		report(dev, "message: %s", strerror(errno));
+	// Status polls must not restart the clock of the operation being waited for
+	if (command != LSC_READ_STATUS && command != LSC_CHECK_BUSY)
+	{
+		dev->last_command = command;
+		dev->last_operand = operand;
+		clock_gettime(CLOCK_MONOTONIC, &dev->last_command_time);
+	}
 	return status >= 0;
 }
 
+// One frame as it came, for bridges that pass frames on
+int send_command(struct machxo_device *dev, const uint8_t *cmd, int direction, uint8_t *data, int data_len)
+{
+	if (no_device(dev))
+		return 1; // Debug mode
+	return send_receive(dev, cmd[0], 0x10000 * cmd[1] + 0x100 * cmd[2] + cmd[3], direction, data, data_len);
+}
+
 static uint32_t be_4bytes(uint8_t *buffer)
 {
 	return buffer[3] + 0x100 * buffer[2] + 0x10000 * buffer[1] + 0x1000000 * buffer[0];
@@ -149,260 +358,1304 @@ static void to_be_4bytes(uint32_t val, uint8_t *buffer)
 	buffer[0] = (val & 0xFF000000) >> 24;
 }
 
-int open_device(char *dev_name, int mode, int addr)
+static void read_spidev_bufsiz(struct machxo_device *dev)
+{
+	FILE *f = fopen(SPIDEV_BUFSIZ, "r");
+	int bufsiz;
+	if (f == 0)
+		return;
+	if (fscanf(f, "%d", &bufsiz) == 1 && bufsiz >= 64)
+		dev->max_transfer = bufsiz;
+	fclose(f);
+}
+
+/*
+ * What the I2C adapter can do, and its bus clock where the device tree
+ * tells (Fast-mode Plus boards run at 1 MHz).  Batching needs I2C_M_STOP
+ * to end each command, long reads need I2C_M_NOSTART to continue a read
+ * over several messages.
+ */
+static void read_i2c_adapter(struct machxo_device *dev)
+{
+	char path[80];
+	uint8_t be[4];
+	int bus;
+	FILE *f;
+	if (do_ioctl(dev, I2C_FUNCS, &dev->i2c_funcs) < 0)
+		dev->i2c_funcs = 0;
+	if (dev->sim != 0 || sscanf(dev->name, "/dev/i2c-%d", &bus) != 1)
+		return;
+	snprintf(path, sizeof path, "/sys/class/i2c-dev/i2c-%d/device/of_node/clock-frequency", bus);
+	f = fopen(path, "rb");
+	if (f == 0)
+		return;
+	if (fread(be, 4, 1, f) == 1 && be_4bytes(be) >= 10000)
+		dev->i2c_speed = be_4bytes(be);
+	fclose(f);
+}
+
+// Until this is called the bus runs at whatever the spidev driver was left at
+static int apply_spi_settings(struct machxo_device *dev)
 {
+	if (do_ioctl(dev, SPI_IOC_WR_MODE, &dev->spi_mode) < 0 ||
+	    do_ioctl(dev, SPI_IOC_WR_BITS_PER_WORD, &dev->spi_bits) < 0 ||
+	    do_ioctl(dev, SPI_IOC_WR_MAX_SPEED_HZ, &dev->spi_speed) < 0)
+	{
+		report(dev, "Failed to set SPI mode %d at %u Hz: %s", dev->spi_mode, dev->spi_speed, strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Returns 0 only when out of memory or when the simulator options are bad.
+ * A device file that can not be opened gives a device in debug mode, where
+ * every command succeeds without touching the bus; see device_present().
+ */
+struct machxo_device *open_device(char *dev_name, int dev_mode, int addr)
+{
+	struct machxo_device *dev;
 	DEBUG(fprintf(stderr, "Open device\n"));
 	if (dev_name == 0)
 		dev_name = DEFAULT_SPI_DEV;
-	i2c_addr = addr;
-	dev_fd = open(dev_name, O_RDWR);
-	if (dev_fd < 0)
+	dev = (struct machxo_device *)calloc(1, sizeof *dev);
+	if (dev == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	dev->name = dev_name;
+	dev->dev_fd = -1;
+	dev->mode = dev_mode;
+	dev->spi_bits = 8;
+	dev->spi_speed = DEFAULT_SPI_SPEED;
+	dev->i2c_addr = addr;
+	dev->i2c_speed = DEFAULT_I2C_SPEED;
+	dev->max_transfer = 4096;
+	dev->page_program_delay = MACHXO2_PAGE_GAP_USECS;
+	dev->flash_page = -1;
+	memcpy(dev->busy_classes, default_busy_classes, sizeof dev->busy_classes);
+	dev->adaptive_polling = 1;
+	if (strncmp(dev_name, GPMC_DEV, strlen(GPMC_DEV)) == 0)
+	{
+		// "gpmc" or "gpmc:<file>", whatever bus was asked for
+		dev->mode = MODE_GPMC;
+		dev->gpmc = gpmc_open(dev_name);
+		return dev;
+	}
+	if (strncmp(dev_name, SIM_DEV, strlen(SIM_DEV)) == 0)
+	{
+		// "sim" or "sim:<options>", see sim.h
+		char *options = dev_name + strlen(SIM_DEV);
+		if (*options == ':')
+			options++;
+		dev->sim = sim_open(dev->mode, options);
+		if (dev->sim == 0)
+		{
+			free(dev);
+			return 0;
+		}
+		if (dev->mode == MODE_SPI)
+		{
+			dev->max_transfer = sim_bufsiz(dev->sim);
+			apply_spi_settings(dev);
+		}
+		else
+			read_i2c_adapter(dev);
+		return dev;
+	}
+	dev->dev_fd = open(dev_name, O_RDWR);
+	if (dev->dev_fd < 0)
 		perror("open_device");
+	else if (dev->mode == MODE_SPI)
+	{
+		read_spidev_bufsiz(dev);
+		apply_spi_settings(dev);
+	}
+	else
+		read_i2c_adapter(dev);
+	return dev;
+}
+
+int set_spi_clock(struct machxo_device *dev, int spi_mode, uint32_t speed_hz)
+{
+	dev->spi_mode = spi_mode;
+	dev->spi_speed = speed_hz;
+	if (no_device(dev) || dev->mode != MODE_SPI)
+		return 1;
+	return apply_spi_settings(dev);
+}
+
+uint32_t get_spi_speed(struct machxo_device *dev)
+{
+	return dev->spi_speed;
+}
+
+// The rate itself is set by the adapter driver, this only tells what it is
+void set_i2c_speed(struct machxo_device *dev, uint32_t speed_hz)
+{
+	if (speed_hz > 0)
+		dev->i2c_speed = speed_hz;
+}
+
+static int i2c_can_batch(struct machxo_device *dev)
+{
+	return dev->mode == MODE_I2C && (dev->i2c_funcs & I2C_FUNC_PROTOCOL_MANGLING);
+}
+
+int device_present(struct machxo_device *dev)
+{
+	return !no_device(dev);
+}
+
+const char *device_name(struct machxo_device *dev)
+{
+	return dev->name;
+}
+
+void set_message_handler(struct machxo_device *dev, machxo_message_fn message, void *arg)
+{
+	dev->message = message;
+	dev->message_arg = arg;
+}
+
+void close_device(struct machxo_device *dev)
+{
+	if (dev->sim != 0)
+		sim_close(dev->sim);
+	else if (dev->gpmc != 0)
+		gpmc_close(dev->gpmc);
+	else if (dev->dev_fd != -1)
+		close(dev->dev_fd);
+	if (dev->verify_buffer_owned)
+		free(dev->verify_buffer);
+	free(dev->instr);
+	free(dev);
+}
+
+int read_device_id(struct machxo_device *dev, uint32_t *device_id)
+{
+	uint8_t buffer[4];
+	DEBUG(fprintf(stderr, "Read device ID\n"));
+	*device_id = 0;
+	if (no_device(dev))
+		return 1; // Debug mode
+	if (send_receive(dev, IDCODE_PUB, 0, DIRECTION_RECEIVE, buffer, 4) != 1)
+		return 0;
+	*device_id = be_4bytes(buffer);
 	return 1;
 }
 
-int check_device_id(uint32_t expected_id)
+int check_device_id(struct machxo_device *dev, uint32_t expected_id)
 {
 	uint8_t buffer[4];
 	int status;
 	DEBUG(fprintf(stderr, "Check device ID\n"));
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
-	status = send_receive(IDCODE_PUB, 0, DIRECTION_RECEIVE, buffer, 4);
+	status = send_receive(dev, IDCODE_PUB, 0, DIRECTION_RECEIVE, buffer, 4);
 	if (status != 1)
 		return status;
 	return be_4bytes(buffer) == expected_id;
 }
 
-int check_device_id_quick()
+int check_device_id_quick(struct machxo_device *dev)
 {
 	uint8_t buffer[4];
 	uint32_t device_id;
 	int status;
 	DEBUG(fprintf(stderr, "Check device ID (quick and dirty)\n"));
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
-	status = send_receive(IDCODE_PUB, 0, DIRECTION_RECEIVE, buffer, 4);
+	status = send_receive(dev, IDCODE_PUB, 0, DIRECTION_RECEIVE, buffer, 4);
 	if (status != 1)
 		return status;
 	device_id = be_4bytes(buffer);
 	if (device_id == 0 || device_id == 0xFFFFFFFF)
 	{
-		fprintf(stderr, "Device ID = %04x\n", device_id);
+		report(dev, "Device ID = %04x", device_id);
 		return 0;
 	}
 	else
 		return 1;
 }
 
-int read_busy_status()
+int read_busy_status(struct machxo_device *dev)
 {
 	uint8_t buffer[1];
 	int status;
 	DEBUG(fprintf(stderr, "Read busy status\n"));
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
-	status = send_receive(LSC_CHECK_BUSY, 0, DIRECTION_RECEIVE, buffer, 1);
+	status = send_receive(dev, LSC_CHECK_BUSY, 0, DIRECTION_RECEIVE, buffer, 1);
 	if (status != 1)
 		return 0;
 	DEBUG(fprintf(stderr, "Status: %02x\n", buffer[0]));
 	return buffer[0] != 0;
 }
 
-int read_status_register()
+int read_status_register(struct machxo_device *dev)
 {
 	uint8_t buffer[4];
 	uint32_t read_status;
-	int status;
 //  DEBUG(fprintf(stderr, "Read status register\n"));
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
-	status = send_receive(LSC_READ_STATUS, 0, DIRECTION_RECEIVE, buffer, 4);
+	// A dead bus must not pass for a device that is done
+	if (send_receive(dev, LSC_READ_STATUS, 0, DIRECTION_RECEIVE, buffer, 4) != 1)
+		return READ_STATUS_BUSY(~0U) | READ_STATUS_FAIL(~0U);
 	read_status = be_4bytes(buffer);
 	DEBUG(fprintf(stderr, "Status: %04x %02x\n", read_status, buffer[2]));
 	return READ_STATUS_BUSY(read_status) | READ_STATUS_FAIL(read_status);
 }
 
-int wait_not_busy()
+static int busy_class_of(uint8_t command, uint32_t operand)
+{
+	switch (command)
+	{
+	case LSC_PROG_INCR_NV:
+	case LSC_PROG_TAG:
+	case ISC_PROGRAM_USERCODE:
+		return BUSY_PAGE;
+	case ISC_ERASE:
+		return operand == ERASE_SRAM ? BUSY_ERASE_SRAM : BUSY_ERASE;
+	case LSC_ERASE_TAG:
+		return BUSY_ERASE_UFM;
+	case LSC_PROG_FEATURE:
+	case LSC_PROG_FEABITS:
+		return BUSY_FEATURE;
+	case ISC_PROGRAM_DONE:
+		return BUSY_DONE;
+	case LSC_REFRESH:
+		return BUSY_REFRESH;
+	default:
+		return BUSY_OTHER;
+	}
+}
+
+void set_adaptive_polling(struct machxo_device *dev, int enable)
+{
+	dev->adaptive_polling = enable;
+}
+
+static void busy_sleep(struct machxo_device *dev, uint32_t usecs)
+{
+	usleep(usecs);
+	if (dev->instr != 0)
+	{
+		dev->instr->sleep_usecs += usecs;
+		dev->instr->sleeps++;
+	}
+}
+
+static int wait_not_busy_fixed(struct machxo_device *dev)
 {
 	uint32_t status;
+	busy_sleep(dev, 1000);
+	while (read_busy_status(dev))
+		busy_sleep(dev, 1000);
+	while ((status = read_status_register(dev)) != 0)
+	{
+		if (READ_STATUS_FAIL(status))
+			return status;
+		if (!READ_STATUS_BUSY(status))
+			break;
+	}
+	return 1;
+}
+
+int wait_not_busy(struct machxo_device *dev)
+{
+	struct busy_class *bc = &dev->busy_classes[busy_class_of(dev->last_command, dev->last_operand)];
+	uint32_t status;
+	uint32_t elapsed;
+	uint32_t interval;
+	int polls = 0;
 	DEBUG(fprintf(stderr, "Wait not busy\n"));
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
-	usleep(1000);
-	while (read_busy_status())
-		usleep(1000);
-	while (status = read_status_register())
+	if (!dev->adaptive_polling)
+		return wait_not_busy_fixed(dev);
+	// Sleep until the operation is expected to complete, then poll
+	elapsed = usecs_since(&dev->last_command_time);
+	if (elapsed < bc->estimate)
+		busy_sleep(dev, bc->estimate - elapsed);
+	interval = bc->min_interval;
+	while (1)
 	{
+		// One LSC_READ_STATUS gives both the busy and the fail flag
+		status = read_status_register(dev);
+		polls++;
+		elapsed = usecs_since(&dev->last_command_time);
 		if (READ_STATUS_FAIL(status))
-			return status;
+		{
+			report(dev, "Device reports failure after %s operation", bc->name);
+			return 0;
+		}
 		if (!READ_STATUS_BUSY(status))
 			break;
+		if (elapsed > bc->timeout)
+		{
+			report(dev, "Timeout waiting for %s operation", bc->name);
+			return 0;
+		}
+		busy_sleep(dev, interval);
+		// Short fixed spins for fast operations, exponential back-off for slow ones
+		if (interval < bc->max_interval)
+			interval *= 2;
+		if (interval > bc->max_interval)
+			interval = bc->max_interval;
 	}
+	/*
+	 * Done at the first poll only tells that the estimate was too long, so
+	 * shrink it a little.  Otherwise the completion time is known to within
+	 * one poll interval.
+	 */
+	if (polls == 1)
+		bc->estimate -= bc->estimate / 8;
+	else
+		bc->estimate = (3 * bc->estimate + elapsed) / 4;
+	if (bc->estimate < bc->min_interval)
+		bc->estimate = bc->min_interval;
+	bc->waits++;
+	bc->total += elapsed;
+	if (dev->instr != 0)
+		dev->instr->polls += polls;
 	return 1;
 }
 
-int erase_flash()
+void print_busy_statistics(struct machxo_device *dev)
 {
-	int status;
 	int i;
+	for (i = 0; i < BUSY_NUM_CLASSES; i++)
+	{
+		struct busy_class *bc = &dev->busy_classes[i];
+		if (bc->waits == 0)
+			continue;
+		report(dev, "Busy wait %-8s %6u waits, average %7llu us, estimate %7u us",
+		       bc->name, bc->waits, (unsigned long long)(bc->total / bc->waits), bc->estimate);
+	}
+}
+
+void set_instrumentation(struct machxo_device *dev, int enable)
+{
+	if (enable && dev->instr == 0)
+		dev->instr = (struct instrumentation *)calloc(1, sizeof *dev->instr);
+	else if (!enable)
+	{
+		free(dev->instr);
+		dev->instr = 0;
+	}
+}
+
+static const char *command_name(uint8_t command)
+{
+	switch (command)
+	{
+	case IDCODE_PUB: return "IDCODE_PUB";
+	case ISC_ENABLE_X: return "ISC_ENABLE_X";
+	case ISC_ENABLE: return "ISC_ENABLE";
+	case LSC_CHECK_BUSY: return "LSC_CHECK_BUSY";
+	case LSC_READ_STATUS: return "LSC_READ_STATUS";
+	case ISC_ERASE: return "ISC_ERASE";
+	case LSC_ERASE_TAG: return "LSC_ERASE_TAG";
+	case LSC_INIT_ADDRESS: return "LSC_INIT_ADDRESS";
+	case LSC_WRITE_ADDRESS: return "LSC_WRITE_ADDRESS";
+	case LSC_PROG_INCR_NV: return "LSC_PROG_INCR_NV";
+	case LSC_INIT_ADDR_UFM: return "LSC_INIT_ADDR_UFM";
+	case LSC_PROG_TAG: return "LSC_PROG_TAG";
+	case ISC_PROGRAM_USERCODE: return "ISC_PROGRAM_USERCODE";
+	case USERCODE: return "USERCODE";
+	case LSC_PROG_FEATURE: return "LSC_PROG_FEATURE";
+	case LSC_READ_FEATURE: return "LSC_READ_FEATURE";
+	case LSC_PROG_FEABITS: return "LSC_PROG_FEABITS";
+	case LSC_READ_FEABITS: return "LSC_READ_FEABITS";
+	case LSC_READ_INCR_NV: return "LSC_READ_INCR_NV";
+	case LSC_READ_UFM: return "LSC_READ_UFM";
+	case ISC_PROGRAM_DONE: return "ISC_PROGRAM_DONE";
+	case LSC_PROG_OTP: return "LSC_PROG_OTP";
+	case LSC_READ_OTP: return "LSC_READ_OTP";
+	case ISC_DISABLE: return "ISC_DISABLE";
+	case ISC_NOOP: return "ISC_NOOP";
+	case LSC_REFRESH: return "LSC_REFRESH";
+	case LSC_BITSTREAM_BURST: return "LSC_BITSTREAM_BURST";
+	case ISC_PROGRAM_SECURITY: return "ISC_PROGRAM_SECURITY";
+	case ISC_PROGRAM_SECPLUS: return "ISC_PROGRAM_SECPLUS";
+	case UIDCODE_PUB: return "UIDCODE_PUB";
+	default: return "unknown";
+	}
+}
+
+// Upper bound of the histogram bucket holding the given fraction of the calls
+static uint32_t latency_percentile(struct command_stats *cs, double fraction)
+{
+	uint32_t count = 0;
+	int i;
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++)
+	{
+		count += cs->histogram[i];
+		if (count >= fraction * cs->calls)
+			break;
+	}
+	return i < LATENCY_BUCKETS - 1 ? 1u << i : cs->max_usecs;
+}
+
+void print_instrumentation(struct machxo_device *dev)
+{
+	struct instrumentation *in = dev->instr;
+	int i;
+	if (in == 0)
+		return;
+	for (i = 0; i < 256; i++)
+	{
+		struct command_stats *cs = &in->commands[i];
+		if (cs->calls == 0)
+			continue;
+		report(dev, "Command %02x %-20s %7u calls %7u ioctls %9llu bytes %9.3f ms, p50 < %u us, p99 < %u us, max %u us",
+		       i, command_name(i), cs->calls, cs->ioctls, (unsigned long long)cs->bytes, cs->usecs / 1000.0,
+		       latency_percentile(cs, 0.5), latency_percentile(cs, 0.99), cs->max_usecs);
+	}
+	report(dev, "Slept %.3f ms in %u sleeps and %u status polls waiting for busy",
+	       in->sleep_usecs / 1000.0, in->sleeps, in->polls);
+}
+
+/*
+ * The counters as the members of a JSON object, for the caller to put
+ * inside its own braces along with whatever else it knows.
+ */
+void write_instrumentation_json(struct machxo_device *dev, FILE *f)
+{
+	struct instrumentation *in = dev->instr;
+	const char *sep = "";
+	int i, j;
+	fprintf(f, "\"commands\": [");
+	for (i = 0; in != 0 && i < 256; i++)
+	{
+		struct command_stats *cs = &in->commands[i];
+		if (cs->calls == 0)
+			continue;
+		fprintf(f, "%s\n    {\"opcode\": %d, \"name\": \"%s\", \"calls\": %u, \"failures\": %u, \"ioctls\": %u, "
+			"\"bytes\": %llu, \"usecs\": %llu, \"max_usecs\": %u, \"histogram\": [",
+			sep, i, command_name(i), cs->calls, cs->failures, cs->ioctls, (unsigned long long)cs->bytes,
+			(unsigned long long)cs->usecs, cs->max_usecs);
+		for (j = 0; j < LATENCY_BUCKETS; j++)
+			fprintf(f, "%s%u", j > 0 ? ", " : "", cs->histogram[j]);
+		fprintf(f, "]}");
+		sep = ",";
+	}
+	fprintf(f, "],\n  \"busy\": [");
+	sep = "";
+	for (i = 0; i < BUSY_NUM_CLASSES; i++)
+	{
+		struct busy_class *bc = &dev->busy_classes[i];
+		if (bc->waits == 0)
+			continue;
+		fprintf(f, "%s\n    {\"class\": \"%s\", \"waits\": %u, \"usecs\": %llu, \"estimate_usecs\": %u}",
+			sep, bc->name, bc->waits, (unsigned long long)bc->total, bc->estimate);
+		sep = ",";
+	}
+	fprintf(f, "],\n  \"sleep_usecs\": %llu, \"sleeps\": %u, \"polls\": %u",
+		in != 0 ? (unsigned long long)in->sleep_usecs : 0ULL, in != 0 ? in->sleeps : 0, in != 0 ? in->polls : 0);
+}
+
+// Returns 0 when the device is not instrumented
+int get_instrumentation_totals(struct machxo_device *dev, struct machxo_counters *c)
+{
+	struct instrumentation *in = dev->instr;
+	int i, j;
+	memset(c, 0, sizeof *c);
+	if (in == 0)
+		return 0;
+	for (i = 0; i < 256; i++)
+	{
+		struct command_stats *cs = &in->commands[i];
+		c->commands += cs->calls;
+		c->bytes += cs->bytes;
+		c->usecs += cs->usecs;
+		for (j = 0; j < LATENCY_BUCKETS; j++)
+			c->histogram[j] += cs->histogram[j];
+	}
+	c->ioctls = in->ioctls;
+	c->sleep_usecs = in->sleep_usecs;
+	c->polls = in->polls;
+	return 1;
+}
+
+int erase_flash_sections(struct machxo_device *dev, uint32_t sections)
+{
+	DEBUG(fprintf(stderr, "Erase flash sections\n"));
+	if (no_device(dev))
+		return 1; // Debug mode
+	return send_receive(dev, ISC_ERASE, sections, DIRECTION_RECEIVE, 0, 0);
+}
+
+int erase_flash(struct machxo_device *dev)
+{
+	int status;
 	DEBUG(fprintf(stderr, "Erase flash\n"));
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
-	status = send_receive(ISC_ERASE, ERASE_FEATURE_ROW | ERASE_CONFIGURATION | ERASE_USER_FLASH, DIRECTION_RECEIVE, 0, 0);
+	status = send_receive(dev, ISC_ERASE, ERASE_FEATURE_ROW | ERASE_CONFIGURATION | ERASE_USER_FLASH, DIRECTION_RECEIVE, 0, 0);
 	return status;
 }
 
-int enable_offline_configuration()
+int enable_offline_configuration(struct machxo_device *dev)
 {
 	DEBUG(fprintf(stderr, "Enable offline configuration\n"));
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
-	return send_receive(ISC_ENABLE, 0x080000, DIRECTION_RECEIVE, 0, 0); /* TODO: special command for i2c */
+	// The GPMC bridge is user logic, which offline mode would stop
+	if (dev->mode == MODE_GPMC)
+		return enable_transparent_configuration(dev);
+	return send_receive(dev, ISC_ENABLE, 0x080000, DIRECTION_RECEIVE, 0, 0); /* TODO: special command for i2c */
+}
+
+// Configuration access with the user logic left running
+int enable_transparent_configuration(struct machxo_device *dev)
+{
+	DEBUG(fprintf(stderr, "Enable transparent configuration\n"));
+	if (no_device(dev))
+		return 1; // Debug mode
+	return send_receive(dev, ISC_ENABLE_X, 0x080000, DIRECTION_RECEIVE, 0, 0);
+}
+
+int enable_sram_configuration(struct machxo_device *dev)
+{
+	DEBUG(fprintf(stderr, "Enable SRAM configuration\n"));
+	if (no_device(dev))
+		return 1; // Debug mode
+	if (dev->mode == MODE_GPMC)
+	{
+		report(dev, "Loading SRAM would erase the GPMC bridge while it is in use");
+		return 0;
+	}
+	return send_receive(dev, ISC_ENABLE, 0, DIRECTION_RECEIVE, 0, 0);
+}
+
+int erase_sram(struct machxo_device *dev)
+{
+	DEBUG(fprintf(stderr, "Erase SRAM\n"));
+	if (no_device(dev))
+		return 1; // Debug mode
+	return send_receive(dev, ISC_ERASE, ERASE_SRAM, DIRECTION_RECEIVE, 0, 0);
+}
+
+/*
+ * The SRAM burst can not be split into several transactions, so on I2C a
+ * bitstream longer than one message needs an adapter with I2C_FUNC_NOSTART.
+ */
+int check_sram_length(struct machxo_device *dev, int data_len)
+{
+	if (dev->mode == MODE_I2C && data_len > MAX_I2C_MESSAGE && !(dev->i2c_funcs & I2C_FUNC_NOSTART))
+	{
+		report(dev, "The %d byte bitstream is longer than one I2C message (%d bytes), and the adapter "
+		       "does not support I2C_M_NOSTART.  Load it over SPI, or program the flash instead.",
+		       data_len, MAX_I2C_MESSAGE);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Send a whole bitstream to configuration SRAM with one LSC_BITSTREAM_BURST
+ * command.  The device wakes up from it on ISC_DISABLE.
+ */
+int program_sram(struct machxo_device *dev, uint8_t *data, int data_len)
+{
+	DEBUG(fprintf(stderr, "Program SRAM\n"));
+	if (no_device(dev))
+		return 1; // Debug mode
+	if (check_sram_length(dev, data_len) != 1)
+		return 0;
+	return send_receive(dev, LSC_BITSTREAM_BURST, 0, DIRECTION_SEND, data, data_len);
 }
 
-int erase_user_flash()
+int disable_configuration(struct machxo_device *dev)
+{
+	DEBUG(fprintf(stderr, "Disable configuration\n"));
+	if (no_device(dev))
+		return 1; // Debug mode
+	if (send_receive(dev, ISC_DISABLE, 0, DIRECTION_RECEIVE, 0, 0) != 1)
+		return 0;
+	return send_receive(dev, ISC_NOOP, 0xFFFFFF, DIRECTION_RECEIVE, 0, 0);
+}
+
+int is_configured(struct machxo_device *dev)
+{
+	uint8_t buffer[4];
+	DEBUG(fprintf(stderr, "Read DONE status\n"));
+	if (no_device(dev))
+		return 0; // Debug mode
+	if (send_receive(dev, LSC_READ_STATUS, 0, DIRECTION_RECEIVE, buffer, 4) != 1)
+		return 0;
+	return READ_STATUS_DONE(be_4bytes(buffer)) != 0;
+}
+
+int erase_user_flash(struct machxo_device *dev)
 {
 	DEBUG(fprintf(stderr, "Erase user flash\n"));
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
-	return send_receive(LSC_ERASE_TAG, 0, DIRECTION_RECEIVE, 0, 0);
+	return send_receive(dev, LSC_ERASE_TAG, 0, DIRECTION_RECEIVE, 0, 0);
 }
 
-int set_configuration_flash_address(uint16_t page_address, int is_user_flash)
+int set_configuration_flash_address(struct machxo_device *dev, uint16_t page_address, int is_user_flash)
 {
 	uint8_t buffer[4];
 	uint32_t address = page_address;
 	DEBUG(fprintf(stderr, "Set configuration flash address\n"));
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
 	if (is_user_flash)
 		address |= 0x40000000;
 	to_be_4bytes(address, buffer);
-	return send_receive(LSC_WRITE_ADDRESS, 0, DIRECTION_SEND, buffer, 4);
+	dev->flash_page = page_address;
+	dev->flash_ufm = is_user_flash;
+	return send_receive(dev, LSC_WRITE_ADDRESS, 0, DIRECTION_SEND, buffer, 4);
 }
 
-int reset_configuration_flash_address()
+int reset_configuration_flash_address(struct machxo_device *dev)
 {
 	DEBUG("Reset flash address\n");
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
-	return send_receive(LSC_INIT_ADDRESS, 0, DIRECTION_RECEIVE, 0, 0);
+	dev->flash_page = 0;
+	dev->flash_ufm = 0;
+	return send_receive(dev, LSC_INIT_ADDRESS, 0, DIRECTION_RECEIVE, 0, 0);
 }
 
-int program_configuration_flash(uint8_t *data, int data_len)
+int program_configuration_flash(struct machxo_device *dev, uint8_t *data, int data_len)
 {
 	DEBUG(fprintf(stderr, "Program flash\n"));
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
-	return send_receive(LSC_PROG_INCR_NV, 1, DIRECTION_SEND, data, data_len);
+	if (dev->flash_page >= 0)
+		dev->flash_page++;
+	return send_receive(dev, LSC_PROG_INCR_NV, 1, DIRECTION_SEND, data, data_len);
+}
+
+void set_page_program_delay(struct machxo_device *dev, int usecs)
+{
+	dev->page_program_delay = usecs;
+}
+
+/*
+ * Program up to MACHXO2_MAX_BATCH_PAGES pages with a single ioctl.  Each page
+ * is a separate LSC_PROG_INCR_NV command with CS toggled in between.  The
+ * transfer delay is spent before CS is deasserted, which is before the device
+ * starts programming, so the gap is an empty transfer at the start of the
+ * next page instead.
+ */
+static int send_pages(struct machxo_device *dev, uint8_t *data, int num_pages)
+{
+	static uint8_t cmd_buffer[4] = { LSC_PROG_INCR_NV, 0, 0, 1 };
+	struct spi_ioc_transfer *xfer = dev->batch_xfer;
+	struct timespec start;
+	uint32_t ioctls = 0;
+	int status;
+	int i;
+	if (dev->instr != 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ioctls = dev->instr->ioctls;
+	}
+	memset(dev->batch_xfer, 0, (num_pages * 3 - 1) * sizeof dev->batch_xfer[0]);
+	for (i = 0; i < num_pages; i++)
+	{
+		if (i > 0)
+		{
+			xfer->len = 0;
+			xfer->delay_usecs = dev->page_program_delay;
+			xfer++;
+		}
+		xfer[0].tx_buf = (unsigned long)cmd_buffer;
+		xfer[0].len = 4;
+		xfer[1].tx_buf = (unsigned long)(data + i * MACHXO2_PAGE_SIZE);
+		xfer[1].len = MACHXO2_PAGE_SIZE;
+		// Deassert CS between pages, but not after the last one
+		xfer[1].cs_change = i < num_pages - 1;
+		xfer += 2;
+	}
+	status = do_ioctl(dev, SPI_IOC_MESSAGE(num_pages * 3 - 1), dev->batch_xfer);
+	// Counted as one command, moving all of the pages
+	if (dev->instr != 0)
+		count_command(dev, LSC_PROG_INCR_NV, num_pages * MACHXO2_PAGE_SIZE, status, &start, ioctls);
+	if (status < 0)
+		report(dev, "message: %s", strerror(errno));
+	dev->last_command = LSC_PROG_INCR_NV;
+	dev->last_operand = 1;
+	clock_gettime(CLOCK_MONOTONIC, &dev->last_command_time);
+	return status >= 0;
+}
+
+/*
+ * NOOP bytes between batched I2C page writes, so that the bus is busy for
+ * as long as the page before takes to program.  The spacer's own address
+ * byte counts, the address and command of the next page are the margin.
+ * 0 when a single byte is enough, which is above 3 MHz.
+ */
+static int i2c_spacer_bytes(struct machxo_device *dev)
+{
+	double byte_usecs = 9e6 / dev->i2c_speed; // With the ACK bit
+	int n = (int)(dev->page_program_delay / byte_usecs + 0.999) - 1;
+	if (n <= 0)
+		return 0;
+	if (n < 4)
+		n = 4; // A whole ISC_NOOP
+	if (n > I2C_MAX_SPACER)
+		n = I2C_MAX_SPACER;
+	return n;
 }
 
-int program_user_code(uint32_t user_code)
+static int i2c_batch_pages(struct machxo_device *dev)
+{
+	return i2c_spacer_bytes(dev) > 0 ? (I2C_RDWR_IOCTL_MAX_MSGS + 1) / 3 : I2C_RDWR_IOCTL_MAX_MSGS / 2;
+}
+
+/*
+ * Program up to i2c_batch_pages() pages with a single I2C_RDWR.  Each page
+ * is a command and a data message ending in STOP, like send_receive() does
+ * it, followed by a NOOP message as long as the page takes to program.
+ */
+static int send_pages_i2c(struct machxo_device *dev, uint8_t *data, int num_pages)
+{
+	static uint8_t cmd_buffer[4] = { LSC_PROG_INCR_NV, 0, 0, 1 };
+	static uint8_t noop[I2C_MAX_SPACER] = { [0 ... I2C_MAX_SPACER - 1] = ISC_NOOP };
+	struct i2c_msg *msg = dev->i2c_messages;
+	int spacer = i2c_spacer_bytes(dev);
+	struct timespec start;
+	uint32_t ioctls = 0;
+	int status;
+	int i;
+	if (dev->instr != 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ioctls = dev->instr->ioctls;
+	}
+	memset(dev->i2c_messages, 0, sizeof dev->i2c_messages);
+	for (i = 0; i < num_pages; i++)
+	{
+		if (i > 0 && spacer > 0)
+		{
+			msg->addr = dev->i2c_addr;
+			msg->flags = I2C_M_STOP;
+			msg->buf = noop;
+			msg->len = spacer;
+			msg++;
+		}
+		msg[0].addr = dev->i2c_addr;
+		msg[0].buf = cmd_buffer;
+		msg[0].len = 4;
+		msg[1].addr = dev->i2c_addr;
+		msg[1].flags = I2C_M_STOP;
+		msg[1].buf = data + i * MACHXO2_PAGE_SIZE;
+		msg[1].len = MACHXO2_PAGE_SIZE;
+		msg += 2;
+	}
+	dev->i2c_packets.msgs = dev->i2c_messages;
+	dev->i2c_packets.nmsgs = msg - dev->i2c_messages;
+	status = do_ioctl(dev, I2C_RDWR, &dev->i2c_packets);
+	if (dev->instr != 0)
+		count_command(dev, LSC_PROG_INCR_NV, num_pages * MACHXO2_PAGE_SIZE, status, &start, ioctls);
+	if (status < 0)
+		report(dev, "message: %s", strerror(errno));
+	dev->last_command = LSC_PROG_INCR_NV;
+	dev->last_operand = 1;
+	clock_gettime(CLOCK_MONOTONIC, &dev->last_command_time);
+	return status >= 0;
+}
+
+static const char *flash_name(struct machxo_device *dev)
+{
+	return dev->flash_ufm ? "UFM" : "configuration flash";
+}
+
+/*
+ * Read back 'num_pages' pages from 'first' and report the first one that
+ * differs from 'data'.  The address is left after the last page.
+ */
+static int find_failed_page(struct machxo_device *dev, uint8_t *data, int first, int num_pages)
+{
+	uint8_t page[MACHXO2_PAGE_SIZE];
+	int i;
+	if (set_configuration_flash_address(dev, first, dev->flash_ufm) != 1)
+		return 0;
+	for (i = 0; i < num_pages; i++)
+	{
+		if (read_flash_page(dev, page) != 1)
+			return 0;
+		if (memcmp(page, data + i * MACHXO2_PAGE_SIZE, MACHXO2_PAGE_SIZE) != 0)
+		{
+			report(dev, "Page %d of the %s did not program", first + i, flash_name(dev));
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Wait for a batch of pages from 'first' to finish and check it.  A page
+ * command the device ignored while busy sets no FAIL flag, but moves the
+ * pages after it down one, so reading back the last page of the batch
+ * shows it.  With the address not known, verify has to find it.
+ */
+static int check_batch(struct machxo_device *dev, uint8_t *data, int first, int num_pages)
+{
+	uint8_t page[MACHXO2_PAGE_SIZE];
+	int last = num_pages - 1;
+	if (wait_not_busy(dev) != 1)
+	{
+		if (first >= 0)
+		{
+			find_failed_page(dev, data, first, num_pages);
+			dev->flash_page = -1;
+		}
+		return 0;
+	}
+	if (first < 0)
+		return 1;
+	if (set_configuration_flash_address(dev, first + last, dev->flash_ufm) != 1 || read_flash_page(dev, page) != 1)
+		return 0;
+	if (memcmp(page, data + last * MACHXO2_PAGE_SIZE, MACHXO2_PAGE_SIZE) != 0)
+	{
+		if (find_failed_page(dev, data, first, num_pages) == 1)
+			report(dev, "Pages %d to %d of the %s did not program", first, first + last, flash_name(dev));
+		dev->flash_page = -1;
+		return 0;
+	}
+	return 1;
+}
+
+int program_configuration_flash_pages(struct machxo_device *dev, uint8_t *data, int data_len, int batch_pages)
+{
+	int num_pages = data_len / MACHXO2_PAGE_SIZE;
+	int i, n, first;
+	DEBUG(fprintf(stderr, "Program flash pages\n"));
+	if (no_device(dev))
+		return 1; // Debug mode
+	if (batch_pages > MACHXO2_MAX_BATCH_PAGES)
+		batch_pages = MACHXO2_MAX_BATCH_PAGES;
+	// A batch is one SPI_IOC_MESSAGE, which spidev limits to its buffer size
+	if (dev->mode == MODE_SPI && batch_pages > dev->max_transfer / (4 + MACHXO2_PAGE_SIZE))
+		batch_pages = dev->max_transfer / (4 + MACHXO2_PAGE_SIZE);
+	if (i2c_can_batch(dev) && batch_pages > 1)
+	{
+		if (batch_pages > i2c_batch_pages(dev))
+			batch_pages = i2c_batch_pages(dev);
+	}
+	else if (dev->mode != MODE_SPI || batch_pages <= 1)
+	{
+		// One command and one busy wait per page
+		for (i = 0; i < num_pages; i++)
+		{
+			first = dev->flash_page;
+			if (program_configuration_flash(dev, data + i * MACHXO2_PAGE_SIZE, MACHXO2_PAGE_SIZE) != 1)
+				return 0;
+			if (wait_not_busy(dev) != 1)
+			{
+				if (first >= 0)
+					report(dev, "Page %d of the %s did not program", first, flash_name(dev));
+				return 0;
+			}
+		}
+		return 1;
+	}
+	for (i = 0; i < num_pages; i += n)
+	{
+		n = num_pages - i;
+		if (n > batch_pages)
+			n = batch_pages;
+		first = dev->flash_page;
+		if ((dev->mode == MODE_SPI ? send_pages(dev, data + i * MACHXO2_PAGE_SIZE, n) :
+		     send_pages_i2c(dev, data + i * MACHXO2_PAGE_SIZE, n)) != 1 ||
+		    check_batch(dev, data + i * MACHXO2_PAGE_SIZE, first, n) != 1)
+			return 0;
+		if (first >= 0)
+			dev->flash_page = first + n;
+	}
+	return 1;
+}
+
+int program_user_code(struct machxo_device *dev, uint32_t user_code)
 {
 	uint8_t buffer[4];
 	DEBUG(fprintf(stderr, "Program user code\n"));
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
 	to_be_4bytes(user_code, buffer);
-	return send_receive(ISC_PROGRAM_USERCODE, 0, DIRECTION_SEND, buffer, 4);
+	return send_receive(dev, ISC_PROGRAM_USERCODE, 0, DIRECTION_SEND, buffer, 4);
+}
+
+int read_user_code(struct machxo_device *dev, uint32_t *user_code)
+{
+	uint8_t buffer[4];
+	int status;
+	DEBUG(fprintf(stderr, "Read user code\n"));
+	if (no_device(dev))
+		return 0; // Debug mode
+	status = send_receive(dev, USERCODE, 0, DIRECTION_RECEIVE, buffer, 4);
+	if (status != 1)
+		return status;
+	*user_code = be_4bytes(buffer);
+	return 1;
 }
 
-int verify_user_code(uint32_t expected_user_code)
+int verify_user_code(struct machxo_device *dev, uint32_t expected_user_code)
 {
 	uint8_t buffer[4];
 	int status;
 	uint32_t user_code;
 	DEBUG(fprintf(stderr, "Verify user code\n"));
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
-	status = send_receive(USERCODE, 0, DIRECTION_RECEIVE, buffer, 4);
+	status = send_receive(dev, USERCODE, 0, DIRECTION_RECEIVE, buffer, 4);
 	if (status != 1)
 		return status;
 	user_code = be_4bytes(buffer);
 	if (user_code != expected_user_code)
 	{
-		fprintf(stderr, "Found %08x Expected %08x\n", user_code, expected_user_code);
+		report(dev, "Found %08x Expected %08x", user_code, expected_user_code);
 		return 0;
 	}
 	return 1;
 }
 
-int verify_configuration_flash(uint8_t *expected_data, int data_len)
+int read_flash_page(struct machxo_device *dev, uint8_t *data)
+{
+	DEBUG(fprintf(stderr, "Read flash page\n"));
+	if (no_device(dev))
+		return 0; // Debug mode
+	if (dev->flash_page >= 0)
+		dev->flash_page++;
+	return send_receive(dev, LSC_READ_INCR_NV, dev->mode != MODE_I2C ? 0x100001 : 1, DIRECTION_RECEIVE, data, MACHXO2_PAGE_SIZE);
+}
+
+void set_verify_burst(struct machxo_device *dev, int pages)
+{
+	dev->verify_burst = pages;
+}
+
+/*
+ * Pages per LSC_READ_INCR_NV when verifying.  On SPI a burst is one ioctl,
+ * with the command and the extra page in the spidev buffer too: CS is only
+ * kept asserted into a further message by cs_change, which is a hint that
+ * not every controller takes, and a dropped CS ends the read partway.
+ */
+static int verify_burst_pages(struct machxo_device *dev)
+{
+	int burst;
+	if (dev->mode == MODE_SPI)
+	{
+		burst = (dev->max_transfer - 4) / MACHXO2_PAGE_SIZE - 1;
+		if (burst > MAX_READ_PAGES)
+			burst = MAX_READ_PAGES;
+	}
+	else if (dev->mode != MODE_I2C)
+		burst = MAX_READ_PAGES;
+	else if (dev->i2c_funcs & I2C_FUNC_NOSTART)
+	{
+		// The two lead pages cost less the more pages share them
+		burst = (MAX_I2C_TRANSFER - 2*MACHXO2_PAGE_SIZE) / (MACHXO2_PAGE_SIZE + 4);
+		if (burst > MAX_READ_PAGES)
+			burst = MAX_READ_PAGES;
+	}
+	else
+		burst = (MAX_I2C_MESSAGE - 2*MACHXO2_PAGE_SIZE) / (MACHXO2_PAGE_SIZE + 4);
+	if (dev->verify_burst > 0 && dev->verify_burst < burst)
+		burst = dev->verify_burst;
+	return burst;
+}
+
+// Bytes read for 'num_pages' pages, with the dummy lead bytes and I2C padding
+static int verify_read_len(struct machxo_device *dev, int num_pages)
+{
+	if (num_pages == 1)
+		return MACHXO2_PAGE_SIZE;
+	if (dev->mode != MODE_I2C)
+		return (num_pages + 1) * MACHXO2_PAGE_SIZE; // One extra page
+	return 2*MACHXO2_PAGE_SIZE + num_pages * (MACHXO2_PAGE_SIZE + 4);
+}
+
+// Size of a buffer for set_verify_buffer() that no verify outgrows
+int verify_buffer_size(struct machxo_device *dev)
+{
+	return verify_read_len(dev, verify_burst_pages(dev));
+}
+
+/*
+ * Read back into 'buffer' when verifying, instead of a buffer allocated on
+ * first use.  The caller keeps it until the device is closed.
+ */
+void set_verify_buffer(struct machxo_device *dev, uint8_t *buffer, int size)
+{
+	if (dev->verify_buffer_owned)
+		free(dev->verify_buffer);
+	dev->verify_buffer = buffer;
+	dev->verify_buffer_size = size;
+	dev->verify_buffer_owned = 0;
+}
+
+static uint8_t *get_verify_buffer(struct machxo_device *dev, int size)
+{
+	uint8_t *buffer;
+	if (size <= dev->verify_buffer_size)
+		return dev->verify_buffer;
+	size = (size + 4095) & ~4095;
+	if (posix_memalign((void **)&buffer, 4096, size) != 0)
+	{
+		report(dev, "Malloc failed");
+		return 0;
+	}
+	set_verify_buffer(dev, buffer, size);
+	dev->verify_buffer_owned = 1;
+	return dev->verify_buffer;
+}
+
+static void report_mismatch(struct machxo_device *dev, uint8_t *found, uint8_t *expected, int i, int offset, int read_idx)
+{
+	report(dev, "Verify failed at offset %d (%d) : found = %02x expected = %02x",
+	       offset + i, read_idx + i, found[i], expected[i]);
+}
+
+/*
+ * Read 'num_pages' pages with a single LSC_READ_INCR_NV command and compare
+ * them with 'expected_data'.  'offset' is only used in messages.
+ */
+static int verify_pages(struct machxo_device *dev, uint8_t *expected_data, int num_pages, int offset)
 {
 	uint8_t *data;
+	int data_len = num_pages * MACHXO2_PAGE_SIZE;
 	int read_len;
 	int status;
 	uint32_t op;
-	int read_idx, data_idx;
-	DEBUG(fprintf(stderr, "Verify flash\n"));
-	if (dev_fd == -1)
-		return 1; // Debug mode
-	if (data_len > MACHXO2_PAGE_SIZE)
+	int read_idx;
+	int i;
+	read_len = verify_read_len(dev, num_pages);
+	if (num_pages > 1)
 	{
-		if (mode == MODE_SPI)
-		{
-			read_len = data_len + MACHXO2_PAGE_SIZE; // One extra page
-			read_idx = MACHXO2_PAGE_SIZE;
-		}
-		else
-		{
-			read_len = 2*MACHXO2_PAGE_SIZE + (data_len / MACHXO2_PAGE_SIZE) * 4 + data_len;
-			read_idx = 2*MACHXO2_PAGE_SIZE;
-		}
-		op = data_len / MACHXO2_PAGE_SIZE + 1;
+		read_idx = dev->mode != MODE_I2C ? MACHXO2_PAGE_SIZE : 2*MACHXO2_PAGE_SIZE;
+		op = num_pages + 1;
 	}
 	else
 	{
-		read_len = data_len;
 		op = 1;
 		read_idx = 0;
 	}
-	if (mode != MODE_I2C)
+	if (dev->mode != MODE_I2C)
 		op |= 0x100000;
-	data = (uint8_t*)malloc(read_len);
+	data = get_verify_buffer(dev, read_len);
 	if (data == 0)
-	{
-		fprintf(stderr, "Malloc failed\n");
 		return 0;
-	}
-	status = send_receive(LSC_READ_INCR_NV, op, DIRECTION_RECEIVE, data, read_len);
+	status = send_receive(dev, LSC_READ_INCR_NV, op, DIRECTION_RECEIVE, data, read_len);
 	if (status != 1)
 		return status;
-	data_idx = 0;
-	while (data_idx < data_len)
+	if (dev->mode != MODE_I2C || num_pages == 1)
+	{
+		i = first_mismatch(data + read_idx, expected_data, data_len);
+		if (i == data_len)
+			return 1;
+		report_mismatch(dev, data + read_idx, expected_data, i, offset, read_idx);
+		return 0;
+	}
+	// I2C pads every page with 4 bytes
+	for (i = 0; i < num_pages; i++)
 	{
-		if (data[read_idx] != expected_data[data_idx])
+		uint8_t *found = data + read_idx + i * (MACHXO2_PAGE_SIZE + 4);
+		uint8_t *expected = expected_data + i * MACHXO2_PAGE_SIZE;
+		int j = first_mismatch(found, expected, MACHXO2_PAGE_SIZE);
+		if (j != MACHXO2_PAGE_SIZE)
 		{
-			fprintf(stderr, "Verify failed at offset %d (%d) : found = %02x expected = %02x\n",
-				data_idx, read_idx, data[read_idx], expected_data[data_idx]);
-			return 0; // differs
+			report_mismatch(dev, found, expected, j, offset + i * MACHXO2_PAGE_SIZE, found - data);
+			return 0;
 		}
-		data_idx++;
-		read_idx++;
-		if (((data_idx % MACHXO2_PAGE_SIZE) == 0) && (mode == MODE_I2C))
-			read_idx += 4;
 	}
 	return 1;
 }
 
-int program_feature_row(uint8_t *feature_row)
+/*
+ * Read 'num_pages' pages over I2C as one page reads in a single I2C_RDWR.
+ * Each page costs two address bytes and a command instead of 4 bytes of
+ * padding, but there are no lead pages, which is less for short reads.
+ */
+static int verify_pages_packed(struct machxo_device *dev, uint8_t *expected_data, int num_pages, int offset)
+{
+	static uint8_t cmd_buffer[4] = { LSC_READ_INCR_NV, 0, 0, 1 };
+	int data_len = num_pages * MACHXO2_PAGE_SIZE;
+	struct timespec start;
+	uint32_t ioctls = 0;
+	uint8_t *data;
+	int status;
+	int i;
+	data = get_verify_buffer(dev, data_len);
+	if (data == 0)
+		return 0;
+	if (dev->instr != 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ioctls = dev->instr->ioctls;
+	}
+	memset(dev->i2c_messages, 0, sizeof dev->i2c_messages);
+	for (i = 0; i < num_pages; i++)
+	{
+		dev->i2c_messages[2*i].addr = dev->i2c_addr;
+		dev->i2c_messages[2*i].buf = cmd_buffer;
+		dev->i2c_messages[2*i].len = 4;
+		dev->i2c_messages[2*i + 1].addr = dev->i2c_addr;
+		dev->i2c_messages[2*i + 1].flags = I2C_M_RD | I2C_M_STOP;
+		dev->i2c_messages[2*i + 1].buf = data + i * MACHXO2_PAGE_SIZE;
+		dev->i2c_messages[2*i + 1].len = MACHXO2_PAGE_SIZE;
+	}
+	dev->i2c_packets.msgs = dev->i2c_messages;
+	dev->i2c_packets.nmsgs = 2 * num_pages;
+	status = do_ioctl(dev, I2C_RDWR, &dev->i2c_packets);
+	if (dev->instr != 0)
+		count_command(dev, LSC_READ_INCR_NV, data_len, status, &start, ioctls);
+	if (status < 0)
+	{
+		report(dev, "message: %s", strerror(errno));
+		return 0;
+	}
+	i = first_mismatch(data, expected_data, data_len);
+	if (i == data_len)
+		return 1;
+	report_mismatch(dev, data, expected_data, i, offset, 0);
+	return 0;
+}
+
+/*
+ * Verify 'data_len' bytes from the current flash address.  The data is read
+ * in bursts as long as the bus allows (SPI bursts continue across several
+ * spidev messages) into one buffer that is reused between calls.
+ */
+int verify_configuration_flash(struct machxo_device *dev, uint8_t *expected_data, int data_len)
+{
+	int num_pages = data_len / MACHXO2_PAGE_SIZE;
+	int burst, i, n;
+	int status;
+	DEBUG(fprintf(stderr, "Verify flash\n"));
+	if (no_device(dev))
+		return 1; // Debug mode
+	if (data_len <= MACHXO2_PAGE_SIZE)
+		return verify_pages(dev, expected_data, 1, 0);
+	burst = verify_burst_pages(dev);
+	for (i = 0; i < num_pages; i += n)
+	{
+		n = num_pages - i;
+		if (n > burst)
+			n = burst;
+		if (i2c_can_batch(dev) && n < I2C_PACKED_READ_PAGES)
+			status = verify_pages_packed(dev, expected_data + i * MACHXO2_PAGE_SIZE, n, i * MACHXO2_PAGE_SIZE);
+		else
+			status = verify_pages(dev, expected_data + i * MACHXO2_PAGE_SIZE, n, i * MACHXO2_PAGE_SIZE);
+		if (status != 1)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Clock steps tried by tune_spi_speed().  spidev rounds down to what the
+ * controller can divide its clock to, so neighbouring steps may end up the
+ * same on some boards.
+ */
+static const uint32_t spi_speed_steps[] = {
+	1000000, 2000000, 5000000, 10000000, 15000000, 20000000,
+	25000000, 30000000, 40000000, 50000000, 66000000
+};
+#define NUM_SPI_SPEED_STEPS (int)(sizeof spi_speed_steps / sizeof spi_speed_steps[0])
+
+static void ignore_message(void *arg, const char *text)
+{
+}
+
+// Repeated IDCODE reads, and reads of the first pages compared to what was read slowly
+static int spi_link_ok(struct machxo_device *dev, uint32_t expected_id, uint8_t *expected_pages)
+{
+	uint32_t device_id;
+	int i;
+	for (i = 0; i < TUNE_ID_READS; i++)
+		if (read_device_id(dev, &device_id) != 1 || device_id != expected_id)
+			return 0;
+	for (i = 0; i < TUNE_PAGE_PASSES; i++)
+		if (reset_configuration_flash_address(dev) != 1 ||
+		    verify_configuration_flash(dev, expected_pages, TUNE_PAGES * MACHXO2_PAGE_SIZE) != 1)
+			return 0;
+	return 1;
+}
+
+/*
+ * Step the SPI clock up to 'max_hz' until the link fails, then settle one
+ * step below the fastest clock that passed.  The step of margin is kept
+ * when 'max_hz' is reached without a failure too, as a link that passes a
+ * few reads can still be marginal, and the clock is cached for the board.
+ * The device is read in transparent mode, so the running design is left
+ * alone.  Returns the clock in use afterwards, or 0 if the link does not
+ * work even at the slowest step.
+ */
+uint32_t tune_spi_speed(struct machxo_device *dev, uint32_t max_hz)
+{
+	machxo_message_fn message = dev->message;
+	void *message_arg = dev->message_arg;
+	uint8_t pages[TUNE_PAGES * MACHXO2_PAGE_SIZE];
+	uint32_t device_id;
+	int fastest = -1;
+	int i;
+	DEBUG(fprintf(stderr, "Tune SPI speed\n"));
+	if (no_device(dev) || dev->mode != MODE_SPI)
+		return dev->spi_speed;
+	if (set_spi_clock(dev, dev->spi_mode, spi_speed_steps[0]) != 1 ||
+	    read_device_id(dev, &device_id) != 1 || device_id == 0 || device_id == 0xFFFFFFFF)
+	{
+		report(dev, "No device answering at %u Hz", spi_speed_steps[0]);
+		return 0;
+	}
+	if (enable_transparent_configuration(dev) != 1 || wait_not_busy(dev) != 1 ||
+	    reset_configuration_flash_address(dev) != 1)
+		return 0;
+	for (i = 0; i < TUNE_PAGES; i++)
+		if (read_flash_page(dev, pages + i * MACHXO2_PAGE_SIZE) != 1)
+		{
+			disable_configuration(dev);
+			return 0;
+		}
+	// Mismatches are expected on the way, and are not errors
+	set_message_handler(dev, ignore_message, 0);
+	for (i = 0; i < NUM_SPI_SPEED_STEPS && spi_speed_steps[i] <= max_hz; i++)
+	{
+		if (set_spi_clock(dev, dev->spi_mode, spi_speed_steps[i]) != 1 || !spi_link_ok(dev, device_id, pages))
+			break;
+		fastest = i;
+	}
+	set_message_handler(dev, message, message_arg);
+	if (fastest > 0)
+		fastest--;
+	set_spi_clock(dev, dev->spi_mode, spi_speed_steps[fastest >= 0 ? fastest : 0]);
+	disable_configuration(dev);
+	if (fastest < 0)
+	{
+		report(dev, "SPI link fails even at %u Hz", spi_speed_steps[0]);
+		return 0;
+	}
+	return dev->spi_speed;
+}
+
+int program_feature_row(struct machxo_device *dev, uint8_t *feature_row)
 {
 	DEBUG(fprintf(stderr, "Program feature row\n"));
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
-	return send_receive(LSC_PROG_FEATURE, 0, DIRECTION_SEND, feature_row, 8);
+	return send_receive(dev, LSC_PROG_FEATURE, 0, DIRECTION_SEND, feature_row, 8);
 }
 
-int verify_feature_row(uint8_t *expected_feature_row)
+int verify_feature_row(struct machxo_device *dev, uint8_t *expected_feature_row)
 {
 	uint8_t buffer[8];
 	int i;
 	int status;
 	DEBUG(fprintf(stderr, "Verify feature row\n"));
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
-	status = send_receive(LSC_READ_FEATURE, 0, DIRECTION_RECEIVE, buffer, 8);
+	status = send_receive(dev, LSC_READ_FEATURE, 0, DIRECTION_RECEIVE, buffer, 8);
 	if (status != 1)
 		return status;
 	for (i = 0; i < 8; i++)
@@ -411,39 +1664,45 @@ int verify_feature_row(uint8_t *expected_feature_row)
 	return 1;
 }
 
-int program_feature_bits(uint8_t *feature_bits)
+int program_feature_bits(struct machxo_device *dev, uint8_t *feature_bits)
 {
 	DEBUG(fprintf(stderr, "Program feature bits\n"));
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
-	return send_receive(LSC_PROG_FEABITS, 0, DIRECTION_SEND, feature_bits, 2);
+	return send_receive(dev, LSC_PROG_FEABITS, 0, DIRECTION_SEND, feature_bits, 2);
 }
 
-int verify_feature_bits(uint8_t *expected_feature_bits)
+int verify_feature_bits(struct machxo_device *dev, uint8_t *expected_feature_bits)
 {
 	uint8_t buffer[2];
 	int status;
 	DEBUG(fprintf(stderr, "Verify feature bits\n"));
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
-	status = send_receive(LSC_READ_FEABITS, 0, DIRECTION_RECEIVE, buffer, 2);
+	status = send_receive(dev, LSC_READ_FEABITS, 0, DIRECTION_RECEIVE, buffer, 2);
 	if (status != 1)
 		return status;
 	return buffer[0] == expected_feature_bits[0] && buffer[1] == expected_feature_bits[1];
 }
 
-int program_done()
+int program_done(struct machxo_device *dev)
 {
 	DEBUG(fprintf(stderr, "Program DONE\n"));
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
-	return send_receive(ISC_PROGRAM_DONE, 0, DIRECTION_RECEIVE, 0, 0);
+	return send_receive(dev, ISC_PROGRAM_DONE, 0, DIRECTION_RECEIVE, 0, 0);
+}
+
+// The GPMC bridge is part of the design that a refresh replaces
+int bus_survives_refresh(struct machxo_device *dev)
+{
+	return dev->mode != MODE_GPMC;
 }
 
-int refresh()
+int refresh(struct machxo_device *dev)
 {
 	DEBUG(fprintf(stderr, "Refresh device\n"));
-	if (dev_fd == -1)
+	if (no_device(dev))
 		return 1; // Debug mode
-	return send_receive(LSC_REFRESH, 0, DIRECTION_RECEIVE, 0, 0);
+	return send_receive(dev, LSC_REFRESH, 0, DIRECTION_RECEIVE, 0, 0);
 }
@@ -7,15 +7,18 @@
 #ifndef _COMMANDS_H
 #define _COMMANDS_H 1
 #include <stdint.h>
+#include <stdio.h>
 
 #define IDCODE_PUB 0xE0
 #define ISC_ENABLE_X 0x74
 #define ISC_ENABLE 0xC6
 #define LSC_CHECK_BUSY 0xF0
 #define LSC_READ_STATUS 0x3C
+# define READ_STATUS_DONE(x) ((x) & 0x00000100)
 # define READ_STATUS_BUSY(x) ((x) & 0x00001000)
 # define READ_STATUS_FAIL(x) ((x) & 0x00002000)
 #define ISC_ERASE 0x0E
+# define ERASE_SRAM 0x00010000
 # define ERASE_FEATURE_ROW 0x00020000
 # define ERASE_CONFIGURATION 0x00040000
 # define ERASE_USER_FLASH 0x00080000
@@ -39,6 +42,7 @@
 #define ISC_DISABLE 0x26 
 #define ISC_NOOP 0xFF
 #define LSC_REFRESH 0x79
+#define LSC_BITSTREAM_BURST 0x7A
 #define ISC_PROGRAM_SECURITY 0xCE
 #define ISC_PROGRAM_SECPLUS 0xCF
 #define UIDCODE_PUB 0x19
@@ -47,29 +51,115 @@
 #define DIRECTION_RECEIVE 1
 
 #define DEFAULT_SPI_DEV "/dev/spidev2.0"
+#define SIM_DEV "sim"
 
 #define MACHXO2_PAGE_SIZE 16
+#define MACHXO2_MAX_BATCH_PAGES 128
+#define MAX_SPI_TRANSFER (1024*1024) // Longer than the spidev buffer, sent as several messages
+#define MAX_I2C_MESSAGE 8192 // i2c-dev limit per message
+#define MAX_I2C_TRANSFER (MAX_I2C_MESSAGE * 40) // Continued with I2C_M_NOSTART
+#define MAX_READ_PAGES 4095
+#define SPIDEV_BUFSIZ "/sys/module/spidev/parameters/bufsiz"
+#define MACHXO2_PAGE_PROGRAM_USECS 200
+#define MACHXO2_PAGE_GAP_USECS 250	// Between batched pages, the typical page time and 25% margin
+#define BUSY_PAGE 0
+#define BUSY_ERASE 1
+#define BUSY_ERASE_UFM 2
+#define BUSY_ERASE_SRAM 3
+#define BUSY_FEATURE 4
+#define BUSY_DONE 5
+#define BUSY_REFRESH 6
+#define BUSY_OTHER 7
+#define BUSY_NUM_CLASSES 8
+
 #define MODE_SPI 0
 #define MODE_I2C 1
+#define MODE_GPMC 2	// Frames as on SPI, through the bridge in gpmc.h
+
+#define DEFAULT_SPI_SPEED 5000000
+#define DEFAULT_I2C_SPEED 400000
+#define I2C_MAX_SPACER 128	// NOOP bytes between batched I2C page writes, enough for 3.4 MHz
+/*
+ * Below this many pages an I2C read is cheaper as one page reads packed in
+ * one I2C_RDWR (22 bus bytes a page) than as one read with two lead pages
+ * and 4 bytes padding a page (38 + 20 per page).  At most 21 fit.
+ */
+#define I2C_PACKED_READ_PAGES 19
+#define MAX_SPI_SPEED 66000000	// Top of the steps tried by tune_spi_speed()
+// Link checks at each step of tune_spi_speed()
+#define TUNE_ID_READS 32
+#define TUNE_PAGES 64
+#define TUNE_PAGE_PASSES 4
+
+// Command latency histogram: bucket i counts latencies below 2^i usecs, the last one the rest
+#define LATENCY_BUCKETS 16
+
+// Instrumentation summed over all commands, see set_instrumentation()
+struct machxo_counters {
+	uint32_t commands;
+	uint32_t ioctls;
+	uint64_t bytes;
+	uint64_t usecs;			// In ioctls
+	uint32_t histogram[LATENCY_BUCKETS];
+	uint64_t sleep_usecs;		// In wait_not_busy()
+	uint32_t polls;
+};
+
+struct machxo_device;
+
+typedef void (*machxo_message_fn)(void *arg, const char *text);
 
-int open_device(char *dev_name, int mode, int addr);
-int check_device_id_quick();
-int check_device_id(uint32_t expected_id);
-int enable_offline_configuration();
-int read_status_register();
-int wait_not_busy();
-int erase_flash();
-int set_configuration_flash_address(uint16_t page_address, int is_user_flash);
-int reset_configuration_flash_address();
-int program_configuration_flash(uint8_t *data, int data_len);
-int program_user_code(uint32_t user_code);
-int verify_user_code(uint32_t expected_user_code);
-int verify_configuration_flash(uint8_t *expected_data, int data_len);
-int program_feature_row(uint8_t *feature_row);
-int verify_feature_row(uint8_t *expected_feature_row);
-int program_feature_bits(uint8_t *feature_bits);
-int verify_feature_bits(uint8_t *expected_feature_bits);
-int program_done();
-int refresh();
+struct machxo_device *open_device(char *dev_name, int mode, int addr);
+int device_present(struct machxo_device *dev);
+int set_spi_clock(struct machxo_device *dev, int spi_mode, uint32_t speed_hz);
+uint32_t get_spi_speed(struct machxo_device *dev);
+void set_i2c_speed(struct machxo_device *dev, uint32_t speed_hz);
+uint32_t tune_spi_speed(struct machxo_device *dev, uint32_t max_hz);
+const char *device_name(struct machxo_device *dev);
+void set_message_handler(struct machxo_device *dev, machxo_message_fn message, void *arg);
+void close_device(struct machxo_device *dev);
+int send_command(struct machxo_device *dev, const uint8_t *cmd, int direction, uint8_t *data, int data_len);
+int check_device_id_quick(struct machxo_device *dev);
+int read_device_id(struct machxo_device *dev, uint32_t *device_id);
+int check_device_id(struct machxo_device *dev, uint32_t expected_id);
+int enable_offline_configuration(struct machxo_device *dev);
+int enable_transparent_configuration(struct machxo_device *dev);
+int enable_sram_configuration(struct machxo_device *dev);
+int disable_configuration(struct machxo_device *dev);
+int is_configured(struct machxo_device *dev);
+int read_status_register(struct machxo_device *dev);
+int wait_not_busy(struct machxo_device *dev);
+void set_adaptive_polling(struct machxo_device *dev, int enable);
+void print_busy_statistics(struct machxo_device *dev);
+void set_instrumentation(struct machxo_device *dev, int enable);
+void print_instrumentation(struct machxo_device *dev);
+void write_instrumentation_json(struct machxo_device *dev, FILE *f);
+int get_instrumentation_totals(struct machxo_device *dev, struct machxo_counters *c);
+int erase_flash(struct machxo_device *dev);
+int erase_flash_sections(struct machxo_device *dev, uint32_t sections);
+int erase_user_flash(struct machxo_device *dev);
+int erase_sram(struct machxo_device *dev);
+int check_sram_length(struct machxo_device *dev, int data_len);
+int program_sram(struct machxo_device *dev, uint8_t *data, int data_len);
+int set_configuration_flash_address(struct machxo_device *dev, uint16_t page_address, int is_user_flash);
+int reset_configuration_flash_address(struct machxo_device *dev);
+int program_configuration_flash(struct machxo_device *dev, uint8_t *data, int data_len);
+int program_configuration_flash_pages(struct machxo_device *dev, uint8_t *data, int data_len, int batch_pages);
+void set_page_program_delay(struct machxo_device *dev, int usecs);
+int program_user_code(struct machxo_device *dev, uint32_t user_code);
+int verify_user_code(struct machxo_device *dev, uint32_t expected_user_code);
+int read_user_code(struct machxo_device *dev, uint32_t *user_code);
+int read_flash_page(struct machxo_device *dev, uint8_t *data);
+int verify_configuration_flash(struct machxo_device *dev, uint8_t *expected_data, int data_len);
+void set_verify_burst(struct machxo_device *dev, int pages);
+int verify_buffer_size(struct machxo_device *dev);
+void set_verify_buffer(struct machxo_device *dev, uint8_t *buffer, int size);
+int program_feature_row(struct machxo_device *dev, uint8_t *feature_row);
+int verify_feature_row(struct machxo_device *dev, uint8_t *expected_feature_row);
+int program_feature_bits(struct machxo_device *dev, uint8_t *feature_bits);
+int verify_feature_bits(struct machxo_device *dev, uint8_t *expected_feature_bits);
+int program_done(struct machxo_device *dev);
+int bus_survives_refresh(struct machxo_device *dev);
+int refresh(struct machxo_device *dev);
 
 #endif
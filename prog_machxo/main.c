@@ -4,214 +4,644 @@
  * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
  */
 
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/resource.h>
 #include "machxo.h"
-#include "jedec.h"
+#include "bitstream.h"
+#include "cache.h"
+#include "daemon.h"
+#include "gpmc.h"
+#include "image.h"
+#include "jtag.h"
+#include "swd.h"
+#include "tpiu.h"
+#include "trace.h"
+#include "kernels.h"
+#include "program.h"
 
-#define DO_ERASE 1
-#define DO_FLASH 2
-#define DO_VERIFY 4
+#define STREAM_BYTES (MACHXO2_MAX_BATCH_PAGES * MACHXO2_PAGE_SIZE)
 
-static int all_zero(uint8_t *data, int data_len)
+// Bus bytes of a page program command and data, and of a LSC_WRITE_ADDRESS
+#define PAGE_PROGRAM_BUS_BYTES (4 + MACHXO2_PAGE_SIZE)
+#define ADDRESS_BUS_BYTES (4 + 4)
+// Extra bus bytes for a new LSC_READ_INCR_NV: command and dummy lead bytes
+#define READ_START_BUS_BYTES (4 + 16)
+
+#define TARGET_PASS 0
+#define TARGET_SKIPPED 1
+#define TARGET_FAIL 2
+
+#define JOB_WORK 0
+#define JOB_UFM 1
+#define JOB_SRAM 2
+
+static int page_program_delay = MACHXO2_PAGE_GAP_USECS;
+static int verify_burst = 0;
+static int adaptive_polling = 1;
+static int spi_mode = 0;
+static uint32_t spi_speed = DEFAULT_SPI_SPEED;
+static uint32_t i2c_speed = 0;	// 0 for what the adapter tells
+static uint32_t tune_max_speed = 0;	// 0 for no tuning
+static char *speed_cache_dir = 0;
+static int show_timing = 0;
+static char *json_file = 0;
+static int fleet = 0;
+static struct machxo_options options;
+
+// One device being programmed, with its own copy of the options for the callbacks
+struct target {
+	char *name;
+	struct machxo_device *dev;
+	struct machxo_options options;
+	struct machxo_session session;
+	int status;
+	double elapsed;
+	char *json;		// Instrumentation, kept when the device is closed
+	size_t json_len;
+};
+
+/*
+ * What to do to every target.  The image and bitstream are read only while
+ * the targets are worked on, so all workers share them.
+ */
+struct job {
+	int kind;
+	struct machxo_image *image;
+	uint8_t *bitstream;
+	int bitstream_len;
+};
+
+struct fleet {
+	struct target *targets;
+	int num_targets;
+	int next;		// Next target for a worker to take
+	pthread_mutex_t lock;
+	struct job *job;
+	int mode;
+	int i2c_addr;
+};
+
+static double now()
 {
-	int i;
-	for (i = 0; i < data_len; i++)
-		if (data[i] != 0)
-			return 0;
-	return 1;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-static void abort_and_clean_up(char *message)
+// Messages name the device when several are worked on at once
+static void print_message(void *arg, const char *text)
 {
-	erase_flash();
-	wait_not_busy();
-	refresh();
-	if (message != 0)
-		fprintf(stderr, "%s\n", message);
-	fprintf(stderr, "Aborting. Flash is erased.\n");
-	exit(1);
+	struct target *t = (struct target *)arg;
+	if (fleet)
+		fprintf(stderr, "%s: %s\n", t->name, text);
+	else
+		fprintf(stderr, "%s\n", text);
 }
 
-static void just_abort(char *message)
+static void print_timing(struct target *t)
 {
-	refresh();
-	if (message != 0)
-		fprintf(stderr, "%s\n", message);
-	fprintf(stderr, "Aborting. Flash may be incorrect.\n");
-	exit(1);
+	struct machxo_stats *st = &t->session.stats;
+	char line[160];
+	if (!show_timing)
+		return;
+	snprintf(line, sizeof line, "Phases: enable %.3f s, erase %.3f s, program %.3f s, verify %.3f s, finish %.3f s",
+		 st->enable_time, st->erase_time, st->program_time, st->verify_time, st->finish_time);
+	print_message(t, line);
+	if (st->program_bytes > 0 && st->program_time > 0)
+	{
+		snprintf(line, sizeof line, "Programmed %d bytes in %.3f s (%.0f bytes/s, %s)",
+			 st->program_bytes, st->program_time, st->program_bytes / st->program_time,
+			 options.batch_pages > 1 ? "batched" : "per page");
+		print_message(t, line);
+	}
+	if (st->verify_bytes > 0 && st->verify_time > 0)
+	{
+		snprintf(line, sizeof line, "Verified %d bytes in %.3f s (%.0f bytes/s)",
+			 st->verify_bytes, st->verify_time, st->verify_bytes / st->verify_time);
+		print_message(t, line);
+	}
+	if (st->program_pages_saved > 0)
+	{
+		snprintf(line, sizeof line, "Skipped %d zero pages when programming, saving %d bus bytes",
+			 st->program_pages_saved, st->program_pages_saved * PAGE_PROGRAM_BUS_BYTES -
+			 st->program_jumps * ADDRESS_BUS_BYTES);
+		print_message(t, line);
+	}
+	if (st->verify_pages_saved > 0)
+	{
+		snprintf(line, sizeof line, "Skipped %d erased pages when verifying, saving %d bus bytes",
+			 st->verify_pages_saved, st->verify_pages_saved * MACHXO2_PAGE_SIZE -
+			 st->verify_jumps * (ADDRESS_BUS_BYTES + READ_START_BUS_BYTES));
+		print_message(t, line);
+	}
+	print_busy_statistics(t->dev);
+	print_instrumentation(t->dev);
 }
 
-static void do_work(int op)
+static void write_json_string(FILE *f, const char *s)
 {
-	int section;
-	uint32_t address;
-	uint8_t *data;
-	int data_len;
-	int tag_data_seen = 0;
-	int page_address;
+	fputc('"', f);
+	for (; *s != 0; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			fputc('\\', f);
+		if ((unsigned char)*s >= ' ')
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+// The JSON object of a target, written now because the counters go with the device
+static void close_target(struct target *t)
+{
+	static const char *results[] = { "pass", "skipped", "fail" };
+	struct machxo_stats *st = &t->session.stats;
+	FILE *f;
+	if (json_file != 0 && (f = open_memstream(&t->json, &t->json_len)) != 0)
+	{
+		fprintf(f, "{\"device\": ");
+		write_json_string(f, t->name);
+		fprintf(f, ", \"result\": \"%s\", \"seconds\": %.6f,\n  \"message\": ", results[t->status], t->elapsed);
+		write_json_string(f, t->session.message);
+		fprintf(f, ",\n  \"phases\": {\"enable\": %.6f, \"erase\": %.6f, \"program\": %.6f, "
+			"\"verify\": %.6f, \"finish\": %.6f},\n",
+			st->enable_time, st->erase_time, st->program_time, st->verify_time, st->finish_time);
+		fprintf(f, "  \"program_bytes\": %d, \"verify_bytes\": %d, \"program_pages_saved\": %d, "
+			"\"verify_pages_saved\": %d,\n  ", st->program_bytes, st->verify_bytes,
+			st->program_pages_saved, st->verify_pages_saved);
+		if (t->dev != 0)
+			write_instrumentation_json(t->dev, f);
+		else
+			fprintf(f, "\"commands\": []");
+		fprintf(f, "}");
+		fclose(f);
+	}
+	if (t->dev != 0)
+		close_device(t->dev);
+	t->dev = 0;
+}
+
+
+static long peak_rss_kib()
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+	return usage.ru_maxrss;
+}
+
+static int write_json(char *image_file, double load_time, struct target *targets, int num_targets)
+{
+	FILE *f = strcmp(json_file, "-") == 0 ? stdout : fopen(json_file, "w");
 	int i;
+	if (f == 0)
+	{
+		perror(json_file);
+		return 0;
+	}
+	fprintf(f, "{\"image\": ");
+	write_json_string(f, image_file);
+	fprintf(f, ", \"load_seconds\": %.6f, \"peak_rss_kib\": %ld,\n\"devices\": [\n", load_time, peak_rss_kib());
+	for (i = 0; i < num_targets; i++)
+		fprintf(f, "%s%s", targets[i].json != 0 ? targets[i].json : "{}", i < num_targets - 1 ? ",\n" : "\n");
+	fprintf(f, "]}\n");
+	if (f != stdout)
+		fclose(f);
+	return 1;
+}
 
-	// Assume there will be one initial section that we can safely ignore
-	if (get_next_jedec_section(&section, &address, &data, &data_len) != 1)
-		return;
-	// Initialize flash not that the JEDEC file looks OK
-	if (check_device_id_quick() != 1)
+/*
+ * Use the SPI clock tuned for this board on an earlier run, or tune it now
+ * and keep the result for the next run.
+ */
+static int tune_target(struct target *t)
+{
+	uint32_t device_id;
+	uint32_t speed;
+	char line[80];
+	if (!device_present(t->dev))
+		return 1;
+	if (read_device_id(t->dev, &device_id) != 1)
+		return 0;
+	if (speed_cache_dir != 0 && load_cached_spi_speed(speed_cache_dir, t->name, device_id, &speed) == 1 &&
+	    speed <= tune_max_speed)
 	{
-		fprintf(stderr, "Device ID doesn't make sense.  Exiting.\n");
-		exit(1);
+		if (set_spi_clock(t->dev, spi_mode, speed) != 1)
+			return 0;
+		snprintf(line, sizeof line, "SPI clock %u Hz, as tuned before", speed);
 	}
-	if (enable_offline_configuration() != 1 || wait_not_busy() != 1)
+	else
 	{
-		fprintf(stderr, "Failed to enable configuration.\n");
-		exit(1);
+		speed = tune_spi_speed(t->dev, tune_max_speed);
+		if (speed == 0)
+			return 0;
+		if (speed_cache_dir != 0)
+			save_cached_spi_speed(speed_cache_dir, t->name, device_id, speed);
+		snprintf(line, sizeof line, "SPI clock tuned to %u Hz", speed);
 	}
-	if (op & DO_ERASE)
+	if (show_timing)
+		print_message(t, line);
+	return 1;
+}
+
+static int open_target(struct target *t, char *name, int mode, int i2c_addr)
+{
+	memset(t, 0, sizeof *t);
+	t->name = name;
+	t->options = options;
+	t->options.message = print_message;
+	t->options.arg = t;
+	t->status = TARGET_FAIL;
+	t->dev = open_device(name, mode, i2c_addr);
+	// A device file that can not be opened is only useful for a dry run of one device
+	if (t->dev != 0 && fleet && !device_present(t->dev))
 	{
-		if (erase_flash() != 1 || wait_not_busy() != 1)
-		{
-			fprintf(stderr, "Failed to erase flash.\n");
-			exit(1);
-		}
+		close_device(t->dev);
+		t->dev = 0;
 	}
-	while (1)
+	if (t->dev == 0)
 	{
-		if (get_next_jedec_section(&section, &address, &data, &data_len) != 1)
+		print_message(t, "Failed to open device.");
+		snprintf(t->session.message, sizeof t->session.message, "Failed to open device.");
+		return 0;
+	}
+	set_page_program_delay(t->dev, page_program_delay);
+	set_verify_burst(t->dev, verify_burst);
+	set_adaptive_polling(t->dev, adaptive_polling);
+	if (mode == MODE_SPI && set_spi_clock(t->dev, spi_mode, spi_speed) != 1)
+		print_message(t, "Using the SPI settings the driver had.");
+	set_i2c_speed(t->dev, i2c_speed);
+	// Counting costs a clock read per command, so only when it is shown
+	set_instrumentation(t->dev, show_timing || json_file != 0);
+	init_session(&t->session, t->dev, &t->options);
+	if (mode == MODE_SPI && tune_max_speed > 0 && tune_target(t) != 1)
+	{
+		snprintf(t->session.message, sizeof t->session.message, "SPI clock tuning failed.");
+		close_device(t->dev);
+		t->dev = 0;
+		return 0;
+	}
+	return 1;
+}
+
+static int run_job(struct target *t, struct job *job)
+{
+	int status;
+	switch (job->kind)
+	{
+	case JOB_UFM:
+		status = update_user_flash(&t->session, job->image);
+		break;
+	case JOB_SRAM:
+		status = load_sram(&t->session, job->bitstream, job->bitstream_len);
+		if (status == 1 && show_timing)
 		{
-			abort_and_clean_up("Input file error.");
-			return;
+			char line[80];
+			snprintf(line, sizeof line, "Loaded %d bytes into SRAM in %.3f s (%.0f bytes/s)",
+				 job->bitstream_len, t->session.stats.program_time,
+				 job->bitstream_len / t->session.stats.program_time);
+			print_message(t, line);
+			// Not flash programming, so not repeated below
+			t->session.stats.program_bytes = 0;
 		}
-		switch (section)
-		{
-		case SECTION_NOTE:
-			if (strstr((char*)data, "TAG DATA") != 0)
-				tag_data_seen = 1;
-			break;
-		case SECTION_FUSE_MAP:
-			if (op & DO_FLASH)
-			{
-				if ((address / MACHXO2_PAGE_SIZE) * MACHXO2_PAGE_SIZE != address)
-					abort_and_clean_up("Flash address not multiple of page size");
-				if ((data_len / MACHXO2_PAGE_SIZE) * MACHXO2_PAGE_SIZE != data_len)
-					abort_and_clean_up("Data block size not multiple of page size");
-				if (!all_zero(data, data_len))
-				{
-					page_address = address / MACHXO2_PAGE_SIZE;
-					if (set_configuration_flash_address(page_address, tag_data_seen) != 1)
-						abort_and_clean_up("Failed to set flash address");
-					for (i = 0; i < data_len; i += MACHXO2_PAGE_SIZE)
-					{
-						if (program_configuration_flash(&data[i], MACHXO2_PAGE_SIZE) != 1 || wait_not_busy() != 1)
-							abort_and_clean_up("Failed to program device.");
-					}
-				}
-			}
-			if (op & DO_VERIFY)
-			{
-				if ((address / MACHXO2_PAGE_SIZE) * MACHXO2_PAGE_SIZE != address)
-					just_abort("Flash address not multiple of page size");
-				if ((data_len / MACHXO2_PAGE_SIZE) * MACHXO2_PAGE_SIZE != data_len)
-					just_abort("Data block size not multiple of page size");
-				page_address = address / MACHXO2_PAGE_SIZE;
-				if (set_configuration_flash_address(page_address, tag_data_seen) != 1)
-					just_abort("Failed to set flash address");
-				// Last page not included.  Due to a quirk in MachXO multi-page flash access,
-				// the last page must be in separate request.
-//				for (i = 0; i < (data_len - MACHXO2_PAGE_SIZE); i += MACHXO2_PAGE_SIZE * 8)
-				for (i = 0; i < data_len; i += MACHXO2_PAGE_SIZE * 8)
-				{
-//					int block_len = data_len - MACHXO2_PAGE_SIZE - i;
-					int block_len = data_len - i;
-					if (block_len > (MACHXO2_PAGE_SIZE * 8)) block_len = MACHXO2_PAGE_SIZE * 8;
-					if (verify_configuration_flash(&data[i], block_len) != 1)
-					{
-						fprintf(stderr, "Flash verify failed at offset %d length %d (total length = %d)."
-									"Programming not completed.", i, block_len, data_len);
-						just_abort(0);
-					}
-				}
-				// Last page, but skip it in configuration flash when this actually the user code
-//				if (tag_data_seen)
-//					if (verify_configuration_flash(&data[i], MACHXO2_PAGE_SIZE) != 1)
-//						just_abort("Flash verify failed.  Programming not completed.");
-			}
-			break;
-		case SECTION_ARCH:
-			if (op & DO_FLASH)
-			{
-				if (data_len != 10)
-					abort_and_clean_up("Incorrect size feature row and bits");
-				if (program_feature_row(data) != 1 || wait_not_busy() != 1)
-					abort_and_clean_up("Failed to program feature row");
-				if (program_feature_bits(data + 8) != 1 || wait_not_busy() != 1)
-					abort_and_clean_up("Failed to program feature bits");
-			}
-			if (op & DO_VERIFY)
-			{
-				if (data_len != 10)
-					just_abort("Incorrect size feature row and bits");
-				if (verify_feature_row(data) != 1)
-					just_abort("Failed to verify feature row.  Programming not completed.");
-				if (verify_feature_bits(data + 8) != 1)
-					just_abort("Failed to verify feature bits.  Programming not completed.");
-			}
-			break;
-		case SECTION_USERCODE:
-			if (op & DO_FLASH)
-				if (program_user_code(address) != 1 || wait_not_busy() != 1)
-					abort_and_clean_up("Failed to program user code");
-			if (op & DO_VERIFY)
-				if (verify_user_code(address) != 1)
-					just_abort("Failed to verify user code.  Programming not completed.");
-			break;
-		case SECTION_END:
-			program_done() != 1 || wait_not_busy() != 1 || refresh() != 1 || wait_not_busy() != 1;
-			return;
-		case SECTION_NUM_PINS:
-		case SECTION_NUM_FUSES:
-		case SECTION_DEFAULT_FUSE_VAL:
-		case SECTION_CHECK_SUM:
-			break; // just ignore for now
-		case SECTION_SECURITY_FUSE:
-			if (data[0] != '0')
-				fprintf(stderr, "Security fuse not implemented");
+		break;
+	default:
+		status = program_image(&t->session, job->image);
+		break;
+	}
+	if (status == 1)
+	{
+		t->status = t->session.already_programmed ? TARGET_SKIPPED : TARGET_PASS;
+		if (!t->session.already_programmed)
+			print_timing(t);
+	}
+	return status;
+}
+
+static void *fleet_worker(void *arg)
+{
+	struct fleet *f = (struct fleet *)arg;
+	struct target *t;
+	double start;
+	int i;
+	for (;;)
+	{
+		pthread_mutex_lock(&f->lock);
+		i = f->next++;
+		pthread_mutex_unlock(&f->lock);
+		if (i >= f->num_targets)
+			return 0;
+		t = &f->targets[i];
+		start = now();
+		if (open_target(t, t->name, f->mode, f->i2c_addr) == 1)
+			run_job(t, f->job);
+		t->elapsed = now() - start;
+		close_target(t);
+	}
+}
+
+/*
+ * Work on all targets at once, each worker taking the next target in turn
+ * until none are left.  Devices share nothing but the image, so workers
+ * need the lock only to pick a target.
+ */
+static void run_fleet(struct fleet *f, int num_workers)
+{
+	pthread_t *workers;
+	int i;
+	if (num_workers > f->num_targets)
+		num_workers = f->num_targets;
+	workers = (pthread_t *)calloc(num_workers, sizeof *workers);
+	if (workers == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	// Choose the kernels before the workers race to do it
+	selected_kernels();
+	pthread_mutex_init(&f->lock, 0);
+	f->next = 0;
+	for (i = 0; i < num_workers; i++)
+		if (pthread_create(&workers[i], 0, fleet_worker, f) != 0)
 			break;
-		default:
-			abort_and_clean_up("Unknown JEDEC section");
-		}
+	if (i == 0)
+		fleet_worker(f);
+	num_workers = i;
+	for (i = 0; i < num_workers; i++)
+		pthread_join(workers[i], 0);
+	pthread_mutex_destroy(&f->lock);
+	free(workers);
+}
+
+static int print_summary(struct fleet *f, double elapsed)
+{
+	static const char *results[] = { "PASS", "PASS", "FAIL" };
+	struct target *t;
+	int width = strlen("Device");
+	int failed = 0;
+	int i;
+	for (i = 0; i < f->num_targets; i++)
+		if ((int)strlen(f->targets[i].name) > width)
+			width = strlen(f->targets[i].name);
+	printf("%-*s %-6s %8s  %s\n", width, "Device", "Result", "Time", "Notes");
+	for (i = 0; i < f->num_targets; i++)
+	{
+		t = &f->targets[i];
+		printf("%-*s %-6s %7.3fs  %s\n", width, t->name, results[t->status], t->elapsed,
+		       t->status == TARGET_SKIPPED ? "already programmed" : t->session.message);
+		if (t->status == TARGET_FAIL)
+			failed++;
 	}
+	printf("%d of %d devices passed in %.3f s\n", f->num_targets - failed, f->num_targets, elapsed);
+	return failed == 0;
+}
+
+// Serve a GPMC mailbox file in place of the bridge design, see gpmc.h
+static int run_bridge(char *path, char *dev_name, int mode, int i2c_addr)
+{
+	struct machxo_device *dev;
+	int status;
+	dev = open_device(dev_name, mode, i2c_addr);
+	if (dev == 0)
+		return 0;
+	set_page_program_delay(dev, page_program_delay);
+	if (mode == MODE_SPI)
+		set_spi_clock(dev, spi_mode, spi_speed);
+	else
+		set_i2c_speed(dev, i2c_speed);
+	status = run_gpmc_bridge(path, dev);
+	close_device(dev);
+	return status;
+}
+
+// List the devices on the JTAG chain behind the GPMC JTAG master
+static int scan_jtag_chain(char *window)
+{
+	uint32_t idcodes[JTAG_MAX_CHAIN];
+	struct jtag *j;
+	int n, i;
+	j = jtag_open(window);
+	if (j == 0)
+		return 0;
+	n = jtag_read_idcodes(j, idcodes, JTAG_MAX_CHAIN);
+	jtag_close(j);
+	if (n < 0)
+		return 0;
+	printf("%d device%s on the JTAG chain, nearest TDO first\n", n, n == 1 ? "" : "s");
+	for (i = 0; i < n; i++)
+	{
+		if (idcodes[i] == 0)
+			printf("  %d: no IDCODE\n", i);
+		else
+			printf("  %d: IDCODE %08x\n", i, idcodes[i]);
+	}
+	return 1;
+}
+
+// Connect to the target behind the GPMC SWD master and show what is there
+static int probe_swd(char *window)
+{
+	uint32_t dpidr, idr = 0;
+	struct swd *s;
+	int status;
+	s = swd_open(window);
+	if (s == 0)
+		return 0;
+	status = swd_connect(s, &dpidr);
+	if (status == 1)
+		status = swd_read_ap(s, 0, SWD_AP_IDR, &idr) == 1 && swd_flush(s) == 1;
+	swd_close(s);
+	if (status != 1)
+		return 0;
+	printf("SW-DP DPIDR %08x, AP 0 IDR %08x\n", dpidr, idr);
+	return 1;
 }
 
 static void print_usage(const char *prog)
 {
-	fprintf(stderr, "Usage: %s [-d <device>] [-a <i2c_addr>] <jedec file>\n", prog);
-	fputs("  -d   device to use (default /dev/spidev2.0)\n"
+	fprintf(stderr, "Usage: %s [-d <device>]... [-j <jobs>] [-a <i2c_addr>] [-b <pages>] [-p <usecs>] <jedec file>\n", prog);
+	fprintf(stderr, "       %s -D <socket> [options] [<file to preload>]...\n", prog);
+	fprintf(stderr, "       %s [-t] -c <socket> <request>...\n", prog);
+	fprintf(stderr, "       %s -B <window file> [-d <device>] [-a <i2c_addr>]\n", prog);
+	fprintf(stderr, "       %s -g <window>\n", prog);
+	fprintf(stderr, "       %s -O <port|socket path> <window>\n", prog);
+	fprintf(stderr, "       %s -G <window file> [taps=<n>,idcode=<id>,usercode=<code>]\n", prog);
+	fprintf(stderr, "       %s -x <window>\n", prog);
+	fprintf(stderr, "       %s -X <window file> [mem=<KB>,wait=<n>,parity=<n>,dpidr=<id>]\n", prog);
+	fprintf(stderr, "       %s -R <window> <output file> [<seconds>]\n", prog);
+	fprintf(stderr, "       %s -Y <window file> [rate=<MB/s>,fifo=<bytes>]\n", prog);
+	fprintf(stderr, "       %s -Z <capture|-> <output|-> [format=bin|csv|raw,id=<n>,threads=<n>]\n", prog);
+	fputs("  -d   device to use (default /dev/spidev2.0, \"sim[:<options>]\" for a simulated device,\n"
+	      "       \"gpmc\" for the GPMC bridge, \"gpmc:<file>\" for a bridge served with -B)\n"
+	      "       repeat to program several devices at once from the same image\n"
+	      "  -j   number of devices worked on at the same time (default all)\n"
 	      "  -a   i2c address\n"
+	      "  -b   pages per programming batch (default 128, at most 14 or 21 on I2C, 1 = one page at a time)\n"
+	      "  -p   delay in microseconds after each page in a batch (default 250)\n"
 		  "  -e   Do not erase\n"
 		  "  -f   Do not flash\n"
-		  "  -v   Do not verify\n", stderr);
+		  "  -v   Do not verify\n"
+		  "  -r   pages per verify read (default as many as the bus allows)\n"
+		  "  -t   Print timing statistics, per phase and per command\n"
+		  "  -J   Write timing statistics as JSON to a file, \"-\" for stdout\n"
+		  "  -S   Stream the JEDEC file in fixed memory instead of loading it first\n"
+		  "  -C   directory for parsed JEDEC files (default ~/.cache/prog_machxo)\n"
+		  "  -N   Do not cache parsed JEDEC files or tuned SPI clocks\n"
+		  "  -F   Program even if the hash page (-H) shows the device already holds the image\n"
+		  "  -s   Load a bitstream (.bit/.bin) into SRAM, leaving flash untouched; flash is\n"
+		  "       programmed from the JEDEC file only\n"
+		  "  -u   Only rewrite the user flash (UFM), from the JEDEC file\n"
+		  "  -U   Only rewrite the user flash (UFM), from a raw binary file\n"
+		  "  -V   With -u or -U, read back the whole configuration flash to check the design, not\n"
+		  "       only the usercode, feature row and hash page\n"
+		  "  -H   UFM page holding a hash of the image; a device that already holds the image\n"
+		  "       is then left alone.  Without it the device is always programmed\n"
+		  "  -w   Poll busy status every millisecond instead of adaptively\n"
+		  "  -k   SPI clock in Hz (default 5000000), or the I2C bus rate when the adapter does not tell\n"
+		  "  -m   SPI mode, 0 to 3 (default 0)\n"
+		  "  -T   Tune the SPI clock, up to the given Hz (0 for 66 MHz), and remember it for the board;\n"
+		  "       it settles one step below the fastest clock that works\n"
+		  "  -D   Run as a daemon, keeping devices open and images loaded, taking jobs on <socket>\n"
+		  "  -c   Send a request to the daemon on <socket>, such as \"program <device> <file>\",\n"
+		  "       \"verify\", \"ufm\", \"sram\", \"usercode <device>\", \"status\", \"refresh\" or \"close\"\n"
+		  "  -B   Stand in for the GPMC bridge design on <window file>, passing frames to the -d device\n"
+		  "  -g   List the devices on the JTAG chain behind the JTAG master on <window> (\"gpmc\" or \"gpmc:<file>\")\n"
+		  "  -G   Stand in for the JTAG master design on <window file>, with simulated MachXO2 TAPs\n"
+		  "  -O   Serve OpenOCD's jtag_vpi protocol on a TCP port or Unix socket, for the JTAG master on <window>\n"
+		  "  -x   Connect to the target behind the SWD master on <window> and show its DPIDR\n"
+		  "  -X   Stand in for the SWD master design on <window file>, with a simulated target\n"
+		  "  -R   Capture trace from the trace FIFO on <window> to a file, for <seconds> or until interrupted\n"
+		  "  -Y   Stand in for the trace capture design on <window file>, with a steady trace source\n"
+		  "  -Z   Deframe a TPIU capture and decode the ITM/DWT packets of trace ID <n> (default 1), in parallel\n", stderr);
 	exit(1);
 }
 
 int main(int argc, char **argv)
 {
-	char *device_file = DEFAULT_SPI_DEV;
+	char **device_files;
+	int num_devices = 0;
+	int num_workers = 0;
 	int mode = MODE_SPI;
 	int i2c_addr = 0x40;
-	int op = DO_ERASE | DO_FLASH | DO_VERIFY;
+	struct machxo_image image;
+	struct job job;
+	struct fleet f;
+	struct target target;
+	int ufm_only = 0;
+	char *ufm_file = 0;
+	char *cache_dir = default_cache_dir();
+	struct image_cache cache;
+	int cached = 0;
+	int sram = 0;
+	int stream = 0;
+	int status;
+	double start;
+	double load_time = 0;
+	int i;
+	char *daemon_socket = 0;
+	char *bridge_file = 0;
+	struct daemon_config daemon;
 	char *prog_name = "prog_machxo";
 	if (argc < 2)
 		print_usage(prog_name);
+	device_files = (char **)calloc(argc, sizeof *device_files);
+	if (device_files == 0)
+		return 1;
+	memset(&job, 0, sizeof job);
+	default_options(&options);
 	argc--; argv++;
-	while (argv[0][0] == '-')
+	while (argc > 0 && argv[0][0] == '-')
 	{
-		if (argv[0][1] == 'd')
+		if (argv[0][1] == 'c')
+		{
+			// The rest of the command line is the request
+			if (argc < 3)
+				print_usage(prog_name);
+			return send_request(argv[1], argc - 2, argv + 2, show_timing) == 1 ? 0 : 1;
+		}
+		else if (argv[0][1] == 'D')
+		{
+			if (argc < 2)
+				print_usage(prog_name);
+			daemon_socket = argv[1];
+			argv ++;
+			argc --;
+		}
+		else if (argv[0][1] == 'g')
+		{
+			if (argc < 2)
+				print_usage(prog_name);
+			return scan_jtag_chain(argv[1]) == 1 ? 0 : 1;
+		}
+		else if (argv[0][1] == 'O')
+		{
+			if (argc < 3)
+				print_usage(prog_name);
+			return run_jtag_server(argv[1], argv[2]) == 1 ? 0 : 1;
+		}
+		else if (argv[0][1] == 'G')
+		{
+			if (argc < 2)
+				print_usage(prog_name);
+			return run_jtag_sim(argv[1], argc > 2 ? argv[2] : 0) == 1 ? 0 : 1;
+		}
+		else if (argv[0][1] == 'x')
+		{
+			if (argc < 2)
+				print_usage(prog_name);
+			return probe_swd(argv[1]) == 1 ? 0 : 1;
+		}
+		else if (argv[0][1] == 'X')
+		{
+			if (argc < 2)
+				print_usage(prog_name);
+			return run_swd_sim(argv[1], argc > 2 ? argv[2] : 0) == 1 ? 0 : 1;
+		}
+		else if (argv[0][1] == 'R')
+		{
+			if (argc < 3)
+				print_usage(prog_name);
+			return run_trace_capture(argv[1], argv[2], argc > 3 ? atof(argv[3]) : 0) == 1 ? 0 : 1;
+		}
+		else if (argv[0][1] == 'Y')
+		{
+			if (argc < 2)
+				print_usage(prog_name);
+			return run_trace_sim(argv[1], argc > 2 ? argv[2] : 0) == 1 ? 0 : 1;
+		}
+		else if (argv[0][1] == 'Z')
+		{
+			if (argc < 3)
+				print_usage(prog_name);
+			return run_tpiu_decode(argv[1], argv[2], argc > 3 ? argv[3] : 0) == 1 ? 0 : 1;
+		}
+		else if (argv[0][1] == 'B')
+		{
+			if (argc < 2)
+				print_usage(prog_name);
+			bridge_file = argv[1];
+			argv ++;
+			argc --;
+		}
+		else if (argv[0][1] == 'd')
 		{
 			if (argc < 3)
 				print_usage(prog_name);
-			device_file = argv[1];
+			device_files[num_devices++] = argv[1];
+			argv ++;
+			argc --;
+		}
+		else if (argv[0][1] == 'j')
+		{
+			if (argc < 3)
+				print_usage(prog_name);
+			num_workers = atoi(argv[1]);
 			argv ++;
 			argc --;
 		}
@@ -224,22 +654,237 @@ int main(int argc, char **argv)
 			argv ++;
 			argc --;
 		}
+		else if (argv[0][1] == 'b')
+		{
+			if (argc < 3)
+				print_usage(prog_name);
+			options.batch_pages = atoi(argv[1]);
+			argv ++;
+			argc --;
+		}
+		else if (argv[0][1] == 'p')
+		{
+			if (argc < 3)
+				print_usage(prog_name);
+			page_program_delay = atoi(argv[1]);
+			argv ++;
+			argc --;
+		}
+		else if (argv[0][1] == 'r')
+		{
+			if (argc < 3)
+				print_usage(prog_name);
+			verify_burst = atoi(argv[1]);
+			argv ++;
+			argc --;
+		}
+		else if (argv[0][1] == 't')
+			show_timing = 1;
+		else if (argv[0][1] == 'J')
+		{
+			if (argc < 3)
+				print_usage(prog_name);
+			json_file = argv[1];
+			argv ++;
+			argc --;
+		}
+		else if (argv[0][1] == 'S')
+			stream = 1;
+		else if (argv[0][1] == 'C')
+		{
+			if (argc < 3)
+				print_usage(prog_name);
+			cache_dir = argv[1];
+			argv ++;
+			argc --;
+		}
+		else if (argv[0][1] == 'N')
+			cache_dir = 0;
+		else if (argv[0][1] == 'F')
+			options.force = 1;
+		else if (argv[0][1] == 's')
+			sram = 1;
+		else if (argv[0][1] == 'u')
+			ufm_only = 1;
+		else if (argv[0][1] == 'U')
+		{
+			if (argc < 3)
+				print_usage(prog_name);
+			ufm_file = argv[1];
+			ufm_only = 1;
+			argv ++;
+			argc --;
+		}
+		else if (argv[0][1] == 'V')
+			options.check_design = 1;
+		else if (argv[0][1] == 'H')
+		{
+			if (argc < 3)
+				print_usage(prog_name);
+			options.hash_page = atoi(argv[1]);
+			argv ++;
+			argc --;
+		}
+		else if (argv[0][1] == 'w')
+			adaptive_polling = 0;
+		else if (argv[0][1] == 'k')
+		{
+			if (argc < 3)
+				print_usage(prog_name);
+			spi_speed = i2c_speed = strtoul(argv[1], 0, 0);
+			argv ++;
+			argc --;
+		}
+		else if (argv[0][1] == 'm')
+		{
+			if (argc < 3)
+				print_usage(prog_name);
+			spi_mode = atoi(argv[1]);
+			argv ++;
+			argc --;
+		}
+		else if (argv[0][1] == 'T')
+		{
+			if (argc < 3)
+				print_usage(prog_name);
+			tune_max_speed = strtoul(argv[1], 0, 0);
+			if (tune_max_speed == 0)
+				tune_max_speed = MAX_SPI_SPEED;
+			argv ++;
+			argc --;
+		}
 		else if (argv[0][1] == 'e')
-			op &= ~DO_ERASE;
+			options.op &= ~MACHXO_ERASE;
 		else if (argv[0][1] == 'f')
-			op &= ~DO_FLASH;
+			options.op &= ~MACHXO_FLASH;
 		else if (argv[0][1] == 'v')
-			op &= ~DO_VERIFY;
+			options.op &= ~MACHXO_VERIFY;
 		else
 			print_usage(prog_name);
 		argv ++;
 		argc --;
 	}
-	if (open_jedec(argv[0]) != 1)
-		return 1;
-	if (open_device(0, mode, i2c_addr) != 1)
+	speed_cache_dir = cache_dir;
+	if (bridge_file != 0)
+		return run_bridge(bridge_file, num_devices > 0 ? device_files[0] : DEFAULT_SPI_DEV, mode, i2c_addr) == 1 ? 0 : 1;
+	if (daemon_socket != 0)
+	{
+		daemon.mode = mode;
+		daemon.i2c_addr = i2c_addr;
+		daemon.page_program_delay = page_program_delay;
+		daemon.verify_burst = verify_burst;
+		daemon.adaptive_polling = adaptive_polling;
+		daemon.spi_mode = spi_mode;
+		daemon.spi_speed = spi_speed;
+		daemon.i2c_speed = i2c_speed;
+		daemon.options = options;
+		return run_daemon(daemon_socket, &daemon, argv, argc) == 1 ? 0 : 1;
+	}
+	if (argc < 1)
+		print_usage(prog_name);
+	if (num_devices == 0)
+		device_files[num_devices++] = DEFAULT_SPI_DEV;
+	fleet = num_devices > 1;
+	if (num_workers <= 0)
+		num_workers = num_devices;
+	// A bitstream is a command stream for SRAM, not the pages of the configuration flash
+	if (!sram && is_bitstream_file(argv[0]))
+	{
+		fprintf(stderr, "%s is a bitstream, which can only be loaded into SRAM (-s).  "
+			"Program flash from the JEDEC file.\n", argv[0]);
 		return 1;
-	do_work(op);
-  //initialize_flash();
-	return 0;
-}
\ No newline at end of file
+	}
+	// Streaming parses the file while programming, so it is for one device only
+	if (stream && !fleet && !sram && !ufm_only && options.hash_page < 0)
+	{
+		start = now();
+		if (open_target(&target, device_files[0], mode, i2c_addr) != 1)
+			return 1;
+		status = program_jedec_stream(&target.session, argv[0], STREAM_BYTES);
+		if (status == 1)
+		{
+			target.status = TARGET_PASS;
+			print_timing(&target);
+		}
+		if (show_timing)
+			fprintf(stderr, "Peak RSS %ld KiB\n", peak_rss_kib());
+		target.elapsed = now() - start;
+		close_target(&target);
+		// Parsing is part of programming in stream mode
+		if (json_file != 0 && write_json(argv[0], 0, &target, 1) != 1)
+			status = 0;
+		free(target.json);
+		return status == 1 ? 0 : 1;
+	}
+	start = now();
+	memset(&image, 0, sizeof image);
+	if (sram)
+	{
+		job.kind = JOB_SRAM;
+		if (load_bitstream(argv[0], &job.bitstream, &job.bitstream_len, &image.map, &image.map_len) != 1)
+			return 1;
+	}
+	else
+	{
+		if (cache_dir != 0 && open_image_cache(&cache, cache_dir, argv[0]) == 1)
+			cached = load_cached_image(&cache, &image);
+		else
+			cache_dir = 0;
+		if (!cached)
+		{
+			if (load_jedec_image(argv[0], &image) != 1)
+				return 1;
+			if (cache_dir != 0)
+				save_cached_image(&cache, &image);
+		}
+	}
+	if (!sram)
+	{
+		if (ufm_file != 0 && load_user_flash_binary(ufm_file, &image) != 1)
+			return 1;
+		load_time = now() - start;
+		if (show_timing)
+			fprintf(stderr, "Loaded %s in %.3f s%s, peak RSS %ld KiB\n",
+				argv[0], load_time, cached ? " from cache" : "", peak_rss_kib());
+		if (options.hash_page >= 0 && prepare_hash_page(&image, options.hash_page) != 1)
+			return 1;
+		job.kind = ufm_only ? JOB_UFM : JOB_WORK;
+	}
+	job.image = &image;
+	if (!fleet)
+	{
+		start = now();
+		if (open_target(&target, device_files[0], mode, i2c_addr) != 1)
+			return 1;
+		status = run_job(&target, &job);
+		target.elapsed = now() - start;
+		close_target(&target);
+		if (json_file != 0 && write_json(argv[0], load_time, &target, 1) != 1)
+			status = 0;
+		free(target.json);
+	}
+	else
+	{
+		memset(&f, 0, sizeof f);
+		f.targets = (struct target *)calloc(num_devices, sizeof *f.targets);
+		if (f.targets == 0)
+			return 1;
+		for (i = 0; i < num_devices; i++)
+			f.targets[i].name = device_files[i];
+		f.num_targets = num_devices;
+		f.job = &job;
+		f.mode = mode;
+		f.i2c_addr = i2c_addr;
+		start = now();
+		run_fleet(&f, num_workers);
+		status = print_summary(&f, now() - start);
+		if (json_file != 0 && write_json(argv[0], load_time, f.targets, f.num_targets) != 1)
+			status = 0;
+		for (i = 0; i < num_devices; i++)
+			free(f.targets[i].json);
+		free(f.targets);
+	}
+	free_image(&image);
+	free(device_files);
+	return status == 1 ? 0 : 1;
+}
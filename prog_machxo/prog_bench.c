@@ -0,0 +1,187 @@
+/*
+ * Benchmark of the SPI and I2C programming paths, on the simulated device
+ * so that it runs on any Linux host.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * Each run is a full erase, program and verify cycle of a generated image
+ * where about half the pages are zero, like real designs.  Runs sweep the
+ * image size, the page batching and the busy polling strategy.  The
+ * simulator takes as long as the real bus and device would, so the erase
+ * alone is half a second of every run.  I2C runs at 400 kHz and at the
+ * 1 MHz of Fast-mode Plus.
+ *
+ * Usage: prog_bench [-q]   (-q for a quick sweep of the smallest image only)
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "image.h"
+#include "machxo.h"
+#include "program.h"
+
+struct bench_config {
+	int mode;
+	uint32_t speed;	// Bus clock in Hz
+	int pages;
+	int batch_pages;
+	int adaptive_polling;
+};
+
+static const int spi_pages[] = { 512, 2175, 9216 };
+static const int i2c_pages[] = { 512, 2175 };
+static const int spi_batches[] = { 1, 16, 128 };
+static const int i2c_batches[] = { 1, 21 };	// One page per command, and as many as an I2C_RDWR takes
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Same random fill for every run of a size, so runs can be compared.  The
+ * fuse data is the caller's to free, after free_image().
+ */
+static int make_image(struct machxo_image *image, int pages, uint8_t **fuses)
+{
+	struct image_block *block;
+	uint32_t seed = 12345;
+	int i, j;
+	memset(image, 0, sizeof *image);
+	block = (struct image_block *)calloc(1, sizeof *block);
+	*fuses = (uint8_t *)calloc(pages, MACHXO2_PAGE_SIZE);
+	if (block == 0 || *fuses == 0)
+	{
+		free(block);
+		free(*fuses);
+		return 0;
+	}
+	block->data = *fuses;
+	block->data_len = pages * MACHXO2_PAGE_SIZE;
+	for (i = 0; i < pages; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		if ((seed >> 16) & 1)
+			continue;
+		for (j = 0; j < MACHXO2_PAGE_SIZE; j++)
+		{
+			seed = seed * 1103515245 + 12345;
+			block->data[i * MACHXO2_PAGE_SIZE + j] = seed >> 16;
+		}
+	}
+	image->blocks = block;
+	image->num_blocks = 1;
+	image->erase_sections = ERASE_CONFIGURATION;
+	return find_page_runs(image);
+}
+
+// Upper bound of the histogram bucket holding the given fraction of the commands
+static uint32_t percentile(struct machxo_counters *c, double fraction)
+{
+	uint32_t count = 0;
+	int i;
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++)
+	{
+		count += c->histogram[i];
+		if (count >= fraction * c->commands)
+			return 1u << i;
+	}
+	return 1u << i;
+}
+
+static int run(struct bench_config *bc, struct machxo_image *image)
+{
+	struct machxo_options options;
+	struct machxo_session s;
+	struct machxo_device *dev;
+	struct machxo_counters c;
+	char name[80];
+	double start, elapsed;
+	int pages_written;
+	int status;
+	snprintf(name, sizeof name, "sim:pages=%d,speed=%u", bc->pages, bc->speed);
+	dev = open_device(name, bc->mode, 0x40);
+	if (dev == 0)
+		return 0;
+	if (bc->mode == MODE_SPI)
+		set_spi_clock(dev, 0, bc->speed);
+	else
+		set_i2c_speed(dev, bc->speed);
+	set_adaptive_polling(dev, bc->adaptive_polling);
+	set_instrumentation(dev, 1);
+	default_options(&options);
+	options.batch_pages = bc->batch_pages;
+	options.force = 1;
+	init_session(&s, dev, &options);
+	start = now();
+	status = program_image(&s, image);
+	elapsed = now() - start;
+	get_instrumentation_totals(dev, &c);
+	close_device(dev);
+	if (status != 1)
+	{
+		fprintf(stderr, "Run failed: %s\n", s.message);
+		return 0;
+	}
+	pages_written = s.stats.program_bytes / MACHXO2_PAGE_SIZE;
+	printf("%-4s %5u %6d %6d %-8s %8.3f %9.0f %9.0f %9.0f %8.2f %8.1f %6u %6u\n",
+	       bc->mode == MODE_SPI ? "spi" : "i2c", bc->speed / 1000, bc->pages, bc->batch_pages,
+	       bc->adaptive_polling ? "adaptive" : "fixed", elapsed,
+	       pages_written / s.stats.program_time, s.stats.program_bytes / s.stats.program_time,
+	       s.stats.verify_bytes / s.stats.verify_time, (double)c.ioctls / pages_written,
+	       c.sleep_usecs / 1000.0, percentile(&c, 0.5), percentile(&c, 0.99));
+	fflush(stdout);
+	return 1;
+}
+
+static int sweep(int mode, uint32_t speed, const int *sizes, int num_sizes, const int *batches, int num_batches)
+{
+	struct machxo_image image;
+	struct bench_config bc;
+	uint8_t *fuses;
+	int i, j, k;
+	bc.mode = mode;
+	bc.speed = speed;
+	for (i = 0; i < num_sizes; i++)
+	{
+		if (make_image(&image, sizes[i], &fuses) != 1)
+			return 0;
+		bc.pages = sizes[i];
+		for (j = 0; j < num_batches; j++)
+			for (k = 1; k >= 0; k--)
+			{
+				bc.batch_pages = batches[j];
+				bc.adaptive_polling = k;
+				if (run(&bc, &image) != 1)
+					return 0;
+			}
+		free_image(&image);
+		free(fuses);
+	}
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	int quick = argc > 1 && strcmp(argv[1], "-q") == 0;
+	int num_sizes;
+	printf("Erase, program and verify of an image with about half the pages zero, on the simulated device\n");
+	printf("%-4s %5s %6s %6s %-8s %8s %9s %9s %9s %8s %8s %6s %6s\n", "bus", "kHz", "pages", "batch", "polling",
+	       "seconds", "pages/s", "prog B/s", "read B/s", "ioctl/pg", "sleep ms", "p50 us", "p99 us");
+	num_sizes = quick ? 1 : sizeof spi_pages / sizeof spi_pages[0];
+	if (sweep(MODE_SPI, DEFAULT_SPI_SPEED, spi_pages, num_sizes, spi_batches,
+		  sizeof spi_batches / sizeof spi_batches[0]) != 1)
+		return 1;
+	num_sizes = quick ? 1 : sizeof i2c_pages / sizeof i2c_pages[0];
+	if (sweep(MODE_I2C, DEFAULT_I2C_SPEED, i2c_pages, num_sizes, i2c_batches,
+		  sizeof i2c_batches / sizeof i2c_batches[0]) != 1)
+		return 1;
+	if (sweep(MODE_I2C, 1000000, i2c_pages, 1, i2c_batches, sizeof i2c_batches / sizeof i2c_batches[0]) != 1)
+		return 1;
+	return 0;
+}
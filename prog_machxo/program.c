@@ -0,0 +1,673 @@
+/*
+ * Programming a MachXO2 from an image, for prog_machxo and other programs.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * Everything about one operation is in the session, and everything about
+ * the device in its handle, so any number of devices can be programmed from
+ * different threads.  Failures are returned as 0 with the error code and
+ * message in the session; nothing here exits.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "image.h"
+#include "jedec.h"
+#include "machxo.h"
+#include "program.h"
+
+/*
+ * Zero runs shorter than this are read anyway.  Jumping costs an address
+ * write and a new read command, two bus messages, which take about as long
+ * as reading this many pages.
+ */
+#define VERIFY_MIN_GAP 8
+
+// Batches per progress report when programming
+#define PROGRESS_BATCHES 8
+
+static const char *error_strings[MACHXO_NUM_ERRORS] = {
+	[MACHXO_OK] = "Success",
+	[MACHXO_ERR_DEVICE_ID] = "Device ID doesn't make sense",
+	[MACHXO_ERR_ENABLE] = "Failed to enable configuration",
+	[MACHXO_ERR_ERASE] = "Failed to erase",
+	[MACHXO_ERR_PROGRAM] = "Failed to program",
+	[MACHXO_ERR_VERIFY] = "Verify failed",
+	[MACHXO_ERR_IMAGE] = "Image does not fit the device",
+	[MACHXO_ERR_DIFFERS] = "Device differs from the image, a full reprogram is needed",
+	[MACHXO_ERR_SRAM] = "Failed to load SRAM",
+	[MACHXO_ERR_INPUT] = "Input file error",
+	[MACHXO_ERR_NO_MEMORY] = "Out of memory",
+};
+
+const char *machxo_strerror(int error)
+{
+	if (error < 0 || error >= MACHXO_NUM_ERRORS)
+		return "Unknown error";
+	return error_strings[error];
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void say(struct machxo_session *s, const char *format, ...)
+{
+	char text[256];
+	va_list ap;
+	va_start(ap, format);
+	vsnprintf(text, sizeof text, format, ap);
+	va_end(ap);
+	if (s->options->message != 0)
+		s->options->message(s->options->arg, text);
+	else
+		fprintf(stderr, "%s\n", text);
+}
+
+static int fail(struct machxo_session *s, int error, const char *message)
+{
+	say(s, "%s", message);
+	if (s->error == MACHXO_OK)
+	{
+		s->error = error;
+		snprintf(s->message, sizeof s->message, "%s", message);
+	}
+	return 0;
+}
+
+static void progress(struct machxo_session *s, int stage, int done, int total)
+{
+	if (s->options->progress != 0)
+		s->options->progress(s->options->arg, stage, done, total);
+}
+
+void default_options(struct machxo_options *options)
+{
+	memset(options, 0, sizeof *options);
+	options->op = MACHXO_ERASE | MACHXO_FLASH | MACHXO_VERIFY;
+	options->batch_pages = MACHXO2_MAX_BATCH_PAGES;
+	options->hash_page = -1;
+}
+
+void init_session(struct machxo_session *s, struct machxo_device *dev, const struct machxo_options *options)
+{
+	memset(s, 0, sizeof *s);
+	s->dev = dev;
+	s->options = options;
+	s->erase_sections = ERASE_FEATURE_ROW | ERASE_CONFIGURATION | ERASE_USER_FLASH;
+	if (options->message != 0)
+		set_message_handler(dev, options->message, options->arg);
+}
+
+static int abort_and_clean_up(struct machxo_session *s, int error, char *message)
+{
+	erase_flash_sections(s->dev, s->erase_sections);
+	wait_not_busy(s->dev);
+	refresh(s->dev);
+	fail(s, error, message);
+	return fail(s, error, "Aborting. Flash is erased.");
+}
+
+static int just_abort(struct machxo_session *s, int error, char *message)
+{
+	refresh(s->dev);
+	fail(s, error, message);
+	return fail(s, error, "Aborting. Flash may be incorrect.");
+}
+
+static int ufm_abort(struct machxo_session *s, int error, char *message)
+{
+	disable_configuration(s->dev);
+	fail(s, error, message);
+	return fail(s, error, "Aborting. User flash may be incorrect.");
+}
+
+/*
+ * Quick check whether the device is configured from this very image.  Only
+ * the usercode, the feature row and bits, and the hash page are read, which
+ * takes a few milliseconds.  Many designs share the default usercode and
+ * feature row, so without a hash page nothing identifies the image.
+ */
+static int already_programmed(struct machxo_session *s, struct machxo_image *image)
+{
+	struct machxo_device *dev = s->dev;
+	int hash_page = s->options->hash_page;
+	uint32_t user_code;
+	uint8_t page[MACHXO2_PAGE_SIZE];
+	if (hash_page < 0 || !is_configured(dev))
+		return 0;
+	if (image->has_user_code)
+		if (read_user_code(dev, &user_code) != 1 || user_code != image->user_code)
+			return 0;
+	if (image->has_feature_row)
+		if (verify_feature_row(dev, image->feature_row) != 1 || verify_feature_bits(dev, image->feature_bits) != 1)
+			return 0;
+	if (set_configuration_flash_address(dev, hash_page, 1) != 1 || read_flash_page(dev, page) != 1)
+		return 0;
+	return memcmp(page, image->hash_data, MACHXO2_PAGE_SIZE) == 0;
+}
+
+/*
+ * Offline mode stops the user logic, transparent mode leaves it running
+ * but can not erase or program the configuration flash.
+ */
+static int enter_configuration(struct machxo_session *s, int transparent)
+{
+	double start = now();
+	if (check_device_id_quick(s->dev) != 1)
+		return fail(s, MACHXO_ERR_DEVICE_ID, "Device ID doesn't make sense.  Exiting.");
+	if ((transparent ? enable_transparent_configuration(s->dev) : enable_offline_configuration(s->dev)) != 1 ||
+	    wait_not_busy(s->dev) != 1)
+		return fail(s, MACHXO_ERR_ENABLE, "Failed to enable configuration.");
+	s->stats.enable_time += now() - start;
+	return 1;
+}
+
+static int erase(struct machxo_session *s)
+{
+	double start = now();
+	progress(s, MACHXO_STAGE_ERASE, 0, 1);
+	if (erase_flash_sections(s->dev, s->erase_sections) != 1 || wait_not_busy(s->dev) != 1)
+		return fail(s, MACHXO_ERR_ERASE, "Failed to erase flash.");
+	s->stats.erase_time += now() - start;
+	progress(s, MACHXO_STAGE_ERASE, 1, 1);
+	return 1;
+}
+
+// A hash page that prepare_hash_page() has not filled in is all zero
+static int hash_page_ready(struct machxo_session *s, struct machxo_image *image)
+{
+	if (s->options->hash_page < 0 || image->hash_data[0] != 0)
+		return 1;
+	return fail(s, MACHXO_ERR_IMAGE, "Hash page not prepared for the image.");
+}
+
+// The runs of block 'i', which are next to each other as runs are listed block by block
+static struct page_run *block_runs(struct machxo_image *image, int i, int *num_runs)
+{
+	int first, n;
+	for (first = 0; first < image->num_runs && image->runs[first].block < i; first++)
+		;
+	for (n = 0; first + n < image->num_runs && image->runs[first + n].block == i; n++)
+		;
+	*num_runs = n;
+	return image->runs + first;
+}
+
+static int image_run_bytes(struct machxo_image *image, int user_flash_only)
+{
+	int bytes = 0;
+	int i;
+	for (i = 0; i < image->num_runs; i++)
+		if (!user_flash_only || image->blocks[image->runs[i].block].is_user_flash)
+			bytes += image->runs[i].num_pages * MACHXO2_PAGE_SIZE;
+	return bytes;
+}
+
+/*
+ * Program the non-zero pages of 'block', listed in 'runs'.  Zero pages are
+ * what the erase left behind, so the flash address jumps over them.  Long
+ * runs are sent a few batches at a time, for progress reports; the address
+ * carries on from where the last piece ended.
+ */
+static int program_block_runs(struct machxo_session *s, struct image_block *block, struct page_run *runs, int num_runs,
+			      int *done, int total)
+{
+	struct machxo_stats *st = &s->stats;
+	int batch_pages = s->options->batch_pages;
+	int piece_bytes = (batch_pages > 0 ? batch_pages : 1) * PROGRESS_BATCHES * MACHXO2_PAGE_SIZE;
+	int page_address = block->address / MACHXO2_PAGE_SIZE;
+	int num_pages = block->data_len / MACHXO2_PAGE_SIZE;
+	double start = now();
+	int i, offset, len, n;
+	for (i = 0; i < num_runs; i++)
+	{
+		offset = runs[i].first_page * MACHXO2_PAGE_SIZE;
+		len = runs[i].num_pages * MACHXO2_PAGE_SIZE;
+		if (set_configuration_flash_address(s->dev, page_address + runs[i].first_page, block->is_user_flash) != 1)
+			return 0;
+		for (; len > 0; offset += n, len -= n)
+		{
+			n = len < piece_bytes ? len : piece_bytes;
+			if (program_configuration_flash_pages(s->dev, block->data + offset, n, batch_pages) != 1)
+				return 0;
+			st->program_bytes += n;
+			*done += n;
+			progress(s, MACHXO_STAGE_PROGRAM, *done, total);
+		}
+		num_pages -= runs[i].num_pages;
+	}
+	st->program_time += now() - start;
+	st->program_pages_saved += num_pages;
+	st->program_jumps += num_runs > 0 ? num_runs - 1 : -1;
+	return 1;
+}
+
+/*
+ * Verify 'block'.  Right after an erase the zero pages are known to be zero,
+ * so only the runs are read back, with runs less than VERIFY_MIN_GAP pages
+ * apart read as one.  Otherwise the whole block is read.
+ */
+static int verify_block_runs(struct machxo_session *s, struct image_block *block, struct page_run *runs, int num_runs,
+			     int erased, int *done, int total)
+{
+	struct machxo_stats *st = &s->stats;
+	int page_address = block->address / MACHXO2_PAGE_SIZE;
+	int num_pages = block->data_len / MACHXO2_PAGE_SIZE;
+	double start = now();
+	int jumps = -1;
+	int run_bytes;
+	int i, j;
+	if (!erased)
+	{
+		if (set_configuration_flash_address(s->dev, page_address, block->is_user_flash) != 1 ||
+		    verify_configuration_flash(s->dev, block->data, block->data_len) != 1)
+			return 0;
+		st->verify_time += now() - start;
+		st->verify_bytes += block->data_len;
+		for (i = 0; i < num_runs; i++)
+			*done += runs[i].num_pages * MACHXO2_PAGE_SIZE;
+		progress(s, MACHXO_STAGE_VERIFY, *done, total);
+		return 1;
+	}
+	for (i = 0; i < num_runs; i = j)
+	{
+		int first = runs[i].first_page;
+		int end = first + runs[i].num_pages;
+		run_bytes = runs[i].num_pages * MACHXO2_PAGE_SIZE;
+		for (j = i + 1; j < num_runs && runs[j].first_page - end < VERIFY_MIN_GAP; j++)
+		{
+			end = runs[j].first_page + runs[j].num_pages;
+			run_bytes += runs[j].num_pages * MACHXO2_PAGE_SIZE;
+		}
+		if (set_configuration_flash_address(s->dev, page_address + first, block->is_user_flash) != 1 ||
+		    verify_configuration_flash(s->dev, block->data + first * MACHXO2_PAGE_SIZE, (end - first) * MACHXO2_PAGE_SIZE) != 1)
+			return 0;
+		num_pages -= end - first;
+		st->verify_bytes += (end - first) * MACHXO2_PAGE_SIZE;
+		// Progress counts the runs only, the gaps are not part of the total
+		*done += run_bytes;
+		progress(s, MACHXO_STAGE_VERIFY, *done, total);
+		jumps++;
+	}
+	st->verify_time += now() - start;
+	st->verify_pages_saved += num_pages;
+	st->verify_jumps += jumps;
+	return 1;
+}
+
+// Blocks are programmed and verified one at a time, so the totals are only a guide for verify
+struct block_progress {
+	int program_done;
+	int program_total;
+	int verify_done;
+	int verify_total;
+};
+
+static int write_block(struct machxo_session *s, struct image_block *block, struct page_run *runs, int num_runs,
+		       struct block_progress *bp)
+{
+	int op = s->options->op;
+	char message[80];
+	if ((block->address / MACHXO2_PAGE_SIZE) * MACHXO2_PAGE_SIZE != block->address)
+		return abort_and_clean_up(s, MACHXO_ERR_IMAGE, "Flash address not multiple of page size");
+	if ((block->data_len / MACHXO2_PAGE_SIZE) * MACHXO2_PAGE_SIZE != block->data_len)
+		return abort_and_clean_up(s, MACHXO_ERR_IMAGE, "Data block size not multiple of page size");
+	if ((op & MACHXO_FLASH) &&
+	    program_block_runs(s, block, runs, num_runs, &bp->program_done, bp->program_total) != 1)
+		return abort_and_clean_up(s, MACHXO_ERR_PROGRAM, "Failed to program device.");
+	if ((op & MACHXO_VERIFY) &&
+	    verify_block_runs(s, block, runs, num_runs, (op & MACHXO_ERASE) &&
+			      (s->erase_sections & (block->is_user_flash ? ERASE_USER_FLASH : ERASE_CONFIGURATION)),
+			      &bp->verify_done, bp->verify_total) != 1)
+	{
+		snprintf(message, sizeof message, "Flash verify failed (block length = %d).  "
+			 "Programming not completed.", block->data_len);
+		return just_abort(s, MACHXO_ERR_VERIFY, message);
+	}
+	return 1;
+}
+
+static int write_feature_row(struct machxo_session *s, uint8_t *feature_row, uint8_t *feature_bits)
+{
+	int op = s->options->op;
+	if (op & MACHXO_FLASH)
+	{
+		if (program_feature_row(s->dev, feature_row) != 1 || wait_not_busy(s->dev) != 1)
+			return abort_and_clean_up(s, MACHXO_ERR_PROGRAM, "Failed to program feature row");
+		if (program_feature_bits(s->dev, feature_bits) != 1 || wait_not_busy(s->dev) != 1)
+			return abort_and_clean_up(s, MACHXO_ERR_PROGRAM, "Failed to program feature bits");
+	}
+	if (op & MACHXO_VERIFY)
+	{
+		if (verify_feature_row(s->dev, feature_row) != 1)
+			return just_abort(s, MACHXO_ERR_VERIFY, "Failed to verify feature row.  Programming not completed.");
+		if (verify_feature_bits(s->dev, feature_bits) != 1)
+			return just_abort(s, MACHXO_ERR_VERIFY, "Failed to verify feature bits.  Programming not completed.");
+	}
+	return 1;
+}
+
+static int write_user_code(struct machxo_session *s, uint32_t user_code)
+{
+	int op = s->options->op;
+	if (op & MACHXO_FLASH)
+		if (program_user_code(s->dev, user_code) != 1 || wait_not_busy(s->dev) != 1)
+			return abort_and_clean_up(s, MACHXO_ERR_PROGRAM, "Failed to program user code");
+	if (op & MACHXO_VERIFY)
+		if (verify_user_code(s->dev, user_code) != 1)
+			return just_abort(s, MACHXO_ERR_VERIFY, "Failed to verify user code.  Programming not completed.");
+	return 1;
+}
+
+/*
+ * Set DONE and boot the new image.  Over the GPMC bridge the refresh is the
+ * last command, as nothing answers once it has replaced the bridge design.
+ */
+static int finish(struct machxo_session *s)
+{
+	struct machxo_device *dev = s->dev;
+	double start = now();
+	int ok = program_done(dev) == 1 && wait_not_busy(dev) == 1;
+	if (ok && bus_survives_refresh(dev))
+		ok = refresh(dev) == 1 && wait_not_busy(dev) == 1;
+	else if (ok)
+	{
+		say(s, "Refreshing the device.  The GPMC bridge goes away until the new design brings it back.");
+		refresh(dev);
+	}
+	s->stats.finish_time += now() - start;
+	if (!ok)
+		return just_abort(s, MACHXO_ERR_PROGRAM, "Failed to program DONE or refresh.  Programming not completed.");
+	progress(s, MACHXO_STAGE_DONE, 1, 1);
+	return 1;
+}
+
+/*
+ * Erase, program and verify as selected by the options.  A device that
+ * already holds the image is left alone unless 'force' is set, which is
+ * success with 'already_programmed' set.
+ */
+int program_image(struct machxo_session *s, struct machxo_image *image)
+{
+	struct machxo_device *dev = s->dev;
+	int hash_page = s->options->hash_page;
+	int op = s->options->op;
+	struct block_progress bp;
+	struct page_run *runs;
+	int num_runs;
+	int i;
+
+	if (hash_page_ready(s, image) != 1)
+		return 0;
+	s->erase_sections = image->erase_sections;
+	// Programming only sets bits, so the hash page needs the UFM erased
+	if (hash_page >= 0)
+		s->erase_sections |= ERASE_USER_FLASH;
+	memset(&bp, 0, sizeof bp);
+	bp.program_total = image_run_bytes(image, 0);
+	bp.verify_total = bp.program_total;
+	// Look for the image with the design still running, so that nothing to do disturbs nothing
+	if ((op & MACHXO_ERASE) && (op & MACHXO_FLASH) && hash_page >= 0 && !s->options->force)
+	{
+		if (enter_configuration(s, 1) != 1)
+			return 0;
+		s->already_programmed = already_programmed(s, image);
+		disable_configuration(dev);
+		if (s->already_programmed)
+		{
+			say(s, "Device already programmed with this image.  Use -F to reprogram.");
+			return 1;
+		}
+	}
+	// Initialize flash now that the JEDEC file looks OK
+	if (enter_configuration(s, 0) != 1)
+		return 0;
+	if ((op & MACHXO_ERASE) && erase(s) != 1)
+		return 0;
+	for (i = 0; i < image->num_blocks; i++)
+	{
+		runs = block_runs(image, i, &num_runs);
+		if (write_block(s, &image->blocks[i], runs, num_runs, &bp) != 1)
+			return 0;
+	}
+	if (hash_page >= 0)
+	{
+		if (op & MACHXO_FLASH)
+			if (set_configuration_flash_address(dev, hash_page, 1) != 1 ||
+			    program_configuration_flash(dev, image->hash_data, MACHXO2_PAGE_SIZE) != 1 || wait_not_busy(dev) != 1)
+				return abort_and_clean_up(s, MACHXO_ERR_PROGRAM, "Failed to program hash page");
+		if (op & MACHXO_VERIFY)
+			if (set_configuration_flash_address(dev, hash_page, 1) != 1 ||
+			    verify_configuration_flash(dev, image->hash_data, MACHXO2_PAGE_SIZE) != 1)
+				return just_abort(s, MACHXO_ERR_VERIFY, "Failed to verify hash page.  Programming not completed.");
+	}
+	if (image->has_feature_row && write_feature_row(s, image->feature_row, image->feature_bits) != 1)
+		return 0;
+	if (image->has_user_code && write_user_code(s, image->user_code) != 1)
+		return 0;
+	return finish(s);
+}
+
+// The design hash in the hash page, which a UFM-only update leaves as it is
+static int same_design(struct machxo_session *s, struct machxo_image *image)
+{
+	uint8_t page[MACHXO2_PAGE_SIZE];
+	if (set_configuration_flash_address(s->dev, s->options->hash_page, 1) != 1 || read_flash_page(s->dev, page) != 1)
+		return 0;
+	return memcmp(page, image->hash_data, HASH_MAGIC_LEN) == 0 &&
+	       memcmp(page + HASH_DESIGN_OFFSET, image->hash_data + HASH_DESIGN_OFFSET, HASH_DESIGN_LEN) == 0;
+}
+
+/*
+ * Rewrite only the user flash (UFM).  The configuration flash, feature row
+ * and usercode must already match the image, as they are left untouched and
+ * the device is not refreshed.  The usercode, feature row and, when there is
+ * one, the hash page tell, which takes milliseconds; 'check_design' reads
+ * back the whole configuration flash as well.  It is all done in transparent
+ * mode, which can erase and program the UFM, so the design keeps running.
+ */
+int update_user_flash(struct machxo_session *s, struct machxo_image *image)
+{
+	struct machxo_device *dev = s->dev;
+	int hash_page = s->options->hash_page;
+	struct block_progress bp;
+	struct image_block *block;
+	struct page_run *runs;
+	double start;
+	int num_runs;
+	int i;
+
+	if (hash_page_ready(s, image) != 1)
+		return 0;
+	memset(&bp, 0, sizeof bp);
+	bp.program_total = image_run_bytes(image, 1);
+	bp.verify_total = bp.program_total;
+	if (enter_configuration(s, 1) != 1)
+		return 0;
+	if ((image->has_user_code && verify_user_code(dev, image->user_code) != 1) ||
+	    (image->has_feature_row && (verify_feature_row(dev, image->feature_row) != 1 ||
+					verify_feature_bits(dev, image->feature_bits) != 1)))
+		return ufm_abort(s, MACHXO_ERR_DIFFERS, "Usercode or feature row differs from the image.  A full reprogram is needed.");
+	if (hash_page >= 0 && same_design(s, image) != 1)
+		return ufm_abort(s, MACHXO_ERR_DIFFERS, "Hash page shows another design.  A full reprogram is needed.");
+	for (i = 0; s->options->check_design && i < image->num_blocks; i++)
+	{
+		block = &image->blocks[i];
+		if (block->is_user_flash)
+			continue;
+		if (set_configuration_flash_address(dev, block->address / MACHXO2_PAGE_SIZE, 0) != 1 ||
+		    verify_configuration_flash(dev, block->data, block->data_len) != 1)
+			return ufm_abort(s, MACHXO_ERR_DIFFERS, "Configuration flash differs from the image.  A full reprogram is needed.");
+	}
+	start = now();
+	progress(s, MACHXO_STAGE_ERASE, 0, 1);
+	if (erase_user_flash(dev) != 1 || wait_not_busy(dev) != 1)
+		return ufm_abort(s, MACHXO_ERR_ERASE, "Failed to erase user flash.");
+	s->stats.erase_time += now() - start;
+	progress(s, MACHXO_STAGE_ERASE, 1, 1);
+	for (i = 0; i < image->num_blocks; i++)
+	{
+		block = &image->blocks[i];
+		if (!block->is_user_flash)
+			continue;
+		if ((block->address / MACHXO2_PAGE_SIZE) * MACHXO2_PAGE_SIZE != block->address ||
+		    (block->data_len / MACHXO2_PAGE_SIZE) * MACHXO2_PAGE_SIZE != block->data_len)
+			return ufm_abort(s, MACHXO_ERR_IMAGE, "User flash block not multiple of page size");
+		runs = block_runs(image, i, &num_runs);
+		if (program_block_runs(s, block, runs, num_runs, &bp.program_done, bp.program_total) != 1)
+			return ufm_abort(s, MACHXO_ERR_PROGRAM, "Failed to program user flash.");
+		if (verify_block_runs(s, block, runs, num_runs, 1, &bp.verify_done, bp.verify_total) != 1)
+			return ufm_abort(s, MACHXO_ERR_VERIFY, "Failed to verify user flash.");
+	}
+	if (hash_page >= 0)
+	{
+		if (set_configuration_flash_address(dev, hash_page, 1) != 1 ||
+		    program_configuration_flash(dev, image->hash_data, MACHXO2_PAGE_SIZE) != 1 || wait_not_busy(dev) != 1 ||
+		    set_configuration_flash_address(dev, hash_page, 1) != 1 ||
+		    verify_configuration_flash(dev, image->hash_data, MACHXO2_PAGE_SIZE) != 1)
+			return ufm_abort(s, MACHXO_ERR_PROGRAM, "Failed to program hash page");
+	}
+	disable_configuration(dev);
+	progress(s, MACHXO_STAGE_DONE, 1, 1);
+	return 1;
+}
+
+/*
+ * Load a bitstream straight into configuration SRAM.  Flash is left alone,
+ * so the device returns to the flash design on the next refresh or power
+ * cycle.
+ */
+int load_sram(struct machxo_session *s, uint8_t *data, int data_len)
+{
+	struct machxo_device *dev = s->dev;
+	double start = now();
+	if (check_sram_length(dev, data_len) != 1)
+		return fail(s, MACHXO_ERR_SRAM, "Bitstream can not be loaded on this bus.");
+	if (check_device_id_quick(dev) != 1)
+		return fail(s, MACHXO_ERR_DEVICE_ID, "Device ID doesn't make sense.  Exiting.");
+	if (enable_sram_configuration(dev) != 1 || wait_not_busy(dev) != 1)
+		return fail(s, MACHXO_ERR_ENABLE, "Failed to enable configuration.");
+	s->stats.enable_time += now() - start;
+	start = now();
+	progress(s, MACHXO_STAGE_ERASE, 0, 1);
+	if (erase_sram(dev) != 1 || wait_not_busy(dev) != 1 || reset_configuration_flash_address(dev) != 1)
+	{
+		disable_configuration(dev);
+		return fail(s, MACHXO_ERR_ERASE, "Failed to erase SRAM.");
+	}
+	s->stats.erase_time += now() - start;
+	progress(s, MACHXO_STAGE_ERASE, 1, 1);
+	start = now();
+	if (program_sram(dev, data, data_len) != 1 || wait_not_busy(dev) != 1)
+	{
+		disable_configuration(dev);
+		return fail(s, MACHXO_ERR_SRAM, "Failed to load SRAM.");
+	}
+	s->stats.program_time += now() - start;
+	s->stats.program_bytes += data_len;
+	progress(s, MACHXO_STAGE_PROGRAM, data_len, data_len);
+	if (disable_configuration(dev) != 1 || !is_configured(dev))
+		return fail(s, MACHXO_ERR_SRAM, "Device did not wake up from the bitstream.");
+	progress(s, MACHXO_STAGE_DONE, 1, 1);
+	return 1;
+}
+
+/*
+ * Program straight from the JEDEC file, without building an image.  Fuse
+ * rows arrive in pieces of at most 'piece_bytes', so memory use does not
+ * grow with the size of the device.  There is no image to compare with, so
+ * the already programmed check is not done.
+ */
+int program_jedec_stream(struct machxo_session *s, char *fname, int piece_bytes)
+{
+	struct machxo_image piece;
+	struct image_block block;
+	struct block_progress bp;
+	struct jedec_file jf;
+	int section;
+	uint32_t address;
+	uint8_t *data;
+	int data_len;
+	int tag_data_seen = 0;
+	int status = 0;
+
+	memset(&bp, 0, sizeof bp);
+	if (open_jedec(&jf, fname, piece_bytes) != 1)
+	{
+		close_jedec(&jf);
+		return fail(s, MACHXO_ERR_INPUT, "Input file error.");
+	}
+	// Assume there will be one initial section that we can safely ignore
+	if (get_next_jedec_section(&jf, &section, &address, &data, &data_len) != 1)
+	{
+		close_jedec(&jf);
+		return fail(s, MACHXO_ERR_INPUT, "Input file error.");
+	}
+	if (enter_configuration(s, 0) != 1 || ((s->options->op & MACHXO_ERASE) && erase(s) != 1))
+	{
+		close_jedec(&jf);
+		return 0;
+	}
+	do
+	{
+		if (get_next_jedec_section(&jf, &section, &address, &data, &data_len) != 1)
+		{
+			abort_and_clean_up(s, MACHXO_ERR_INPUT, "Input file error.");
+			goto out;
+		}
+		switch (section)
+		{
+		case SECTION_NOTE:
+			if (strstr((char*)data, "TAG DATA") != 0)
+				tag_data_seen = 1;
+			break;
+		case SECTION_FUSE_MAP:
+			block.address = address;
+			block.is_user_flash = tag_data_seen;
+			block.data = data;
+			block.data_len = data_len;
+			// Each piece is an image of one block, to find its runs
+			memset(&piece, 0, sizeof piece);
+			piece.blocks = &block;
+			piece.num_blocks = 1;
+			if (find_page_runs(&piece) != 1)
+			{
+				abort_and_clean_up(s, MACHXO_ERR_NO_MEMORY, "Out of memory");
+				goto out;
+			}
+			if (write_block(s, &block, piece.runs, piece.num_runs, &bp) != 1)
+			{
+				free(piece.runs);
+				goto out;
+			}
+			free(piece.runs);
+			break;
+		case SECTION_ARCH:
+			if (write_feature_row(s, data, data + 8) != 1)
+				goto out;
+			break;
+		case SECTION_USERCODE:
+			if (write_user_code(s, address) != 1)
+				goto out;
+			break;
+		case SECTION_SECURITY_FUSE:
+			if (data[0] != '0')
+				say(s, "Security fuse not implemented");
+			break;
+		default:
+			break;
+		}
+	} while (section != SECTION_END);
+	status = finish(s);
+out:
+	close_jedec(&jf);
+	return status;
+}
@@ -0,0 +1,91 @@
+/*
+ * Programming a MachXO2 from an image, for prog_machxo and other programs.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ */
+#ifndef _PROGRAM_H
+#define _PROGRAM_H 1
+#include <stdint.h>
+
+#include "image.h"
+#include "machxo.h"
+
+#define MACHXO_ERASE 1
+#define MACHXO_FLASH 2
+#define MACHXO_VERIFY 4
+
+// Error codes, see machxo_strerror()
+#define MACHXO_OK 0
+#define MACHXO_ERR_DEVICE_ID 1
+#define MACHXO_ERR_ENABLE 2
+#define MACHXO_ERR_ERASE 3
+#define MACHXO_ERR_PROGRAM 4
+#define MACHXO_ERR_VERIFY 5
+#define MACHXO_ERR_IMAGE 6
+#define MACHXO_ERR_DIFFERS 7
+#define MACHXO_ERR_SRAM 8
+#define MACHXO_ERR_INPUT 9
+#define MACHXO_ERR_NO_MEMORY 10
+#define MACHXO_NUM_ERRORS 11
+
+// Stages passed to the progress callback
+#define MACHXO_STAGE_ERASE 0
+#define MACHXO_STAGE_PROGRAM 1
+#define MACHXO_STAGE_VERIFY 2
+#define MACHXO_STAGE_DONE 3
+
+/*
+ * 'done' and 'total' are bytes of the stage, 'total' is 0 when it is not
+ * known in advance (stream mode).
+ */
+typedef void (*machxo_progress_fn)(void *arg, int stage, int done, int total);
+
+struct machxo_options {
+	int op;			// MACHXO_ERASE | MACHXO_FLASH | MACHXO_VERIFY
+	int batch_pages;	// Pages per SPI programming batch
+	int force;		// Program even if the hash page shows the image is there
+	int hash_page;		// UFM page for the image hash, -1 for none and always program
+	int check_design;	// Read back the configuration flash before a UFM-only update
+	machxo_progress_fn progress;
+	machxo_message_fn message;	// stderr when not set
+	void *arg;		// Passed to both callbacks
+};
+
+// Seconds spent in each phase, and what was moved
+struct machxo_stats {
+	double enable_time;	// Device ID check and entering configuration mode
+	double erase_time;
+	double finish_time;	// Done bit, refresh and leaving configuration mode
+	double program_time;
+	int program_bytes;
+	double verify_time;
+	int verify_bytes;
+	int program_pages_saved;
+	int program_jumps;
+	int verify_pages_saved;
+	int verify_jumps;
+};
+
+/*
+ * One operation on one device.  The caller owns the session and the device;
+ * nothing is allocated here, except for the pieces of stream mode.
+ */
+struct machxo_session {
+	struct machxo_device *dev;
+	const struct machxo_options *options;
+	uint32_t erase_sections;
+	int already_programmed;	// Left alone, the device holds the image
+	struct machxo_stats stats;
+	int error;		// First error
+	char message[128];	// and what was reported with it
+};
+
+void default_options(struct machxo_options *options);
+void init_session(struct machxo_session *s, struct machxo_device *dev, const struct machxo_options *options);
+int program_image(struct machxo_session *s, struct machxo_image *image);
+int update_user_flash(struct machxo_session *s, struct machxo_image *image);
+int load_sram(struct machxo_session *s, uint8_t *data, int data_len);
+int program_jedec_stream(struct machxo_session *s, char *fname, int piece_bytes);
+const char *machxo_strerror(int error);
+
+#endif
@@ -0,0 +1,745 @@
+/*
+ * Software model of the Lattice MachXO2 configuration engine.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * The model sits below the ioctl() interface, so the SPI and I2C message
+ * building in machxo.c runs unchanged against it.  Bus and operation times
+ * are tracked on a clock that runs ahead of the real one during an ioctl,
+ * and the ioctl does not return before the real clock has caught up.  A
+ * command that arrives while the device is busy is ignored, just like the
+ * real device does, and counted.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/ioctl.h>
+
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include <linux/types.h>
+#include <linux/spi/spidev.h>
+
+#include "machxo.h"
+#include "sim.h"
+
+#define STATUS_DONE 0x00000100
+#define STATUS_ENABLED 0x00000200
+#define STATUS_BUSY 0x00001000
+#define STATUS_FAIL 0x00002000
+
+struct machxo_sim {
+	int mode;
+	uint32_t idcode;
+	uint16_t i2c_addr;
+	uint32_t speed;
+	uint32_t max_speed;	// Reads are corrupted above this SPI clock, 0 for no limit
+	uint32_t glitches;
+	uint32_t bufsiz;
+	int nostart;		// The I2C adapter can continue a message without a START
+	uint32_t latency[SIM_NUM_LATENCIES];	// usecs
+	int cfg_pages;
+	int ufm_pages;
+	uint8_t *cfg;
+	uint8_t *ufm;
+	uint8_t feature_row[8];
+	uint8_t feature_bits[2];
+	uint32_t usercode;
+	int enabled;
+	int sram_loaded;
+	int done;
+	int configured;
+	int fail;
+	int ufm_region;		// address pointer
+	int page;
+	uint64_t busy_until;	// ns
+	uint64_t now;		// ns, bus time of the byte being transferred
+	// Current command frame (one CS assertion or one I2C transaction)
+	int in_frame;
+	uint8_t header[4];
+	int header_len;
+	int header_need;
+	int started;
+	int ignore;
+	uint8_t *payload;
+	int payload_len;
+	int payload_size;
+	int read_pos;
+	int read_pages;
+	// Statistics
+	unsigned long ioctls;
+	unsigned long commands;
+	unsigned long ignored;
+	char *state_file;
+};
+
+// Persistent state, followed by configuration flash and UFM
+struct sim_state {
+	char magic[8];
+	uint32_t cfg_pages;
+	uint32_t ufm_pages;
+	uint32_t usercode;
+	uint8_t feature_row[8];
+	uint8_t feature_bits[2];
+	uint8_t done;
+	uint8_t configured;
+};
+
+#define SIM_STATE_MAGIC "MXO2SIM1"
+
+static const char *latency_names[SIM_NUM_LATENCIES] = {
+	"page", "erase", "ufmerase", "sramerase", "feature", "done", "refresh"
+};
+
+static uint64_t real_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+	struct timespec ts;
+	ts.tv_sec = t / 1000000000ULL;
+	ts.tv_nsec = t % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+		;
+}
+
+static void load_state(struct machxo_sim *sim)
+{
+	struct sim_state state;
+	FILE *f = fopen(sim->state_file, "rb");
+	if (f == 0)
+		return; // Start with an erased device
+	if (fread(&state, sizeof state, 1, f) != 1 || memcmp(state.magic, SIM_STATE_MAGIC, 8) != 0
+	    || state.cfg_pages != sim->cfg_pages || state.ufm_pages != sim->ufm_pages
+	    || fread(sim->cfg, MACHXO2_PAGE_SIZE, sim->cfg_pages, f) != sim->cfg_pages
+	    || fread(sim->ufm, MACHXO2_PAGE_SIZE, sim->ufm_pages, f) != sim->ufm_pages)
+	{
+		fprintf(stderr, "sim: ignoring unusable state file %s\n", sim->state_file);
+		memset(sim->cfg, 0, sim->cfg_pages * MACHXO2_PAGE_SIZE);
+		memset(sim->ufm, 0, sim->ufm_pages * MACHXO2_PAGE_SIZE);
+		fclose(f);
+		return;
+	}
+	fclose(f);
+	sim->usercode = state.usercode;
+	memcpy(sim->feature_row, state.feature_row, 8);
+	memcpy(sim->feature_bits, state.feature_bits, 2);
+	sim->done = state.done;
+	sim->configured = state.configured;
+}
+
+static void save_state(struct machxo_sim *sim)
+{
+	struct sim_state state;
+	FILE *f = fopen(sim->state_file, "wb");
+	if (f == 0)
+	{
+		perror("sim");
+		return;
+	}
+	memset(&state, 0, sizeof state);
+	memcpy(state.magic, SIM_STATE_MAGIC, 8);
+	state.cfg_pages = sim->cfg_pages;
+	state.ufm_pages = sim->ufm_pages;
+	state.usercode = sim->usercode;
+	memcpy(state.feature_row, sim->feature_row, 8);
+	memcpy(state.feature_bits, sim->feature_bits, 2);
+	state.done = sim->done;
+	state.configured = sim->configured;
+	if (fwrite(&state, sizeof state, 1, f) != 1
+	    || fwrite(sim->cfg, MACHXO2_PAGE_SIZE, sim->cfg_pages, f) != sim->cfg_pages
+	    || fwrite(sim->ufm, MACHXO2_PAGE_SIZE, sim->ufm_pages, f) != sim->ufm_pages)
+		perror("sim");
+	fclose(f);
+}
+
+static int parse_option(struct machxo_sim *sim, const char *key, const char *value)
+{
+	unsigned long val = strtoul(value, 0, 0);
+	int i;
+	for (i = 0; i < SIM_NUM_LATENCIES; i++)
+		if (strcmp(key, latency_names[i]) == 0)
+		{
+			sim->latency[i] = val;
+			return 1;
+		}
+	if (strcmp(key, "pages") == 0)
+		sim->cfg_pages = val;
+	else if (strcmp(key, "ufmpages") == 0)
+		sim->ufm_pages = val;
+	else if (strcmp(key, "idcode") == 0)
+		sim->idcode = val;
+	else if (strcmp(key, "addr") == 0)
+		sim->i2c_addr = val;
+	else if (strcmp(key, "speed") == 0)
+		sim->speed = val;
+	else if (strcmp(key, "maxspeed") == 0)
+		sim->max_speed = val;
+	else if (strcmp(key, "bufsiz") == 0)
+		sim->bufsiz = val;
+	else if (strcmp(key, "nostart") == 0)
+		sim->nostart = val != 0;
+	else if (strcmp(key, "state") == 0)
+	{
+		free(sim->state_file);
+		sim->state_file = strdup(value);
+	}
+	else
+		return 0;
+	return 1;
+}
+
+struct machxo_sim *sim_open(int mode, const char *options)
+{
+	struct machxo_sim *sim;
+	char *opts, *tok, *save;
+	sim = (struct machxo_sim *)calloc(1, sizeof *sim);
+	if (sim == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	sim->mode = mode;
+	sim->idcode = SIM_DEFAULT_IDCODE;
+	sim->i2c_addr = 0x40;
+	sim->speed = mode == MODE_SPI ? 5000000 : 400000;
+	sim->bufsiz = 4096;
+	sim->cfg_pages = SIM_DEFAULT_CFG_PAGES;
+	sim->ufm_pages = SIM_DEFAULT_UFM_PAGES;
+	sim->latency[SIM_LATENCY_PAGE] = 180;
+	sim->latency[SIM_LATENCY_ERASE] = 300000;
+	sim->latency[SIM_LATENCY_ERASE_UFM] = 30000;
+	sim->latency[SIM_LATENCY_ERASE_SRAM] = 500;
+	sim->latency[SIM_LATENCY_FEATURE] = 180;
+	sim->latency[SIM_LATENCY_DONE] = 180;
+	sim->latency[SIM_LATENCY_REFRESH] = 3000;
+	if (options != 0 && *options != 0)
+	{
+		opts = strdup(options);
+		for (tok = strtok_r(opts, ",", &save); tok != 0; tok = strtok_r(0, ",", &save))
+		{
+			char *eq = strchr(tok, '=');
+			if (eq == 0)
+			{
+				fprintf(stderr, "sim: expected key=value, got '%s'\n", tok);
+				free(opts);
+				free(sim);
+				return 0;
+			}
+			*eq = 0;
+			if (!parse_option(sim, tok, eq + 1))
+			{
+				fprintf(stderr, "sim: unknown option '%s'\n", tok);
+				free(opts);
+				free(sim->state_file);
+				free(sim);
+				return 0;
+			}
+		}
+		free(opts);
+	}
+	sim->cfg = (uint8_t *)calloc(sim->cfg_pages, MACHXO2_PAGE_SIZE);
+	sim->ufm = (uint8_t *)calloc(sim->ufm_pages, MACHXO2_PAGE_SIZE);
+	if (sim->cfg == 0 || sim->ufm == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		sim_close(sim);
+		return 0;
+	}
+	if (sim->state_file != 0)
+		load_state(sim);
+	return sim;
+}
+
+void sim_close(struct machxo_sim *sim)
+{
+	if (sim == 0)
+		return;
+	if (sim->ignored)
+		fprintf(stderr, "sim: %lu of %lu commands were ignored because the device was busy\n",
+			sim->ignored, sim->commands);
+	if (sim->state_file != 0 && sim->cfg != 0 && sim->ufm != 0)
+		save_state(sim);
+	free(sim->state_file);
+	free(sim->cfg);
+	free(sim->ufm);
+	free(sim->payload);
+	free(sim);
+}
+
+uint32_t sim_bufsiz(struct machxo_sim *sim)
+{
+	return sim->bufsiz;
+}
+
+static int is_busy(struct machxo_sim *sim)
+{
+	return sim->now < sim->busy_until;
+}
+
+static void set_busy(struct machxo_sim *sim, int latency)
+{
+	sim->busy_until = sim->now + sim->latency[latency] * 1000ULL;
+}
+
+static uint32_t status_word(struct machxo_sim *sim)
+{
+	uint32_t status = 0;
+	if (sim->configured)
+		status |= STATUS_DONE;
+	if (sim->enabled)
+		status |= STATUS_ENABLED;
+	if (is_busy(sim))
+		status |= STATUS_BUSY;
+	if (sim->fail)
+		status |= STATUS_FAIL;
+	return status;
+}
+
+static int header_length(uint8_t command)
+{
+	switch (command)
+	{
+	case ISC_ENABLE:
+	case ISC_ENABLE_X:
+	case ISC_DISABLE:
+	case LSC_REFRESH:
+		return 3;
+	default:
+		return 4;
+	}
+}
+
+static void begin_command(struct machxo_sim *sim)
+{
+	uint8_t command = sim->header[0];
+	sim->started = 1;
+	sim->commands++;
+	switch (command)
+	{
+	case LSC_CHECK_BUSY:
+	case LSC_READ_STATUS:
+	case IDCODE_PUB:
+	case ISC_NOOP:
+		return;
+	}
+	if (is_busy(sim))
+	{
+		if (sim->ignored++ == 0)
+			fprintf(stderr, "sim: command %02x while busy ignored\n", command);
+		sim->ignore = 1;
+		return;
+	}
+	if (command == LSC_READ_INCR_NV || command == LSC_READ_UFM)
+		sim->read_pages = sim->header[3] + 0x100 * (sim->header[2] & 0x3F);
+}
+
+static uint8_t be_byte(uint32_t val, int idx)
+{
+	return idx < 4 ? (val >> (8 * (3 - idx))) & 0xFF : 0xFF;
+}
+
+static uint8_t read_page_byte(struct machxo_sim *sim, int ufm_region)
+{
+	int lead = 0;
+	int stride = MACHXO2_PAGE_SIZE;
+	int off, in_page;
+	uint8_t *mem = ufm_region ? sim->ufm : sim->cfg;
+	int pages = ufm_region ? sim->ufm_pages : sim->cfg_pages;
+	uint8_t val = 0xFF;
+	// Multi-page reads start with dummy data, and on I2C every page is padded
+	if (sim->read_pages > 1)
+	{
+		if (sim->mode == MODE_SPI)
+			lead = MACHXO2_PAGE_SIZE;
+		else
+		{
+			lead = 2 * MACHXO2_PAGE_SIZE;
+			stride = MACHXO2_PAGE_SIZE + 4;
+		}
+	}
+	if (sim->read_pos < lead)
+		return 0xFF;
+	off = sim->read_pos - lead;
+	in_page = off % stride;
+	if (in_page >= MACHXO2_PAGE_SIZE)
+		return 0xFF;
+	if (sim->page < pages)
+		val = mem[sim->page * MACHXO2_PAGE_SIZE + in_page];
+	if (in_page == MACHXO2_PAGE_SIZE - 1)
+		sim->page++;
+	return val;
+}
+
+static uint8_t read_byte(struct machxo_sim *sim)
+{
+	int pos = sim->read_pos;
+	uint8_t val;
+	switch (sim->header[0])
+	{
+	case IDCODE_PUB:
+		val = be_byte(sim->idcode, pos);
+		break;
+	case UIDCODE_PUB:
+		val = pos < 8 ? (uint8_t)(sim->idcode >> (pos % 4 * 8)) ^ (0x5A + pos) : 0xFF;
+		break;
+	case USERCODE:
+		val = be_byte(sim->usercode, pos);
+		break;
+	case LSC_READ_STATUS:
+		val = be_byte(status_word(sim), pos);
+		break;
+	case LSC_CHECK_BUSY:
+		val = is_busy(sim) ? 0x80 : 0x00;
+		break;
+	case LSC_READ_FEATURE:
+		val = pos < 8 ? sim->feature_row[pos] : 0xFF;
+		break;
+	case LSC_READ_FEABITS:
+		val = pos < 2 ? sim->feature_bits[pos] : 0xFF;
+		break;
+	case LSC_READ_INCR_NV:
+		val = read_page_byte(sim, sim->ufm_region);
+		break;
+	case LSC_READ_UFM:
+		val = read_page_byte(sim, 1);
+		break;
+	default:
+		val = 0xFF;
+		break;
+	}
+	sim->read_pos++;
+	return val;
+}
+
+static void add_payload(struct machxo_sim *sim, uint8_t val)
+{
+	if (sim->payload_len == sim->payload_size)
+	{
+		int size = sim->payload_size ? 2 * sim->payload_size : 256;
+		uint8_t *p = (uint8_t *)realloc(sim->payload, size);
+		if (p == 0)
+			return;
+		sim->payload = p;
+		sim->payload_size = size;
+	}
+	sim->payload[sim->payload_len++] = val;
+}
+
+static void program_page(struct machxo_sim *sim, int ufm_region)
+{
+	uint8_t *mem = ufm_region ? sim->ufm : sim->cfg;
+	int pages = ufm_region ? sim->ufm_pages : sim->cfg_pages;
+	int i;
+	if (!sim->enabled || sim->payload_len != MACHXO2_PAGE_SIZE || sim->page >= pages)
+	{
+		sim->fail = 1;
+		return;
+	}
+	// Erased bits read as 0, and programming can only set bits
+	for (i = 0; i < MACHXO2_PAGE_SIZE; i++)
+		mem[sim->page * MACHXO2_PAGE_SIZE + i] |= sim->payload[i];
+	sim->page++;
+	set_busy(sim, SIM_LATENCY_PAGE);
+}
+
+static void execute_command(struct machxo_sim *sim)
+{
+	uint8_t *p = sim->payload;
+	uint32_t operand = 0x10000 * sim->header[1] + 0x100 * sim->header[2] + sim->header[3];
+	int i;
+	switch (sim->header[0])
+	{
+	case ISC_ENABLE:
+	case ISC_ENABLE_X:
+		sim->enabled = 1;
+		sim->fail = 0;
+		break;
+	case ISC_DISABLE:
+		sim->enabled = 0;
+		if (sim->sram_loaded)
+			sim->configured = 1;
+		break;
+	case ISC_ERASE:
+		if (!sim->enabled)
+		{
+			sim->fail = 1;
+			break;
+		}
+		if (operand & ERASE_SRAM)
+		{
+			sim->sram_loaded = 0;
+			sim->configured = 0;
+		}
+		if (operand & ERASE_FEATURE_ROW)
+		{
+			memset(sim->feature_row, 0, sizeof sim->feature_row);
+			memset(sim->feature_bits, 0, sizeof sim->feature_bits);
+		}
+		if (operand & ERASE_CONFIGURATION)
+		{
+			memset(sim->cfg, 0, sim->cfg_pages * MACHXO2_PAGE_SIZE);
+			sim->usercode = 0;
+			sim->done = 0;
+		}
+		if (operand & ERASE_USER_FLASH)
+			memset(sim->ufm, 0, sim->ufm_pages * MACHXO2_PAGE_SIZE);
+		set_busy(sim, operand == ERASE_SRAM ? SIM_LATENCY_ERASE_SRAM : SIM_LATENCY_ERASE);
+		break;
+	case LSC_BITSTREAM_BURST:
+		// Accept anything that carries the bitstream preamble
+		sim->sram_loaded = 0;
+		for (i = 0; i + 3 < sim->payload_len; i++)
+			if (p[i] == 0xFF && p[i + 1] == 0xFF && p[i + 2] == 0xBD && p[i + 3] == 0xB3)
+				sim->sram_loaded = 1;
+		if (!sim->enabled || !sim->sram_loaded)
+			sim->fail = 1;
+		break;
+	case LSC_ERASE_TAG:
+		if (!sim->enabled)
+		{
+			sim->fail = 1;
+			break;
+		}
+		memset(sim->ufm, 0, sim->ufm_pages * MACHXO2_PAGE_SIZE);
+		set_busy(sim, SIM_LATENCY_ERASE_UFM);
+		break;
+	case LSC_INIT_ADDRESS:
+		sim->ufm_region = 0;
+		sim->page = 0;
+		break;
+	case LSC_INIT_ADDR_UFM:
+		sim->ufm_region = 1;
+		sim->page = 0;
+		break;
+	case LSC_WRITE_ADDRESS:
+		if (sim->payload_len != 4)
+		{
+			sim->fail = 1;
+			break;
+		}
+		sim->ufm_region = (p[0] & 0x40) != 0;
+		sim->page = 0x100 * (p[2] & 0x3F) + p[3];
+		break;
+	case LSC_PROG_INCR_NV:
+		program_page(sim, sim->ufm_region);
+		break;
+	case LSC_PROG_TAG:
+		program_page(sim, 1);
+		break;
+	case ISC_PROGRAM_USERCODE:
+		if (!sim->enabled || sim->payload_len != 4)
+		{
+			sim->fail = 1;
+			break;
+		}
+		sim->usercode = 0x1000000 * p[0] + 0x10000 * p[1] + 0x100 * p[2] + p[3];
+		set_busy(sim, SIM_LATENCY_PAGE);
+		break;
+	case LSC_PROG_FEATURE:
+		if (!sim->enabled || sim->payload_len != 8)
+		{
+			sim->fail = 1;
+			break;
+		}
+		memcpy(sim->feature_row, p, 8);
+		set_busy(sim, SIM_LATENCY_FEATURE);
+		break;
+	case LSC_PROG_FEABITS:
+		if (!sim->enabled || sim->payload_len != 2)
+		{
+			sim->fail = 1;
+			break;
+		}
+		memcpy(sim->feature_bits, p, 2);
+		set_busy(sim, SIM_LATENCY_FEATURE);
+		break;
+	case ISC_PROGRAM_DONE:
+		if (!sim->enabled)
+		{
+			sim->fail = 1;
+			break;
+		}
+		sim->done = 1;
+		set_busy(sim, SIM_LATENCY_DONE);
+		break;
+	case LSC_REFRESH:
+		sim->enabled = 0;
+		sim->fail = 0;
+		sim->sram_loaded = 0;
+		sim->configured = sim->done;
+		set_busy(sim, SIM_LATENCY_REFRESH);
+		break;
+	default:
+		break;
+	}
+}
+
+static void start_frame(struct machxo_sim *sim)
+{
+	sim->in_frame = 1;
+	sim->header_len = 0;
+	sim->header_need = 4;
+	sim->started = 0;
+	sim->ignore = 0;
+	sim->payload_len = 0;
+	sim->read_pos = 0;
+	sim->read_pages = 0;
+}
+
+static void end_frame(struct machxo_sim *sim)
+{
+	sim->in_frame = 0;
+	if (sim->header_len == 0)
+		return;
+	if (!sim->started)
+		begin_command(sim);
+	if (!sim->ignore)
+		execute_command(sim);
+}
+
+static void transfer_byte(struct machxo_sim *sim, const uint8_t *tx, uint8_t *rx)
+{
+	if (sim->header_len < sim->header_need)
+	{
+		sim->header[sim->header_len++] = tx != 0 ? *tx : 0;
+		if (sim->header_len == 1)
+			sim->header_need = header_length(sim->header[0]);
+		if (sim->header_len == sim->header_need)
+			begin_command(sim);
+		if (rx != 0)
+			*rx = 0xFF;
+		return;
+	}
+	if (rx != 0)
+		*rx = sim->ignore ? 0xFF : read_byte(sim);
+	if (tx != 0 && !sim->ignore)
+		add_payload(sim, *tx);
+}
+
+static int sim_spi_message(struct machxo_sim *sim, struct spi_ioc_transfer *xfer, int n)
+{
+	uint64_t byte_ns = 8000000000ULL / sim->speed;
+	uint32_t total = 0;
+	int i, j;
+	for (i = 0; i < n; i++)
+		total += xfer[i].len;
+	if (total > sim->bufsiz)
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+	for (i = 0; i < n; i++)
+	{
+		const uint8_t *tx = (const uint8_t *)(unsigned long)xfer[i].tx_buf;
+		uint8_t *rx = (uint8_t *)(unsigned long)xfer[i].rx_buf;
+		if (!sim->in_frame)
+			start_frame(sim);
+		for (j = 0; j < xfer[i].len; j++)
+		{
+			transfer_byte(sim, tx != 0 ? tx + j : 0, rx != 0 ? rx + j : 0);
+			// A clock too fast for the board flips a bit now and then
+			if (rx != 0 && sim->max_speed != 0 && sim->speed > sim->max_speed && ++sim->glitches % 61 == 0)
+				rx[j] ^= 0x10;
+		}
+		sim->now += xfer[i].len * byte_ns + xfer[i].delay_usecs * 1000ULL;
+		// cs_change ends the frame, except on the last transfer where it
+		// keeps CS asserted into the next message
+		if (xfer[i].cs_change != (i == n - 1))
+			end_frame(sim);
+	}
+	return total;
+}
+
+static int sim_i2c_rdwr(struct machxo_sim *sim, struct i2c_rdwr_ioctl_data *packets)
+{
+	uint64_t byte_ns = 9000000000ULL / sim->speed;
+	int i, j;
+	if (packets->nmsgs > I2C_RDWR_IOCTL_MAX_MSGS)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < packets->nmsgs; i++)
+		if ((packets->msgs[i].flags & I2C_M_NOSTART) && !sim->nostart)
+		{
+			errno = EOPNOTSUPP;
+			return -1;
+		}
+	for (i = 0; i < packets->nmsgs; i++)
+	{
+		struct i2c_msg *msg = &packets->msgs[i];
+		if (msg->addr != sim->i2c_addr)
+		{
+			if (sim->in_frame)
+				end_frame(sim);
+			errno = ENXIO;
+			return -1;
+		}
+		if (!sim->in_frame)
+			start_frame(sim);
+		for (j = 0; j < msg->len; j++)
+		{
+			if (msg->flags & I2C_M_RD)
+				transfer_byte(sim, 0, msg->buf + j);
+			else
+				transfer_byte(sim, msg->buf + j, 0);
+		}
+		sim->now += (msg->len + 1) * byte_ns;
+		if ((msg->flags & I2C_M_STOP) || i == packets->nmsgs - 1)
+			end_frame(sim);
+	}
+	return packets->nmsgs;
+}
+
+int sim_ioctl(struct machxo_sim *sim, unsigned long request, void *arg)
+{
+	uint64_t start = real_now();
+	int status;
+	sim->ioctls++;
+	if (sim->now < start)
+		sim->now = start;
+	if (sim->mode == MODE_I2C && request == I2C_RDWR)
+		status = sim_i2c_rdwr(sim, (struct i2c_rdwr_ioctl_data *)arg);
+	else if (sim->mode == MODE_I2C && (request == I2C_SLAVE || request == I2C_SLAVE_FORCE))
+		status = 0;
+	else if (sim->mode == MODE_I2C && request == I2C_FUNCS)
+	{
+		// What i2c-omap offers, and NOSTART only when asked for
+		*(unsigned long *)arg = I2C_FUNC_I2C | I2C_FUNC_PROTOCOL_MANGLING | (sim->nostart ? I2C_FUNC_NOSTART : 0);
+		status = 0;
+	}
+	else if (sim->mode == MODE_SPI && _IOC_TYPE(request) == SPI_IOC_MAGIC && _IOC_NR(request) == 0
+		 && _IOC_DIR(request) == _IOC_WRITE)
+		status = sim_spi_message(sim, (struct spi_ioc_transfer *)arg,
+					 _IOC_SIZE(request) / sizeof(struct spi_ioc_transfer));
+	else if (sim->mode == MODE_SPI && request == SPI_IOC_WR_MAX_SPEED_HZ)
+	{
+		sim->speed = *(uint32_t *)arg;
+		status = 0;
+	}
+	else if (sim->mode == MODE_SPI && request == SPI_IOC_RD_MAX_SPEED_HZ)
+	{
+		*(uint32_t *)arg = sim->speed;
+		status = 0;
+	}
+	else if (sim->mode == MODE_SPI && (request == SPI_IOC_WR_MODE || request == SPI_IOC_WR_BITS_PER_WORD))
+		status = 0;
+	else
+	{
+		errno = ENOTTY;
+		return -1;
+	}
+	// Do not return before the bus and the delays would have finished
+	sleep_until(sim->now);
+	return status;
+}
@@ -0,0 +1,49 @@
+/*
+ * Software model of the Lattice MachXO2 configuration engine.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ */
+#ifndef _SIM_H
+#define _SIM_H 1
+#include <stdint.h>
+
+#define SIM_LATENCY_PAGE 0
+#define SIM_LATENCY_ERASE 1
+#define SIM_LATENCY_ERASE_UFM 2
+#define SIM_LATENCY_ERASE_SRAM 3
+#define SIM_LATENCY_FEATURE 4
+#define SIM_LATENCY_DONE 5
+#define SIM_LATENCY_REFRESH 6
+#define SIM_NUM_LATENCIES 7
+
+#define SIM_DEFAULT_IDCODE 0x012BA043
+#define SIM_DEFAULT_CFG_PAGES 2175
+#define SIM_DEFAULT_UFM_PAGES 512
+
+struct machxo_sim;
+
+/*
+ * Create a simulated device.  'mode' is MODE_SPI or MODE_I2C and selects
+ * the framing and the read quirks of the bus.  'options' is a comma
+ * separated list of key=value pairs (may be empty or 0):
+ *   page, erase, ufmerase, sramerase, feature,
+ *   done, refresh                                   latencies in usecs
+ *   pages, ufmpages                                 flash sizes in pages
+ *   idcode, addr, speed, bufsiz                     device and bus parameters
+ *   maxspeed                                        fastest SPI clock the board
+ *                                                   carries, reads are corrupted
+ *                                                   above it
+ *   state                                           file that keeps the device
+ *                                                   contents between runs
+ *   nostart                                         1 for an I2C adapter with
+ *                                                   I2C_FUNC_NOSTART, which
+ *                                                   i2c-omap does not have
+ */
+struct machxo_sim *sim_open(int mode, const char *options);
+void sim_close(struct machxo_sim *sim);
+// What SPI_IOC_MESSAGE takes at most, as spidev's bufsiz parameter tells
+uint32_t sim_bufsiz(struct machxo_sim *sim);
+// Same contract as ioctl(2) on a spidev or i2c-dev file descriptor
+int sim_ioctl(struct machxo_sim *sim, unsigned long request, void *arg);
+
+#endif
@@ -0,0 +1,524 @@
+/*
+ * SWD master on the GPMC bus, queuing transactions into batches.  See swd.h.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gpmc.h"
+#include "swd.h"
+
+// Read data to be copied out when its request is through, 0 'dest' to drop it
+struct swd_read {
+	uint32_t *dest;
+	int words;
+	int rdata_offset;	// In the read data of its request
+};
+
+// One mailbox request worth of the queue
+struct swd_segment {
+	int ops_end;
+	int reads_end;
+};
+
+struct swd {
+	struct gpmc_window *w;
+	int wait_limit;
+
+	uint8_t *ops;
+	int ops_len;
+	int ops_size;
+	struct swd_read *reads;
+	int num_reads;
+	int reads_size;
+	struct swd_segment *segments;
+	int num_segments;
+	int segments_size;
+	int seg_start;		// Of the segment being filled
+	int seg_rdata;		// Read data bytes of the segment being filled
+
+	// DP and AP state as it will be once the queue is through
+	uint32_t select;
+	int select_valid;
+	uint32_t csw;
+	int csw_ap;		// -1 when not known
+	uint32_t *posted;	// Where the AP read in RDBUFF goes
+	int have_posted;
+	int recovering;
+
+	struct swd_stats stats;
+};
+
+//#define DEBUG(x) (x)
+#define DEBUG(x)
+
+#define SWD_READ_MAX_WORDS (GPMC_DATA_SIZE / 4)
+#define SWD_WRITE_MAX_WORDS ((GPMC_DATA_SIZE - 4) / 4)
+#define SWD_SEQ_MAX_BITS 64
+
+struct swd *swd_open(const char *name)
+{
+	struct swd *s;
+	s = (struct swd *)calloc(1, sizeof *s);
+	if (s == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	s->w = gpmc_map(name, SWD_MASTER_ID);
+	if (s->w == 0)
+	{
+		free(s);
+		return 0;
+	}
+	s->wait_limit = SWD_DEFAULT_WAIT_LIMIT;
+	s->csw_ap = -1;
+	return s;
+}
+
+void swd_close(struct swd *s)
+{
+	if (s == 0)
+		return;
+	gpmc_close(s->w);
+	free(s->ops);
+	free(s->reads);
+	free(s->segments);
+	free(s);
+}
+
+void swd_set_wait_limit(struct swd *s, int limit)
+{
+	s->wait_limit = limit;
+}
+
+void swd_get_stats(struct swd *s, struct swd_stats *stats)
+{
+	*stats = s->stats;
+}
+
+static int grow(void **buffer, int *size, int needed, int item_size)
+{
+	void *p;
+	int n;
+	if (needed <= *size)
+		return 1;
+	n = *size > 0 ? *size : 64;
+	while (n < needed)
+		n *= 2;
+	p = realloc(*buffer, (size_t)n * item_size);
+	if (p == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	*buffer = p;
+	*size = n;
+	return 1;
+}
+
+static int close_segment(struct swd *s)
+{
+	if (s->ops_len == s->seg_start)
+		return 1;
+	if (!grow((void **)&s->segments, &s->segments_size, s->num_segments + 1, sizeof *s->segments))
+		return 0;
+	s->segments[s->num_segments].ops_end = s->ops_len;
+	s->segments[s->num_segments].reads_end = s->num_reads;
+	s->num_segments++;
+	s->seg_start = s->ops_len;
+	s->seg_rdata = 0;
+	return 1;
+}
+
+/*
+ * Room for an operation of 'op_len' bytes giving 'rdata_len' bytes of
+ * read data, in the segment being filled if it fits there.
+ */
+static uint8_t *queue_op(struct swd *s, int op_len, int rdata_len, int *rdata_offset)
+{
+	uint8_t *op;
+	if (s->ops_len >= SWD_QUEUE_MAX && swd_flush(s) != 1)
+		return 0;
+	if (s->ops_len - s->seg_start + op_len > GPMC_DATA_SIZE || s->seg_rdata + rdata_len > GPMC_DATA_SIZE)
+	{
+		if (close_segment(s) != 1)
+			return 0;
+	}
+	if (!grow((void **)&s->ops, &s->ops_size, s->ops_len + op_len, 1))
+		return 0;
+	op = s->ops + s->ops_len;
+	s->ops_len += op_len;
+	*rdata_offset = s->seg_rdata;
+	s->seg_rdata += rdata_len;
+	return op;
+}
+
+static int add_read(struct swd *s, uint32_t *dest, int words, int rdata_offset)
+{
+	struct swd_read *r;
+	if (!grow((void **)&s->reads, &s->reads_size, s->num_reads + 1, sizeof *s->reads))
+		return 0;
+	r = &s->reads[s->num_reads++];
+	r->dest = dest;
+	r->words = words;
+	r->rdata_offset = rdata_offset;
+	return 1;
+}
+
+static void discard_queue(struct swd *s)
+{
+	s->ops_len = 0;
+	s->num_reads = 0;
+	s->num_segments = 0;
+	s->seg_start = 0;
+	s->seg_rdata = 0;
+	s->have_posted = 0;
+}
+
+// The request byte: start, APnDP, RnW, A[3:2], parity, stop, park
+static uint8_t request_byte(int ap, int read, int addr)
+{
+	int a2 = (addr >> 2) & 1;
+	int a3 = (addr >> 3) & 1;
+	int parity = ap ^ read ^ a2 ^ a3;
+	return 0x81 | (ap << 1) | (read << 2) | (a2 << 3) | (a3 << 4) | (parity << 5);
+}
+
+/*
+ * 'count' reads of one register.  The data of a posted AP read belongs to
+ * the AP read before it, so each piece hands its first word to that one
+ * and leaves its last for the next.
+ */
+static int queue_reads(struct swd *s, uint8_t req, int count, uint32_t *dest, int posted)
+{
+	uint8_t *op;
+	int offset;
+	int done, n;
+	for (done = 0; done < count; done += n)
+	{
+		n = count - done;
+		if (n > SWD_READ_MAX_WORDS)
+			n = SWD_READ_MAX_WORDS;
+		op = queue_op(s, 4, n * 4, &offset);
+		if (op == 0)
+			return 0;
+		op[0] = SWD_OP_READ;
+		op[1] = req;
+		op[2] = n & 0xFF;
+		op[3] = n >> 8;
+		if (!posted)
+		{
+			if (!add_read(s, dest + done, n, offset))
+				return 0;
+			continue;
+		}
+		if (!add_read(s, s->have_posted ? s->posted : 0, 1, offset))
+			return 0;
+		if (n > 1 && !add_read(s, dest + done, n - 1, offset + 4))
+			return 0;
+		s->posted = dest + done + n - 1;
+		s->have_posted = 1;
+	}
+	s->stats.transactions += count;
+	return 1;
+}
+
+static int queue_writes(struct swd *s, uint8_t req, int count, const uint32_t *data)
+{
+	uint8_t *op;
+	int unused;
+	int done, n, i;
+	for (done = 0; done < count; done += n)
+	{
+		n = count - done;
+		if (n > SWD_WRITE_MAX_WORDS)
+			n = SWD_WRITE_MAX_WORDS;
+		op = queue_op(s, 4 + n * 4, 0, &unused);
+		if (op == 0)
+			return 0;
+		op[0] = SWD_OP_WRITE;
+		op[1] = req;
+		op[2] = n & 0xFF;
+		op[3] = n >> 8;
+		for (i = 0; i < n; i++)
+		{
+			uint32_t val = data[done + i];
+			op[4 + 4 * i] = val & 0xFF;
+			op[5 + 4 * i] = (val >> 8) & 0xFF;
+			op[6 + 4 * i] = (val >> 16) & 0xFF;
+			op[7 + 4 * i] = val >> 24;
+		}
+	}
+	s->stats.transactions += count;
+	return 1;
+}
+
+static int queue_seq(struct swd *s, int bits, const uint8_t *swdio)
+{
+	uint8_t *op;
+	int unused;
+	int bytes;
+	if (bits < 1 || bits > SWD_SEQ_MAX_BITS)
+		return 0;
+	bytes = (bits + 7) / 8;
+	op = queue_op(s, 2 + bytes, 0, &unused);
+	if (op == 0)
+		return 0;
+	op[0] = SWD_OP_SEQ;
+	op[1] = bits;
+	memcpy(op + 2, swdio, bytes);
+	return 1;
+}
+
+// Collect the posted AP read from RDBUFF before anything that could lose it
+static int settle(struct swd *s)
+{
+	if (!s->have_posted)
+		return 1;
+	s->have_posted = 0;
+	return queue_reads(s, request_byte(0, 1, SWD_DP_RDBUFF), 1, s->posted, 0);
+}
+
+int swd_read_dp(struct swd *s, int reg, uint32_t *value)
+{
+	DEBUG(fprintf(stderr, "Read DP %x\n", reg));
+	if (settle(s) != 1)
+		return 0;
+	return queue_reads(s, request_byte(0, 1, reg), 1, value, 0);
+}
+
+int swd_write_dp(struct swd *s, int reg, uint32_t value)
+{
+	DEBUG(fprintf(stderr, "Write DP %x, %08x\n", reg, value));
+	// Other DP writes leave RDBUFF alone
+	if (reg == SWD_DP_SELECT)
+	{
+		s->select = value;
+		s->select_valid = 1;
+	}
+	return queue_writes(s, request_byte(0, 0, reg), 1, &value);
+}
+
+static int select_ap(struct swd *s, int ap, int reg)
+{
+	uint32_t select = ((uint32_t)ap << 24) | (reg & 0xF0);
+	if (s->select_valid && s->select == select)
+		return 1;
+	return swd_write_dp(s, SWD_DP_SELECT, select);
+}
+
+int swd_read_ap(struct swd *s, int ap, int reg, uint32_t *value)
+{
+	DEBUG(fprintf(stderr, "Read AP %d %02x\n", ap, reg));
+	if (select_ap(s, ap, reg) != 1)
+		return 0;
+	return queue_reads(s, request_byte(1, 1, reg), 1, value, 1);
+}
+
+int swd_write_ap(struct swd *s, int ap, int reg, uint32_t value)
+{
+	DEBUG(fprintf(stderr, "Write AP %d %02x, %08x\n", ap, reg, value));
+	if (settle(s) != 1 || select_ap(s, ap, reg) != 1)
+		return 0;
+	if (reg == SWD_AP_CSW)
+	{
+		s->csw = value;
+		s->csw_ap = ap;
+	}
+	return queue_writes(s, request_byte(1, 0, reg), 1, &value);
+}
+
+static int setup_mem(struct swd *s, int ap, uint32_t addr)
+{
+	uint32_t csw = SWD_CSW_DEFAULT | SWD_CSW_ADDRINC_SINGLE | SWD_CSW_SIZE32;
+	if (addr & 3)
+	{
+		fprintf(stderr, "SWD memory access at %08x is not word aligned\n", addr);
+		return 0;
+	}
+	if ((s->csw_ap != ap || s->csw != csw) && swd_write_ap(s, ap, SWD_AP_CSW, csw) != 1)
+		return 0;
+	return 1;
+}
+
+// Words from 'addr' before TAR stops incrementing
+static int words_to_wrap(uint32_t addr, int count)
+{
+	int n = (SWD_TAR_WRAP - addr % SWD_TAR_WRAP) / 4;
+	return n < count ? n : count;
+}
+
+int swd_read_mem(struct swd *s, int ap, uint32_t addr, uint32_t *words, int count)
+{
+	int done, n;
+	DEBUG(fprintf(stderr, "Read %d words at %08x\n", count, addr));
+	if (setup_mem(s, ap, addr) != 1)
+		return 0;
+	for (done = 0; done < count; done += n)
+	{
+		n = words_to_wrap(addr + 4 * done, count - done);
+		if (swd_write_ap(s, ap, SWD_AP_TAR, addr + 4 * done) != 1)
+			return 0;
+		if (queue_reads(s, request_byte(1, 1, SWD_AP_DRW), n, words + done, 1) != 1)
+			return 0;
+	}
+	return 1;
+}
+
+int swd_write_mem(struct swd *s, int ap, uint32_t addr, const uint32_t *words, int count)
+{
+	int done, n;
+	DEBUG(fprintf(stderr, "Write %d words at %08x\n", count, addr));
+	if (setup_mem(s, ap, addr) != 1)
+		return 0;
+	for (done = 0; done < count; done += n)
+	{
+		n = words_to_wrap(addr + 4 * done, count - done);
+		if (swd_write_ap(s, ap, SWD_AP_TAR, addr + 4 * done) != 1)
+			return 0;
+		if (queue_writes(s, request_byte(1, 0, SWD_AP_DRW), n, words + done) != 1)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * After a failed request nothing is known of SELECT, CSW or RDBUFF.  A
+ * FAULT leaves sticky errors that fail every AP access until cleared, and
+ * a transaction stuck in WAIT needs DAPABORT.
+ */
+static void recover(struct swd *s, int error, int ack)
+{
+	uint32_t abort = error == SWD_ERROR_WAIT ? SWD_ABORT_DAPABORT : SWD_ABORT_CLEAR;
+	s->select_valid = 0;
+	s->csw_ap = -1;
+	if (s->recovering || (error == SWD_ERROR_ACK && ack != SWD_ACK_FAULT) || error == SWD_ERROR_PARITY)
+		return;
+	s->recovering = 1;
+	if (swd_write_dp(s, SWD_DP_ABORT, abort) != 1 || swd_flush(s) != 1)
+		fprintf(stderr, "Could not clear the SWD errors\n");
+	s->recovering = 0;
+}
+
+static const char *error_name(int error, int ack)
+{
+	switch (error)
+	{
+	case SWD_ERROR_ACK:
+		return ack == SWD_ACK_FAULT ? "FAULT" : "no ack";
+	case SWD_ERROR_WAIT:
+		return "too many WAITs";
+	case SWD_ERROR_PARITY:
+		return "parity error";
+	}
+	return "error";
+}
+
+int swd_flush(struct swd *s)
+{
+	volatile uint8_t *regs = gpmc_regs(s->w);
+	uint8_t rdata[GPMC_DATA_SIZE];
+	int ops_start = 0, reads_start = 0;
+	int rdata_len, error, ack;
+	int i, k, m;
+	if (settle(s) != 1 || close_segment(s) != 1)
+	{
+		discard_queue(s);
+		return 0;
+	}
+	for (i = 0; i < s->num_segments; i++)
+	{
+		struct swd_segment *seg = &s->segments[i];
+		int len = seg->ops_end - ops_start;
+		gpmc_write(regs + SWD_REG_DATA, s->ops + ops_start, len);
+		gpmc_put_le(regs, SWD_REG_LENGTH, len, 2);
+		gpmc_put_le(regs, SWD_REG_WAIT_LIMIT, s->wait_limit, 2);
+		if (gpmc_request(s->w) < 0)
+		{
+			fprintf(stderr, "SWD request failed: %s\n", strerror(errno));
+			discard_queue(s);
+			s->select_valid = 0;
+			s->csw_ap = -1;
+			return 0;
+		}
+		s->stats.requests++;
+		s->stats.bytes_out += len;
+		s->stats.waits += gpmc_get_le(regs, SWD_REG_WAITS, 2);
+		s->stats.cycles += gpmc_get_le(regs, SWD_REG_CYCLES, 4);
+		error = regs[SWD_REG_ERROR];
+		if (error != SWD_ERROR_NONE)
+		{
+			ack = regs[SWD_REG_ACK];
+			fprintf(stderr, "SWD %s after %u transactions of request %d\n", error_name(error, ack),
+				gpmc_get_le(regs, SWD_REG_COUNT, 2), i + 1);
+			discard_queue(s);
+			recover(s, error, ack);
+			return 0;
+		}
+		rdata_len = gpmc_get_le(regs, SWD_REG_RDATA_LENGTH, 2);
+		if (rdata_len > GPMC_DATA_SIZE)
+			rdata_len = GPMC_DATA_SIZE;
+		if (rdata_len > 0)
+		{
+			gpmc_read(rdata, regs + SWD_REG_DATA, rdata_len);
+			s->stats.bytes_in += rdata_len;
+		}
+		for (k = reads_start; k < seg->reads_end; k++)
+		{
+			struct swd_read *r = &s->reads[k];
+			if (r->rdata_offset + 4 * r->words > rdata_len)
+			{
+				fprintf(stderr, "SWD master sent %d bytes of read data, expected %d\n", rdata_len, r->rdata_offset + 4 * r->words);
+				discard_queue(s);
+				return 0;
+			}
+			if (r->dest == 0)
+				continue;
+			for (m = 0; m < r->words; m++)
+			{
+				const uint8_t *p = rdata + r->rdata_offset + 4 * m;
+				r->dest[m] = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+			}
+		}
+		ops_start = seg->ops_end;
+		reads_start = seg->reads_end;
+	}
+	discard_queue(s);
+	return 1;
+}
+
+int swd_connect(struct swd *s, uint32_t *dpidr)
+{
+	static const uint8_t ones[7] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+	static const uint8_t jtag_to_swd[2] = { 0x9E, 0xE7 };
+	static const uint8_t idle = 0;
+	uint32_t ctrl = 0;
+	int tries;
+	discard_queue(s);
+	s->select_valid = 0;
+	s->csw_ap = -1;
+	// Line reset, the switch sequence, line reset, then idle before the first request
+	if (queue_seq(s, 56, ones) != 1 || queue_seq(s, 16, jtag_to_swd) != 1 ||
+	    queue_seq(s, 56, ones) != 1 || queue_seq(s, 8, &idle) != 1)
+		return 0;
+	// The DPIDR read is what takes the DP out of its reset state
+	if (swd_read_dp(s, SWD_DP_DPIDR, dpidr) != 1 ||
+	    swd_write_dp(s, SWD_DP_ABORT, SWD_ABORT_CLEAR) != 1 ||
+	    swd_write_dp(s, SWD_DP_SELECT, 0) != 1 ||
+	    swd_write_dp(s, SWD_DP_CTRL_STAT, SWD_CTRL_CDBGPWRUPREQ | SWD_CTRL_CSYSPWRUPREQ) != 1)
+		return 0;
+	for (tries = 0; tries < 10; tries++)
+	{
+		if (swd_read_dp(s, SWD_DP_CTRL_STAT, &ctrl) != 1 || swd_flush(s) != 1)
+			return 0;
+		if ((ctrl & (SWD_CTRL_CDBGPWRUPACK | SWD_CTRL_CSYSPWRUPACK)) == (SWD_CTRL_CDBGPWRUPACK | SWD_CTRL_CSYSPWRUPACK))
+			return 1;
+	}
+	fprintf(stderr, "SWD debug power up not acknowledged, CTRL/STAT %08x\n", ctrl);
+	return 0;
+}
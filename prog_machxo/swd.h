@@ -0,0 +1,155 @@
+/*
+ * ARM Serial Wire Debug master on the GPMC bus, queuing transactions into
+ * batches.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * The SWD master design, SWD_MASTER_ID, has the mailbox header of gpmc.h
+ * and goes on with:
+ *
+ *   0x08  LENGTH       2 bytes, bytes of operations in DATA
+ *   0x0A  RDATA_LENGTH 2 bytes, bytes of read data the master put in DATA
+ *   0x0C  COUNT        2 bytes, transactions through with an OK ack
+ *   0x0E  ACK          ack of the transaction the master stopped at, SWD_ACK_*
+ *   0x0F  ERROR        SWD_ERROR_*
+ *   0x10  WAIT_LIMIT   2 bytes, WAIT acks retried per transaction
+ *   0x12  WAITS        2 bytes, WAIT acks retried in the request
+ *   0x14  CYCLES       4 bytes, SWCLK cycles the request took
+ *   0x20  DATA         operations in, read data out
+ *
+ * The operations are run in order:
+ *
+ *   SWD_OP_SEQ    count (1..64), SWDIO bytes, LSB first; line resets and
+ *                 the JTAG to SWD switch
+ *   SWD_OP_READ   request byte, count (2 bytes); 'count' reads of the same
+ *                 register, 4 bytes of data each
+ *   SWD_OP_WRITE  request byte, count (2 bytes), 4 bytes of data each
+ *
+ * The request byte is as sent on the wire.  The master works out the data
+ * parity, checks it on reads, and retries a transaction on WAIT up to
+ * WAIT_LIMIT times without the host.  It stops the request at a FAULT, a
+ * missing ack, too many WAITs or a parity error; ERROR and ACK then tell
+ * which, and COUNT how far it got.
+ *
+ * AP reads are posted, as on the wire: the data of each comes back with
+ * the next AP read or a DP RDBUFF read.  The host side hides this, and
+ * copies read data to the caller's buffers at swd_flush(), so those must
+ * be kept until it returns.  A block of memory is one READ or WRITE of
+ * the MEM-AP DRW with TAR auto-increment, a few bytes of operations for
+ * up to 56 words per mailbox request.
+ */
+#ifndef _SWD_H
+#define _SWD_H 1
+#include <stdint.h>
+
+#define SWD_MASTER_ID 0x4457534D	// "MSWD"
+
+#define SWD_REG_LENGTH 0x08
+#define SWD_REG_RDATA_LENGTH 0x0A
+#define SWD_REG_COUNT 0x0C
+#define SWD_REG_ACK 0x0E
+#define SWD_REG_ERROR 0x0F
+# define SWD_ERROR_NONE 0
+# define SWD_ERROR_ACK 1	// FAULT, or no ack at all
+# define SWD_ERROR_WAIT 2	// Still WAIT after WAIT_LIMIT retries
+# define SWD_ERROR_PARITY 3	// Bad parity on read data
+#define SWD_REG_WAIT_LIMIT 0x10
+#define SWD_REG_WAITS 0x12
+#define SWD_REG_CYCLES 0x14
+#define SWD_REG_DATA 0x20
+
+#define SWD_OP_SEQ 0x01
+#define SWD_OP_READ 0x02
+#define SWD_OP_WRITE 0x03
+
+#define SWD_ACK_OK 1
+#define SWD_ACK_WAIT 2
+#define SWD_ACK_FAULT 4
+#define SWD_ACK_NONE 7		// Nobody drove SWDIO
+
+// SWCLK cycles on the wire
+#define SWD_READ_CYCLES 46	// Request 8, turnaround, ack 3, data and parity 33, turnaround
+#define SWD_WRITE_CYCLES 46	// Request 8, turnaround, ack 3, turnaround, data and parity 33
+#define SWD_WAIT_CYCLES 13	// Request 8, turnaround, ack 3, turnaround
+
+#define SWD_DEFAULT_WAIT_LIMIT 100
+#define SWD_QUEUE_MAX 65536	// Queued operation bytes before an automatic flush
+
+// DP registers, by address
+#define SWD_DP_DPIDR 0x0	// Read
+#define SWD_DP_ABORT 0x0	// Write
+#define SWD_DP_CTRL_STAT 0x4
+#define SWD_DP_SELECT 0x8
+#define SWD_DP_RDBUFF 0xC
+
+#define SWD_ABORT_DAPABORT 0x01
+#define SWD_ABORT_CLEAR 0x1E	// STKCMPCLR, STKERRCLR, WDERRCLR, ORUNERRCLR
+#define SWD_CTRL_STICKYERR 0x00000020
+#define SWD_CTRL_CDBGPWRUPREQ 0x10000000
+#define SWD_CTRL_CDBGPWRUPACK 0x20000000
+#define SWD_CTRL_CSYSPWRUPREQ 0x40000000
+#define SWD_CTRL_CSYSPWRUPACK 0x80000000
+
+// MEM-AP registers, APBANKSEL in the high nibble
+#define SWD_AP_CSW 0x00
+#define SWD_AP_TAR 0x04
+#define SWD_AP_DRW 0x0C
+#define SWD_AP_IDR 0xFC
+
+#define SWD_CSW_SIZE32 0x00000002
+#define SWD_CSW_ADDRINC_SINGLE 0x00000010
+#define SWD_CSW_DEFAULT 0x23000000	// HPROT and master type bits of an AHB-AP
+
+#define SWD_TAR_WRAP 1024	// TAR auto-increment is only good within this
+
+struct swd_stats {
+	uint64_t transactions;	// Queued, not counting WAIT retries
+	uint64_t waits;		// WAIT acks the master retried
+	uint64_t cycles;	// SWCLK cycles reported by the master
+	uint32_t requests;	// Mailbox requests
+	uint64_t bytes_out;	// Operation bytes written to the mailbox
+	uint64_t bytes_in;	// Read data bytes read back
+};
+
+struct swd;
+
+// 'name' is "gpmc" or "gpmc:<file>"
+struct swd *swd_open(const char *name);
+void swd_close(struct swd *s);
+// WAIT acks the master retries per transaction
+void swd_set_wait_limit(struct swd *s, int limit);
+/*
+ * JTAG to SWD switch and line reset, read the DPIDR, clear errors and
+ * power up the debug domain.  Flushes.
+ */
+int swd_connect(struct swd *s, uint32_t *dpidr);
+// Queued register accesses.  'reg' is the DP address, or the AP one with its bank.
+int swd_read_dp(struct swd *s, int reg, uint32_t *value);
+int swd_write_dp(struct swd *s, int reg, uint32_t value);
+int swd_read_ap(struct swd *s, int ap, int reg, uint32_t *value);
+int swd_write_ap(struct swd *s, int ap, int reg, uint32_t value);
+/*
+ * Word aligned target memory through MEM-AP 'ap', as auto-incrementing
+ * DRW blocks.  Queued like the rest.
+ */
+int swd_read_mem(struct swd *s, int ap, uint32_t addr, uint32_t *words, int count);
+int swd_write_mem(struct swd *s, int ap, uint32_t addr, const uint32_t *words, int count);
+/*
+ * Send everything queued and fill in the read buffers.  After a FAULT the
+ * sticky errors are cleared, so the next batch can go on.
+ */
+int swd_flush(struct swd *s);
+void swd_get_stats(struct swd *s, struct swd_stats *stats);
+
+/*
+ * Stand-in for the SWD master design on a file, with a simulated SW-DP
+ * and AHB-AP behind it.  'options' is a comma separated list of key=value
+ * pairs (may be empty or 0):
+ *   mem         KB of target memory from address 0 (default 64)
+ *   wait        WAIT acks before each DRW access is through (default 0)
+ *   parity      every n-th read comes with bad parity (default never)
+ *   dpidr       DPIDR of the target
+ */
+int run_swd_sim(const char *path, const char *options);
+
+#endif
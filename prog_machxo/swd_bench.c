@@ -0,0 +1,181 @@
+/*
+ * Benchmark of target memory downloads over the GPMC SWD master, against
+ * the simulated target so that it runs on any Linux host.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * The simulated master runs in a child process on a mailbox file in
+ * /dev/shm, as it would with -X.  Each run writes a block of memory and
+ * reads it back, three ways:
+ *
+ *   round trip  one word per mailbox request, TAR and DRW each time, as an
+ *               adapter that waits for every transfer does
+ *   queued      the same transfers, all queued and flushed once
+ *   block       auto-incrementing DRW blocks, TAR once per 1KB
+ *
+ * with and without WAITs from the target.  The wall clock rate is what
+ * the host side costs on this machine; the wire rate is what the SWCLK
+ * cycles the master reports come to at SWD_BENCH_CLOCK.
+ *
+ * Usage: swd_bench [-q]   (-q for a smaller block)
+ */
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#include "swd.h"
+
+#define SWD_BENCH_CLOCK 10000000	// SWCLK in Hz for the wire rate
+#define ROUND_TRIP_WORDS 2048		// Round trips are slow, so fewer of them
+
+enum { ROUND_TRIP, QUEUED, BLOCK };
+static const char *strategy_names[] = { "round trip", "queued", "block" };
+static const int waits[] = { 0, 2 };
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// The child serves the mailbox; wait for its ID to show up
+static pid_t start_sim(const char *path, int wait)
+{
+	char options[32];
+	uint8_t id[4];
+	pid_t pid;
+	int tries, fd;
+	unlink(path);
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0)
+	{
+		snprintf(options, sizeof options, "wait=%d", wait);
+		_exit(run_swd_sim(path, options) == 1 ? 0 : 1);
+	}
+	for (tries = 0; tries < 1000; tries++)
+	{
+		fd = open(path, O_RDONLY);
+		if (fd >= 0)
+		{
+			int n = read(fd, id, 4);
+			close(fd);
+			if (n == 4 && (id[0] | (id[1] << 8) | (id[2] << 16) | ((uint32_t)id[3] << 24)) == SWD_MASTER_ID)
+				return pid;
+		}
+		usleep(1000);
+	}
+	kill(pid, SIGTERM);
+	waitpid(pid, 0, 0);
+	return -1;
+}
+
+static void stop_sim(pid_t pid)
+{
+	kill(pid, SIGTERM);
+	waitpid(pid, 0, 0);
+}
+
+static int transfer(struct swd *s, int strategy, int write, uint32_t *words, int count)
+{
+	int i;
+	if (strategy == BLOCK)
+		return write ? swd_write_mem(s, 0, 0, words, count) : swd_read_mem(s, 0, 0, words, count);
+	for (i = 0; i < count; i++)
+	{
+		if (write && swd_write_mem(s, 0, 4 * i, words + i, 1) != 1)
+			return 0;
+		if (!write && swd_read_mem(s, 0, 4 * i, words + i, 1) != 1)
+			return 0;
+		if (strategy == ROUND_TRIP && swd_flush(s) != 1)
+			return 0;
+	}
+	return 1;
+}
+
+static void print_run(int strategy, int write, int wait, int count, double elapsed, struct swd_stats *a, struct swd_stats *b)
+{
+	double kbytes = count * 4 / 1024.0;
+	double cycles = (double)(b->cycles - a->cycles);
+	printf("%-10s  %-5s  %4d  %6.0f  %8u  %9.1f  %9.0f  %9.0f\n", strategy_names[strategy], write ? "write" : "read",
+		wait, kbytes, b->requests - a->requests, cycles / count, kbytes / elapsed, kbytes / (cycles / SWD_BENCH_CLOCK));
+}
+
+static int run(const char *path, int wait, int count)
+{
+	char window[80];
+	struct swd_stats before, after;
+	uint32_t *out, *in;
+	struct swd *s;
+	uint32_t dpidr;
+	double start;
+	int strategy, write, n, i;
+	int status = 1;
+	pid_t pid = start_sim(path, wait);
+	if (pid < 0)
+	{
+		fprintf(stderr, "Simulated SWD master did not start\n");
+		return 0;
+	}
+	out = (uint32_t *)malloc(count * 4);
+	in = (uint32_t *)malloc(count * 4);
+	snprintf(window, sizeof window, "gpmc:%s", path);
+	s = swd_open(window);
+	if (out == 0 || in == 0 || s == 0 || swd_connect(s, &dpidr) != 1)
+	{
+		status = 0;
+		goto done;
+	}
+	for (strategy = ROUND_TRIP; strategy <= BLOCK && status; strategy++)
+	{
+		n = strategy == ROUND_TRIP && count > ROUND_TRIP_WORDS ? ROUND_TRIP_WORDS : count;
+		for (i = 0; i < n; i++)
+			out[i] = (i + 1) * 2654435761u + strategy;
+		memset(in, 0, n * 4);
+		for (write = 1; write >= 0 && status; write--)
+		{
+			swd_get_stats(s, &before);
+			start = now();
+			status = transfer(s, strategy, write, write ? out : in, n) && swd_flush(s);
+			swd_get_stats(s, &after);
+			if (status)
+				print_run(strategy, write, wait, n, now() - start, &before, &after);
+		}
+		if (status && memcmp(out, in, n * 4) != 0)
+		{
+			fprintf(stderr, "%s: read back differs\n", strategy_names[strategy]);
+			status = 0;
+		}
+	}
+done:
+	swd_close(s);
+	free(out);
+	free(in);
+	stop_sim(pid);
+	unlink(path);
+	return status;
+}
+
+int main(int argc, char **argv)
+{
+	char path[64];
+	int quick = argc > 1 && strcmp(argv[1], "-q") == 0;
+	int count = quick ? 4096 : 16384;
+	unsigned i;
+	snprintf(path, sizeof path, "/dev/shm/swd_bench.%d", (int)getpid());
+	printf("%-10s  %-5s  %4s  %6s  %8s  %9s  %9s  %9s\n", "strategy", "dir", "wait", "KB", "requests", "SWCLK/wd",
+		"KB/s", "wire KB/s");
+	for (i = 0; i < sizeof waits / sizeof waits[0]; i++)
+		if (run(path, waits[i], count) != 1)
+			return 1;
+	return 0;
+}
@@ -0,0 +1,389 @@
+/*
+ * Stand-in for the SWD master design, with a simulated SW-DP and AHB-AP.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * The target is modelled one transaction at a time, as seen on the wire:
+ * the line must be switched from JTAG and reset, the first request after
+ * a line reset must read the DPIDR, AP reads are posted through RDBUFF,
+ * TAR only increments within 1KB, and an access outside the memory sets
+ * STICKYERR, so that AP accesses FAULT until it is cleared in ABORT.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gpmc.h"
+#include "swd.h"
+
+#define SIM_DPIDR 0x2BA01477	// ARM SW-DP v1, as on Cortex-M3 and M4
+#define SIM_AP_IDR 0x24770011	// AHB-AP
+#define SIM_CSW_DEVICEEN 0x00000040
+
+// Line state of the target
+#define LINE_JTAG 0		// Not switched to SWD yet
+#define LINE_RESET 1		// After a line reset, waiting for the DPIDR read
+#define LINE_ACTIVE 2
+
+struct swd_target {
+	int line;
+	int ones;		// High SWDIO bits in a row
+	uint16_t shift;		// Last 16 SWDIO bits, for the switch sequence
+	uint32_t dpidr;
+	uint32_t ctrl_stat;
+	uint32_t select;
+	uint32_t rdbuff;
+	uint32_t csw;
+	uint32_t tar;
+	uint32_t *mem;
+	uint32_t mem_words;
+	int wait;		// WAITs per DRW access
+	int busy;		// WAITs given for the DRW access in progress
+	int parity_every;	// Every n-th read goes out with bad parity, 0 for none
+	uint64_t reads;
+};
+
+struct swd_sim {
+	struct swd_target target;
+	uint64_t cycles;
+	uint64_t transactions;
+	uint64_t waits;
+};
+
+static int parse_option(struct swd_sim *sim, const char *key, const char *value)
+{
+	unsigned long val = strtoul(value, 0, 0);
+	if (strcmp(key, "mem") == 0)
+	{
+		if (val < 1 || val > 65536)
+			return 0;
+		sim->target.mem_words = val * 256;
+	}
+	else if (strcmp(key, "wait") == 0)
+		sim->target.wait = val;
+	else if (strcmp(key, "parity") == 0)
+		sim->target.parity_every = val;
+	else if (strcmp(key, "dpidr") == 0)
+		sim->target.dpidr = val;
+	else
+		return 0;
+	return 1;
+}
+
+static int parse_options(struct swd_sim *sim, const char *options)
+{
+	char *opts, *tok, *save;
+	int status = 1;
+	if (options == 0 || *options == 0)
+		return 1;
+	opts = strdup(options);
+	if (opts == 0)
+		return 0;
+	for (tok = strtok_r(opts, ",", &save); tok != 0 && status; tok = strtok_r(0, ",", &save))
+	{
+		char *eq = strchr(tok, '=');
+		if (eq == 0)
+		{
+			fprintf(stderr, "swd sim: expected key=value, got '%s'\n", tok);
+			status = 0;
+			break;
+		}
+		*eq = 0;
+		status = parse_option(sim, tok, eq + 1);
+		if (!status)
+			fprintf(stderr, "swd sim: bad option '%s'\n", tok);
+	}
+	free(opts);
+	return status;
+}
+
+static void line_bit(struct swd_target *t, int bit)
+{
+	t->shift = (t->shift >> 1) | (bit << 15);
+	if (t->shift == 0xE79E && t->line == LINE_JTAG)
+		t->line = LINE_RESET;
+	if (!bit)
+	{
+		t->ones = 0;
+		return;
+	}
+	if (++t->ones >= 50 && t->line != LINE_JTAG)
+		t->line = LINE_RESET;
+}
+
+static int mem_access(struct swd_target *t, int read, uint32_t *data)
+{
+	uint32_t index = t->tar / 4;
+	if (index >= t->mem_words)
+	{
+		t->ctrl_stat |= SWD_CTRL_STICKYERR;
+		*data = 0;
+		return 0;
+	}
+	if (read)
+		*data = t->mem[index];
+	else
+		t->mem[index] = *data;
+	if (t->csw & SWD_CSW_ADDRINC_SINGLE)
+		t->tar = (t->tar & ~(uint32_t)(SWD_TAR_WRAP - 1)) | ((t->tar + 4) & (SWD_TAR_WRAP - 1));
+	return 1;
+}
+
+static int dp_transfer(struct swd_target *t, int read, int addr, uint32_t *data)
+{
+	switch (addr)
+	{
+	case SWD_DP_DPIDR:
+		if (read)
+			*data = t->dpidr;
+		else
+		{
+			if (*data & SWD_ABORT_DAPABORT)
+				t->busy = 0;
+			if (*data & SWD_ABORT_CLEAR)
+				t->ctrl_stat &= ~SWD_CTRL_STICKYERR;
+		}
+		break;
+	case SWD_DP_CTRL_STAT:
+		if (read)
+			*data = t->ctrl_stat;
+		else
+		{
+			// The power domains come up at once
+			uint32_t req = *data & (SWD_CTRL_CDBGPWRUPREQ | SWD_CTRL_CSYSPWRUPREQ);
+			t->ctrl_stat = (t->ctrl_stat & SWD_CTRL_STICKYERR) | req | (req << 1);
+		}
+		break;
+	case SWD_DP_SELECT:
+		if (!read)
+			t->select = *data;
+		break;
+	case SWD_DP_RDBUFF:
+		if (read)
+			*data = t->rdbuff;
+		break;
+	}
+	return SWD_ACK_OK;
+}
+
+static int ap_transfer(struct swd_target *t, int read, int addr, uint32_t *data)
+{
+	int reg = (t->select & 0xF0) | addr;
+	uint32_t val = 0;
+	if (t->ctrl_stat & SWD_CTRL_STICKYERR)
+		return SWD_ACK_FAULT;
+	if ((t->select >> 24) != 0)
+	{
+		// No AP there, reads as zero
+		if (read)
+		{
+			*data = t->rdbuff;
+			t->rdbuff = 0;
+		}
+		return SWD_ACK_OK;
+	}
+	if (reg == SWD_AP_DRW && t->busy < t->wait)
+	{
+		t->busy++;
+		return SWD_ACK_WAIT;
+	}
+	t->busy = 0;
+	if (!read)
+		val = *data;
+	switch (reg)
+	{
+	case SWD_AP_CSW:
+		if (read)
+			val = t->csw | SIM_CSW_DEVICEEN;
+		else
+			t->csw = val;
+		break;
+	case SWD_AP_TAR:
+		if (read)
+			val = t->tar;
+		else
+			t->tar = val;
+		break;
+	case SWD_AP_DRW:
+		mem_access(t, read, &val);
+		break;
+	case SWD_AP_IDR:
+		val = SIM_AP_IDR;
+		break;
+	}
+	if (read)
+	{
+		*data = t->rdbuff;
+		t->rdbuff = val;
+	}
+	return SWD_ACK_OK;
+}
+
+// One transaction, returns the ack
+static int target_transfer(struct swd_target *t, uint8_t req, uint32_t *data)
+{
+	int ap = (req >> 1) & 1;
+	int read = (req >> 2) & 1;
+	int addr = (req >> 1) & 0xC;
+	int parity = ap ^ read ^ (addr >> 2 & 1) ^ (addr >> 3 & 1);
+	t->ones = 0;
+	if ((req & 0xC1) != 0x81 || ((req >> 5) & 1) != parity)
+		return SWD_ACK_NONE;
+	if (t->line == LINE_JTAG)
+		return SWD_ACK_NONE;
+	if (t->line == LINE_RESET)
+	{
+		if (ap || !read || addr != SWD_DP_DPIDR)
+			return SWD_ACK_NONE;
+		t->line = LINE_ACTIVE;
+	}
+	return ap ? ap_transfer(t, read, addr, data) : dp_transfer(t, read, addr, data);
+}
+
+static int parity32(uint32_t val)
+{
+	val ^= val >> 16;
+	val ^= val >> 8;
+	val ^= val >> 4;
+	val ^= val >> 2;
+	val ^= val >> 1;
+	return val & 1;
+}
+
+/*
+ * One transaction with its WAIT retries, as the master runs it.  Returns
+ * SWD_ERROR_*.
+ */
+static int run_transaction(struct swd_sim *sim, uint8_t req, uint32_t *data, int wait_limit, int *waits, int *ack)
+{
+	struct swd_target *t = &sim->target;
+	int read = (req >> 2) & 1;
+	int retries = 0;
+	int parity_bit;
+	for (;;)
+	{
+		*ack = target_transfer(t, req, data);
+		if (*ack != SWD_ACK_WAIT)
+			break;
+		sim->cycles += SWD_WAIT_CYCLES;
+		if (retries++ >= wait_limit)
+			return SWD_ERROR_WAIT;
+		(*waits)++;
+		sim->waits++;
+	}
+	if (*ack != SWD_ACK_OK)
+	{
+		sim->cycles += SWD_WAIT_CYCLES;
+		return SWD_ERROR_ACK;
+	}
+	sim->cycles += read ? SWD_READ_CYCLES : SWD_WRITE_CYCLES;
+	sim->transactions++;
+	if (!read)
+		return SWD_ERROR_NONE;
+	// The parity bit the target drove, and what the master checks it against
+	parity_bit = parity32(*data);
+	if (t->parity_every > 0 && ++t->reads % t->parity_every == 0)
+		parity_bit ^= 1;
+	if (parity_bit != parity32(*data))
+		return SWD_ERROR_PARITY;
+	return SWD_ERROR_NONE;
+}
+
+static int run_ops(void *arg, volatile uint8_t *regs)
+{
+	struct swd_sim *sim = (struct swd_sim *)arg;
+	uint8_t ops[GPMC_DATA_SIZE];
+	uint8_t rdata[GPMC_DATA_SIZE];
+	uint64_t start_cycles = sim->cycles;
+	int len = gpmc_get_le(regs, SWD_REG_LENGTH, 2);
+	int wait_limit = gpmc_get_le(regs, SWD_REG_WAIT_LIMIT, 2);
+	int pos = 0, rdata_len = 0;
+	int ok = 0, waits = 0, ack = SWD_ACK_OK;
+	int error = SWD_ERROR_NONE;
+	int count, read, i;
+	uint32_t data = 0;
+	if (len > GPMC_DATA_SIZE)
+		return GPMC_STATUS_TOO_LONG;
+	gpmc_read(ops, regs + SWD_REG_DATA, len);
+	while (pos < len && error == SWD_ERROR_NONE)
+	{
+		switch (ops[pos])
+		{
+		case SWD_OP_SEQ:
+			if (pos + 2 > len || ops[pos + 1] < 1 || ops[pos + 1] > 64 || pos + 2 + (ops[pos + 1] + 7) / 8 > len)
+				return GPMC_STATUS_BAD_REQUEST;
+			for (i = 0; i < ops[pos + 1]; i++)
+				line_bit(&sim->target, (ops[pos + 2 + i / 8] >> (i % 8)) & 1);
+			sim->cycles += ops[pos + 1];
+			pos += 2 + (ops[pos + 1] + 7) / 8;
+			break;
+		case SWD_OP_READ:
+		case SWD_OP_WRITE:
+			if (pos + 4 > len)
+				return GPMC_STATUS_BAD_REQUEST;
+			read = ops[pos] == SWD_OP_READ;
+			count = ops[pos + 2] + 0x100 * ops[pos + 3];
+			// The target goes by the RnW bit of the request, which must agree with the op
+			if (((ops[pos + 1] >> 2) & 1) != read)
+				return GPMC_STATUS_BAD_REQUEST;
+			if (!read && pos + 4 + 4 * count > len)
+				return GPMC_STATUS_BAD_REQUEST;
+			if (read && rdata_len + 4 * count > GPMC_DATA_SIZE)
+				return GPMC_STATUS_TOO_LONG;
+			for (i = 0; i < count && error == SWD_ERROR_NONE; i++)
+			{
+				const uint8_t *p = ops + pos + 4 + 4 * i;
+				if (!read)
+					data = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+				error = run_transaction(sim, ops[pos + 1], &data, wait_limit, &waits, &ack);
+				if (error != SWD_ERROR_NONE)
+					break;
+				ok++;
+				if (!read)
+					continue;
+				rdata[rdata_len++] = data & 0xFF;
+				rdata[rdata_len++] = (data >> 8) & 0xFF;
+				rdata[rdata_len++] = (data >> 16) & 0xFF;
+				rdata[rdata_len++] = data >> 24;
+			}
+			pos += 4 + (read ? 0 : 4 * count);
+			break;
+		default:
+			return GPMC_STATUS_BAD_REQUEST;
+		}
+	}
+	gpmc_write(regs + SWD_REG_DATA, rdata, rdata_len);
+	gpmc_put_le(regs, SWD_REG_RDATA_LENGTH, rdata_len, 2);
+	gpmc_put_le(regs, SWD_REG_COUNT, ok, 2);
+	regs[SWD_REG_ACK] = ack;
+	regs[SWD_REG_ERROR] = error;
+	gpmc_put_le(regs, SWD_REG_WAITS, waits, 2);
+	gpmc_put_le(regs, SWD_REG_CYCLES, sim->cycles - start_cycles, 4);
+	return GPMC_STATUS_OK;
+}
+
+int run_swd_sim(const char *path, const char *options)
+{
+	struct swd_sim sim;
+	int status;
+	memset(&sim, 0, sizeof sim);
+	sim.target.dpidr = SIM_DPIDR;
+	sim.target.mem_words = 64 * 256;
+	if (!parse_options(&sim, options))
+		return 0;
+	sim.target.mem = (uint32_t *)calloc(sim.target.mem_words, 4);
+	if (sim.target.mem == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	fprintf(stderr, "SWD master on %s, %u KB of target memory, %d WAIT%s per access\n", path,
+		sim.target.mem_words / 256, sim.target.wait, sim.target.wait == 1 ? "" : "s");
+	status = gpmc_serve(path, SWD_MASTER_ID, run_ops, &sim);
+	if (status == 1)
+		fprintf(stderr, "SWD master stopped after %llu transactions, %llu WAITs, %llu SWCLK\n",
+			(unsigned long long)sim.transactions, (unsigned long long)sim.waits, (unsigned long long)sim.cycles);
+	free(sim.target.mem);
+	return status;
+}
@@ -0,0 +1,907 @@
+/*
+ * TPIU deframer and ITM/DWT decoder, decoding in parallel.  See tpiu.h.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tpiu.h"
+
+#define NONE ((size_t)-1)
+#define ITM_SYNC_ZEROS 5	// Zero bytes before the 0x80 of an ITM sync
+#define CSV_MAX_LINE 64
+#define EVENT_RECORD_SIZE 16
+
+// One thread's piece of a batch
+struct piece {
+	// Deframing, [start, end) of the batch
+	const uint8_t *buf;
+	size_t start;
+	size_t end;
+	int last;
+	int target;
+	int id;			// -1 until the first ID change
+	uint8_t *out;		// Bytes of the target ID
+	size_t out_len;
+	size_t out_size;
+	uint8_t *prefix;	// Bytes before the first ID change
+	size_t prefix_len;
+	size_t prefix_size;
+	size_t stop;		// Where deframing got to
+	uint64_t frames;
+	uint64_t syncs;
+	uint64_t id_bytes[TPIU_NUM_IDS];
+
+	// ITM decoding, [itm_start, itm_end) of the ITM bytes
+	const uint8_t *itm;
+	size_t itm_start;
+	size_t itm_end;
+	int page;
+	uint64_t time;		// Local timestamps in the piece
+	struct itm_event *events;
+	size_t num_events;
+	size_t events_size;
+	size_t itm_stop;
+	uint64_t itm_syncs;
+	uint64_t errors;
+
+	// Output
+	int format;
+	uint64_t time_base;
+	uint8_t *text;
+	size_t text_len;
+	size_t text_size;
+	uint64_t types[ITM_EV_MAX];
+	uint64_t checksum;
+};
+
+// What carries over from one batch to the next
+struct decoder {
+	struct tpiu_options opts;
+	int tpiu_synced;
+	int itm_synced;
+	int id;
+	int page;
+	uint64_t time;
+	uint8_t *carry;		// Capture bytes after the last whole frame
+	size_t carry_len;
+	uint8_t *itm;		// ITM bytes of the batch, after the part packet of the last one
+	size_t itm_len;
+	size_t itm_size;
+	struct piece *pieces;
+	int num_pieces;
+	struct tpiu_stats *stats;
+};
+
+typedef void (*piece_fn)(struct piece *p);
+
+//#define DEBUG(x) (x)
+#define DEBUG(x)
+
+static const char *event_names[ITM_EV_MAX] = {
+	"?", "stimulus", "overflow", "global_ts", "event_counter", "exception",
+	"pc_sample", "data_pc", "data_addr", "data_value", "hardware",
+};
+
+const char *itm_event_name(int type)
+{
+	if (type <= 0 || type >= ITM_EV_MAX)
+		return "?";
+	return event_names[type];
+}
+
+uint64_t itm_event_hash(const struct itm_event *e)
+{
+	uint64_t h = e->time * 0x9E3779B97F4A7C15ULL;
+	h ^= ((uint64_t)e->type << 56) | ((uint64_t)e->channel << 48) | ((uint64_t)e->flags << 40) |
+		((uint64_t)e->size << 32) | e->value;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	return h ^ (h >> 31);
+}
+
+static int grow(void **buffer, size_t *size, size_t needed, size_t item_size)
+{
+	void *p;
+	size_t n;
+	if (needed <= *size)
+		return 1;
+	n = *size > 0 ? *size : 4096;
+	while (n < needed)
+		n *= 2;
+	p = realloc(*buffer, n * item_size);
+	if (p == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	*buffer = p;
+	*size = n;
+	return 1;
+}
+
+// Index just after the first full sync at or after 'from', NONE if there is none
+static size_t find_tpiu_sync(const uint8_t *buf, size_t from, size_t len)
+{
+	const uint8_t *p;
+	size_t i = from + 3;
+	while (i < len)
+	{
+		p = (const uint8_t *)memchr(buf + i, 0x7F, len - i);
+		if (p == 0)
+			return NONE;
+		i = p - buf;
+		if (buf[i - 1] == 0xFF && buf[i - 2] == 0xFF && buf[i - 3] == 0xFF)
+			return i + 1;
+		i++;
+	}
+	return NONE;
+}
+
+static int is_tpiu_sync(const uint8_t *p)
+{
+	return p[0] == 0xFF && p[1] == 0xFF && p[2] == 0xFF && p[3] == 0x7F;
+}
+
+// Index just after the first ITM sync packet at or after 'from', NONE if there is none
+static size_t find_itm_sync(const uint8_t *buf, size_t from, size_t len)
+{
+	const uint8_t *p;
+	size_t i = from + ITM_SYNC_ZEROS;
+	int k;
+	while (i < len)
+	{
+		p = (const uint8_t *)memchr(buf + i, 0x80, len - i);
+		if (p == 0)
+			return NONE;
+		i = p - buf;
+		for (k = 1; k <= ITM_SYNC_ZEROS && buf[i - k] == 0; k++)
+			;
+		if (k > ITM_SYNC_ZEROS)
+			return i + 1;
+		i++;
+	}
+	return NONE;
+}
+
+static void emit(struct piece *p, uint8_t data)
+{
+	if (p->id == p->target)
+		p->out[p->out_len++] = data;
+	else if (p->id < 0)
+		p->prefix[p->prefix_len++] = data;
+	if (p->id >= 0)
+		p->id_bytes[p->id]++;
+}
+
+static void deframe(struct piece *p, const uint8_t *f)
+{
+	uint8_t aux = f[15];
+	int i, bit;
+	// Mostly no ID change in a frame: fifteen bytes of data in order
+	if (((f[0] | f[2] | f[4] | f[6] | f[8] | f[10] | f[12] | f[14]) & 1) == 0 && p->id >= 0)
+	{
+		if (p->id == p->target)
+		{
+			uint8_t *o = p->out + p->out_len;
+			for (i = 0; i < 7; i++)
+			{
+				o[2 * i] = f[2 * i] | ((aux >> i) & 1);
+				o[2 * i + 1] = f[2 * i + 1];
+			}
+			o[14] = f[14] | (aux >> 7);
+			p->out_len += 15;
+		}
+		p->id_bytes[p->id] += 15;
+		return;
+	}
+	for (i = 0; i < 8; i++)
+	{
+		bit = (aux >> i) & 1;
+		if ((f[2 * i] & 1) == 0)
+		{
+			emit(p, f[2 * i] | bit);
+			if (i < 7)
+				emit(p, f[2 * i + 1]);
+		}
+		else if (i == 7)
+			p->id = f[14] >> 1;
+		else if (bit)
+		{
+			// The new ID takes effect after the next byte
+			emit(p, f[2 * i + 1]);
+			p->id = f[2 * i] >> 1;
+		}
+		else
+		{
+			p->id = f[2 * i] >> 1;
+			emit(p, f[2 * i + 1]);
+		}
+	}
+}
+
+static void deframe_piece(struct piece *p)
+{
+	size_t pos = p->start;
+	for (;;)
+	{
+		if (pos + 4 <= p->end && is_tpiu_sync(p->buf + pos))
+		{
+			pos += 4;
+			p->syncs++;
+			continue;
+		}
+		if (pos + TPIU_FRAME_SIZE > p->end)
+			break;
+		deframe(p, p->buf + pos);
+		pos += TPIU_FRAME_SIZE;
+		p->frames++;
+	}
+	p->stop = pos;
+}
+
+static int add_event(struct piece *p, int type, int channel, int size, int flags, uint32_t value)
+{
+	struct itm_event *e;
+	if (p->num_events == p->events_size &&
+	    !grow((void **)&p->events, &p->events_size, p->num_events + 1, sizeof *p->events))
+		return 0;
+	e = &p->events[p->num_events++];
+	e->time = p->time;
+	e->value = value;
+	e->type = type;
+	e->channel = channel;
+	e->size = size;
+	e->flags = flags;
+	return 1;
+}
+
+static int hardware_event(struct piece *p, int disc, int size, uint32_t value)
+{
+	if (disc == 0)
+		return add_event(p, ITM_EV_EVENT_COUNTER, 0, size, 0, value);
+	if (disc == 1)
+		return add_event(p, ITM_EV_EXCEPTION, 0, size, (value >> 12) & 3, value & 0x1FF);
+	if (disc == 2)
+		return add_event(p, ITM_EV_PC_SAMPLE, 0, size, size == 1, value);
+	if ((disc & 0x18) == 0x08)
+		return add_event(p, (disc & 1) ? ITM_EV_DATA_ADDR : ITM_EV_DATA_PC, (disc >> 1) & 3, size, 0, value);
+	if ((disc & 0x18) == 0x10)
+		return add_event(p, ITM_EV_DATA_VALUE, (disc >> 1) & 3, size, disc & 1, value);
+	return add_event(p, ITM_EV_HARDWARE, disc, size, 0, value);
+}
+
+/*
+ * Up to 'max' bytes of 7 bits, bit 7 set on all but the last.  Bytes used,
+ * 0 if the packet goes past 'end'.
+ */
+static int continuation(const uint8_t *itm, size_t pos, size_t end, int max, uint64_t *value)
+{
+	int n = 0;
+	uint8_t c;
+	*value = 0;
+	do
+	{
+		if (pos + n >= end)
+			return 0;
+		c = itm[pos + n];
+		*value |= (uint64_t)(c & 0x7F) << (7 * n);
+		n++;
+	} while ((c & 0x80) && n < max);
+	return n;
+}
+
+// Packets in [itm_start, itm_end), stopping at one that does not fit
+static void decode_piece(struct piece *p)
+{
+	const uint8_t *itm = p->itm;
+	size_t pos = p->itm_start, end = p->itm_end;
+	uint64_t value;
+	uint8_t b;
+	int size, n, ok = 1;
+	while (pos < end && ok)
+	{
+		b = itm[pos];
+		if (b & 3)
+		{
+			// Stimulus or hardware source
+			size = 1 << ((b & 3) - 1);
+			if (pos + 1 + size > end)
+				break;
+			value = itm[pos + 1];
+			if (size > 1)
+				value |= itm[pos + 2] << 8;
+			if (size > 2)
+				value |= (itm[pos + 3] << 16) | ((uint32_t)itm[pos + 4] << 24);
+			if (b & 4)
+				ok = hardware_event(p, b >> 3, size, value);
+			else
+				ok = add_event(p, ITM_EV_STIMULUS, (b >> 3) + 32 * p->page, size, 0, value);
+			pos += 1 + size;
+		}
+		else if (b == 0)
+		{
+			n = 1;
+			while (pos + n < end && itm[pos + n] == 0)
+				n++;
+			if (pos + n >= end)
+				break;
+			if (itm[pos + n] != 0x80 || n < ITM_SYNC_ZEROS)
+			{
+				p->errors += n;
+				pos += n;
+				continue;
+			}
+			p->itm_syncs++;
+			p->page = 0;
+			pos += n + 1;
+		}
+		else if (b == 0x70)
+		{
+			ok = add_event(p, ITM_EV_OVERFLOW, 0, 0, 0, 0);
+			pos++;
+		}
+		else if ((b & 0x8F) == 0)
+		{
+			// Local timestamp of the header alone
+			p->time += b >> 4;
+			pos++;
+		}
+		else if ((b & 0xCF) == 0xC0)
+		{
+			n = continuation(itm, pos + 1, end, 4, &value);
+			if (n == 0)
+				break;
+			p->time += value;
+			pos += 1 + n;
+		}
+		else if (b == 0x94 || b == 0xB4)
+		{
+			n = continuation(itm, pos + 1, end, b == 0x94 ? 4 : 7, &value);
+			if (n == 0)
+				break;
+			if (b == 0x94)
+				value &= 0x3FFFFFF;
+			ok = add_event(p, ITM_EV_GLOBAL_TS, 0, n, b == 0xB4, value);
+			pos += 1 + n;
+		}
+		else if ((b & 0x0B) == 0x08)
+		{
+			// Extension, the stimulus page unless SH is set
+			n = 0;
+			if ((b & 0x80) && (n = continuation(itm, pos + 1, end, 4, &value)) == 0)
+				break;
+			if ((b & 4) == 0)
+				p->page = (b >> 4) & 7;
+			pos += 1 + n;
+		}
+		else
+		{
+			p->errors++;
+			pos++;
+		}
+	}
+	p->itm_stop = pos;
+}
+
+static uint8_t *put_dec(uint8_t *o, uint64_t v)
+{
+	uint8_t digits[20];
+	int n = 0;
+	do
+	{
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v > 0);
+	while (n > 0)
+		*o++ = digits[--n];
+	return o;
+}
+
+static uint8_t *put_hex(uint8_t *o, uint32_t v, int digits)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i;
+	for (i = digits - 1; i >= 0; i--)
+		*o++ = hex[(v >> (4 * i)) & 0xF];
+	return o;
+}
+
+static void format_piece(struct piece *p)
+{
+	uint8_t *o;
+	size_t i;
+	int k;
+	size_t needed = p->num_events * (p->format == TPIU_OUT_CSV ? CSV_MAX_LINE : EVENT_RECORD_SIZE);
+	p->text_len = 0;
+	if (!grow((void **)&p->text, &p->text_size, needed, 1))
+	{
+		p->num_events = 0;
+		return;
+	}
+	o = p->text;
+	for (i = 0; i < p->num_events; i++)
+	{
+		struct itm_event *e = &p->events[i];
+		const char *name;
+		e->time += p->time_base;
+		p->types[e->type]++;
+		p->checksum += itm_event_hash(e);
+		if (p->format != TPIU_OUT_CSV)
+		{
+			for (k = 0; k < 8; k++)
+				*o++ = e->time >> (8 * k);
+			for (k = 0; k < 4; k++)
+				*o++ = e->value >> (8 * k);
+			*o++ = e->type;
+			*o++ = e->channel;
+			*o++ = e->size;
+			*o++ = e->flags;
+			continue;
+		}
+		o = put_dec(o, e->time);
+		*o++ = ',';
+		for (name = event_names[e->type]; *name; name++)
+			*o++ = *name;
+		*o++ = ',';
+		o = put_dec(o, e->channel);
+		*o++ = ',';
+		o = put_dec(o, e->size);
+		*o++ = ',';
+		o = put_dec(o, e->flags);
+		*o++ = ',';
+		o = put_hex(o, e->value, e->size == 0 ? 1 : e->size < 4 ? 2 * e->size : 8);
+		*o++ = '\n';
+	}
+	p->text_len = o - p->text;
+}
+
+struct piece_job {
+	piece_fn fn;
+	struct piece *p;
+};
+
+static void *job_thread(void *arg)
+{
+	struct piece_job *job = (struct piece_job *)arg;
+	job->fn(job->p);
+	return 0;
+}
+
+// 'fn' on each piece, a thread each but for the first, which is done here
+static void run_pieces(struct piece *pieces, int n, piece_fn fn)
+{
+	pthread_t threads[n > 0 ? n : 1];
+	struct piece_job jobs[n > 0 ? n : 1];
+	int started[n > 0 ? n : 1];
+	int i;
+	for (i = 1; i < n; i++)
+	{
+		jobs[i].fn = fn;
+		jobs[i].p = &pieces[i];
+		started[i] = pthread_create(&threads[i], 0, job_thread, &jobs[i]) == 0;
+		if (!started[i])
+			fn(&pieces[i]);
+	}
+	if (n > 0)
+		fn(&pieces[0]);
+	for (i = 1; i < n; i++)
+		if (started[i])
+			pthread_join(threads[i], 0);
+}
+
+static int write_all(int fd, const uint8_t *buffer, size_t len)
+{
+	ssize_t n;
+	while (len > 0)
+	{
+		n = write(fd, buffer, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			perror("Trace output");
+			return 0;
+		}
+		buffer += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/*
+ * Cut the batch at TPIU syncs and deframe the pieces, then put the target
+ * ID's bytes, each piece's first ones with the ID the piece before ended
+ * with, after what is left of the last batch's.
+ */
+static int deframe_batch(struct decoder *d, const uint8_t *buf, size_t len, int at_end)
+{
+	struct tpiu_stats *st = d->stats;
+	size_t starts[d->num_pieces];
+	size_t first = 0, s, total, kept;
+	int n = 0, i, k, cur;
+	if (!d->tpiu_synced)
+	{
+		first = find_tpiu_sync(buf, 0, len);
+		if (first == NONE)
+		{
+			// Keep what could be the start of a sync
+			first = len > 3 ? len - 3 : 0;
+			st->skipped += first;
+			memmove(d->carry, buf + first, len - first);
+			d->carry_len = at_end ? 0 : len - first;
+			if (at_end)
+				st->skipped += len - first;
+			return 1;
+		}
+		st->skipped += first - 4;
+		st->syncs++;
+		d->tpiu_synced = 1;
+	}
+	starts[n++] = first;
+	for (i = 1; i < d->num_pieces; i++)
+	{
+		s = find_tpiu_sync(buf, first + i * ((len - first) / d->num_pieces), len);
+		if (s == NONE)
+			break;
+		if (s - 4 > starts[n - 1])
+			starts[n++] = s - 4;
+	}
+	for (i = 0; i < n; i++)
+	{
+		struct piece *p = &d->pieces[i];
+		p->buf = buf;
+		p->start = starts[i];
+		p->end = i + 1 < n ? starts[i + 1] : len;
+		p->last = i + 1 == n;
+		p->target = d->opts.id;
+		p->id = -1;
+		p->out_len = 0;
+		p->prefix_len = 0;
+		p->frames = 0;
+		p->syncs = 0;
+		memset(p->id_bytes, 0, sizeof p->id_bytes);
+		// A frame gives at most 15 bytes, so this is room enough
+		if (!grow((void **)&p->out, &p->out_size, p->end - p->start, 1) ||
+		    !grow((void **)&p->prefix, &p->prefix_size, p->end - p->start, 1))
+			return 0;
+	}
+	run_pieces(d->pieces, n, deframe_piece);
+	kept = total = d->itm_len;
+	for (i = 0; i < n; i++)
+		total += d->pieces[i].out_len + d->pieces[i].prefix_len;
+	if (!grow((void **)&d->itm, &d->itm_size, total, 1))
+		return 0;
+	cur = d->id;
+	for (i = 0; i < n; i++)
+	{
+		struct piece *p = &d->pieces[i];
+		if (p->prefix_len > 0)
+		{
+			if (cur == d->opts.id)
+			{
+				memcpy(d->itm + d->itm_len, p->prefix, p->prefix_len);
+				d->itm_len += p->prefix_len;
+			}
+			if (cur >= 0)
+				st->id_bytes[cur] += p->prefix_len;
+			else
+				st->skipped += p->prefix_len;
+		}
+		memcpy(d->itm + d->itm_len, p->out, p->out_len);
+		d->itm_len += p->out_len;
+		if (p->id >= 0)
+			cur = p->id;
+		for (k = 0; k < TPIU_NUM_IDS; k++)
+			st->id_bytes[k] += p->id_bytes[k];
+		st->frames += p->frames;
+		st->syncs += p->syncs;
+		// Pieces but the last end at a sync, so anything short of it is damage
+		if (!p->last)
+			st->skipped += p->end - p->stop;
+	}
+	st->itm_bytes += d->itm_len - kept;
+	d->id = cur;
+	s = d->pieces[n - 1].stop;
+	if (at_end)
+	{
+		st->skipped += len - s;
+		d->carry_len = 0;
+	}
+	else
+	{
+		memmove(d->carry, buf + s, len - s);
+		d->carry_len = len - s;
+	}
+	return 1;
+}
+
+/*
+ * Cut the ITM bytes at ITM syncs and decode the pieces, then write the
+ * events out in order.  The part packet at the end is kept for the next
+ * batch.
+ */
+static int decode_batch(struct decoder *d, int out_fd, int at_end)
+{
+	struct tpiu_stats *st = d->stats;
+	size_t starts[d->num_pieces];
+	size_t first = 0, s, len = d->itm_len;
+	uint64_t time;
+	int n = 0, i, k;
+	if (d->opts.format == TPIU_OUT_RAW)
+	{
+		d->itm_len = 0;
+		return write_all(out_fd, d->itm, len);
+	}
+	if (!d->itm_synced)
+	{
+		first = find_itm_sync(d->itm, 0, len);
+		if (first == NONE)
+		{
+			first = len > ITM_SYNC_ZEROS ? len - ITM_SYNC_ZEROS : 0;
+			if (at_end)
+				first = len;
+			st->itm_skipped += first;
+			memmove(d->itm, d->itm + first, len - first);
+			d->itm_len = len - first;
+			return 1;
+		}
+		st->itm_skipped += first - ITM_SYNC_ZEROS - 1;
+		st->itm_syncs++;
+		d->itm_synced = 1;
+		d->page = 0;
+	}
+	starts[n++] = first;
+	for (i = 1; i < d->num_pieces; i++)
+	{
+		s = find_itm_sync(d->itm, first + i * ((len - first) / d->num_pieces), len);
+		if (s == NONE)
+			break;
+		if (s > starts[n - 1])
+			starts[n++] = s;
+	}
+	for (i = 0; i < n; i++)
+	{
+		struct piece *p = &d->pieces[i];
+		p->itm = d->itm;
+		p->itm_start = starts[i];
+		p->itm_end = i + 1 < n ? starts[i + 1] : len;
+		p->page = i == 0 ? d->page : 0;
+		p->time = 0;
+		p->num_events = 0;
+		p->itm_syncs = 0;
+		p->errors = 0;
+		p->format = d->opts.format;
+		memset(p->types, 0, sizeof p->types);
+		p->checksum = 0;
+	}
+	run_pieces(d->pieces, n, decode_piece);
+	time = d->time;
+	for (i = 0; i < n; i++)
+	{
+		struct piece *p = &d->pieces[i];
+		p->time_base = time;
+		time += p->time;
+		// Pieces but the last end at a sync, so stopping short is damage
+		if (i + 1 < n && p->itm_stop != p->itm_end)
+			st->errors += p->itm_end - p->itm_stop;
+	}
+	d->time = time;
+	d->page = d->pieces[n - 1].page;
+	run_pieces(d->pieces, n, format_piece);
+	for (i = 0; i < n; i++)
+	{
+		struct piece *p = &d->pieces[i];
+		if (!write_all(out_fd, p->text, p->text_len))
+			return 0;
+		st->events += p->num_events;
+		st->itm_syncs += p->itm_syncs;
+		st->errors += p->errors;
+		st->checksum += p->checksum;
+		for (k = 0; k < ITM_EV_MAX; k++)
+			st->types[k] += p->types[k];
+	}
+	s = d->pieces[n - 1].itm_stop;
+	if (at_end)
+		st->itm_skipped += len - s;
+	d->itm_len = at_end ? 0 : len - s;
+	memmove(d->itm, d->itm + s, d->itm_len);
+	return 1;
+}
+
+static int read_batch(int fd, uint8_t *buf, size_t size, size_t *len)
+{
+	ssize_t n;
+	while (*len < size)
+	{
+		n = read(fd, buf + *len, size - *len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+		{
+			perror("Trace input");
+			return -1;
+		}
+		if (n == 0)
+			return 0;
+		*len += n;
+	}
+	return 1;
+}
+
+static void free_decoder(struct decoder *d)
+{
+	int i;
+	for (i = 0; i < d->num_pieces; i++)
+	{
+		free(d->pieces[i].out);
+		free(d->pieces[i].prefix);
+		free(d->pieces[i].events);
+		free(d->pieces[i].text);
+	}
+	free(d->pieces);
+	free(d->carry);
+	free(d->itm);
+}
+
+int tpiu_decode(int in_fd, int out_fd, const struct tpiu_options *opts, struct tpiu_stats *stats)
+{
+	static const char csv_header[] = "time,type,channel,size,flags,value\n";
+	struct decoder d;
+	size_t batch, len;
+	int more = 1, status = 1;
+	memset(&d, 0, sizeof d);
+	memset(stats, 0, sizeof *stats);
+	d.opts = *opts;
+	d.stats = stats;
+	d.id = -1;
+	d.num_pieces = opts->threads > 0 ? opts->threads : sysconf(_SC_NPROCESSORS_ONLN);
+	if (d.num_pieces < 1)
+		d.num_pieces = 1;
+	stats->threads = d.num_pieces;
+	batch = (size_t)d.num_pieces * TPIU_CHUNK_BYTES;
+	d.pieces = (struct piece *)calloc(d.num_pieces, sizeof *d.pieces);
+	// Room for the batch after what is carried over, less than a frame and a sync
+	d.carry = (uint8_t *)malloc(batch + 2 * TPIU_FRAME_SIZE);
+	if (d.pieces == 0 || d.carry == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		free_decoder(&d);
+		return 0;
+	}
+	if (opts->format == TPIU_OUT_CSV && !write_all(out_fd, (const uint8_t *)csv_header, sizeof csv_header - 1))
+		status = 0;
+	while (more && status)
+	{
+		len = d.carry_len;
+		more = read_batch(in_fd, d.carry, len + batch, &len);
+		if (more < 0)
+		{
+			status = 0;
+			break;
+		}
+		stats->bytes_in += len - d.carry_len;
+		stats->batches++;
+		if (!deframe_batch(&d, d.carry, len, !more) || !decode_batch(&d, out_fd, !more))
+			status = 0;
+	}
+	free_decoder(&d);
+	return status;
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int parse_option(struct tpiu_options *opts, const char *key, const char *value)
+{
+	if (strcmp(key, "format") == 0)
+	{
+		if (strcmp(value, "bin") == 0)
+			opts->format = TPIU_OUT_BINARY;
+		else if (strcmp(value, "csv") == 0)
+			opts->format = TPIU_OUT_CSV;
+		else if (strcmp(value, "raw") == 0)
+			opts->format = TPIU_OUT_RAW;
+		else
+			return 0;
+	}
+	else if (strcmp(key, "id") == 0)
+	{
+		opts->id = strtoul(value, 0, 0);
+		if (opts->id < 1 || opts->id >= TPIU_NUM_IDS)
+			return 0;
+	}
+	else if (strcmp(key, "threads") == 0)
+		opts->threads = strtoul(value, 0, 0);
+	else
+		return 0;
+	return 1;
+}
+
+static int parse_options(struct tpiu_options *opts, const char *options)
+{
+	char *s, *tok, *save;
+	int status = 1;
+	if (options == 0 || *options == 0)
+		return 1;
+	s = strdup(options);
+	if (s == 0)
+		return 0;
+	for (tok = strtok_r(s, ",", &save); tok != 0 && status; tok = strtok_r(0, ",", &save))
+	{
+		char *eq = strchr(tok, '=');
+		if (eq == 0)
+		{
+			fprintf(stderr, "tpiu: expected key=value, got '%s'\n", tok);
+			status = 0;
+			break;
+		}
+		*eq = 0;
+		status = parse_option(opts, tok, eq + 1);
+		if (!status)
+			fprintf(stderr, "tpiu: bad option '%s'\n", tok);
+	}
+	free(s);
+	return status;
+}
+
+int run_tpiu_decode(const char *in, const char *out, const char *options)
+{
+	struct tpiu_options opts;
+	struct tpiu_stats st;
+	double start, elapsed;
+	int in_fd, out_fd;
+	int status, i;
+	memset(&opts, 0, sizeof opts);
+	opts.id = TPIU_DEFAULT_ITM_ID;
+	opts.format = TPIU_OUT_BINARY;
+	if (!parse_options(&opts, options))
+		return 0;
+	in_fd = strcmp(in, "-") == 0 ? 0 : open(in, O_RDONLY);
+	if (in_fd < 0)
+	{
+		perror(in);
+		return 0;
+	}
+	out_fd = strcmp(out, "-") == 0 ? 1 : open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out_fd < 0)
+	{
+		perror(out);
+		close(in_fd);
+		return 0;
+	}
+	start = now();
+	status = tpiu_decode(in_fd, out_fd, &opts, &st);
+	elapsed = now() - start;
+	if (in_fd != 0)
+		close(in_fd);
+	if (out_fd != 1 && close(out_fd) != 0)
+		status = 0;
+	fprintf(stderr, "Decoded %llu bytes in %.3f s, %.1f MB/s with %d thread%s\n", (unsigned long long)st.bytes_in,
+		elapsed, st.bytes_in / elapsed / 1e6, st.threads, st.threads == 1 ? "" : "s");
+	fprintf(stderr, "TPIU: %llu frames, %llu syncs, %llu bytes skipped\n", (unsigned long long)st.frames,
+		(unsigned long long)st.syncs, (unsigned long long)st.skipped);
+	for (i = 0; i < TPIU_NUM_IDS; i++)
+		if (st.id_bytes[i] > 0)
+			fprintf(stderr, "  ID %d: %llu bytes%s\n", i, (unsigned long long)st.id_bytes[i],
+				i == TPIU_ID_NULL ? " (padding)" : i == opts.id ? " (ITM)" : "");
+	if (opts.format == TPIU_OUT_RAW)
+		return status;
+	fprintf(stderr, "ITM: %llu events, %llu syncs, %llu bad bytes, %llu bytes skipped\n", (unsigned long long)st.events,
+		(unsigned long long)st.itm_syncs, (unsigned long long)st.errors, (unsigned long long)st.itm_skipped);
+	for (i = 1; i < ITM_EV_MAX; i++)
+		if (st.types[i] > 0)
+			fprintf(stderr, "  %s: %llu\n", itm_event_name(i), (unsigned long long)st.types[i]);
+	return status;
+}
@@ -0,0 +1,110 @@
+/*
+ * TPIU deframer and ITM/DWT decoder for captured trace, decoding in
+ * parallel.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * The TPIU formatter packs the trace sources into 16 byte frames: even
+ * bytes are either an ID change (bit 0 set, ID in bits 7:1) or data with
+ * its bit 0 in the last byte of the frame, odd bytes are data.  Full
+ * syncs, FF FF FF 7F, come between frames and can not show up inside
+ * them, as an even byte of FF would be the reserved ID 7F.  The ITM
+ * stream has sync packets of at least 47 zero bits and a one, and no
+ * other packet has more than four zero bytes in a row.
+ *
+ * So both levels can be split without decoding what comes before.  The
+ * capture is read in batches of TPIU_CHUNK_BYTES per thread.  Each batch
+ * is cut at TPIU syncs and deframed in parallel, each piece keeping the
+ * bytes of the selected ID.  Bytes before a piece's first ID change get
+ * the ID the piece before ended with.  The ITM bytes are then cut at ITM
+ * syncs and decoded in parallel.  Local timestamps are deltas, so each
+ * piece counts from 0 and is moved by what the pieces before it add up
+ * to.  Output goes in capture order.  What is left at the end of a batch,
+ * a partial frame or packet, goes in front of the next, so a pipe can be
+ * decoded as it comes.
+ *
+ * A stimulus page set by an extension packet is taken to last until the
+ * next ITM sync.
+ */
+#ifndef _TPIU_H
+#define _TPIU_H 1
+#include <stdint.h>
+
+#define TPIU_FRAME_SIZE 16
+#define TPIU_NUM_IDS 128
+#define TPIU_ID_NULL 0		// Padding
+#define TPIU_DEFAULT_ITM_ID 1
+#define TPIU_CHUNK_BYTES (4 * 1024 * 1024)	// Per thread and batch
+
+// Output formats
+#define TPIU_OUT_BINARY 0	// struct itm_event records, 16 bytes, little endian
+#define TPIU_OUT_CSV 1
+#define TPIU_OUT_RAW 2		// The bytes of the ID, not decoded
+
+// Event types
+#define ITM_EV_STIMULUS 1	// 'channel' is the port, 32 per page
+#define ITM_EV_OVERFLOW 2
+#define ITM_EV_GLOBAL_TS 3	// 'flags' 1 for the high bits (GTS2)
+#define ITM_EV_EVENT_COUNTER 4	// 'value' has the counters that wrapped
+#define ITM_EV_EXCEPTION 5	// 'value' exception number, 'flags' 1 entry, 2 exit, 3 return
+#define ITM_EV_PC_SAMPLE 6	// 'size' 1 and 'flags' 1 when sleeping
+#define ITM_EV_DATA_PC 7	// 'channel' is the comparator
+#define ITM_EV_DATA_ADDR 8
+#define ITM_EV_DATA_VALUE 9	// 'flags' 1 for a write
+#define ITM_EV_HARDWARE 10	// Other DWT packets, 'channel' is the discriminator
+#define ITM_EV_MAX 11
+
+/*
+ * One decoded packet.  'time' is the sum of the local timestamps since
+ * the first ITM sync.  As written, 8 bytes of time and 4 of value little
+ * endian, then type, channel, size and flags.
+ */
+struct itm_event {
+	uint64_t time;
+	uint32_t value;
+	uint8_t type;
+	uint8_t channel;
+	uint8_t size;
+	uint8_t flags;
+};
+
+struct tpiu_options {
+	int id;			// Trace ID of the ITM
+	int format;		// TPIU_OUT_*
+	int threads;		// 0 for one per CPU
+};
+
+struct tpiu_stats {
+	uint64_t bytes_in;
+	uint64_t frames;
+	uint64_t syncs;		// TPIU full syncs
+	uint64_t skipped;	// Capture bytes before the first sync, or with no known ID
+	uint64_t id_bytes[TPIU_NUM_IDS];
+	uint64_t itm_bytes;	// Of the selected ID
+	uint64_t itm_skipped;	// Before the first ITM sync, or cut off at the end
+	uint64_t itm_syncs;
+	uint64_t errors;	// Bytes that are no ITM packet
+	uint64_t events;
+	uint64_t types[ITM_EV_MAX];
+	uint64_t checksum;	// Sum of itm_event_hash() over the events
+	uint64_t batches;
+	int threads;
+};
+
+// Order independent, so any split of the capture sums to the same
+uint64_t itm_event_hash(const struct itm_event *e);
+const char *itm_event_name(int type);
+
+// Decode all of 'in_fd' to 'out_fd'
+int tpiu_decode(int in_fd, int out_fd, const struct tpiu_options *opts, struct tpiu_stats *stats);
+/*
+ * Decode the capture in 'in' to 'out', "-" for stdin and stdout, and show
+ * the statistics.  'options' is a comma separated list of key=value pairs
+ * (may be empty or 0):
+ *   format      bin, csv or raw (default bin)
+ *   id          trace ID of the ITM (default 1)
+ *   threads     decoding threads (default one per CPU)
+ */
+int run_tpiu_decode(const char *in, const char *out, const char *options);
+
+#endif
@@ -0,0 +1,477 @@
+/*
+ * Throughput benchmark of the TPIU deframer and ITM decoder, on a
+ * synthetic capture so that it runs without a target.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * The capture is an ITM stream of a made up mix of stimulus writes,
+ * timestamps, exception trace, PC samples and data trace, with a sync
+ * now and then, on trace ID 1 and bursts of another source on ID 2, put
+ * through a TPIU formatter with a full sync every 32 frames.  It is
+ * written to /dev/shm and decoded to /dev/null with each thread count and
+ * output format, and the decoder statistics are checked against what
+ * went in.
+ *
+ * Usage: tpiu_bench [-q] [-w <capture file>]   (-q for a smaller capture,
+ *                                                -w to keep it)
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tpiu.h"
+
+#define OTHER_ID 2
+#define SYNC_FRAMES 32		// Frames between full syncs
+#define ITM_SYNC_PACKETS 1000	// Packets between ITM syncs, about
+#define GARBAGE 7		// Bytes in front of the first sync
+
+struct itm_gen {
+	uint8_t *buf;
+	size_t len;
+	size_t size;
+	uint64_t rng;
+	uint64_t time;
+	int page;
+	struct tpiu_stats expect;
+};
+
+struct tpiu_gen {
+	FILE *f;
+	const uint8_t *itm;
+	size_t itm_len;
+	size_t itm_pos;
+	uint64_t rng;
+	int burst;
+	// Bytes waiting to go into a frame, two at most
+	int ids[2];
+	uint8_t data[2];
+	int queued;
+	int id;
+	int frames;
+	struct tpiu_stats *expect;
+};
+
+static const int thread_counts[] = { 1, 2, 4 };
+static const int formats[] = { TPIU_OUT_BINARY, TPIU_OUT_CSV };
+static const char *format_names[] = { "bin", "csv" };
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint32_t next_rand(uint64_t *rng)
+{
+	*rng ^= *rng << 13;
+	*rng ^= *rng >> 7;
+	*rng ^= *rng << 17;
+	return *rng >> 16;
+}
+
+static void put(struct itm_gen *g, uint8_t b)
+{
+	g->buf[g->len++] = b;
+}
+
+static void expect_event(struct itm_gen *g, int type, int channel, int size, int flags, uint32_t value)
+{
+	struct itm_event e;
+	e.time = g->time;
+	e.value = value;
+	e.type = type;
+	e.channel = channel;
+	e.size = size;
+	e.flags = flags;
+	g->expect.events++;
+	g->expect.types[type]++;
+	g->expect.checksum += itm_event_hash(&e);
+}
+
+// A source packet with the payload of 'size' bytes
+static void source(struct itm_gen *g, int header, int size, uint32_t value)
+{
+	int i;
+	put(g, header | (size == 4 ? 3 : size));
+	for (i = 0; i < size; i++)
+		put(g, value >> (8 * i));
+}
+
+static void hardware(struct itm_gen *g, int disc, int size, uint32_t value)
+{
+	source(g, (disc << 3) | 4, size, value);
+}
+
+// 'n' bytes of 7 bits, all but the last with bit 7 set
+static void continuation(struct itm_gen *g, uint64_t value, int n)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		put(g, ((value >> (7 * i)) & 0x7F) | (i + 1 < n ? 0x80 : 0));
+}
+
+static void itm_sync(struct itm_gen *g)
+{
+	int zeros = 5 + next_rand(&g->rng) % 3;
+	while (zeros-- > 0)
+		put(g, 0);
+	put(g, 0x80);
+	g->page = 0;
+	g->expect.itm_syncs++;
+}
+
+static void packet(struct itm_gen *g)
+{
+	uint32_t r = next_rand(&g->rng), v = next_rand(&g->rng) | (next_rand(&g->rng) << 16);
+	int pick = r % 100, size = 1 << ((r >> 8) % 3), k = (r >> 10) & 3;
+	uint64_t delta;
+	int n;
+	if (pick < 40)
+	{
+		int port = (r >> 12) & 31;
+		if (size < 4)
+			v &= (1u << (8 * size)) - 1;
+		source(g, port << 3, size, v);
+		expect_event(g, ITM_EV_STIMULUS, port + 32 * g->page, size, 0, v);
+	}
+	else if (pick < 50)
+	{
+		// Local timestamp in as few bytes as it takes
+		delta = 1 + (v & ((1u << (7 * (1 + k))) - 1));
+		for (n = 1; n < 4 && delta >> (7 * n); n++)
+			;
+		put(g, 0xC0);
+		continuation(g, delta, n);
+		g->time += delta;
+	}
+	else if (pick < 60)
+	{
+		delta = 1 + v % 6;
+		put(g, delta << 4);
+		g->time += delta;
+	}
+	else if (pick < 70)
+	{
+		int number = v & 0x1FF, fn = 1 + k % 3;
+		hardware(g, 1, 2, number | (fn << 12));
+		expect_event(g, ITM_EV_EXCEPTION, 0, 2, fn, number);
+	}
+	else if (pick < 78)
+	{
+		if (k == 0)
+		{
+			hardware(g, 2, 1, 0);
+			expect_event(g, ITM_EV_PC_SAMPLE, 0, 1, 1, 0);
+		}
+		else
+		{
+			hardware(g, 2, 4, v);
+			expect_event(g, ITM_EV_PC_SAMPLE, 0, 4, 0, v);
+		}
+	}
+	else if (pick < 86)
+	{
+		int write = (r >> 12) & 1;
+		if (size < 4)
+			v &= (1u << (8 * size)) - 1;
+		hardware(g, 0x10 | (k << 1) | write, size, v);
+		expect_event(g, ITM_EV_DATA_VALUE, k, size, write, v);
+	}
+	else if (pick < 90)
+	{
+		hardware(g, 0x08 | (k << 1), 4, v);
+		expect_event(g, ITM_EV_DATA_PC, k, 4, 0, v);
+	}
+	else if (pick < 94)
+	{
+		hardware(g, 0x09 | (k << 1), 2, v & 0xFFFF);
+		expect_event(g, ITM_EV_DATA_ADDR, k, 2, 0, v & 0xFFFF);
+	}
+	else if (pick < 96)
+	{
+		hardware(g, 0, 1, v & 0x3F);
+		expect_event(g, ITM_EV_EVENT_COUNTER, 0, 1, 0, v & 0x3F);
+	}
+	else if (pick < 97)
+	{
+		put(g, 0x70);
+		expect_event(g, ITM_EV_OVERFLOW, 0, 0, 0, 0);
+	}
+	else if (pick < 98)
+	{
+		put(g, 0x94);
+		continuation(g, v & 0x3FFFFFF, 4);
+		expect_event(g, ITM_EV_GLOBAL_TS, 0, 4, 0, v & 0x3FFFFFF);
+	}
+	else if (pick < 99)
+	{
+		put(g, 0xB4);
+		continuation(g, v, 5);
+		expect_event(g, ITM_EV_GLOBAL_TS, 0, 5, 1, v);
+	}
+	else
+	{
+		// Stimulus page, up to the next sync
+		g->page = (r >> 12) & 7;
+		put(g, 0x08 | (g->page << 4));
+	}
+}
+
+static int generate_itm(struct itm_gen *g, size_t size)
+{
+	size_t packets = 0;
+	g->buf = (uint8_t *)malloc(size);
+	if (g->buf == 0)
+		return 0;
+	g->size = size;
+	g->rng = 0x2545F4914F6CDD1DULL;
+	// Room for the largest packet and a sync
+	while (g->len + 16 < size)
+	{
+		if (packets++ % ITM_SYNC_PACKETS == 0)
+			itm_sync(g);
+		else
+			packet(g);
+	}
+	g->expect.itm_bytes = g->len;
+	return 1;
+}
+
+// The next byte for the formatter, ID 1 with bursts of ID 2 in between
+static int pull(struct tpiu_gen *t, int *id, uint8_t *data)
+{
+	if (t->burst == 0 && (next_rand(&t->rng) & 63) == 0)
+		t->burst = 1 + next_rand(&t->rng) % 32;
+	if (t->burst > 0)
+	{
+		t->burst--;
+		*id = OTHER_ID;
+		*data = next_rand(&t->rng);
+		return 1;
+	}
+	if (t->itm_pos == t->itm_len)
+		return 0;
+	*id = TPIU_DEFAULT_ITM_ID;
+	*data = t->itm[t->itm_pos++];
+	return 1;
+}
+
+static void fill_queue(struct tpiu_gen *t)
+{
+	while (t->queued < 2 && pull(t, &t->ids[t->queued], &t->data[t->queued]))
+		t->queued++;
+}
+
+// Queued byte 'k', or ID 0 padding past the end
+static int peek_id(struct tpiu_gen *t, int k)
+{
+	return k < t->queued ? t->ids[k] : TPIU_ID_NULL;
+}
+
+static uint8_t take(struct tpiu_gen *t)
+{
+	uint8_t data = t->queued > 0 ? t->data[0] : 0;
+	t->expect->id_bytes[peek_id(t, 0)]++;
+	if (t->queued > 0)
+	{
+		t->ids[0] = t->ids[1];
+		t->data[0] = t->data[1];
+		t->queued--;
+	}
+	return data;
+}
+
+static void frame(struct tpiu_gen *t)
+{
+	static const uint8_t sync[4] = { 0xFF, 0xFF, 0xFF, 0x7F };
+	uint8_t f[TPIU_FRAME_SIZE];
+	uint8_t data;
+	int i;
+	f[15] = 0;
+	for (i = 0; i < 8; i++)
+	{
+		fill_queue(t);
+		if (peek_id(t, 0) != t->id)
+		{
+			// New ID, the next byte its first
+			t->id = peek_id(t, 0);
+			f[2 * i] = (t->id << 1) | 1;
+			if (i < 7)
+				f[2 * i + 1] = take(t);
+		}
+		else if (i == 7)
+		{
+			data = take(t);
+			f[14] = data & 0xFE;
+			f[15] |= (data & 1) << 7;
+		}
+		else if (peek_id(t, 1) == t->id)
+		{
+			data = take(t);
+			f[2 * i] = data & 0xFE;
+			f[15] |= (data & 1) << i;
+			f[2 * i + 1] = take(t);
+		}
+		else
+		{
+			// New ID after the next byte, which is the old ID's last
+			t->id = peek_id(t, 1);
+			f[2 * i] = (t->id << 1) | 1;
+			f[15] |= 1 << i;
+			f[2 * i + 1] = take(t);
+		}
+	}
+	if (t->frames++ % SYNC_FRAMES == 0)
+	{
+		fwrite(sync, 1, 4, t->f);
+		t->expect->syncs++;
+	}
+	fwrite(f, 1, TPIU_FRAME_SIZE, t->f);
+	t->expect->frames++;
+}
+
+static int write_capture(const char *path, struct itm_gen *g, struct tpiu_stats *expect)
+{
+	static const uint8_t garbage[GARBAGE] = { 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55 };
+	struct tpiu_gen t;
+	memset(&t, 0, sizeof t);
+	t.f = fopen(path, "wb");
+	if (t.f == 0)
+	{
+		perror(path);
+		return 0;
+	}
+	t.itm = g->buf;
+	t.itm_len = g->len;
+	t.rng = 0x9E3779B97F4A7C15ULL;
+	t.expect = expect;
+	// Start part way into a source, so the decoder has to find its feet
+	t.id = -1;
+	fwrite(garbage, 1, GARBAGE, t.f);
+	expect->skipped = GARBAGE;
+	do
+	{
+		frame(&t);
+		fill_queue(&t);
+	} while (t.queued > 0);
+	if (fclose(t.f) != 0)
+	{
+		perror(path);
+		return 0;
+	}
+	return 1;
+}
+
+static int check(const struct tpiu_stats *got, const struct tpiu_stats *expect)
+{
+	int status = 1, i;
+#define CHECK(field) \
+	if (got->field != expect->field) \
+	{ \
+		fprintf(stderr, "  " #field ": %llu, expected %llu\n", (unsigned long long)got->field, \
+			(unsigned long long)expect->field); \
+		status = 0; \
+	}
+	CHECK(frames)
+	CHECK(syncs)
+	CHECK(skipped)
+	CHECK(itm_bytes)
+	CHECK(itm_skipped)
+	CHECK(itm_syncs)
+	CHECK(errors)
+	CHECK(events)
+	CHECK(checksum)
+	for (i = 0; i < TPIU_NUM_IDS; i++)
+		CHECK(id_bytes[i])
+	for (i = 0; i < ITM_EV_MAX; i++)
+		CHECK(types[i])
+#undef CHECK
+	return status;
+}
+
+static int run(const char *path, int threads, int format, const struct tpiu_stats *expect)
+{
+	struct tpiu_options opts;
+	struct tpiu_stats st;
+	double start, elapsed;
+	int in_fd, out_fd, status;
+	opts.id = TPIU_DEFAULT_ITM_ID;
+	opts.format = formats[format];
+	opts.threads = threads;
+	in_fd = open(path, O_RDONLY);
+	out_fd = open("/dev/null", O_WRONLY);
+	if (in_fd < 0 || out_fd < 0)
+	{
+		perror(path);
+		return 0;
+	}
+	start = now();
+	status = tpiu_decode(in_fd, out_fd, &opts, &st);
+	elapsed = now() - start;
+	close(in_fd);
+	close(out_fd);
+	if (status != 1)
+		return 0;
+	printf("%7d  %-6s  %8.1f  %9llu  %8.2f  %9.1f\n", threads, format_names[format], st.bytes_in / 1e6,
+		(unsigned long long)st.events, elapsed, st.bytes_in / elapsed / 1e6);
+	return check(&st, expect);
+}
+
+int main(int argc, char **argv)
+{
+	char path[64];
+	const char *keep = 0;
+	struct itm_gen g;
+	struct tpiu_stats expect;
+	size_t size = 64 * 1024 * 1024;
+	int threads[sizeof thread_counts / sizeof thread_counts[0] + 1];
+	int num_threads = 0, cpus, i, k, status = 1;
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-q") == 0)
+			size = 8 * 1024 * 1024;
+		else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+			keep = argv[++i];
+		else
+		{
+			fprintf(stderr, "Usage: %s [-q] [-w <capture file>]\n", argv[0]);
+			return 1;
+		}
+	}
+	memset(&g, 0, sizeof g);
+	if (!generate_itm(&g, size))
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	expect = g.expect;
+	if (keep != 0)
+		snprintf(path, sizeof path, "%s", keep);
+	else
+		snprintf(path, sizeof path, "/dev/shm/tpiu_bench.%d", (int)getpid());
+	if (!write_capture(keep != 0 ? keep : path, &g, &expect))
+		return 1;
+	free(g.buf);
+	for (i = 0; i < (int)(sizeof thread_counts / sizeof thread_counts[0]); i++)
+		threads[num_threads++] = thread_counts[i];
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > thread_counts[num_threads - 1])
+		threads[num_threads++] = cpus;
+	printf("%d CPUs, %.1f MB of ITM in the capture, %llu events\n", cpus, expect.itm_bytes / 1e6,
+		(unsigned long long)expect.events);
+	printf("%7s  %-6s  %8s  %9s  %8s  %9s\n", "threads", "format", "MB", "events", "s", "MB/s");
+	for (i = 0; i < num_threads && status; i++)
+		for (k = 0; k < (int)(sizeof formats / sizeof formats[0]) && status; k++)
+			status = run(keep != 0 ? keep : path, threads[i], k, &expect);
+	if (keep == 0)
+		unlink(path);
+	if (!status)
+		fprintf(stderr, "Decoded statistics differ from the capture\n");
+	return status ? 0 : 1;
+}
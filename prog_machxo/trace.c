@@ -0,0 +1,355 @@
+/*
+ * Trace capture from the FPGA trace FIFO on the GPMC bus.  See trace.h.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gpmc.h"
+#include "trace.h"
+
+struct trace_capture {
+	struct gpmc_window *w;
+	int fd;
+	pthread_t reader;
+	pthread_t writer;
+	int running;
+
+	/*
+	 * The ring.  'head' is only written by the reader and 'tail' only by
+	 * the writer, both counting bytes since the start, so no locks.
+	 */
+	uint8_t *ring;
+	uint64_t ring_size;	// A power of two
+	uint64_t head;
+	uint64_t tail;
+	int stop_reading;
+	int reader_done;
+
+	uint32_t last_overflow;	// OVERFLOW as last read
+	struct trace_stats stats;	// Each field has one thread writing it
+};
+
+//#define DEBUG(x) (x)
+#define DEBUG(x)
+
+// Statistics are read by other threads, so no torn 64 bit values
+static void add_stat(uint64_t *stat, uint64_t n)
+{
+	__atomic_store_n(stat, *stat + n, __ATOMIC_RELAXED);
+}
+
+static void max_stat(uint64_t *stat, uint64_t n)
+{
+	if (n > *stat)
+		__atomic_store_n(stat, n, __ATOMIC_RELAXED);
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct trace_capture *trace_open(const char *name, size_t ring_size)
+{
+	struct trace_capture *t;
+	if (ring_size == 0)
+		ring_size = TRACE_DEFAULT_RING;
+	if (ring_size % TRACE_WRITE_CHUNK != 0 || (ring_size & (ring_size - 1)) != 0)
+	{
+		fprintf(stderr, "Trace ring size must be a power of two and a multiple of %d\n", TRACE_WRITE_CHUNK);
+		return 0;
+	}
+	t = (struct trace_capture *)calloc(1, sizeof *t);
+	if (t == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	// Page aligned, so each write() hands the kernel whole pages
+	if (posix_memalign((void **)&t->ring, 4096, ring_size) != 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		free(t);
+		return 0;
+	}
+	t->w = gpmc_map(name, TRACE_CAPTURE_ID);
+	if (t->w == 0)
+	{
+		free(t->ring);
+		free(t);
+		return 0;
+	}
+	t->ring_size = ring_size;
+	t->stats.ring_size = ring_size;
+	t->stats.fifo_size = gpmc_get_le(gpmc_regs(t->w), TRACE_REG_FIFO_SIZE, 2);
+	return t;
+}
+
+void trace_close(struct trace_capture *t)
+{
+	if (t == 0)
+		return;
+	if (t->running)
+		trace_stop(t);
+	gpmc_close(t->w);
+	free(t->ring);
+	free(t);
+}
+
+void trace_get_stats(struct trace_capture *t, struct trace_stats *stats)
+{
+	stats->captured = __atomic_load_n(&t->stats.captured, __ATOMIC_RELAXED);
+	stats->written = __atomic_load_n(&t->stats.written, __ATOMIC_RELAXED);
+	stats->ring_drops = __atomic_load_n(&t->stats.ring_drops, __ATOMIC_RELAXED);
+	stats->fifo_overflow = __atomic_load_n(&t->stats.fifo_overflow, __ATOMIC_RELAXED);
+	stats->fifo_high_water = __atomic_load_n(&t->stats.fifo_high_water, __ATOMIC_RELAXED);
+	stats->fifo_size = __atomic_load_n(&t->stats.fifo_size, __ATOMIC_RELAXED);
+	stats->ring_high_water = __atomic_load_n(&t->stats.ring_high_water, __ATOMIC_RELAXED);
+	stats->ring_size = t->stats.ring_size;
+	stats->requests = __atomic_load_n(&t->stats.requests, __ATOMIC_RELAXED);
+	stats->empty_polls = __atomic_load_n(&t->stats.empty_polls, __ATOMIC_RELAXED);
+	stats->write_error = __atomic_load_n(&t->stats.write_error, __ATOMIC_RELAXED);
+}
+
+// The mailbox side must be read word aligned, so a wrap goes through a bounce buffer
+static void store(struct trace_capture *t, volatile uint8_t *regs, int len)
+{
+	uint64_t pos = t->head & (t->ring_size - 1);
+	uint8_t bounce[GPMC_DATA_SIZE];
+	int first;
+	if (pos + len <= t->ring_size)
+	{
+		gpmc_read(t->ring + pos, regs + TRACE_REG_DATA, len);
+		return;
+	}
+	first = t->ring_size - pos;
+	gpmc_read(bounce, regs + TRACE_REG_DATA, len);
+	memcpy(t->ring + pos, bounce, first);
+	memcpy(t->ring, bounce + first, len - first);
+}
+
+static void *reader_thread(void *arg)
+{
+	struct trace_capture *t = (struct trace_capture *)arg;
+	volatile uint8_t *regs = gpmc_regs(t->w);
+	uint32_t overflow, high_water;
+	uint64_t used;
+	int len;
+	while (!__atomic_load_n(&t->stop_reading, __ATOMIC_RELAXED))
+	{
+		if (gpmc_request(t->w) < 0)
+		{
+			fprintf(stderr, "Trace request failed: %s\n", strerror(errno));
+			break;
+		}
+		add_stat(&t->stats.requests, 1);
+		if (t->stats.fifo_size == 0)
+			__atomic_store_n(&t->stats.fifo_size, gpmc_get_le(regs, TRACE_REG_FIFO_SIZE, 2), __ATOMIC_RELAXED);
+		high_water = gpmc_get_le(regs, TRACE_REG_HIGH_WATER, 2);
+		if (high_water > t->stats.fifo_high_water)
+			__atomic_store_n(&t->stats.fifo_high_water, high_water, __ATOMIC_RELAXED);
+		overflow = gpmc_get_le(regs, TRACE_REG_OVERFLOW, 4);
+		add_stat(&t->stats.fifo_overflow, overflow - t->last_overflow);
+		t->last_overflow = overflow;
+		len = gpmc_get_le(regs, TRACE_REG_LENGTH, 2);
+		if (len > GPMC_DATA_SIZE)
+			len = GPMC_DATA_SIZE;
+		if (len == 0)
+		{
+			// Only sleep once the burst has drained the FIFO
+			add_stat(&t->stats.empty_polls, 1);
+			usleep(TRACE_IDLE_USECS);
+			continue;
+		}
+		used = t->head - __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE);
+		if (used + len > t->ring_size)
+		{
+			// Keep the FIFO drained anyway, so the losses are counted here
+			add_stat(&t->stats.ring_drops, len);
+			continue;
+		}
+		store(t, regs, len);
+		__atomic_store_n(&t->head, t->head + len, __ATOMIC_RELEASE);
+		add_stat(&t->stats.captured, len);
+		max_stat(&t->stats.ring_high_water, used + len);
+	}
+	__atomic_store_n(&t->reader_done, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int write_all(int fd, const uint8_t *buffer, size_t len)
+{
+	ssize_t n;
+	while (len > 0)
+	{
+		n = write(fd, buffer, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		buffer += n;
+		len -= n;
+	}
+	return 1;
+}
+
+// Whole chunks while running, whatever is left once the reader is done
+static void *writer_thread(void *arg)
+{
+	struct trace_capture *t = (struct trace_capture *)arg;
+	uint64_t head, pos, len;
+	int done;
+	for (;;)
+	{
+		done = __atomic_load_n(&t->reader_done, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+		if (head - t->tail < TRACE_WRITE_CHUNK && !done)
+		{
+			usleep(1000);
+			continue;
+		}
+		if (head == t->tail)
+			break;
+		pos = t->tail & (t->ring_size - 1);
+		len = head - t->tail;
+		if (len > TRACE_WRITE_CHUNK)
+			len = TRACE_WRITE_CHUNK;
+		// The tail only leaves chunk alignment at the very end, so this is rarely cut
+		if (pos + len > t->ring_size)
+			len = t->ring_size - pos;
+		if (!write_all(t->fd, t->ring + pos, len))
+		{
+			__atomic_store_n(&t->stats.write_error, errno ? errno : EIO, __ATOMIC_RELAXED);
+			perror("Trace write");
+			break;
+		}
+		__atomic_store_n(&t->tail, t->tail + len, __ATOMIC_RELEASE);
+		add_stat(&t->stats.written, len);
+	}
+	return 0;
+}
+
+int trace_start(struct trace_capture *t, int fd)
+{
+	volatile uint8_t *regs = gpmc_regs(t->w);
+	if (t->running)
+		return 0;
+	t->fd = fd;
+	t->stop_reading = 0;
+	t->reader_done = 0;
+	t->last_overflow = gpmc_get_le(regs, TRACE_REG_OVERFLOW, 4);
+	regs[TRACE_REG_CONTROL] = TRACE_CTRL_ENABLE;
+	if (pthread_create(&t->writer, 0, writer_thread, t) != 0)
+	{
+		perror("trace_start");
+		return 0;
+	}
+	if (pthread_create(&t->reader, 0, reader_thread, t) != 0)
+	{
+		perror("trace_start");
+		__atomic_store_n(&t->reader_done, 1, __ATOMIC_RELEASE);
+		pthread_join(t->writer, 0);
+		return 0;
+	}
+	t->running = 1;
+	return 1;
+}
+
+int trace_stop(struct trace_capture *t)
+{
+	if (!t->running)
+		return 0;
+	__atomic_store_n(&t->stop_reading, 1, __ATOMIC_RELAXED);
+	pthread_join(t->reader, 0);
+	gpmc_regs(t->w)[TRACE_REG_CONTROL] = 0;
+	pthread_join(t->writer, 0);
+	t->running = 0;
+	return t->stats.write_error == 0;
+}
+
+static volatile sig_atomic_t capture_stop = 0;
+
+static void stop_capture(int sig)
+{
+	capture_stop = 1;
+}
+
+static void print_stats(struct trace_stats *st, double elapsed, double interval, uint64_t written_before)
+{
+	fprintf(stderr, "%6.1f s: %7.2f MB/s, %llu MB written, ring %llu%% full at most, FIFO %u of %u at most, "
+		"%llu bytes dropped in the ring, %llu lost in the FIFO\n",
+		elapsed, (st->written - written_before) / interval / 1e6, (unsigned long long)(st->written / 1000000),
+		(unsigned long long)(st->ring_high_water * 100 / st->ring_size), st->fifo_high_water, st->fifo_size,
+		(unsigned long long)st->ring_drops, (unsigned long long)st->fifo_overflow);
+}
+
+int run_trace_capture(const char *window, const char *path, double seconds)
+{
+	struct trace_capture *t;
+	struct trace_stats st;
+	struct sigaction sa;
+	struct timespec tick = { 0, 100000000 };
+	double start, last, elapsed;
+	uint64_t written_before = 0;
+	int status;
+	int fd;
+	t = trace_open(window, 0);
+	if (t == 0)
+		return 0;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		perror(path);
+		trace_close(t);
+		return 0;
+	}
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = stop_capture;
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+	if (trace_start(t, fd) != 1)
+	{
+		close(fd);
+		trace_close(t);
+		return 0;
+	}
+	fprintf(stderr, "Capturing trace from %s to %s\n", window, path);
+	start = last = now();
+	while (!capture_stop && (seconds <= 0 || now() - start < seconds))
+	{
+		nanosleep(&tick, 0);
+		if (now() - last < 1.0)
+			continue;
+		trace_get_stats(t, &st);
+		print_stats(&st, now() - start, now() - last, written_before);
+		written_before = st.written;
+		last = now();
+	}
+	status = trace_stop(t);
+	elapsed = now() - start;
+	trace_get_stats(t, &st);
+	if (close(fd) != 0)
+		status = 0;
+	fprintf(stderr, "Captured %llu bytes in %.2f s, %.2f MB/s sustained, %llu requests, %llu found the FIFO empty\n",
+		(unsigned long long)st.written, elapsed, st.written / elapsed / 1e6,
+		(unsigned long long)st.requests, (unsigned long long)st.empty_polls);
+	fprintf(stderr, "Ring high water %llu of %llu bytes, FIFO high water %u of %u bytes\n",
+		(unsigned long long)st.ring_high_water, (unsigned long long)st.ring_size, st.fifo_high_water, st.fifo_size);
+	if (st.ring_drops > 0 || st.fifo_overflow > 0)
+		fprintf(stderr, "Trace lost: %llu bytes dropped in the ring, %llu bytes lost in the FIFO\n",
+			(unsigned long long)st.ring_drops, (unsigned long long)st.fifo_overflow);
+	trace_close(t);
+	return status;
+}
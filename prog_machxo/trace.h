@@ -0,0 +1,91 @@
+/*
+ * Trace capture from the FPGA trace FIFO on the GPMC bus, to a file.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * The trace capture design, TRACE_CAPTURE_ID, has the mailbox header of
+ * gpmc.h and goes on with:
+ *
+ *   0x08  LEVEL       2 bytes, bytes in the FIFO before this request
+ *   0x0A  LENGTH      2 bytes, bytes of trace the design put in DATA
+ *   0x0C  OVERFLOW    4 bytes, bytes lost to a full FIFO since the design
+ *                     was enabled, wrapping
+ *   0x10  HIGH_WATER  2 bytes, highest LEVEL since the last request
+ *   0x12  FIFO_SIZE   2 bytes
+ *   0x14  CONTROL     TRACE_CTRL_*, written by the host
+ *   0x20  DATA        trace out
+ *
+ * Every request moves as much of the FIFO as DATA holds.  A reader thread
+ * drains it in bursts, back to back while the FIFO has more, into a
+ * single producer, single consumer ring.  A writer thread streams the
+ * ring to the file in large writes straight from the ring, each one
+ * TRACE_WRITE_CHUNK aligned.  If the ring is full the reader still drains
+ * the FIFO and counts what it could not keep, so the losses on the host
+ * and in the FPGA show up apart.
+ */
+#ifndef _TRACE_H
+#define _TRACE_H 1
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_CAPTURE_ID 0x4352544D	// "MTRC"
+
+#define TRACE_REG_LEVEL 0x08
+#define TRACE_REG_LENGTH 0x0A
+#define TRACE_REG_OVERFLOW 0x0C
+#define TRACE_REG_HIGH_WATER 0x10
+#define TRACE_REG_FIFO_SIZE 0x12
+#define TRACE_REG_CONTROL 0x14
+# define TRACE_CTRL_ENABLE 0x01
+#define TRACE_REG_DATA 0x20
+
+#define TRACE_WRITE_CHUNK (256 * 1024)	// Bytes per write(), and the ring alignment
+#define TRACE_DEFAULT_RING (64 * 1024 * 1024)
+#define TRACE_IDLE_USECS 100	// Reader sleep when the FIFO is empty
+
+struct trace_stats {
+	uint64_t captured;	// Bytes taken from the FIFO into the ring
+	uint64_t written;	// Bytes written to the file
+	uint64_t ring_drops;	// Bytes taken from the FIFO with no room in the ring
+	uint64_t fifo_overflow;	// Bytes the FPGA lost to a full FIFO
+	uint32_t fifo_high_water;
+	uint32_t fifo_size;
+	uint64_t ring_high_water;
+	uint64_t ring_size;
+	uint64_t requests;	// Mailbox requests
+	uint64_t empty_polls;	// Requests that found the FIFO empty
+	int write_error;	// errno of a failed write, 0 if none
+};
+
+struct trace_capture;
+
+/*
+ * 'name' is "gpmc" or "gpmc:<file>", 'ring_size' a multiple of
+ * TRACE_WRITE_CHUNK (0 for the default).
+ */
+struct trace_capture *trace_open(const char *name, size_t ring_size);
+// Start the reader and writer threads, writing to 'fd'
+int trace_start(struct trace_capture *t, int fd);
+// Stop reading, and return once everything captured is written
+int trace_stop(struct trace_capture *t);
+// Safe while running
+void trace_get_stats(struct trace_capture *t, struct trace_stats *stats);
+void trace_close(struct trace_capture *t);
+
+/*
+ * Capture from 'window' to 'path' for 'seconds', or until SIGINT or
+ * SIGTERM if 0, with a line of statistics every second on stderr.
+ */
+int run_trace_capture(const char *window, const char *path, double seconds);
+
+/*
+ * Stand-in for the trace capture design on a file, with a trace source
+ * behind it.  'options' is a comma separated list of key=value pairs (may
+ * be empty or 0):
+ *   rate        MB/s of trace going into the FIFO (default 8)
+ *   fifo        FIFO size in bytes (default 4096)
+ * The trace is a count of 32 bit little endian words, so gaps show.
+ */
+int run_trace_sim(const char *path, const char *options);
+
+#endif
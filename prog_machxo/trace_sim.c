@@ -0,0 +1,171 @@
+/*
+ * Stand-in for the trace capture design, with a trace source behind it.
+ * Copyright (c) 2013 Bjarne Steinsbo <bjarne at steinsbo dot com>
+ * License: http://www.gnu.org/licenses/gpl.html GPL version 2 or higher
+ *
+ * Trace goes into the FIFO at a steady rate while the design is enabled,
+ * worked out from the clock at each request, and what does not fit is
+ * lost and counted, as in the FPGA.  The trace is a count of 32 bit little
+ * endian words, so a capture can be checked for gaps.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gpmc.h"
+#include "trace.h"
+
+struct trace_sim {
+	double rate;		// Bytes per second
+	uint8_t *fifo;
+	int fifo_size;
+	int fifo_start;
+	int level;
+	double last;		// When trace was last put in, 0 while disabled
+	double pending;		// Trace not yet put in, less than a word
+	uint64_t next;		// Index of the next trace byte
+	uint32_t overflow;
+	int high_water;
+	uint64_t produced;
+};
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int parse_option(struct trace_sim *sim, const char *key, const char *value)
+{
+	if (strcmp(key, "rate") == 0)
+	{
+		sim->rate = strtod(value, 0) * 1e6;
+		if (sim->rate <= 0)
+			return 0;
+	}
+	else if (strcmp(key, "fifo") == 0)
+	{
+		sim->fifo_size = strtoul(value, 0, 0);
+		if (sim->fifo_size < 4 || sim->fifo_size > 0xFFFC || sim->fifo_size % 4 != 0)
+			return 0;
+	}
+	else
+		return 0;
+	return 1;
+}
+
+static int parse_options(struct trace_sim *sim, const char *options)
+{
+	char *opts, *tok, *save;
+	int status = 1;
+	if (options == 0 || *options == 0)
+		return 1;
+	opts = strdup(options);
+	if (opts == 0)
+		return 0;
+	for (tok = strtok_r(opts, ",", &save); tok != 0 && status; tok = strtok_r(0, ",", &save))
+	{
+		char *eq = strchr(tok, '=');
+		if (eq == 0)
+		{
+			fprintf(stderr, "trace sim: expected key=value, got '%s'\n", tok);
+			status = 0;
+			break;
+		}
+		*eq = 0;
+		status = parse_option(sim, tok, eq + 1);
+		if (!status)
+			fprintf(stderr, "trace sim: bad option '%s'\n", tok);
+	}
+	free(opts);
+	return status;
+}
+
+static void fill(struct trace_sim *sim)
+{
+	double t = now();
+	uint64_t n, fit, i;
+	int pos;
+	if (sim->last == 0)
+	{
+		sim->last = t;
+		return;
+	}
+	sim->pending += (t - sim->last) * sim->rate;
+	sim->last = t;
+	// The FIFO is 32 bits wide, so trace comes and is lost a word at a time
+	n = (uint64_t)sim->pending & ~(uint64_t)3;
+	sim->pending -= n;
+	fit = sim->fifo_size - sim->level;
+	if (fit > n)
+		fit = n;
+	pos = (sim->fifo_start + sim->level) % sim->fifo_size;
+	for (i = 0; i < fit; i++)
+	{
+		uint64_t k = sim->next + i;
+		sim->fifo[pos] = (k / 4) >> (8 * (k % 4));
+		if (++pos == sim->fifo_size)
+			pos = 0;
+	}
+	sim->level += fit;
+	sim->next += n;
+	sim->overflow += n - fit;
+	sim->produced += n;
+	if (sim->level > sim->high_water)
+		sim->high_water = sim->level;
+}
+
+static int run_request(void *arg, volatile uint8_t *regs)
+{
+	struct trace_sim *sim = (struct trace_sim *)arg;
+	uint8_t out[GPMC_DATA_SIZE];
+	int len, i;
+	if (regs[TRACE_REG_CONTROL] & TRACE_CTRL_ENABLE)
+		fill(sim);
+	else
+		sim->last = 0;
+	gpmc_put_le(regs, TRACE_REG_LEVEL, sim->level, 2);
+	gpmc_put_le(regs, TRACE_REG_HIGH_WATER, sim->high_water, 2);
+	gpmc_put_le(regs, TRACE_REG_OVERFLOW, sim->overflow, 4);
+	// A constant in the design, only set once there is a request here
+	gpmc_put_le(regs, TRACE_REG_FIFO_SIZE, sim->fifo_size, 2);
+	sim->high_water = sim->level;
+	len = sim->level < GPMC_DATA_SIZE ? sim->level : GPMC_DATA_SIZE;
+	for (i = 0; i < len; i++)
+	{
+		out[i] = sim->fifo[sim->fifo_start];
+		if (++sim->fifo_start == sim->fifo_size)
+			sim->fifo_start = 0;
+	}
+	sim->level -= len;
+	gpmc_write(regs + TRACE_REG_DATA, out, len);
+	gpmc_put_le(regs, TRACE_REG_LENGTH, len, 2);
+	return GPMC_STATUS_OK;
+}
+
+int run_trace_sim(const char *path, const char *options)
+{
+	struct trace_sim sim;
+	int status;
+	memset(&sim, 0, sizeof sim);
+	sim.rate = 8e6;
+	sim.fifo_size = 4096;
+	if (!parse_options(&sim, options))
+		return 0;
+	sim.fifo = (uint8_t *)malloc(sim.fifo_size);
+	if (sim.fifo == 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	fprintf(stderr, "Trace capture on %s, %.1f MB/s into a %d byte FIFO\n", path, sim.rate / 1e6, sim.fifo_size);
+	status = gpmc_serve(path, TRACE_CAPTURE_ID, run_request, &sim);
+	if (status == 1)
+		fprintf(stderr, "Trace source stopped after %llu bytes, %u lost in the FIFO\n",
+			(unsigned long long)sim.produced, sim.overflow);
+	free(sim.fifo);
+	return status;
+}